@@ -0,0 +1,65 @@
+// The effect and kernel benchmarks (main/diagnostics/effect_bench.hpp) on the host, with Google Benchmark. Time is
+// virtual, so only the drawing code costs anything; "cycles" are nanoseconds here. Runs are named case/leds/cores.
+//
+//   bench_effects --benchmark_out=results.json --benchmark_out_format=json
+//   tools/bench_compare.py before.json after.json
+#include "diagnostics/effect_bench.hpp"
+#include "sim/drivers.hpp"
+#include "sim/recorder.hpp"
+#include "sim/scheduler.hpp"
+#include <benchmark/benchmark.h>
+
+namespace {
+
+void runBench(benchmark::State& state, const EffectBench* bench)
+{
+    host::Scheduler::instance().reset();
+    host::resetDrivers();
+    host::seedRandom(1);
+    RenderPool::instance().setParallel(state.range(1) > 1);
+    Lights strip(static_cast<int>(state.range(0)), GPIO_NUM_27);
+
+    FrameProfiler profiler;
+    uint32_t pass = 0;
+    for (auto _ : state) {
+        if (bench->kernel) {
+            bench->run(strip, pass++);
+        } else {
+            runEffectBench(*bench, strip, profiler, 0);
+        }
+    }
+
+    // Effects: the time per iteration is a whole effect, the counters give the cost per frame
+    if (!bench->kernel) {
+        const LatencyHistogram& perFrame = profiler.perFrame();
+        state.counters["frames"] = benchmark::Counter(perFrame.count(), benchmark::Counter::kAvgIterations);
+        state.counters["mean"] = perFrame.mean();
+        state.counters["p50"] = perFrame.percentile(0.5f);
+        state.counters["p99"] = perFrame.percentile(0.99f);
+        state.counters["max"] = perFrame.max();
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    host::Recorder::instance().recordFrames = false;
+
+    for (const EffectBench& bench : effectBenches()) {
+        auto* b = benchmark::RegisterBenchmark(bench.name, runBench, &bench);
+        for (int leds : BENCH_LED_COUNTS) {
+            for (int cores = 1; cores <= portNUM_PROCESSORS; ++cores)
+                b->Args({ leds, cores });
+        }
+        b->Unit(bench.kernel ? benchmark::kMicrosecond : benchmark::kMillisecond);
+        b->UseRealTime(); // the render worker's half doesn't show in this thread's CPU time
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
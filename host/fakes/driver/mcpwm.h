@@ -0,0 +1,3 @@
+#pragma once
+
+// Included by the motor code, which drives the ESCs through LEDC instead
@@ -0,0 +1,4 @@
+#pragma once
+
+// Everything runs from host memory
+#define IRAM_ATTR
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t esp_cpu_cycle_count_t;
+
+// Nanoseconds of the steady clock stand in for CPU cycles on the host
+esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void);
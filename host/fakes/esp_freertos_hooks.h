@@ -0,0 +1,10 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef void (*esp_freertos_tick_cb_t)(void);
+
+// Runs the hook on every tick of the virtual clock, in the timer service task. The host has one core: hooks for
+// the others never run.
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t new_tick_cb, UBaseType_t cpuid);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <string>
+#include <sys/types.h>
+
+// Just enough of httpd for the response writers. A request records what its handler sent. As in the real server the
+// headers go out with the first chunk, so a content type set after that is lost.
+typedef struct httpd_req {
+    const char* contentType = "text/html"; // httpd's default
+    std::string sentContentType; // what the headers went out with, empty before
+    std::string body;
+    int chunks = 0;
+    bool complete = false;
+} httpd_req_t;
+
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type);
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Seeded pseudo random (host::seedRandom), so a run can be repeated exactly
+uint32_t esp_random(void);
+void esp_fill_random(void* buf, size_t len);
@@ -0,0 +1,80 @@
+// Host stand-in for the FreeRTOS headers, implemented on the virtual-time scheduler (host/sim). Only what the
+// firmware uses.
+#pragma once
+
+#include "esp_attr.h" // the IDF's FreeRTOS.h pulls it in too
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+typedef uint8_t StackType_t; // stack sizes are in bytes, as in the IDF
+
+// Storage for the *Static create functions, about their size on the ESP32. The host objects live on the heap
+// regardless.
+typedef struct {
+    uint8_t opaque[352];
+} StaticTask_t;
+typedef struct {
+    uint8_t opaque[80];
+} StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct {
+    uint8_t opaque[32];
+} StaticEventGroup_t;
+typedef struct {
+    uint8_t opaque[44];
+} StaticTimer_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+
+// Same tick as the firmware (CONFIG_FREERTOS_HZ default), so delays round the same way
+#define configTICK_RATE_HZ 100
+#define configMAX_PRIORITIES 25
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((TickType_t)(ms) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#define pdTICKS_TO_MS(ticks) ((TickType_t)(((uint64_t)(ticks) * 1000U) / configTICK_RATE_HZ))
+#define portNUM_PROCESSORS 2
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 2 // as in sdkconfig.defaults
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// Two cores as far as sizing goes, but the scheduler runs one task at a time, all of them on core 0
+static inline BaseType_t xPortGetCoreID(void) { return 0; }
+
+// Only one task runs at a time, critical sections have nothing to exclude
+typedef struct {
+    uint32_t owner;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+#define taskENTER_CRITICAL(mux) ((void)(mux))
+#define taskEXIT_CRITICAL(mux) ((void)(mux))
+#define portYIELD_FROM_ISR(...) ((void)0)
+
+#ifndef BIT0
+#define BIT31 0x80000000
+#define BIT15 0x00008000
+#define BIT14 0x00004000
+#define BIT13 0x00002000
+#define BIT12 0x00001000
+#define BIT11 0x00000800
+#define BIT10 0x00000400
+#define BIT9 0x00000200
+#define BIT8 0x00000100
+#define BIT7 0x00000080
+#define BIT6 0x00000040
+#define BIT5 0x00000020
+#define BIT4 0x00000010
+#define BIT3 0x00000008
+#define BIT2 0x00000004
+#define BIT1 0x00000002
+#define BIT0 0x00000001
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "queue.h"
+
+// Semaphores are queues of empty items, as in FreeRTOS
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* mutex);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount);
+
+#define xSemaphoreTake(sem, ticks) xQueueReceive((sem), nullptr, (ticks))
+#define xSemaphoreGive(sem) xQueueSend((sem), nullptr, 0)
+#define xSemaphoreGiveFromISR(sem, woken) xQueueSendFromISR((sem), nullptr, (woken))
+#define uxSemaphoreGetCount(sem) uxQueueMessagesWaiting(sem)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
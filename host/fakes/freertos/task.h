@@ -0,0 +1,51 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct tskTaskControlBlock* TaskHandle_t;
+
+BaseType_t xTaskCreate(TaskFunction_t entry, const char* name, uint32_t stackDepth, void* param,
+    UBaseType_t priority, TaskHandle_t* created);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t entry, const char* name, uint32_t stackDepth, void* param,
+    UBaseType_t priority, TaskHandle_t* created, BaseType_t coreId);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t entry, const char* name, uint32_t stackDepth, void* param,
+    UBaseType_t priority, StackType_t* stack, StaticTask_t* tcb, BaseType_t coreId);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+void vTaskSuspend(TaskHandle_t task);
+void vTaskResume(TaskHandle_t task);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+char* pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+// The callback runs once the task is gone, where the target's idle task would clean up its TCB
+typedef void (*TlsDeleteCallbackFunction_t)(int index, void* value);
+void vTaskSetThreadLocalStoragePointerAndDelCallback(TaskHandle_t task, BaseType_t index, void* value,
+    TlsDeleteCallbackFunction_t callback);
+
+#define configRUN_TIME_COUNTER_TYPE uint32_t
+
+typedef enum { eRunning, eReady, eBlocked, eSuspended, eDeleted, eInvalid } eTaskState;
+
+typedef struct {
+    TaskHandle_t xHandle;
+    const char* pcTaskName;
+    UBaseType_t xTaskNumber;
+    eTaskState eCurrentState;
+    UBaseType_t uxCurrentPriority;
+    UBaseType_t uxBasePriority;
+    configRUN_TIME_COUNTER_TYPE ulRunTimeCounter;
+    StackType_t* pxStackBase;
+    uint32_t usStackHighWaterMark;
+    BaseType_t xCoreID;
+} TaskStatus_t;
+
+// Run times are virtual: every task has used none
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* tasks, UBaseType_t maxTasks, configRUN_TIME_COUNTER_TYPE* totalRunTime);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higherPriorityTaskWoken);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+
+#define taskYIELD() vTaskDelay(0)
@@ -0,0 +1,27 @@
+#pragma once
+
+// lwIP's BSD socket calls, UDP only, over the virtual network of sim/network.cpp. Types and the FD_ macros come
+// from the system headers; the calls are renamed to lwip_* as with LWIP_COMPAT_SOCKETS, so they don't clash with
+// the system's own.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_bind(int s, const struct sockaddr* name, socklen_t namelen);
+int lwip_setsockopt(int s, int level, int optname, const void* optval, socklen_t optlen);
+ssize_t lwip_sendto(int s, const void* data, size_t size, int flags, const struct sockaddr* to, socklen_t tolen);
+ssize_t lwip_recvfrom(int s, void* mem, size_t len, int flags, struct sockaddr* from, socklen_t* fromlen);
+// Blocks in virtual time; every socket is always writable
+int lwip_select(int maxfdp1, fd_set* readset, fd_set* writeset, fd_set* exceptset, struct timeval* timeout);
+char* inet_ntoa_r(struct in_addr addr, char* buf, int buflen);
+
+#define socket(domain, type, protocol) lwip_socket(domain, type, protocol)
+#define bind(s, name, namelen) lwip_bind(s, name, namelen)
+#define setsockopt(s, level, optname, optval, optlen) lwip_setsockopt(s, level, optname, optval, optlen)
+#define sendto(s, data, size, flags, to, tolen) lwip_sendto(s, data, size, flags, to, tolen)
+#define recvfrom(s, mem, len, flags, from, fromlen) lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define select(maxfdp1, readset, writeset, exceptset, timeout) \
+    lwip_select(maxfdp1, readset, writeset, exceptset, timeout)
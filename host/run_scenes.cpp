@@ -0,0 +1,202 @@
+// Plays the scenes on the host: the firmware's Lights, Motors, DFPlayer, SceneHandler and scenes against the fake
+// drivers and the virtual clock. Prints what each scene sent to the outputs and exits non-zero when a scene hangs
+// or leaves the strip or the motors running.
+//
+//   run_scenes [--scene N] [--seed N] [--track N=ms] [--trace DIR] [-v]
+#include "actuators/dfplayer.hpp"
+#include "actuators/lights.hpp"
+#include "actuators/motors.hpp"
+#include "scenes/beuk_de_ballen_scene.hpp"
+#include "scenes/herdertjes_scene.hpp"
+#include "scenes/scene_handler.hpp"
+#include "scenes/zakske_scene.hpp"
+#include "sim/dfplayer_device.hpp"
+#include "sim/drivers.hpp"
+#include "sim/recorder.hpp"
+#include "sim/scheduler.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Same wiring as main.cpp
+constexpr gpio_num_t ledPins[] = { GPIO_NUM_18, GPIO_NUM_5, GPIO_NUM_22 };
+constexpr std::array<gpio_num_t, 4> motorPins = { GPIO_NUM_25, GPIO_NUM_26, GPIO_NUM_33, GPIO_NUM_23 };
+constexpr int NUM_LEDS = 89;
+
+const char* const sceneNames[] = { "zakske", "beuk de ballen", "herdertjes" };
+constexpr int NUM_SCENES = sizeof(sceneNames) / sizeof(sceneNames[0]);
+
+constexpr int64_t BOOT_SETTLE_MS = 3000; // player online, ambient glow running
+constexpr int64_t SCENE_LIMIT_US = 10 * 60 * 1000 * 1000LL;
+
+struct Options {
+    int scene = -1; // all
+    uint32_t seed = 1;
+    const char* traceDir = nullptr;
+    bool verbose = false;
+    std::map<uint16_t, int64_t> trackLengthsMs = { { 1, 60 * 1000 }, { 2, 60 * 1000 }, { 3, 60 * 1000 } };
+};
+
+struct Result {
+    bool finished = false;
+    int64_t durationUs = 0;
+    double wallMs = 0;
+    size_t frames = 0;
+    int64_t longestFrameGapUs = 0;
+    size_t ledcWrites = 0;
+    size_t uartFrames = 0;
+    uint64_t contextSwitches = 0;
+    bool dark = false;
+    bool motorsStopped = false;
+};
+
+bool isDark(const host::LedFrame* frame)
+{
+    if (!frame)
+        return true;
+    for (uint8_t v : frame->rgb) {
+        if (v)
+            return false;
+    }
+    return true;
+}
+
+Result runScene(int index, const Options& options)
+{
+    host::Scheduler& scheduler = host::Scheduler::instance();
+    host::Recorder& recorder = host::Recorder::instance();
+    scheduler.reset();
+    host::seedRandom(options.seed);
+    host::resetDrivers();
+
+    Result result;
+    auto wallStart = std::chrono::steady_clock::now();
+    {
+        Motors motors(motorPins);
+        Lights strip(NUM_LEDS, GPIO_NUM_27);
+        DFPlayer player;
+        host::DFPlayerDevice device(DF_UART_NUM, options.trackLengthsMs);
+        player.begin();
+
+        ZakskeScene scene1(strip, player, motors);
+        BeukDeBallenScene scene2(strip, player, motors);
+        HerdertjesScene scene3(strip, player, motors);
+        std::vector<Scene*> scenes = { &scene1, &scene2, &scene3 };
+
+        SceneHandler sceneHandler(&scenes, strip, motors, ledPins, NUM_SCENES);
+        sceneHandler.start();
+        int64_t endUs = -1;
+        sceneHandler.addStateListener([&] {
+            if (!sceneHandler.isScenePlaying() && endUs < 0)
+                endUs = esp_timer_get_time();
+        });
+        wait(BOOT_SETTLE_MS);
+
+        int64_t startUs = esp_timer_get_time();
+        size_t firstFrame = recorder.frames.size();
+        size_t firstLedc = recorder.ledc.size();
+        size_t firstUart = recorder.uart.size();
+        uint64_t firstSwitches = scheduler.contextSwitches();
+        sceneHandler.playScene(index);
+        while (sceneHandler.isScenePlaying() && esp_timer_get_time() - startUs < SCENE_LIMIT_US) {
+            wait(100);
+        }
+
+        result.finished = endUs >= 0;
+        if (!result.finished)
+            endUs = esp_timer_get_time();
+        result.durationUs = endUs - startUs;
+        int64_t previous = startUs;
+        for (size_t i = firstFrame; i < recorder.frames.size() && recorder.frames[i].atUs <= endUs; ++i) {
+            result.frames++;
+            result.longestFrameGapUs = std::max(result.longestFrameGapUs, recorder.frames[i].atUs - previous);
+            previous = recorder.frames[i].atUs;
+        }
+        for (size_t i = firstLedc; i < recorder.ledc.size() && recorder.ledc[i].atUs <= endUs; ++i)
+            result.ledcWrites++;
+        for (size_t i = firstUart; i < recorder.uart.size() && recorder.uart[i].atUs <= endUs; ++i)
+            result.uartFrames++;
+        result.contextSwitches = scheduler.contextSwitches() - firstSwitches;
+
+        result.dark = isDark(recorder.frameAt(endUs));
+        const int64_t stopDuty = MOTOR_SPEED_STOP * ((1 << 13) - 1) / 20000;
+        result.motorsStopped = true;
+        for (int channel = LEDC_CHANNEL_0; channel <= LEDC_CHANNEL_3; ++channel) {
+            if (recorder.dutyAt(LEDC_HIGH_SPEED_MODE, channel, endUs) != stopDuty)
+                result.motorsStopped = false;
+        }
+
+        // The tasks reference the objects above, stop them before those go out of scope
+        scheduler.reset();
+    }
+    result.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+
+    if (options.traceDir) {
+        std::string path = std::string(options.traceDir) + "/scene" + std::to_string(index) + ".trace";
+        if (!recorder.writeTrace(path.c_str()))
+            fprintf(stderr, "Could not write %s\n", path.c_str());
+    }
+    return result;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: run_scenes [--scene N] [--seed N] [--track N=ms] [--trace DIR] [-v]\n");
+    exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--scene") == 0 && hasValue) {
+            options.scene = atoi(argv[++i]);
+        } else if (strcmp(arg, "--seed") == 0 && hasValue) {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(arg, "--track") == 0 && hasValue) {
+            unsigned track = 0;
+            long long ms = 0;
+            if (sscanf(argv[++i], "%u=%lld", &track, &ms) != 2)
+                usage();
+            options.trackLengthsMs[track] = ms;
+        } else if (strcmp(arg, "--trace") == 0 && hasValue) {
+            options.traceDir = argv[++i];
+        } else if (strcmp(arg, "-v") == 0) {
+            options.verbose = true;
+        } else {
+            usage();
+        }
+    }
+    if (options.scene >= NUM_SCENES)
+        usage();
+
+    esp_log_level_set("*", options.verbose ? ESP_LOG_INFO : ESP_LOG_WARN);
+
+    printf("%-16s %9s %9s %8s %7s %6s %9s %6s %5s %9s  %s\n", "scene", "virtual", "wall", "speedup", "frames",
+        "fps", "max gap", "ledc", "uart", "switches", "result");
+    bool ok = true;
+    for (int i = 0; i < NUM_SCENES; ++i) {
+        if (options.scene >= 0 && i != options.scene)
+            continue;
+        Result r = runScene(i, options);
+        double seconds = r.durationUs / 1e6;
+        const char* verdict = !r.finished ? "HUNG" : !r.dark ? "STRIP LEFT ON" : !r.motorsStopped ? "MOTORS LEFT ON" : "ok";
+        printf("%-16s %8.2fs %7.0fms %7.0fx %7zu %6.1f %7.1fms %6zu %5zu %9llu  %s\n", sceneNames[i], seconds,
+            r.wallMs, r.wallMs > 0 ? seconds * 1000 / r.wallMs : 0.0, r.frames, seconds > 0 ? r.frames / seconds : 0.0,
+            r.longestFrameGapUs / 1000.0, r.ledcWrites, r.uartFrames, static_cast<unsigned long long>(r.contextSwitches),
+            verdict);
+        ok = ok && r.finished && r.dark && r.motorsStopped;
+    }
+    return ok ? 0 : 1;
+}
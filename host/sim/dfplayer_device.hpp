@@ -0,0 +1,113 @@
+// Simulated DFPlayer Mini on the other end of the UART: acknowledges frames, reports itself online after booting
+// and sends "track finished" (twice, like the real module) when a track has played for its configured length
+#ifndef HOST_DFPLAYER_DEVICE_HPP
+#define HOST_DFPLAYER_DEVICE_HPP
+
+#include "drivers.hpp"
+#include "scheduler.hpp"
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+namespace host {
+
+class DFPlayerDevice {
+public:
+    static constexpr int64_t BOOT_US = 1500 * 1000;
+    static constexpr int64_t REPLY_US = 12 * 1000; // 10 bytes at 9600 baud plus processing
+
+    DFPlayerDevice(int port, std::map<uint16_t, int64_t> trackLengthsMs)
+        : port_(port)
+        , trackLengthsMs_(std::move(trackLengthsMs))
+    {
+        attachUartDevice(port_, [this](const uint8_t* data, size_t len) { receive(data, len); });
+        Scheduler::instance().callAt(BOOT_US, [this] { send(0x3F, 0x0002); }); // online, SD card present
+    }
+
+    uint16_t playingTrack() const { return playing_; }
+    int volume() const { return volume_; }
+    uint32_t commands() const { return commands_; }
+
+private:
+    int port_;
+    std::map<uint16_t, int64_t> trackLengthsMs_;
+    std::vector<uint8_t> frame_;
+    uint16_t playing_ = 0;
+    uint32_t playGeneration_ = 0; // a newer play or stop cancels the pending "finished"
+    int volume_ = 0;
+    uint32_t commands_ = 0;
+
+    void receive(const uint8_t* data, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i) {
+            if (frame_.empty() && data[i] != 0x7E)
+                continue;
+            frame_.push_back(data[i]);
+            if (frame_.size() == 10) {
+                handle(frame_);
+                frame_.clear();
+            }
+        }
+    }
+
+    void handle(const std::vector<uint8_t>& f)
+    {
+        uint16_t checksum = static_cast<uint16_t>(-(f[1] + f[2] + f[3] + f[4] + f[5] + f[6]));
+        if (f[9] != 0xEF || f[7] != (checksum >> 8) || f[8] != (checksum & 0xFF)) {
+            send(0x40, 0x0004); // checksum error
+            return;
+        }
+        commands_++;
+        uint8_t command = f[3];
+        uint16_t param = (f[5] << 8) | f[6];
+        switch (command) {
+        case 0x03: { // play track
+            playing_ = param;
+            uint32_t generation = ++playGeneration_;
+            auto length = trackLengthsMs_.find(param);
+            if (length != trackLengthsMs_.end()) {
+                int64_t endUs = Scheduler::instance().nowUs() + length->second * 1000;
+                Scheduler::instance().callAt(endUs, [this, generation, param] { finished(generation, param); });
+            }
+            break;
+        }
+        case 0x06:
+            volume_ = param;
+            break;
+        case 0x16: // stop
+            playing_ = 0;
+            playGeneration_++;
+            break;
+        default:
+            break;
+        }
+        if (f[4])
+            send(0x41, 0);
+    }
+
+    void finished(uint32_t generation, uint16_t track)
+    {
+        if (generation != playGeneration_)
+            return;
+        playing_ = 0;
+        send(0x3D, track);
+        send(0x3D, track);
+    }
+
+    void send(uint8_t command, uint16_t param)
+    {
+        uint8_t f[10] = { 0x7E, 0xFF, 0x06, command, 0x00, static_cast<uint8_t>(param >> 8),
+            static_cast<uint8_t>(param & 0xFF), 0, 0, 0xEF };
+        uint16_t checksum = static_cast<uint16_t>(-(f[1] + f[2] + f[3] + f[4] + f[5] + f[6]));
+        f[7] = checksum >> 8;
+        f[8] = checksum & 0xFF;
+        std::vector<uint8_t> bytes(f, f + sizeof(f));
+        int port = port_;
+        Scheduler::instance().callAt(
+            Scheduler::instance().nowUs() + REPLY_US, [port, bytes] { uartInject(port, bytes.data(), bytes.size()); });
+    }
+};
+
+} // namespace host
+
+#endif // HOST_DFPLAYER_DEVICE_HPP
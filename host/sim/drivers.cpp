@@ -0,0 +1,550 @@
+// Fake LEDC, UART, GPIO, led_strip, NVS, logging, RNG, Wi-Fi and httpd responses. Outputs end up in the Recorder, stamped with virtual
+// time.
+#include "drivers.hpp"
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "driver/uart.h"
+#include "esp_cpu.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_pthread.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "led_strip.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "recorder.hpp"
+#include "scheduler.hpp"
+#include <array>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+
+using host::Recorder;
+using host::Scheduler;
+
+namespace {
+
+int64_t now() { return Scheduler::instance().nowUs(); }
+
+struct UartPort {
+    bool installed = false;
+    QueueHandle_t events = nullptr;
+    size_t rxCapacity = 0;
+    std::deque<uint8_t> rx;
+    host::UartDevice device;
+};
+
+struct LedcChannel {
+    uint32_t duty = 0;
+    uint32_t pendingDuty = 0;
+    uint32_t fadeTarget = 0;
+    int fadeMs = 0;
+};
+
+struct DriverState {
+    std::array<UartPort, UART_NUM_MAX> uarts;
+    std::array<std::array<LedcChannel, LEDC_CHANNEL_MAX>, LEDC_SPEED_MODE_MAX> ledc;
+    bool fadeInstalled = false;
+    std::map<int, int> gpioLevels;
+    uint32_t random = 1;
+};
+
+DriverState& state()
+{
+    static DriverState s;
+    return s;
+}
+
+bool validChannel(ledc_mode_t mode, ledc_channel_t channel)
+{
+    return mode >= 0 && mode < LEDC_SPEED_MODE_MAX && channel >= 0 && channel < LEDC_CHANNEL_MAX;
+}
+
+void recordLedc(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, int fadeMs)
+{
+    Recorder::instance().ledc.push_back({ now(), mode, channel, duty, fadeMs });
+}
+
+} // namespace
+
+namespace host {
+
+void attachUartDevice(int port, UartDevice device) { state().uarts[port].device = std::move(device); }
+
+void uartInject(int port, const uint8_t* data, size_t len)
+{
+    UartPort& uart = state().uarts[port];
+    if (!uart.installed)
+        return;
+    if (uart.rx.size() + len > uart.rxCapacity) {
+        uart_event_t event = { UART_BUFFER_FULL, 0, false };
+        xQueueSend(uart.events, &event, 0);
+        return;
+    }
+    uart.rx.insert(uart.rx.end(), data, data + len);
+    uart_event_t event = { UART_DATA, len, false };
+    xQueueSend(uart.events, &event, 0);
+}
+
+void seedRandom(uint32_t seed) { state().random = seed ? seed : 1; }
+
+void resetDrivers()
+{
+    uint32_t seed = state().random;
+    state() = DriverState();
+    state().random = seed;
+    resetNetwork();
+    Recorder::instance().clear();
+}
+
+int64_t stripTransmitUs(uint32_t leds) { return leds * 24 * 125 / 100 + 50; }
+
+} // namespace host
+
+// --- LEDC ---
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t*) { return ESP_OK; }
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* config)
+{
+    if (!validChannel(config->speed_mode, config->channel))
+        return ESP_ERR_INVALID_ARG;
+    LedcChannel& ch = state().ledc[config->speed_mode][config->channel];
+    ch = LedcChannel();
+    ch.duty = ch.pendingDuty = config->duty;
+    recordLedc(config->speed_mode, config->channel, config->duty, 0);
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty)
+{
+    if (!validChannel(mode, channel))
+        return ESP_ERR_INVALID_ARG;
+    state().ledc[mode][channel].pendingDuty = duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+    if (!validChannel(mode, channel))
+        return ESP_ERR_INVALID_ARG;
+    LedcChannel& ch = state().ledc[mode][channel];
+    ch.duty = ch.pendingDuty;
+    recordLedc(mode, channel, ch.duty, 0);
+    return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+    return validChannel(mode, channel) ? state().ledc[mode][channel].duty : 0;
+}
+
+esp_err_t ledc_stop(ledc_mode_t mode, ledc_channel_t channel, uint32_t)
+{
+    return ledc_set_duty(mode, channel, 0) == ESP_OK ? ledc_update_duty(mode, channel) : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t ledc_fade_func_install(int)
+{
+    if (state().fadeInstalled)
+        return ESP_ERR_INVALID_STATE;
+    state().fadeInstalled = true;
+    return ESP_OK;
+}
+
+void ledc_fade_func_uninstall(void) { state().fadeInstalled = false; }
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t mode, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms)
+{
+    if (!validChannel(mode, channel) || !state().fadeInstalled)
+        return ESP_ERR_INVALID_STATE;
+    LedcChannel& ch = state().ledc[mode][channel];
+    ch.fadeTarget = target_duty;
+    ch.fadeMs = max_fade_time_ms;
+    return ESP_OK;
+}
+
+// The hardware fade isn't simulated step by step: the target and fade time are recorded, the duty lands on the
+// target right away
+esp_err_t ledc_fade_start(ledc_mode_t mode, ledc_channel_t channel, ledc_fade_mode_t fade_mode)
+{
+    if (!validChannel(mode, channel) || !state().fadeInstalled)
+        return ESP_ERR_INVALID_STATE;
+    LedcChannel& ch = state().ledc[mode][channel];
+    ch.duty = ch.pendingDuty = ch.fadeTarget;
+    recordLedc(mode, channel, ch.fadeTarget, ch.fadeMs);
+    if (fade_mode == LEDC_FADE_WAIT_DONE)
+        Scheduler::instance().sleepFor(static_cast<int64_t>(ch.fadeMs) * 1000);
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_stop(ledc_mode_t mode, ledc_channel_t channel)
+{
+    return validChannel(mode, channel) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// --- UART ---
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t*)
+{
+    return port >= 0 && port < UART_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int, int, int, int)
+{
+    return port >= 0 && port < UART_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int, int event_queue_size,
+    QueueHandle_t* uart_queue, int)
+{
+    if (port < 0 || port >= UART_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    UartPort& uart = state().uarts[port];
+    if (uart.installed)
+        return ESP_FAIL;
+    uart.installed = true;
+    uart.rxCapacity = rx_buffer_size;
+    uart.events = xQueueCreate(event_queue_size > 0 ? event_queue_size : 1, sizeof(uart_event_t));
+    if (uart_queue)
+        *uart_queue = event_queue_size > 0 ? uart.events : nullptr;
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t port)
+{
+    state().uarts[port].installed = false;
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t port, const void* src, size_t size)
+{
+    UartPort& uart = state().uarts[port];
+    if (!uart.installed)
+        return -1;
+    auto* bytes = static_cast<const uint8_t*>(src);
+    Recorder::instance().uart.push_back({ now(), port, std::vector<uint8_t>(bytes, bytes + size) });
+    if (uart.device)
+        uart.device(bytes, size);
+    return static_cast<int>(size);
+}
+
+int uart_read_bytes(uart_port_t port, void* buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    UartPort& uart = state().uarts[port];
+    if (!uart.installed)
+        return -1;
+    int64_t deadline = ticks_to_wait == portMAX_DELAY
+        ? -1
+        : now() + static_cast<int64_t>(ticks_to_wait) * 1000 * 1000 / configTICK_RATE_HZ;
+    Scheduler::instance().blockUntil([&uart, length] { return uart.rx.size() >= length; }, deadline);
+    size_t n = std::min<size_t>(length, uart.rx.size());
+    std::copy(uart.rx.begin(), uart.rx.begin() + n, static_cast<uint8_t*>(buf));
+    uart.rx.erase(uart.rx.begin(), uart.rx.begin() + n);
+    return static_cast<int>(n);
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+    state().uarts[port].rx.clear();
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t* size)
+{
+    *size = state().uarts[port].rx.size();
+    return ESP_OK;
+}
+
+// --- GPIO ---
+
+esp_err_t gpio_config(const gpio_config_t*) { return ESP_OK; }
+esp_err_t gpio_reset_pin(gpio_num_t) { return ESP_OK; }
+esp_err_t gpio_set_direction(gpio_num_t, gpio_mode_t) { return ESP_OK; }
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    state().gpioLevels[pin] = level ? 1 : 0;
+    Recorder::instance().gpio.push_back({ now(), pin, level ? 1 : 0 });
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t pin)
+{
+    auto it = state().gpioLevels.find(pin);
+    return it == state().gpioLevels.end() ? 0 : it->second;
+}
+
+// --- led_strip ---
+
+struct led_strip_t {
+    int gpio;
+    std::vector<uint8_t> rgb;
+};
+
+esp_err_t led_strip_new_rmt_device(
+    const led_strip_config_t* led_config, const led_strip_rmt_config_t*, led_strip_handle_t* ret_strip)
+{
+    if (!led_config || !ret_strip || led_config->max_leds == 0)
+        return ESP_ERR_INVALID_ARG;
+    *ret_strip = new led_strip_t { led_config->strip_gpio_num, std::vector<uint8_t>(led_config->max_leds * 3, 0) };
+    return ESP_OK;
+}
+
+esp_err_t led_strip_set_pixel(led_strip_handle_t strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue)
+{
+    if (index * 3 >= strip->rgb.size())
+        return ESP_ERR_INVALID_ARG;
+    uint8_t* p = &strip->rgb[index * 3];
+    p[0] = red;
+    p[1] = green;
+    p[2] = blue;
+    return ESP_OK;
+}
+
+esp_err_t led_strip_refresh(led_strip_handle_t strip)
+{
+    if (Recorder::instance().recordFrames)
+        Recorder::instance().frames.push_back({ now(), strip->rgb });
+    // The RMT driver waits for the transmission to finish, other tasks run meanwhile
+    Scheduler::instance().sleepFor(host::stripTransmitUs(strip->rgb.size() / 3));
+    return ESP_OK;
+}
+
+esp_err_t led_strip_clear(led_strip_handle_t strip)
+{
+    std::fill(strip->rgb.begin(), strip->rgb.end(), 0);
+    return led_strip_refresh(strip);
+}
+
+esp_err_t led_strip_del(led_strip_handle_t strip)
+{
+    delete strip;
+    return ESP_OK;
+}
+
+// --- NVS ---
+
+namespace {
+
+struct NvsStore {
+    std::map<std::string, std::map<std::string, int64_t>> namespaces;
+    std::vector<std::pair<std::string, bool>> handles; // namespace, writable; index + 1 is the handle
+};
+
+NvsStore& nvs()
+{
+    static NvsStore store;
+    return store;
+}
+
+std::map<std::string, int64_t>* nvsNamespace(nvs_handle_t handle, bool write)
+{
+    if (handle == 0 || handle > nvs().handles.size())
+        return nullptr;
+    auto& [name, writable] = nvs().handles[handle - 1];
+    if (write && !writable)
+        return nullptr;
+    return &nvs().namespaces[name];
+}
+
+template <typename T> esp_err_t nvsGet(nvs_handle_t handle, const char* key, T* out)
+{
+    auto* ns = nvsNamespace(handle, false);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto it = ns->find(key);
+    if (it == ns->end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    *out = static_cast<T>(it->second);
+    return ESP_OK;
+}
+
+template <typename T> esp_err_t nvsSet(nvs_handle_t handle, const char* key, T value)
+{
+    auto* ns = nvsNamespace(handle, true);
+    if (!ns)
+        return ESP_ERR_NVS_READ_ONLY;
+    (*ns)[key] = value;
+    return ESP_OK;
+}
+
+} // namespace
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+esp_err_t nvs_flash_erase(void)
+{
+    nvs().namespaces.clear();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle)
+{
+    // Like the real thing, a namespace that was never written can't be opened read-only
+    if (open_mode == NVS_READONLY && nvs().namespaces.find(name) == nvs().namespaces.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    nvs().handles.emplace_back(name, open_mode == NVS_READWRITE);
+    *out_handle = nvs().handles.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t) { }
+esp_err_t nvs_commit(nvs_handle_t) { return ESP_OK; }
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* out_value) { return nvsGet(handle, key, out_value); }
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value) { return nvsSet(handle, key, value); }
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value) { return nvsGet(handle, key, out_value); }
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value) { return nvsSet(handle, key, value); }
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+    auto* ns = nvsNamespace(handle, true);
+    if (!ns)
+        return ESP_ERR_NVS_READ_ONLY;
+    return ns->erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+// --- Logging, RNG, cycle counter, errors ---
+
+namespace {
+
+struct LogLevels {
+    esp_log_level_t fallback = ESP_LOG_INFO;
+    std::map<std::string, esp_log_level_t> tags;
+};
+
+LogLevels& logLevels()
+{
+    static LogLevels levels;
+    return levels;
+}
+
+} // namespace
+
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+    if (strcmp(tag, "*") == 0) {
+        logLevels().fallback = level;
+        logLevels().tags.clear();
+    } else {
+        logLevels().tags[tag] = level;
+    }
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+    auto it = logLevels().tags.find(tag);
+    esp_log_level_t limit = it != logLevels().tags.end() ? it->second : logLevels().fallback;
+    if (level > limit)
+        return;
+    static const char letters[] = "NEWIDV";
+    printf("%c (%lld) %s: ", letters[level], static_cast<long long>(now() / 1000), tag);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+uint32_t esp_random(void)
+{
+    // xorshift32
+    uint32_t& x = state().random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+void esp_fill_random(void* buf, size_t len)
+{
+    auto* p = static_cast<uint8_t*>(buf);
+    for (size_t i = 0; i < len; ++i)
+        p[i] = esp_random() & 0xFF;
+}
+
+esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void)
+{
+    auto ns = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<esp_cpu_cycle_count_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(ns).count());
+}
+
+esp_pthread_cfg_t esp_pthread_get_default_config(void)
+{
+    return { 3072, 5, false, "pthread", -1 };
+}
+
+esp_err_t esp_pthread_set_cfg(const esp_pthread_cfg_t*) { return ESP_OK; }
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t*) { return ESP_FAIL; }
+
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type)
+{
+    req->contentType = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len)
+{
+    if (req->complete)
+        return ESP_FAIL;
+    if (req->sentContentType.empty())
+        req->sentContentType = req->contentType;
+    if (!buf || len == 0) {
+        req->complete = true;
+        return ESP_OK;
+    }
+    req->body.append(buf, len < 0 ? strlen(buf) : static_cast<size_t>(len));
+    req->chunks++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len)
+{
+    if (req->complete || !req->sentContentType.empty())
+        return ESP_FAIL;
+    req->sentContentType = req->contentType;
+    req->body.assign(buf, len < 0 ? strlen(buf) : static_cast<size_t>(len));
+    req->complete = true;
+    return ESP_OK;
+}
+
+size_t heap_caps_get_free_size(uint32_t) { return 200 * 1024; }
+size_t heap_caps_get_minimum_free_size(uint32_t) { return 200 * 1024; }
+size_t heap_caps_get_largest_free_block(uint32_t) { return 100 * 1024; }
+
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    default:
+        return "ERROR";
+    }
+}
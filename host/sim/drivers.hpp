@@ -0,0 +1,41 @@
+// Hooks into the fake drivers for the host runner and the simulated devices
+#ifndef HOST_DRIVERS_HPP
+#define HOST_DRIVERS_HPP
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace host {
+
+// Receives every byte the firmware writes to that UART
+using UartDevice = std::function<void(const uint8_t* data, size_t len)>;
+void attachUartDevice(int port, UartDevice device);
+
+// Bytes a device sends back: queued in the RX buffer, with a UART_DATA event like the real driver
+void uartInject(int port, const uint8_t* data, size_t len);
+
+void seedRandom(uint32_t seed);
+
+// Forgets strips, UART drivers, LEDC state and devices, and clears the recorder. NVS is kept, like flash across
+// a reboot. Call after Scheduler::reset().
+void resetDrivers();
+
+// Time the fake led_strip_refresh blocks: WS2812 bits at 800 kHz plus the latch
+int64_t stripTransmitUs(uint32_t leds);
+
+// UDP between the simulated controllers (Scheduler::enterNode), see sim/network.cpp. Node n is 10.0.0.(n + 1),
+// in host byte order here.
+uint32_t nodeAddress(int node);
+
+// One-way delay of a datagram from one node to another in virtual us, negative to lose it. Without one,
+// everything arrives after 1 ms.
+using LinkDelay = std::function<int64_t(int fromNode, int toNode)>;
+void setLinkDelay(LinkDelay delay);
+
+// Closes every socket and forgets the link delay, part of resetDrivers()
+void resetNetwork();
+
+} // namespace host
+
+#endif // HOST_DRIVERS_HPP
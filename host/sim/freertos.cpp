@@ -0,0 +1,399 @@
+// FreeRTOS and esp_timer on top of the virtual-time scheduler. Nothing here needs locking: only the task holding
+// the turn ever touches these objects.
+#include "esp_freertos_hooks.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "scheduler.hpp"
+#include <deque>
+#include <string.h>
+#include <vector>
+
+using host::Scheduler;
+
+namespace {
+
+Scheduler& sched() { return Scheduler::instance(); }
+
+int64_t deadlineFor(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+        return -1;
+    return sched().nowUs() + static_cast<int64_t>(ticks) * 1000 * 1000 / configTICK_RATE_HZ;
+}
+
+int64_t ticksToUs(TickType_t ticks) { return static_cast<int64_t>(ticks) * 1000 * 1000 / configTICK_RATE_HZ; }
+
+host::Task* toTask(TaskHandle_t handle) { return reinterpret_cast<host::Task*>(handle); }
+TaskHandle_t toHandle(host::Task* task) { return reinterpret_cast<TaskHandle_t>(task); }
+
+} // namespace
+
+// --- Tasks ---
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t entry, const char* name, uint32_t, void* param,
+    UBaseType_t priority, TaskHandle_t* created, BaseType_t)
+{
+    host::Task* task = sched().spawn(name, priority, [entry, param] { entry(param); });
+    if (created)
+        *created = toHandle(task);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t entry, const char* name, uint32_t stackDepth, void* param,
+    UBaseType_t priority, TaskHandle_t* created)
+{
+    return xTaskCreatePinnedToCore(entry, name, stackDepth, param, priority, created, tskNO_AFFINITY);
+}
+
+// The *Static functions ignore the storage they get: host objects live on the heap
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t entry, const char* name, uint32_t stackDepth, void* param,
+    UBaseType_t priority, StackType_t*, StaticTask_t*, BaseType_t coreId)
+{
+    TaskHandle_t created = nullptr;
+    xTaskCreatePinnedToCore(entry, name, stackDepth, param, priority, &created, coreId);
+    return created;
+}
+
+void vTaskDelete(TaskHandle_t task) { sched().kill(toTask(task)); }
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+        sched().yield();
+    else
+        sched().sleepFor(ticksToUs(ticks));
+}
+
+void vTaskSuspend(TaskHandle_t task) { sched().suspend(toTask(task)); }
+void vTaskResume(TaskHandle_t task) { sched().resume(toTask(task)); }
+
+TickType_t xTaskGetTickCount(void)
+{
+    return static_cast<TickType_t>(sched().nowUs() * configTICK_RATE_HZ / (1000 * 1000));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return toHandle(sched().current()); }
+
+char* pcTaskGetName(TaskHandle_t task)
+{
+    host::Task* t = task ? toTask(task) : sched().current();
+    return const_cast<char*>(t->name.c_str());
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 1024; } // no stacks to measure on the host
+
+// The firmware uses one index, so one callback per task is enough
+void vTaskSetThreadLocalStoragePointerAndDelCallback(TaskHandle_t task, BaseType_t index, void* value,
+    TlsDeleteCallbackFunction_t callback)
+{
+    host::Task* t = task ? toTask(task) : sched().current();
+    t->onDeleted = [index, value, callback] { callback(index, value); };
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* tasks, UBaseType_t maxTasks, configRUN_TIME_COUNTER_TYPE* totalRunTime)
+{
+    std::vector<host::Task*> live = sched().liveTasks();
+    if (live.size() > maxTasks)
+        return 0;
+    for (size_t i = 0; i < live.size(); ++i) {
+        host::Task* t = live[i];
+        tasks[i] = { toHandle(t), t->name.c_str(), static_cast<UBaseType_t>(i), t == sched().current() ? eRunning
+                : t->state == host::Task::State::Blocked ? eBlocked : eReady,
+            static_cast<UBaseType_t>(t->priority), static_cast<UBaseType_t>(t->priority), 0, nullptr,
+            uxTaskGetStackHighWaterMark(toHandle(t)), tskNO_AFFINITY };
+    }
+    if (totalRunTime)
+        *totalRunTime = static_cast<configRUN_TIME_COUNTER_TYPE>(sched().nowUs());
+    return static_cast<UBaseType_t>(live.size());
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    toTask(task)->notifyValue++;
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higherPriorityTaskWoken)
+{
+    xTaskNotifyGive(task);
+    if (higherPriorityTaskWoken)
+        *higherPriorityTaskWoken = pdFALSE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+    host::Task* self = sched().current();
+    sched().blockUntil([self] { return self->notifyValue > 0; }, deadlineFor(ticks));
+    uint32_t value = self->notifyValue;
+    if (value > 0)
+        self->notifyValue = clearOnExit ? 0 : value - 1;
+    return value;
+}
+
+// --- Queues and semaphores ---
+
+struct QueueDefinition {
+    size_t length;
+    size_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+
+    bool full() const { return items.size() >= length; }
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    return new QueueDefinition { length, itemSize, {} };
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t itemSize, uint8_t*, StaticQueue_t*)
+{
+    return xQueueCreate(length, itemSize);
+}
+
+void vQueueDelete(QueueHandle_t queue) { delete queue; }
+
+static BaseType_t queueSend(QueueHandle_t queue, const void* item, TickType_t ticks, bool front)
+{
+    if (!sched().blockUntil([queue] { return !queue->full(); }, deadlineFor(ticks)))
+        return pdFALSE;
+    std::vector<uint8_t> copy(queue->itemSize);
+    if (item && queue->itemSize > 0)
+        memcpy(copy.data(), item, queue->itemSize);
+    if (front)
+        queue->items.push_front(std::move(copy));
+    else
+        queue->items.push_back(std::move(copy));
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks)
+{
+    return queueSend(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void* item, TickType_t ticks)
+{
+    return queueSend(queue, item, ticks, true);
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t* higherPriorityTaskWoken)
+{
+    if (higherPriorityTaskWoken)
+        *higherPriorityTaskWoken = pdFALSE;
+    return queueSend(queue, item, 0, false);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void* item)
+{
+    queue->items.clear();
+    return queueSend(queue, item, 0, false);
+}
+
+static BaseType_t queueReceive(QueueHandle_t queue, void* item, TickType_t ticks, bool remove)
+{
+    if (!sched().blockUntil([queue] { return !queue->items.empty(); }, deadlineFor(ticks)))
+        return pdFALSE;
+    if (item && queue->itemSize > 0)
+        memcpy(item, queue->items.front().data(), queue->itemSize);
+    if (remove)
+        queue->items.pop_front();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks)
+{
+    return queueReceive(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticks)
+{
+    return queueReceive(queue, item, ticks, false);
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    queue->items.clear();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) { return queue->items.size(); }
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) { return queue->length - queue->items.size(); }
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+    QueueHandle_t queue = xQueueCreate(maxCount, 0);
+    for (UBaseType_t i = 0; i < initialCount; ++i)
+        queue->items.emplace_back();
+    return queue;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return xSemaphoreCreateCounting(1, 0); }
+
+// No priority inheritance: with one task running at a time there is no inversion to fix
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return xSemaphoreCreateCounting(1, 1); }
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t*) { return xSemaphoreCreateMutex(); }
+
+// --- Event groups ---
+
+struct EventGroupDef_t {
+    EventBits_t bits = 0;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) { return new EventGroupDef_t(); }
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t*) { return xEventGroupCreate(); }
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    group->bits |= bits;
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) { return group->bits; }
+
+EventBits_t xEventGroupWaitBits(
+    EventGroupHandle_t group, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitForAll, TickType_t ticks)
+{
+    auto satisfied = [group, bits, waitForAll] {
+        return waitForAll ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    bool met = sched().blockUntil(satisfied, deadlineFor(ticks));
+    EventBits_t value = group->bits;
+    if (met && clearOnExit)
+        group->bits &= ~bits;
+    return value;
+}
+
+// --- Tick hooks ---
+
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t new_tick_cb, UBaseType_t cpuid)
+{
+    if (!new_tick_cb)
+        return ESP_ERR_INVALID_ARG;
+    if (cpuid != 0)
+        return ESP_OK;
+    int64_t tickUs = ticksToUs(1);
+    host::SoftTimer* timer = sched().createTimer("tick_hook", [new_tick_cb] { new_tick_cb(); });
+    sched().startTimer(timer, sched().nowUs() + tickUs, tickUs);
+    return ESP_OK;
+}
+
+// --- FreeRTOS software timers ---
+
+struct tmrTimerControl {
+    host::SoftTimer* timer;
+    TickType_t period;
+    bool autoReload;
+    void* id;
+};
+
+TimerHandle_t xTimerCreate(
+    const char* name, TickType_t period, UBaseType_t autoReload, void* id, TimerCallbackFunction_t callback)
+{
+    auto* handle = new tmrTimerControl { nullptr, period, autoReload != pdFALSE, id };
+    handle->timer = sched().createTimer(name, [handle, callback] { callback(handle); });
+    return handle;
+}
+
+TimerHandle_t xTimerCreateStatic(const char* name, TickType_t period, UBaseType_t autoReload, void* id,
+    TimerCallbackFunction_t callback, StaticTimer_t*)
+{
+    return xTimerCreate(name, period, autoReload, id, callback);
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t)
+{
+    int64_t periodUs = ticksToUs(timer->period);
+    sched().startTimer(timer->timer, sched().nowUs() + periodUs, timer->autoReload ? periodUs : 0);
+    return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks) { return xTimerStart(timer, ticks); }
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t)
+{
+    sched().stopTimer(timer->timer);
+    return pdPASS;
+}
+
+// Like FreeRTOS this also starts a dormant timer
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks)
+{
+    timer->period = period;
+    return xTimerStart(timer, ticks);
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t)
+{
+    sched().deleteTimer(timer->timer);
+    delete timer;
+    return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) { return timer->timer->armed ? pdTRUE : pdFALSE; }
+
+void* pvTimerGetTimerID(TimerHandle_t timer) { return timer->id; }
+
+// --- esp_timer ---
+
+struct esp_timer {
+    host::SoftTimer* timer;
+};
+
+int64_t esp_timer_get_time(void) { return sched().localUs(); }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out_handle)
+{
+    if (!args || !args->callback || !out_handle)
+        return ESP_ERR_INVALID_ARG;
+    esp_timer_cb_t callback = args->callback;
+    void* arg = args->arg;
+    *out_handle = new esp_timer { sched().createTimer(args->name, [callback, arg] { callback(arg); }) };
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    sched().startTimer(timer->timer, sched().nowUs() + timeout_us, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    if (timer->timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    sched().startTimer(timer->timer, sched().nowUs() + period, period);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    sched().stopTimer(timer->timer);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (timer->timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    sched().deleteTimer(timer->timer);
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) { return timer->timer->armed; }
@@ -0,0 +1,183 @@
+// Fake UDP sockets between the simulated controllers (Scheduler::enterNode). Node n has address 10.0.0.(n + 1),
+// a broadcast reaches every other node's socket on the port, and every datagram arrives after the LinkDelay, in
+// virtual time.
+#include "drivers.hpp"
+#include "lwip/sockets.h"
+#include "scheduler.hpp"
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using host::Scheduler;
+
+namespace {
+
+constexpr int FIRST_FD = 3;
+constexpr int64_t DEFAULT_DELAY_US = 1000;
+
+struct Datagram {
+    sockaddr_in from;
+    std::vector<uint8_t> data;
+};
+
+struct Socket {
+    int node = 0;
+    uint16_t port = 0; // host order, 0 until bound
+    std::deque<Datagram> inbox;
+};
+
+struct Network {
+    std::vector<std::unique_ptr<Socket>> sockets; // index + FIRST_FD is the fd
+    host::LinkDelay delay;
+};
+
+Network& network()
+{
+    static Network n;
+    return n;
+}
+
+Socket* find(int fd)
+{
+    size_t i = fd - FIRST_FD;
+    return fd >= FIRST_FD && i < network().sockets.size() ? network().sockets[i].get() : nullptr;
+}
+
+bool readable(int fd)
+{
+    Socket* s = find(fd);
+    return s && !s->inbox.empty();
+}
+
+sockaddr_in addressOf(int node, uint16_t port)
+{
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(host::nodeAddress(node));
+    return addr;
+}
+
+} // namespace
+
+namespace host {
+
+uint32_t nodeAddress(int node) { return (10u << 24) | static_cast<uint32_t>(node + 1); }
+
+void setLinkDelay(LinkDelay delay) { network().delay = std::move(delay); }
+
+void resetNetwork() { network() = Network(); }
+
+} // namespace host
+
+int lwip_socket(int domain, int type, int)
+{
+    if (domain != AF_INET || type != SOCK_DGRAM) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    network().sockets.push_back(std::make_unique<Socket>());
+    network().sockets.back()->node = Scheduler::instance().currentNode();
+    return FIRST_FD + network().sockets.size() - 1;
+}
+
+int lwip_bind(int s, const struct sockaddr* name, socklen_t namelen)
+{
+    Socket* sock = find(s);
+    if (!sock || namelen < sizeof(sockaddr_in))
+        return -1;
+    sock->port = ntohs(reinterpret_cast<const sockaddr_in*>(name)->sin_port);
+    return 0;
+}
+
+int lwip_setsockopt(int s, int, int, const void*, socklen_t) { return find(s) ? 0 : -1; }
+
+ssize_t lwip_sendto(int s, const void* data, size_t size, int, const struct sockaddr* to, socklen_t tolen)
+{
+    Socket* sender = find(s);
+    if (!sender || tolen < sizeof(sockaddr_in))
+        return -1;
+    const auto* dest = reinterpret_cast<const sockaddr_in*>(to);
+    uint32_t destAddr = ntohl(dest->sin_addr.s_addr);
+    uint16_t destPort = ntohs(dest->sin_port);
+    Datagram datagram = { addressOf(sender->node, sender->port),
+        std::vector<uint8_t>(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size) };
+
+    Scheduler& scheduler = Scheduler::instance();
+    auto& sockets = network().sockets;
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        const Socket& receiver = *sockets[i];
+        bool addressed = destAddr == INADDR_BROADCAST ? receiver.node != sender->node
+                                                      : destAddr == host::nodeAddress(receiver.node);
+        if (!addressed || receiver.port != destPort)
+            continue;
+        int64_t delay = network().delay ? network().delay(sender->node, receiver.node) : DEFAULT_DELAY_US;
+        if (delay < 0)
+            continue; // lost
+        int fd = FIRST_FD + i;
+        scheduler.callAt(scheduler.nowUs() + delay, [fd, datagram] {
+            if (Socket* sock = find(fd))
+                sock->inbox.push_back(datagram);
+        });
+    }
+    return size;
+}
+
+ssize_t lwip_recvfrom(int s, void* mem, size_t len, int, struct sockaddr* from, socklen_t* fromlen)
+{
+    if (!find(s))
+        return -1;
+    Scheduler::instance().blockUntil([s] { return readable(s); }, -1);
+    Socket* sock = find(s);
+    Datagram datagram = std::move(sock->inbox.front());
+    sock->inbox.pop_front();
+    size_t n = std::min(len, datagram.data.size());
+    memcpy(mem, datagram.data.data(), n);
+    if (from && fromlen) {
+        memcpy(from, &datagram.from, std::min<size_t>(*fromlen, sizeof(datagram.from)));
+        *fromlen = sizeof(datagram.from);
+    }
+    return n;
+}
+
+int lwip_select(int maxfdp1, fd_set* readset, fd_set* writeset, fd_set* exceptset, struct timeval* timeout)
+{
+    auto anyReadable = [&] {
+        for (int fd = FIRST_FD; readset && fd < maxfdp1; ++fd) {
+            if (FD_ISSET(fd, readset) && readable(fd))
+                return true;
+        }
+        return false;
+    };
+    int writable = 0;
+    for (int fd = FIRST_FD; writeset && fd < maxfdp1; ++fd)
+        writable += FD_ISSET(fd, writeset) && find(fd);
+
+    Scheduler& scheduler = Scheduler::instance();
+    if (writable == 0) {
+        int64_t deadline = timeout ? scheduler.nowUs() + timeout->tv_sec * 1000000LL + timeout->tv_usec : -1;
+        scheduler.blockUntil(anyReadable, deadline);
+    }
+
+    int ready = writable;
+    for (int fd = FIRST_FD; readset && fd < maxfdp1; ++fd) {
+        if (FD_ISSET(fd, readset) && !readable(fd))
+            FD_CLR(fd, readset);
+        else if (FD_ISSET(fd, readset))
+            ready++;
+    }
+    if (exceptset)
+        FD_ZERO(exceptset);
+    return ready;
+}
+
+char* inet_ntoa_r(struct in_addr addr, char* buf, int buflen)
+{
+    uint32_t a = ntohl(addr.s_addr);
+    snprintf(buf, buflen, "%u.%u.%u.%u", a >> 24, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF);
+    return buf;
+}
@@ -0,0 +1,125 @@
+// Everything the fake drivers were asked to output, stamped with virtual time
+#ifndef HOST_RECORDER_HPP
+#define HOST_RECORDER_HPP
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace host {
+
+struct LedFrame {
+    int64_t atUs;
+    std::vector<uint8_t> rgb; // 3 bytes per pixel, as sent to the strip
+};
+
+struct LedcWrite {
+    int64_t atUs;
+    int mode;
+    int channel;
+    uint32_t duty; // target duty for fades
+    int fadeMs; // 0 = jump
+};
+
+struct UartWrite {
+    int64_t atUs;
+    int port;
+    std::vector<uint8_t> bytes;
+};
+
+struct GpioWrite {
+    int64_t atUs;
+    int pin;
+    int level;
+};
+
+class Recorder {
+public:
+    static Recorder& instance()
+    {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    std::vector<LedFrame> frames;
+    std::vector<LedcWrite> ledc;
+    std::vector<UartWrite> uart;
+    std::vector<GpioWrite> gpio;
+
+    // Benchmarks turn this off, copying every frame would cost more than drawing it
+    bool recordFrames = true;
+
+    void clear()
+    {
+        frames.clear();
+        ledc.clear();
+        uart.clear();
+        gpio.clear();
+    }
+
+    // Latest frame sent at or before atUs, nullptr if none
+    const LedFrame* frameAt(int64_t atUs) const
+    {
+        auto it = std::upper_bound(
+            frames.begin(), frames.end(), atUs, [](int64_t t, const LedFrame& f) { return t < f.atUs; });
+        return it == frames.begin() ? nullptr : &*(it - 1);
+    }
+
+    // Latest duty written to an LEDC channel at or before atUs, -1 if none
+    int64_t dutyAt(int mode, int channel, int64_t atUs) const
+    {
+        int64_t duty = -1;
+        for (const auto& w : ledc) {
+            if (w.atUs > atUs)
+                break;
+            if (w.mode == mode && w.channel == channel)
+                duty = w.duty;
+        }
+        return duty;
+    }
+
+    // One line per output event in time order: "<us> led <rrggbb...>", "<us> ledc <mode> <channel> <duty>
+    // <fade ms>", "<us> uart <port> <hex>", "<us> gpio <pin> <level>"
+    bool writeTrace(const char* path) const
+    {
+        FILE* f = fopen(path, "w");
+        if (!f)
+            return false;
+        std::vector<std::pair<int64_t, std::string>> lines;
+        lines.reserve(frames.size() + ledc.size() + uart.size() + gpio.size());
+        for (const auto& frame : frames)
+            lines.emplace_back(frame.atUs, "led " + hex(frame.rgb));
+        for (const auto& w : ledc) {
+            char line[64];
+            snprintf(line, sizeof(line), "ledc %d %d %u %d", w.mode, w.channel, static_cast<unsigned>(w.duty), w.fadeMs);
+            lines.emplace_back(w.atUs, line);
+        }
+        for (const auto& w : uart)
+            lines.emplace_back(w.atUs, "uart " + std::to_string(w.port) + " " + hex(w.bytes));
+        for (const auto& w : gpio)
+            lines.emplace_back(w.atUs, "gpio " + std::to_string(w.pin) + " " + std::to_string(w.level));
+        std::stable_sort(lines.begin(), lines.end(), [](auto& a, auto& b) { return a.first < b.first; });
+        for (const auto& line : lines)
+            fprintf(f, "%lld %s\n", static_cast<long long>(line.first), line.second.c_str());
+        return fclose(f) == 0;
+    }
+
+private:
+    static std::string hex(const std::vector<uint8_t>& bytes)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string s;
+        s.reserve(bytes.size() * 2);
+        for (uint8_t b : bytes) {
+            s += digits[b >> 4];
+            s += digits[b & 0xF];
+        }
+        return s;
+    }
+};
+
+} // namespace host
+
+#endif // HOST_RECORDER_HPP
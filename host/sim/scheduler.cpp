@@ -0,0 +1,323 @@
+#include "scheduler.hpp"
+#include <algorithm>
+#include <exception>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace host {
+
+Scheduler& Scheduler::instance()
+{
+    static Scheduler* scheduler = new Scheduler(); // never destroyed, task threads may still reference it at exit
+    return *scheduler;
+}
+
+Scheduler::Scheduler()
+{
+    // The thread that first touches the scheduler plays app_main
+    tasks_.push_back(std::make_unique<Task>());
+    main_ = tasks_.back().get();
+    main_->name = "main";
+    main_->priority = 1;
+    current_ = main_;
+}
+
+Task* Scheduler::spawn(const char* name, int priority, std::function<void()> entry)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::make_unique<Task>());
+    Task* task = tasks_.back().get();
+    task->name = name ? name : "";
+    task->priority = priority;
+    task->entry = std::move(entry);
+    task->node = current_->node;
+    task->clockOffsetUs = current_->clockOffsetUs;
+    task->thread = std::thread(&Scheduler::threadMain, this, task);
+    return task;
+}
+
+void Scheduler::enterNode(int node, int64_t clockOffsetUs)
+{
+    current_->node = node;
+    current_->clockOffsetUs = clockOffsetUs;
+}
+
+void Scheduler::threadMain(Scheduler* self, Task* task)
+{
+    std::unique_lock<std::mutex> lock(self->mutex_);
+    task->turn.wait(lock, [&] { return self->current_ == task; });
+    if (!task->killed) {
+        lock.unlock();
+        try {
+            task->entry();
+        } catch (const TaskKilled&) {
+        }
+        lock.lock();
+    }
+    if (task->onDeleted) {
+        lock.unlock();
+        task->onDeleted();
+        lock.lock();
+    }
+    task->state = Task::State::Deleted;
+    task->wakeWhen = nullptr;
+    Task* next = task->killer ? task->killer : self->pickNext();
+    self->current_ = next;
+    next->lastTurn = ++self->turns_;
+    self->switches_++;
+    next->turn.notify_one();
+}
+
+bool Scheduler::runnable(Task* task) const
+{
+    if (task->state == Task::State::Deleted || task->suspended)
+        return false;
+    if (task->state == Task::State::Ready)
+        return true;
+    if (task->deadlineUs >= 0 && task->deadlineUs <= nowUs_)
+        return true;
+    return task->wakeWhen && task->wakeWhen();
+}
+
+Task* Scheduler::pickNext()
+{
+    while (true) {
+        // Highest priority first, round robin among equals
+        Task* best = nullptr;
+        for (auto& task : tasks_) {
+            if (!runnable(task.get()))
+                continue;
+            if (!best || task->priority > best->priority
+                || (task->priority == best->priority && task->lastTurn < best->lastTurn))
+                best = task.get();
+        }
+        if (best)
+            return best;
+
+        // Everybody waits: jump ahead to the first deadline
+        int64_t next = INT64_MAX;
+        for (auto& task : tasks_) {
+            if (task->state == Task::State::Blocked && !task->suspended && task->deadlineUs >= 0)
+                next = std::min(next, task->deadlineUs);
+        }
+        if (next == INT64_MAX) {
+            fprintf(stderr, "host: deadlock at %lld us, every task waits forever:\n", static_cast<long long>(nowUs_));
+            for (auto& task : tasks_) {
+                if (task->state != Task::State::Deleted)
+                    fprintf(stderr, "  %s%s\n", task->name.c_str(), task->suspended ? " (suspended)" : "");
+            }
+            abort();
+        }
+        nowUs_ = next;
+    }
+}
+
+void Scheduler::switchTo(std::unique_lock<std::mutex>& lock, Task* self, Task* next)
+{
+    current_ = next;
+    next->lastTurn = ++turns_;
+    next->switches++;
+    switches_++;
+    next->turn.notify_one();
+    self->turn.wait(lock, [&] { return current_ == self; });
+    if (self->killed && std::uncaught_exceptions() == 0)
+        throw TaskKilled();
+}
+
+void Scheduler::handOver(std::unique_lock<std::mutex>& lock, Task* self)
+{
+    Task* next = pickNext();
+    if (next == self) {
+        self->lastTurn = ++turns_;
+        return;
+    }
+    switchTo(lock, self, next);
+}
+
+bool Scheduler::blockUntil(std::function<bool()> wakeWhen, int64_t deadlineUs)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Task* self = current_;
+    if (wakeWhen && wakeWhen())
+        return true;
+    // Timed out, or a killed task cleaning up: never block
+    if ((deadlineUs >= 0 && deadlineUs <= nowUs_) || std::uncaught_exceptions() > 0)
+        return false;
+
+    self->state = Task::State::Blocked;
+    self->wakeWhen = std::move(wakeWhen);
+    self->deadlineUs = deadlineUs;
+    handOver(lock, self);
+    self->state = Task::State::Ready;
+    bool woken = self->wakeWhen && self->wakeWhen();
+    self->wakeWhen = nullptr;
+    self->deadlineUs = -1;
+    return woken;
+}
+
+void Scheduler::yield()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    handOver(lock, current_);
+}
+
+void Scheduler::suspend(Task* task)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Task* self = current_;
+    if (!task)
+        task = self;
+    task->suspended = true;
+    if (task == self)
+        handOver(lock, self);
+}
+
+void Scheduler::resume(Task* task)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!task->suspended)
+        return;
+    task->suspended = false;
+    // Like FreeRTOS, a delay that was running when the task got suspended ends right away
+    if (task->state == Task::State::Blocked)
+        task->deadlineUs = nowUs_;
+}
+
+void Scheduler::kill(Task* task)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Task* self = current_;
+    if (!task || task == self) {
+        lock.unlock();
+        throw TaskKilled();
+    }
+    if (task->state == Task::State::Deleted)
+        return;
+    task->killed = true;
+    task->killer = self;
+    task->suspended = false;
+    // The victim unwinds in its own thread while we wait, then hands the turn straight back
+    switchTo(lock, self, task);
+    lock.unlock();
+    if (task->thread.joinable())
+        task->thread.join();
+}
+
+std::vector<Task*> Scheduler::liveTasks()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Task*> live;
+    for (auto& task : tasks_) {
+        if (task->state != Task::State::Deleted)
+            live.push_back(task.get());
+    }
+    return live;
+}
+
+SoftTimer* Scheduler::createTimer(const char* name, std::function<void()> callback)
+{
+    ensureTimerService();
+    timers_.push_back(std::make_unique<SoftTimer>());
+    SoftTimer* timer = timers_.back().get();
+    timer->name = name ? name : "";
+    timer->callback = std::move(callback);
+    timer->node = current_->node;
+    timer->clockOffsetUs = current_->clockOffsetUs;
+    return timer;
+}
+
+void Scheduler::startTimer(SoftTimer* timer, int64_t firstUs, int64_t periodUs)
+{
+    timer->nextUs = firstUs;
+    timer->periodUs = periodUs;
+    timer->armed = true;
+    timerGeneration_++;
+}
+
+void Scheduler::stopTimer(SoftTimer* timer)
+{
+    timer->armed = false;
+    timerGeneration_++;
+}
+
+void Scheduler::deleteTimer(SoftTimer* timer)
+{
+    timers_.erase(std::remove_if(timers_.begin(), timers_.end(), [&](auto& t) { return t.get() == timer; }),
+        timers_.end());
+    timerGeneration_++;
+}
+
+void Scheduler::callAt(int64_t atUs, std::function<void()> fn)
+{
+    SoftTimer* timer = createTimer("deferred", std::move(fn));
+    timer->oneShotOwned = true;
+    startTimer(timer, std::max(atUs, nowUs_), 0);
+}
+
+void Scheduler::ensureTimerService()
+{
+    if (!timerTask_)
+        timerTask_ = spawn("esp_timer", 22, [this] { timerService(); });
+}
+
+void Scheduler::timerService()
+{
+    while (true) {
+        int64_t due = -1;
+        for (auto& timer : timers_) {
+            if (timer->armed && (due < 0 || timer->nextUs < due))
+                due = timer->nextUs;
+        }
+        if (due < 0 || due > nowUs_) {
+            uint64_t generation = timerGeneration_;
+            blockUntil([this, generation] { return timerGeneration_ != generation; }, due);
+            continue;
+        }
+
+        // Earliest first; the callback may start, stop or delete any timer, itself included
+        SoftTimer* timer = nullptr;
+        for (auto& t : timers_) {
+            if (t->armed && t->nextUs <= nowUs_ && (!timer || t->nextUs < timer->nextUs))
+                timer = t.get();
+        }
+        if (timer->periodUs > 0)
+            timer->nextUs += timer->periodUs;
+        else
+            timer->armed = false;
+        bool owned = timer->oneShotOwned;
+        enterNode(timer->node, timer->clockOffsetUs);
+        std::function<void()> callback = timer->callback;
+        if (callback)
+            callback();
+        if (owned)
+            deleteTimer(timer);
+    }
+}
+
+void Scheduler::reset()
+{
+    for (size_t i = tasks_.size(); i-- > 0;) {
+        Task* task = tasks_[i].get();
+        if (task != main_)
+            kill(task);
+    }
+    for (auto& task : tasks_) {
+        if (task->thread.joinable())
+            task->thread.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.erase(std::remove_if(tasks_.begin(), tasks_.end(), [&](auto& t) { return t.get() != main_; }),
+        tasks_.end());
+    timers_.clear();
+    timerTask_ = nullptr;
+    timerGeneration_ = 0;
+    nowUs_ = 0;
+    turns_ = 0;
+    switches_ = 0;
+    main_->lastTurn = 0;
+    main_->notifyValue = 0;
+    main_->node = 0;
+    main_->clockOffsetUs = 0;
+}
+
+} // namespace host
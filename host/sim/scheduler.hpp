@@ -0,0 +1,127 @@
+// Virtual-time scheduler behind the fake FreeRTOS and esp_timer. Every task is a thread, but only one holds the
+// turn at a time, like a single core. Time stands still while a task runs and jumps to the next wakeup once all
+// of them are blocked, so a 60 s scene plays in a fraction of a second and every run is the same.
+#ifndef HOST_SCHEDULER_HPP
+#define HOST_SCHEDULER_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace host {
+
+struct Task {
+    std::string name;
+    int priority = 0;
+    std::function<void()> entry;
+    std::thread thread;
+    std::condition_variable turn;
+
+    enum class State { Ready, Blocked, Deleted };
+    State state = State::Ready;
+    bool suspended = false;
+    bool killed = false;
+    Task* killer = nullptr; // gets the turn back once the task has unwound
+    std::function<bool()> wakeWhen; // while Blocked
+    int64_t deadlineUs = -1; // while Blocked, -1 = none
+    uint64_t lastTurn = 0;
+    uint32_t notifyValue = 0;
+    uint64_t switches = 0;
+    std::function<void()> onDeleted; // TLS deletion callback, run as the task ends
+    // The simulated controller the task runs on, inherited from the task that spawned it
+    int node = 0;
+    int64_t clockOffsetUs = 0;
+};
+
+// Software timer, run by the timer service task: esp_timer, FreeRTOS timers and deferred device events
+struct SoftTimer {
+    std::string name;
+    std::function<void()> callback;
+    int64_t periodUs = 0; // 0 = one-shot
+    int64_t nextUs = 0;
+    bool armed = false;
+    bool oneShotOwned = false; // deleted after firing (callAt)
+    // Of the task that created it, the callback runs as that node
+    int node = 0;
+    int64_t clockOffsetUs = 0;
+};
+
+class Scheduler {
+public:
+    static Scheduler& instance();
+
+    int64_t nowUs() const { return nowUs_; }
+    Task* current() const { return current_; }
+
+    // Several controllers in one process: the calling task, and every task and timer it creates from now on,
+    // belong to the given node, whose esp_timer clock runs clockOffsetUs ahead of the virtual time. Node 0 with
+    // offset 0 is the default.
+    void enterNode(int node, int64_t clockOffsetUs);
+    int currentNode() const { return current_->node; }
+    // esp_timer_get_time() of the running task's node
+    int64_t localUs() const { return nowUs_ + current_->clockOffsetUs; }
+
+    // The task only starts running once the caller blocks or yields
+    Task* spawn(const char* name, int priority, std::function<void()> entry);
+
+    // Blocks the calling task until wakeWhen() holds or the deadline (virtual us, -1 = never) passes. Returns
+    // whether wakeWhen() held. The predicate only reads state of fake objects, which only the running task
+    // changes.
+    bool blockUntil(std::function<bool()> wakeWhen, int64_t deadlineUs);
+    void sleepFor(int64_t us) { blockUntil(nullptr, nowUs_ + us); }
+    void yield();
+
+    void suspend(Task* task);
+    void resume(Task* task);
+    // Unwinds the task's stack (destructors run) before returning; deleting yourself doesn't return
+    void kill(Task* task);
+
+    SoftTimer* createTimer(const char* name, std::function<void()> callback);
+    void startTimer(SoftTimer* timer, int64_t firstUs, int64_t periodUs);
+    void stopTimer(SoftTimer* timer);
+    void deleteTimer(SoftTimer* timer);
+    // Runs fn in the timer service task at the given virtual time, used by the fake devices
+    void callAt(int64_t atUs, std::function<void()> fn);
+
+    // Kills every task and starts over at t = 0
+    void reset();
+
+    uint64_t contextSwitches() const { return switches_; }
+
+    // Every task that wasn't deleted, the main one included
+    std::vector<Task*> liveTasks();
+
+private:
+    struct TaskKilled { };
+
+    Scheduler();
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Task>> tasks_;
+    Task* main_ = nullptr;
+    Task* current_ = nullptr;
+    int64_t nowUs_ = 0;
+    uint64_t turns_ = 0;
+    uint64_t switches_ = 0;
+
+    std::vector<std::unique_ptr<SoftTimer>> timers_;
+    Task* timerTask_ = nullptr;
+    uint64_t timerGeneration_ = 0; // bumped on every change, wakes the timer service
+
+    static void threadMain(Scheduler* self, Task* task);
+    bool runnable(Task* task) const;
+    Task* pickNext();
+    void handOver(std::unique_lock<std::mutex>& lock, Task* self);
+    void switchTo(std::unique_lock<std::mutex>& lock, Task* self, Task* next);
+    void timerService();
+    void ensureTimerService();
+};
+
+} // namespace host
+
+#endif // HOST_SCHEDULER_HPP
@@ -0,0 +1,71 @@
+// Checks what the response writers hand to httpd, against the fake server: a /metrics scrape larger than its buffer
+// goes out in chunks and still as Prometheus text, not as httpd's default text/html. Exits non-zero on a failure.
+#include "actuators/dfplayer.hpp"
+#include "actuators/lights.hpp"
+#include "diagnostics/metrics.hpp"
+#include "web/json_writer.hpp"
+#include "web/prometheus_writer.hpp"
+#include <stdio.h>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what, const httpd_req_t& req)
+{
+    if (ok)
+        return;
+    failures++;
+    fprintf(stderr, "FAIL %s (content type '%s', %d chunks, %zu bytes)\n", what, req.sentContentType.c_str(),
+        req.chunks, req.body.size());
+}
+
+// Same buffer as WebServer::metrics_handler
+void metricsScrape()
+{
+    Lights strip(89, GPIO_NUM_27);
+    DFPlayer player;
+    Metrics metrics(strip, player);
+    httpd_req_t req;
+    char buf[512];
+    PrometheusWriter out(buf, sizeof(buf), &req);
+    metrics.write(out);
+    bool sent = out.finish() == ESP_OK;
+
+    check(sent && req.complete, "/metrics is sent completely", req);
+    check(req.chunks > 1, "/metrics needs more than one chunk", req);
+    check(req.sentContentType == "text/plain; version=0.0.4", "/metrics goes out as Prometheus text", req);
+    check(req.body.find("nativity_uptime_seconds ") != std::string::npos, "/metrics has the uptime", req);
+    check(req.body.find("nativity_task_stack_free_bytes{task=") != std::string::npos, "/metrics has the tasks", req);
+}
+
+void json(size_t items, bool chunked)
+{
+    httpd_req_t req;
+    char buf[64];
+    JsonWriter json(buf, sizeof(buf), &req);
+    json.beginArray();
+    for (size_t i = 0; i < items; ++i)
+        json.value(static_cast<uint32_t>(i));
+    json.endArray();
+    bool sent = json.finish() == ESP_OK;
+
+    check(sent && req.complete, "JSON is sent completely", req);
+    check(chunked ? req.chunks > 1 : req.chunks == 0, chunked ? "long JSON is chunked" : "short JSON isn't", req);
+    check(req.sentContentType == "application/json", "JSON goes out as application/json", req);
+    check(req.body.front() == '[' && req.body.back() == ']', "JSON arrives whole", req);
+}
+
+} // namespace
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    metricsScrape();
+    json(3, false);
+    json(100, true);
+    if (failures == 0)
+        printf("http responses ok\n");
+    return failures == 0 ? 0 : 1;
+}
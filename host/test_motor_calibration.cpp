@@ -0,0 +1,101 @@
+// A stop point trimmed with Motors::calibrateStopPoint (POST /motors/stop) drives the motor right away, is kept in
+// NVS and comes back after a reboot with loadStopPoints; the other motors keep MOTOR_SPEED_STOP and bad values are
+// refused. Full speed stays at MOTOR_SPEED_FORWARD and MOTOR_SPEED_BACK wherever the stop point lies. Exits
+// non-zero on a failure.
+#include "actuators/motors.hpp"
+#include "sim/drivers.hpp"
+#include "sim/recorder.hpp"
+#include "sim/scheduler.hpp"
+#include <iterator>
+#include <stdio.h>
+
+namespace {
+
+constexpr std::array<gpio_num_t, 4> motorPins = { GPIO_NUM_25, GPIO_NUM_26, GPIO_NUM_33, GPIO_NUM_23 };
+constexpr int MOTOR = 2;
+constexpr uint32_t STOP_US = 1490;
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+    if (ok)
+        return;
+    failures++;
+    fprintf(stderr, "FAIL %s\n", what);
+}
+
+// As Motor::setMotorDuty writes it
+uint32_t duty(uint32_t us) { return (us * ((1 << 13) - 1)) / 20000; }
+
+uint32_t lastDuty(int channel)
+{
+    const auto& writes = host::Recorder::instance().ledc;
+    for (auto it = writes.rbegin(); it != writes.rend(); ++it) {
+        if (it->channel == channel)
+            return it->duty;
+    }
+    return 0;
+}
+
+void reboot()
+{
+    host::Scheduler::instance().reset();
+    host::resetDrivers(); // NVS stays, like flash
+}
+
+// Full and half speed both ways around a stop point near either end of the range
+void speedRange(Motors& motors, uint32_t stopUs)
+{
+    Motor& motor = motors.getMotor(MOTOR);
+    motors.calibrateStopPoint(MOTOR, stopUs);
+    char what[64];
+    const int speeds[] = { 100, 50, -50, -100 };
+    const uint32_t pulses[] = { MOTOR_SPEED_FORWARD, (stopUs + MOTOR_SPEED_FORWARD) / 2,
+        (stopUs + MOTOR_SPEED_BACK) / 2, MOTOR_SPEED_BACK };
+    for (size_t i = 0; i < std::size(speeds); ++i) {
+        motor.setSpeed(speeds[i]);
+        snprintf(what, sizeof(what), "speed %d around a %u us stop point is %u us", speeds[i],
+            static_cast<unsigned>(stopUs), static_cast<unsigned>(pulses[i]));
+        check(lastDuty(MOTOR) == duty(pulses[i]), what);
+    }
+    motor.stop();
+}
+
+} // namespace
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    reboot();
+    {
+        Motors motors(motorPins);
+        motors.loadStopPoints();
+        motors.stopAll();
+        check(lastDuty(MOTOR) == duty(MOTOR_SPEED_STOP), "uncalibrated motors stop at MOTOR_SPEED_STOP");
+
+        check(motors.calibrateStopPoint(MOTOR, STOP_US), "calibrating is saved");
+        check(lastDuty(MOTOR) == duty(STOP_US), "the new stop point drives the motor right away");
+        check(!motors.calibrateStopPoint(MOTOR, MOTOR_SPEED_FORWARD), "a full speed pulse isn't a stop point");
+        check(!motors.calibrateStopPoint(4, STOP_US), "there are only 4 motors");
+        check(motors.getMotor(MOTOR).getStopPoint() == STOP_US, "refused values change nothing");
+
+        speedRange(motors, 1990);
+        speedRange(motors, 1010);
+        motors.calibrateStopPoint(MOTOR, STOP_US);
+        host::Scheduler::instance().reset(); // stops the ramp timer before motors goes
+    }
+    reboot();
+    {
+        Motors motors(motorPins);
+        motors.loadStopPoints();
+        check(motors.getMotor(MOTOR).getStopPoint() == STOP_US, "the stop point survives a reboot");
+        check(motors.getMotor(0).getStopPoint() == MOTOR_SPEED_STOP, "other motors keep the default");
+        motors.stopAll();
+        check(lastDuty(MOTOR) == duty(STOP_US), "stop uses the loaded stop point");
+        host::Scheduler::instance().reset();
+    }
+    if (failures == 0)
+        printf("motor calibration ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+// Splitting a frame over both cores (RenderPool::forRange, the passes of Lights::fill and dimTo) must not change a
+// single byte: every effect and kernel case of main/diagnostics/effect_bench.hpp runs on a 2000 LED strip with the
+// RenderPool off and on, and the frames sent to the strip and the pixels left behind are compared. Exits non-zero
+// when they differ.
+#include "diagnostics/effect_bench.hpp"
+#include "sim/drivers.hpp"
+#include "sim/recorder.hpp"
+#include "sim/scheduler.hpp"
+#include <stdio.h>
+#include <vector>
+
+namespace {
+
+constexpr int LEDS = 2000;
+constexpr uint32_t KERNEL_PASSES = 3;
+
+struct Output {
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<uint8_t> shown;
+};
+
+Output render(const EffectBench& bench, bool parallel)
+{
+    host::Scheduler::instance().reset();
+    host::resetDrivers();
+    host::seedRandom(1);
+    RenderPool::instance().setParallel(parallel);
+    Output output;
+    {
+        Lights strip(LEDS, GPIO_NUM_27);
+        for (uint32_t pass = 0; pass < (bench.kernel ? KERNEL_PASSES : 1); ++pass)
+            bench.run(strip, pass);
+        output.shown.assign(strip.pixelData(), strip.pixelData() + LEDS * 3);
+    }
+    for (const host::LedFrame& frame : host::Recorder::instance().frames)
+        output.frames.push_back(frame.rgb);
+    return output;
+}
+
+} // namespace
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    int failures = 0;
+    for (const EffectBench& bench : effectBenches()) {
+        Output serial = render(bench, false);
+        Output parallel = render(bench, true);
+        if (serial.frames != parallel.frames || serial.shown != parallel.shown) {
+            failures++;
+            fprintf(stderr, "FAIL %s: %zu frames serial, %zu parallel, %s\n", bench.name, serial.frames.size(),
+                parallel.frames.size(), serial.shown == parallel.shown ? "same final pixels" : "final pixels differ");
+        }
+    }
+    if (failures == 0)
+        printf("parallel render ok\n");
+    return failures == 0 ? 0 : 1;
+}
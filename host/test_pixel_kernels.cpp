@@ -0,0 +1,14 @@
+// Every SWAR pixel kernel must give the same bytes as its scalar version (checkPixelKernels() in
+// main/diagnostics/effect_bench.hpp, which the on-device benchmark runs too). Exits non-zero when one doesn't.
+#include "diagnostics/effect_bench.hpp"
+#include <stdio.h>
+
+int main()
+{
+    if (const char* mismatch = checkPixelKernels()) {
+        fprintf(stderr, "FAIL pixel_kernels::%s differs from its scalar version\n", mismatch);
+        return 1;
+    }
+    printf("pixel kernels ok\n");
+    return 0;
+}
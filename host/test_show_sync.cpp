@@ -0,0 +1,180 @@
+// Runs the real ShowSync between a leader and two followers, each with a SceneHandler, CommandDispatcher and
+// ShowSync of its own, on the fake UDP network. The nodes booted seconds apart and the links are asymmetric and
+// jittery. A play started on the leader, and one started on a follower, must start the scene on every node within
+// SKEW_LIMIT_US of each other. A PLAY_AT from another node than the leader must start nothing. Exits non-zero when
+// any of that fails.
+//
+// Limits of the model: all nodes share the one simulated core and time stands still while code runs, so only the
+// clock estimate and the network show up in the skew, not the CPU time of the start path. Clocks are offset but
+// don't drift.
+#include "actuators/dfplayer.hpp"
+#include "actuators/lights.hpp"
+#include "actuators/motors.hpp"
+#include "scenes/command_dispatcher.hpp"
+#include "scenes/scene_handler.hpp"
+#include "sim/drivers.hpp"
+#include "sim/scheduler.hpp"
+#include "util.hpp"
+#include "web/show_sync.hpp"
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+namespace {
+
+constexpr gpio_num_t ledPins[] = { GPIO_NUM_18 };
+constexpr std::array<gpio_num_t, 4> motorPins = { GPIO_NUM_25, GPIO_NUM_26, GPIO_NUM_33, GPIO_NUM_23 };
+constexpr uint16_t SYNC_PORT = 4050;
+constexpr int SCENE_MS = 1000;
+constexpr int64_t SKEW_LIMIT_US = 2000;
+
+// Node 0 leads. When each node booted, against the leader.
+constexpr int64_t CLOCK_OFFSETS_US[] = { 0, 3700 * 1000, 12300 * 1000 };
+constexpr int NODES = sizeof(CLOCK_OFFSETS_US) / sizeof(CLOCK_OFFSETS_US[0]);
+
+// Notes when it starts, in virtual time, then plays for a while
+class StartMark : public Scene {
+public:
+    StartMark(Lights& strip, DFPlayer& player, Motors& motors, std::vector<int64_t>& starts)
+        : Scene(strip, player, motors)
+        , starts_(starts)
+    {
+    }
+
+    void play() override
+    {
+        starts_.push_back(host::Scheduler::instance().nowUs());
+        wait(SCENE_MS);
+    }
+
+private:
+    std::vector<int64_t>& starts_;
+};
+
+struct Node {
+    Node(ShowSync::Role role, DFPlayer& player)
+        : motors(motorPins)
+        , strip(10, GPIO_NUM_27)
+        , scene(strip, player, motors, starts)
+        , scenes { &scene }
+        , handler(&scenes, strip, motors, ledPins, 1)
+        , commands(handler)
+        , sync(role, handler, commands, SYNC_PORT)
+    {
+        handler.start();
+        commands.start();
+        sync.start();
+    }
+
+    std::vector<int64_t> starts;
+    Motors motors;
+    Lights strip;
+    StartMark scene;
+    std::vector<Scene*> scenes;
+    SceneHandler handler;
+    CommandDispatcher commands;
+    ShowSync sync;
+};
+
+// Leader to follower 2 ms, back 1 ms, each plus up to 3 ms of queueing
+int64_t linkDelay(int from, int)
+{
+    static uint32_t random = 1;
+    random = random * 1103515245 + 12345;
+    return (from == 0 ? 2000 : 1000) + (random >> 16) % 3000;
+}
+
+// As ShowSync::SyncMessage
+struct __attribute__((packed)) SyncMessage {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t scene;
+    uint16_t show;
+    int64_t t1;
+    int64_t t2;
+    int64_t t3;
+};
+
+// A node that isn't the leader announces a play to everybody
+void strayPlay(int node)
+{
+    host::Scheduler::instance().enterNode(node, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SYNC_PORT);
+    bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    SyncMessage msg = { 0x3159534E, 3, 0, 100, esp_timer_get_time(), 0, 0 }; // PLAY_AT
+    addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    sendto(sock, &msg, sizeof(msg), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    host::Scheduler::instance().enterNode(0, 0);
+}
+
+int failures = 0;
+
+void checkShow(const std::vector<std::unique_ptr<Node>>& nodes, size_t show, const char* startedOn)
+{
+    int64_t first = INT64_MAX;
+    int64_t last = INT64_MIN;
+    for (const auto& node : nodes) {
+        if (node->starts.size() <= show) {
+            failures++;
+            fprintf(stderr, "FAIL play on the %s: a node didn't start the scene\n", startedOn);
+            return;
+        }
+        first = std::min(first, node->starts[show]);
+        last = std::max(last, node->starts[show]);
+    }
+    printf("play on the %s: all %d nodes started within %lld us\n", startedOn, NODES,
+        static_cast<long long>(last - first));
+    if (last - first > SKEW_LIMIT_US) {
+        failures++;
+        fprintf(stderr, "FAIL play on the %s: skew over %lld us\n", startedOn, static_cast<long long>(SKEW_LIMIT_US));
+    }
+}
+
+} // namespace
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    host::Scheduler& scheduler = host::Scheduler::instance();
+    scheduler.reset();
+    host::resetDrivers();
+    host::setLinkDelay(linkDelay);
+    {
+        DFPlayer player; // the scenes never use it
+        std::vector<std::unique_ptr<Node>> nodes;
+        for (int i = 0; i < NODES; ++i) {
+            scheduler.enterNode(i, CLOCK_OFFSETS_US[i]);
+            nodes.push_back(std::make_unique<Node>(i == 0 ? ShowSync::Role::Leader : ShowSync::Role::Follower, player));
+        }
+        scheduler.enterNode(0, 0);
+
+        wait(5000); // a few clock exchanges
+        nodes[0]->commands.submit(CommandType::Play, 0);
+        wait(3 * SCENE_MS);
+        nodes[NODES - 1]->commands.submit(CommandType::Play, 0);
+        wait(3 * SCENE_MS);
+
+        checkShow(nodes, 0, "leader");
+        checkShow(nodes, 1, "follower");
+
+        strayPlay(NODES);
+        wait(3 * SCENE_MS);
+        for (const auto& node : nodes) {
+            if (node->starts.size() > 2) {
+                failures++;
+                fprintf(stderr, "FAIL a PLAY_AT from another node than the leader started a scene\n");
+                break;
+            }
+        }
+
+        // The tasks reference the nodes, stop them first
+        scheduler.reset();
+    }
+    if (failures == 0)
+        printf("show sync ok\n");
+    return failures == 0 ? 0 : 1;
+}
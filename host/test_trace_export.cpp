@@ -0,0 +1,102 @@
+// Builds the trace recorder and the /trace export with CONFIG_NATIVITY_TRACE on, which the other host targets leave
+// off, and checks the Chrome trace JSON: the process and task names, slices and markers on the task's track, the
+// overrun count, and the copy the first overrun freezes. Exits non-zero on a failure.
+//
+// The host's cycle counter is the steady clock while esp_timer runs on virtual time, so timestamps between two
+// clock events are off here. Only the format is checked, not the times.
+#include "diagnostics/trace_recorder.hpp"
+#include "esp_log.h"
+#include "sim/drivers.hpp"
+#include "sim/scheduler.hpp"
+#include "util.hpp"
+#include "web/json_writer.hpp"
+#include "web/trace_export.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+    if (ok)
+        return;
+    failures++;
+    fprintf(stderr, "FAIL %s\n", what);
+}
+
+bool has(const std::string& json, const std::string& part) { return json.find(part) != std::string::npos; }
+
+// Same buffer as WebServer::trace_handler
+std::string exportTrace(bool snapshot)
+{
+    httpd_req_t req;
+    char buf[768];
+    JsonWriter json(buf, sizeof(buf), &req);
+    writeChromeTrace(json, snapshot);
+    bool sent = json.finish() == ESP_OK;
+    check(sent && req.complete, "the trace is sent completely");
+    check(req.sentContentType == "application/json", "the trace goes out as application/json");
+    return req.body;
+}
+
+// No strings in the trace contain brackets, so counting them is enough
+bool balanced(const std::string& json)
+{
+    auto count = [&json](char c) { return std::count(json.begin(), json.end(), c); };
+    return count('{') == count('}') && count('[') == count(']');
+}
+
+} // namespace
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_WARN);
+    host::Scheduler::instance().reset();
+    host::resetDrivers();
+    TraceRecorder& trace = TraceRecorder::instance();
+    trace.start();
+
+    wait(1500); // past the first clock event
+    trace.instant(TraceId::SceneCue, 2);
+    {
+        TraceScope scene(TraceId::Scene, 2);
+        wait(100);
+    }
+    // The export keeps 32 bits of the handle, all there is on the ESP32
+    uint32_t task = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(xTaskGetCurrentTaskHandle()));
+    std::string tid = "\"tid\":" + std::to_string(task);
+
+    std::string live = exportTrace(false);
+    check(live.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0) == 0, "the trace is an object of events");
+    check(balanced(live), "the trace is whole JSON");
+    check(has(live, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"nativity\"}}"),
+        "the process is named");
+    check(has(live, "\"ph\":\"M\",\"pid\":1," + tid + ",\"args\":{\"name\":"), "the task's track is named");
+    check(has(live, "{\"name\":\"scene_cue\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"), "a marker is an instant event");
+    check(has(live, "{\"name\":\"scene\",\"ph\":\"B\",\"ts\":"), "a slice begins");
+    check(has(live, "{\"name\":\"scene\",\"ph\":\"E\",\"ts\":"), "a slice ends");
+    check(has(live, tid + ",\"args\":{\"core\":0,\"scene\":2}}"), "events carry their task, core and argument");
+    check(!has(live, "\"name\":\"clock\""), "clock events aren't exported");
+    check(live.size() > 15 && live.compare(live.size() - 15, 15, "],\"overruns\":0}") == 0, "no overruns yet");
+    check(!trace.hasSnapshot(), "nothing frozen without an overrun");
+
+    trace.checkLate((CONFIG_NATIVITY_TRACE_OVERRUN_MS + 5) * 1000LL);
+    check(trace.overruns() == 1 && trace.hasSnapshot(), "an overrun freezes the rings");
+    trace.instant(TraceId::Button, 1);
+    std::string frozen = exportTrace(true);
+    check(balanced(frozen), "the frozen trace is whole JSON");
+    check(has(frozen, "{\"name\":\"overrun\",\"ph\":\"i\",\"s\":\"t\",\"ts\":"), "the frozen trace has the overrun");
+    check(has(frozen, "\"name\":\"scene\""), "the frozen trace has what came before");
+    check(!has(frozen, "\"name\":\"button\""), "the frozen trace has nothing after the overrun");
+    check(has(frozen, "\"overruns\":1}"), "the overrun is counted");
+    trace.rearm(); // as the download does
+    check(!trace.hasSnapshot(), "a downloaded snapshot is gone");
+
+    host::Scheduler::instance().reset();
+    if (failures == 0)
+        printf("trace export ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+// Where the music is, beat-wise. tools/beat_map.py finds the beats in the tracks on the SD card ahead of time and
+// writes them to beat_maps.hpp; the DFPlayer starts the clock when the player acknowledges a track that has a map
+// and stops it when the track ends or is stopped. The beat effects in Lights lock to it while it runs and fall
+// back to their fixed pulse otherwise. No audio is looked at on the controller.
+#ifndef BEAT_CLOCK_HPP
+#define BEAT_CLOCK_HPP
+
+#include "freertos/FreeRTOS.h"
+#include <stdint.h>
+
+#define BEAT_MAP_UNIT_MS 5 // beat times are stored in these, so a uint16_t reaches 327 s into a track
+
+struct BeatMap {
+    uint16_t track;
+    uint16_t count;
+    uint32_t periodUs; // average beat, for before the first and after the last
+    const uint16_t* beats; // BEAT_MAP_UNIT_MS since the track started, ascending
+    const uint8_t* accents; // onset strength on each beat, 255 the strongest of the track
+};
+
+class BeatClock {
+public:
+    struct Position {
+        int32_t beat; // last beat at or before now, counting on past the ends of the map at its average period
+        float phase; // 0 on that beat, towards 1 just before the next one
+        uint8_t accent; // of that beat
+        uint8_t nextAccent;
+        uint32_t periodUs; // from that beat to the next
+    };
+
+    static BeatClock& instance()
+    {
+        static BeatClock clock;
+        return clock;
+    }
+
+    // The DFPlayer, from its TX task
+    void trackStarted(const BeatMap* map, int64_t atUs)
+    {
+        taskENTER_CRITICAL(&lock_);
+        map_ = map && map->count > 0 ? map : nullptr;
+        startUs_ = atUs;
+        taskEXIT_CRITICAL(&lock_);
+    }
+
+    void trackStopped() { trackStarted(nullptr, 0); }
+
+    bool following() const { return snapshot().map != nullptr; }
+
+    // A steady pulse from startUs, for when no map plays
+    static Position fixed(int64_t nowUs, int64_t startUs, uint32_t periodUs)
+    {
+        int64_t t = nowUs - startUs;
+        return { static_cast<int32_t>(t / periodUs), static_cast<float>(t % periodUs) / periodUs, 255, 255, periodUs };
+    }
+
+    // Only meaningful while following()
+    Position at(int64_t nowUs) const
+    {
+        State state = snapshot();
+        const BeatMap* map = state.map;
+        if (!map)
+            return { 0, 0, 0, 0, 0 };
+        int64_t t = nowUs - state.startUs;
+        int64_t first = beatUs(*map, 0);
+        int64_t last = beatUs(*map, map->count - 1);
+        int64_t period = map->periodUs > 0 ? map->periodUs : 500 * 1000;
+        if (t < first) {
+            // Count backwards from the first beat: beat -1 is the one before it
+            int64_t before = (first - t + period - 1) / period;
+            int64_t at = first - before * period;
+            return { static_cast<int32_t>(-before), static_cast<float>(t - at) / period, 0,
+                before == 1 ? map->accents[0] : uint8_t(0), static_cast<uint32_t>(period) };
+        }
+        if (t >= last) {
+            int64_t after = (t - last) / period;
+            int64_t at = last + after * period;
+            return { static_cast<int32_t>(map->count - 1 + after), static_cast<float>(t - at) / period,
+                after == 0 ? map->accents[map->count - 1] : uint8_t(0), 0, static_cast<uint32_t>(period) };
+        }
+        // Last beat at or before t
+        int lo = 0;
+        int hi = map->count - 1;
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (beatUs(*map, mid) <= t)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        int64_t at = beatUs(*map, lo);
+        int64_t next = beatUs(*map, lo + 1);
+        return { lo, static_cast<float>(t - at) / (next - at), map->accents[lo], map->accents[lo + 1],
+            static_cast<uint32_t>(next - at) };
+    }
+
+private:
+    struct State {
+        const BeatMap* map;
+        int64_t startUs;
+    };
+
+    const BeatMap* map_ = nullptr;
+    int64_t startUs_ = 0;
+    mutable portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+
+    State snapshot() const
+    {
+        taskENTER_CRITICAL(&lock_);
+        State state { map_, startUs_ };
+        taskEXIT_CRITICAL(&lock_);
+        return state;
+    }
+
+    static int64_t beatUs(const BeatMap& map, int index)
+    {
+        return map.beats[index] * static_cast<int64_t>(BEAT_MAP_UNIT_MS * 1000);
+    }
+};
+
+#endif // BEAT_CLOCK_HPP
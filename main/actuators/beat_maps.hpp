@@ -0,0 +1,21 @@
+// Beats of the DFPlayer tracks, generated by tools/beat_map.py. Don't edit, regenerate:
+//   tools/beat_map.py <the tracks on the SD card>
+#ifndef BEAT_MAPS_HPP
+#define BEAT_MAPS_HPP
+
+#include "beat_clock.hpp"
+#include <array>
+
+constexpr std::array<BeatMap, 0> BEAT_MAPS = { {
+} };
+
+inline const BeatMap* beatMapFor(uint16_t track)
+{
+    for (const BeatMap& map : BEAT_MAPS) {
+        if (map.track == track)
+            return &map;
+    }
+    return nullptr;
+}
+
+#endif // BEAT_MAPS_HPP
@@ -0,0 +1,163 @@
+// LEDs next to the buttons, on LEDC PWM channels so the fade engine does the animation in hardware
+#ifndef BUTTON_LEDS_HPP
+#define BUTTON_LEDS_HPP
+
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "static_alloc.hpp"
+#include <vector>
+
+#define BUTTON_LED_SPEED_MODE LEDC_LOW_SPEED_MODE // motors own the high speed timers
+#define BUTTON_LED_TIMER LEDC_TIMER_1
+#define BUTTON_LED_RESOLUTION LEDC_TIMER_13_BIT
+#define BUTTON_LED_MAX_DUTY ((1 << 13) - 1)
+
+class ButtonLeds {
+public:
+    enum class Pattern {
+        Off,
+        On,
+        Blink, // hard on/off, 1s period
+        Breathe, // slow full-range breathing, the idle "press me" animation
+        Active, // gentle pulse near full brightness for the scene that is playing
+    };
+
+    ButtonLeds(const gpio_num_t* pins, int count)
+        : leds_(count)
+    {
+        // Fade engine is shared by all LEDC users
+        esp_err_t err = ledc_fade_func_install(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGE("ButtonLeds", "Failed to install LEDC fade: %s", esp_err_to_name(err));
+        }
+
+        ledc_timer_config_t timer_conf = {};
+        timer_conf.speed_mode = BUTTON_LED_SPEED_MODE;
+        timer_conf.duty_resolution = BUTTON_LED_RESOLUTION;
+        timer_conf.timer_num = BUTTON_LED_TIMER;
+        timer_conf.freq_hz = 5000;
+        timer_conf.clk_cfg = LEDC_AUTO_CLK;
+        ledc_timer_config(&timer_conf);
+
+        for (int i = 0; i < count; ++i) {
+            auto& led = leds_[i];
+            led.channel = static_cast<ledc_channel_t>(LEDC_CHANNEL_0 + i);
+
+            ledc_channel_config_t channel_conf = {};
+            channel_conf.gpio_num = pins[i];
+            channel_conf.speed_mode = BUTTON_LED_SPEED_MODE;
+            channel_conf.channel = led.channel;
+            channel_conf.timer_sel = BUTTON_LED_TIMER;
+            channel_conf.duty = 0;
+            channel_conf.hpoint = 0;
+            ledc_channel_config(&channel_conf);
+
+            // Only re-arms the next hardware fade once per half period, the fade itself costs no CPU
+            led.timer = led.timerStorage.create(
+                "button leds", "button_led", pdMS_TO_TICKS(1000), pdTRUE, &led, &ButtonLeds::timerCallback);
+        }
+    }
+
+    // Timers keep pointers into leds_ (and their storage lives there)
+    ButtonLeds(const ButtonLeds&) = delete;
+    ButtonLeds& operator=(const ButtonLeds&) = delete;
+
+    int count() const { return leds_.size(); }
+
+    void setPattern(int index, Pattern pattern)
+    {
+        if (index < 0 || index >= count())
+            return;
+        auto& led = leds_[index];
+        if (led.pattern == pattern)
+            return;
+        led.pattern = pattern;
+        led.high = true;
+
+        xTimerStop(led.timer, 0);
+        ledc_fade_stop(BUTTON_LED_SPEED_MODE, led.channel);
+
+        const Shape& shape = shapeOf(pattern);
+        fadeTo(led, shape.high, shape.fadeInMs);
+        if (shape.halfPeriodMs > 0) {
+            xTimerChangePeriod(led.timer, pdMS_TO_TICKS(shape.halfPeriodMs), 0);
+            xTimerStart(led.timer, 0);
+        }
+    }
+
+    void setAll(Pattern pattern)
+    {
+        for (int i = 0; i < count(); ++i) {
+            setPattern(i, pattern);
+        }
+    }
+
+    // Highlights one LED and turns the others off
+    void setOnly(int index, Pattern pattern)
+    {
+        for (int i = 0; i < count(); ++i) {
+            setPattern(i, i == index ? pattern : Pattern::Off);
+        }
+    }
+
+private:
+    struct Led {
+        ledc_channel_t channel = LEDC_CHANNEL_0;
+        TimerStorage timerStorage;
+        TimerHandle_t timer = nullptr;
+        Pattern pattern = Pattern::Off;
+        bool high = false;
+    };
+
+    // Duty levels in 0..BUTTON_LED_MAX_DUTY; halfPeriodMs 0 means static
+    struct Shape {
+        uint32_t low;
+        uint32_t high;
+        int fadeInMs;
+        int halfPeriodMs;
+        int fadeMs;
+    };
+
+    std::vector<Led> leds_;
+
+    static const Shape& shapeOf(Pattern pattern)
+    {
+        static const Shape off = { 0, 0, 200, 0, 0 };
+        static const Shape on = { 0, BUTTON_LED_MAX_DUTY, 150, 0, 0 };
+        static const Shape blink = { 0, BUTTON_LED_MAX_DUTY, 30, 1000, 30 };
+        static const Shape breathe = { 0, BUTTON_LED_MAX_DUTY, 950, 1000, 950 };
+        static const Shape active = { BUTTON_LED_MAX_DUTY * 6 / 10, BUTTON_LED_MAX_DUTY, 150, 600, 570 };
+        switch (pattern) {
+        case Pattern::On:
+            return on;
+        case Pattern::Blink:
+            return blink;
+        case Pattern::Breathe:
+            return breathe;
+        case Pattern::Active:
+            return active;
+        case Pattern::Off:
+        default:
+            return off;
+        }
+    }
+
+    static void fadeTo(Led& led, uint32_t duty, int fadeMs)
+    {
+        ledc_set_fade_with_time(BUTTON_LED_SPEED_MODE, led.channel, duty, fadeMs);
+        ledc_fade_start(BUTTON_LED_SPEED_MODE, led.channel, LEDC_FADE_NO_WAIT);
+    }
+
+    static void timerCallback(TimerHandle_t timer)
+    {
+        auto* led = static_cast<Led*>(pvTimerGetTimerID(timer));
+        const Shape& shape = shapeOf(led->pattern);
+        led->high = !led->high;
+        fadeTo(*led, led->high ? shape.high : shape.low, shape.fadeMs);
+    }
+};
+
+#endif // BUTTON_LEDS_HPP
@@ -1,11 +1,24 @@
 #ifndef DFPLAYER_HPP
 #define DFPLAYER_HPP
 
+#include "beat_maps.hpp"
+#include "diagnostics/latency_histogram.hpp"
+#include "diagnostics/latency_probes.hpp"
+#include "diagnostics/trace_recorder.hpp"
 #include "driver/gpio.h"
 #include "driver/uart.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
+#include "shadow_state.hpp"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <stdio.h>
 #include <string.h>
 
@@ -13,46 +26,381 @@
 #define DF_RX GPIO_NUM_14 // ESP32 receives FROM DFPlayer TX
 #define DF_TX GPIO_NUM_13 // ESP32 sends TO DFPlayer RX
 #define BUF_SIZE 1024
+#define DF_COMMAND_GAP_MS 100 // gap when the player doesn't acknowledge, Arduino library uses longer delays
+#define DF_ACK_GAP_MS 20 // gap after an acknowledged command
+#define DF_ACK_TIMEOUT_MS 150
+#define DF_MAX_RETRIES 2
+#define DF_QUEUE_LEN 16
+
+using DFFrame = std::array<uint8_t, 10>;
+
+// Builds a complete command frame, checksum included, at compile time when the arguments are constants
+constexpr DFFrame dfFrame(uint8_t command, uint8_t param1 = 0x00, uint8_t param2 = 0x00)
+{
+    // 0x01 requests feedback (Arduino library default)
+    uint16_t checksum = static_cast<uint16_t>(-(0xFF + 0x06 + command + 0x01 + param1 + param2));
+    return { 0x7E, 0xFF, 0x06, command, 0x01, param1, param2, static_cast<uint8_t>(checksum >> 8),
+        static_cast<uint8_t>(checksum & 0xFF), 0xEF };
+}
+
+// What the player reports back over its TX line
+enum class DFEvent {
+    PlaybackStarted, // playTrack acknowledged
+    TrackFinished, // param = track number
+    Error, // param = DFPlayer error code
+    CardInserted,
+    CardRemoved,
+    Online, // player finished its own initialisation
+};
+
+// Event group bits, for tasks that want to block on player events
+#define DF_BIT_PLAYING BIT0
+#define DF_BIT_TRACK_FINISHED BIT1
+#define DF_BIT_ERROR BIT2
+#define DF_BIT_ONLINE BIT3
+
+#define DF_BOOT_TIME_MS 2000 // the player ignores commands this long after power-up, unless it says it's online
 
 class DFPlayer {
+public:
+    struct Stats {
+        uint32_t acked = 0;
+        uint32_t retries = 0;
+        uint32_t timeouts = 0; // gave up after DF_MAX_RETRIES
+        uint32_t errors = 0;
+        uint32_t badFrames = 0; // framing or checksum errors on RX
+    };
+
 private:
+    static constexpr uint8_t CMD_NEXT = 0x01;
+    static constexpr uint8_t CMD_PREVIOUS = 0x02;
+    static constexpr uint8_t CMD_PLAY_TRACK = 0x03;
+    static constexpr uint8_t CMD_VOLUME = 0x06;
+    static constexpr uint8_t CMD_SLEEP = 0x0A;
+    static constexpr uint8_t CMD_WAKE_UP = 0x0B;
+    static constexpr uint8_t CMD_RESET = 0x0C;
+    static constexpr uint8_t CMD_PLAY = 0x0D;
+    static constexpr uint8_t CMD_PAUSE = 0x0E;
+    static constexpr uint8_t CMD_STOP = 0x16;
+
+    static constexpr uint8_t REPLY_CARD_INSERTED = 0x3A;
+    static constexpr uint8_t REPLY_CARD_REMOVED = 0x3B;
+    static constexpr uint8_t REPLY_TRACK_FINISHED = 0x3D;
+    static constexpr uint8_t REPLY_ONLINE = 0x3F;
+    static constexpr uint8_t REPLY_ERROR = 0x40;
+    static constexpr uint8_t REPLY_ACK = 0x41;
+
+    static constexpr uint8_t ERROR_BUSY = 0x01;
+    static constexpr uint8_t ERROR_CHECKSUM = 0x04;
+
+    static constexpr DFFrame FRAME_NEXT = dfFrame(CMD_NEXT);
+    static constexpr DFFrame FRAME_PREVIOUS = dfFrame(CMD_PREVIOUS);
+    static constexpr DFFrame FRAME_SLEEP = dfFrame(CMD_SLEEP);
+    static constexpr DFFrame FRAME_WAKE_UP = dfFrame(CMD_WAKE_UP);
+    static constexpr DFFrame FRAME_RESET = dfFrame(CMD_RESET);
+    static constexpr DFFrame FRAME_PLAY = dfFrame(CMD_PLAY);
+    static constexpr DFFrame FRAME_PAUSE = dfFrame(CMD_PAUSE);
+    static constexpr DFFrame FRAME_STOP = dfFrame(CMD_STOP);
+
     uart_port_t uart_num;
     static const char* TAG;
 
+    // Pending frames, oldest first. A small ring instead of a FreeRTOS queue so superseded commands can be
+    // taken out.
+    std::array<DFFrame, DF_QUEUE_LEN> pending_ {};
+    std::array<int64_t, DF_QUEUE_LEN> queuedAtUs_ {}; // a coalesced frame keeps the time of the one it replaced
+    size_t head_ = 0;
+    size_t count_ = 0;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t txTaskHandle_ = nullptr;
+    TaskHandle_t rxTaskHandle_ = nullptr;
+    QueueHandle_t uartEvents_ = nullptr;
+    QueueHandle_t replies_ = nullptr; // RX -> TX: ACK or error code for the command in flight
+    EventGroupHandle_t events_ = nullptr;
+    static inline QueueStorage<uint8_t, 4> repliesStorage_; // one player per firmware
+    static inline EventGroupStorage eventsStorage_;
+    std::function<void(DFEvent, uint16_t)> listener_;
+
+    Stats stats_;
+    LatencyHistogram ackLatency_;
+    int64_t lastFinishedUs_ = 0;
+
+    // Only the latest value of these matters, an older pending one is dropped
+    static bool isCoalescible(uint8_t command) { return command == CMD_VOLUME; }
 
-    void sendCommand(uint8_t cmd[], size_t len)
+    // Returns immediately, the TX task spaces the frames out
+    void sendCommand(const DFFrame& frame)
     {
-        uart_write_bytes(uart_num, (const char*)cmd, len);
-        vTaskDelay(pdMS_TO_TICKS(100)); // Arduino library uses longer delays
+        int64_t now = esp_timer_get_time();
+        bool queued = true;
+        bool coalesced = false;
+        int64_t queuedAtUs = now;
+        taskENTER_CRITICAL(&lock_);
+        // The new frame still goes to the tail: a volume change sent after a play must not overtake it
+        if (isCoalescible(frame[3])) {
+            for (size_t i = 0; i < count_; ++i) {
+                if (pending_[(head_ + i) % DF_QUEUE_LEN][3] == frame[3]) {
+                    queuedAtUs = queuedAtUs_[(head_ + i) % DF_QUEUE_LEN];
+                    removeAt(i);
+                    coalesced = true;
+                    break;
+                }
+            }
+        }
+        if (count_ < DF_QUEUE_LEN) {
+            pending_[(head_ + count_) % DF_QUEUE_LEN] = frame;
+            queuedAtUs_[(head_ + count_) % DF_QUEUE_LEN] = queuedAtUs;
+            count_++;
+        } else {
+            queued = false;
+        }
+        taskEXIT_CRITICAL(&lock_);
+
+        TraceRecorder::instance().instant(TraceId::DfQueue, frame[3]);
+        if (coalesced) {
+            outputStats().dfplayer.skip();
+        } else if (!queued) {
+            ESP_LOGW(TAG, "Command queue full, dropping 0x%02X", frame[3]);
+        } else if (txTaskHandle_) {
+            xTaskNotifyGive(txTaskHandle_);
+        }
     }
 
-    void sendCommand(uint8_t command, uint8_t param1 = 0x00, uint8_t param2 = 0x00)
+    // Under lock_. Closes the gap by moving the newer frames forward.
+    void removeAt(size_t index)
     {
-        uint8_t cmd[10];
-        cmd[0] = 0x7E;
-        cmd[1] = 0xFF;
-        cmd[2] = 0x06;
-        cmd[3] = command;
-        cmd[4] = 0x01; // Request feedback (Arduino library default) 0x00 is feedback
-        cmd[5] = param1;
-        cmd[6] = param2;
+        for (size_t i = index; i + 1 < count_; ++i) {
+            pending_[(head_ + i) % DF_QUEUE_LEN] = pending_[(head_ + i + 1) % DF_QUEUE_LEN];
+            queuedAtUs_[(head_ + i) % DF_QUEUE_LEN] = queuedAtUs_[(head_ + i + 1) % DF_QUEUE_LEN];
+        }
+        count_--;
+    }
 
-        // Calculate proper checksum
-        int16_t checksum = -(cmd[1] + cmd[2] + cmd[3] + cmd[4] + cmd[5] + cmd[6]);
-        cmd[7] = (uint8_t)(checksum >> 8);
-        cmd[8] = (uint8_t)(checksum & 0xFF);
-        cmd[9] = 0xEF;
+    bool popCommand(DFFrame& frame, int64_t& queuedAtUs)
+    {
+        taskENTER_CRITICAL(&lock_);
+        bool available = count_ > 0;
+        if (available) {
+            frame = pending_[head_];
+            queuedAtUs = queuedAtUs_[head_];
+            head_ = (head_ + 1) % DF_QUEUE_LEN;
+            count_--;
+        }
+        taskEXIT_CRITICAL(&lock_);
+        return available;
+    }
+
+    static void txTaskEntry(void* param) { static_cast<DFPlayer*>(param)->txTask(); }
+
+    void txTask()
+    {
+        // Commands queue up meanwhile, nobody has to wait for the player to boot
+        xEventGroupWaitBits(events_, DF_BIT_ONLINE, pdFALSE, pdFALSE, pdMS_TO_TICKS(DF_BOOT_TIME_MS));
 
-        ESP_LOGI(TAG, "Sending command: 0x%02X, params: 0x%02X 0x%02X", command, param1, param2);
-        sendCommand(cmd, sizeof(cmd));
+        int64_t lastTxUs = 0;
+        int gapMs = DF_COMMAND_GAP_MS;
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            DFFrame frame;
+            int64_t queuedAtUs;
+            while (true) {
+                // Wait out the gap first, so a burst of setVolume calls collapses into the latest one
+                int64_t sinceLastMs = (esp_timer_get_time() - lastTxUs) / 1000;
+                if (sinceLastMs < gapMs) {
+                    vTaskDelay(pdMS_TO_TICKS(gapMs - sinceLastMs));
+                }
+                if (!popCommand(frame, queuedAtUs))
+                    break;
+                gapMs = transmit(frame, queuedAtUs) ? DF_ACK_GAP_MS : DF_COMMAND_GAP_MS;
+                lastTxUs = esp_timer_get_time();
+            }
+        }
+    }
+
+    // Sends a frame and waits for its ACK, retrying when the player is busy or didn't answer. Returns whether
+    // the command was acknowledged.
+    bool transmit(const DFFrame& frame, int64_t queuedAtUs)
+    {
+        for (int attempt = 0; attempt <= DF_MAX_RETRIES; ++attempt) {
+            if (attempt > 0) {
+                stats_.retries++;
+                vTaskDelay(pdMS_TO_TICKS(DF_COMMAND_GAP_MS));
+            }
+            xQueueReset(replies_);
+            int64_t sentUs = esp_timer_get_time();
+            uint8_t reply;
+            bool answered;
+            {
+                TraceScope trace(TraceId::UartTx, frame[3]);
+                uart_write_bytes(uart_num, reinterpret_cast<const char*>(frame.data()), frame.size());
+                outputStats().dfplayer.hit();
+                ESP_LOGD(TAG, "Sent command: 0x%02X, params: 0x%02X 0x%02X", frame[3], frame[5], frame[6]);
+                answered = xQueueReceive(replies_, &reply, pdMS_TO_TICKS(DF_ACK_TIMEOUT_MS)) == pdTRUE;
+            }
+            if (!answered)
+                continue;
+            if (reply == REPLY_ACK) {
+                int64_t now = esp_timer_get_time();
+                ackLatency_.record(static_cast<uint32_t>(now - sentUs));
+                LatencyProbes::instance().record(LatencyProbe::DfplayerAck, static_cast<uint32_t>(now - queuedAtUs));
+                if (frame[3] == CMD_STOP)
+                    LatencyProbes::instance().end(LatencyProbe::StopToSilence, now);
+                stats_.acked++;
+                if (frame[3] == CMD_PLAY_TRACK)
+                    publish(DFEvent::PlaybackStarted, (frame[5] << 8) | frame[6]);
+                return true;
+            }
+            // Error code: only worth repeating if the player was busy or garbled the frame
+            if (reply != ERROR_BUSY && reply != ERROR_CHECKSUM)
+                return false;
+        }
+        stats_.timeouts++;
+        ESP_LOGW(TAG, "No ACK for command 0x%02X", frame[3]);
+        return false;
+    }
+
+    static void rxTaskEntry(void* param) { static_cast<DFPlayer*>(param)->rxTask(); }
+
+    void rxTask()
+    {
+        uint8_t buffer[64];
+        DFFrame frame;
+        size_t filled = 0;
+        uart_event_t event;
+        while (true) {
+            if (xQueueReceive(uartEvents_, &event, portMAX_DELAY) != pdTRUE)
+                continue;
+            if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+                uart_flush_input(uart_num);
+                xQueueReset(uartEvents_);
+                filled = 0;
+                continue;
+            }
+            if (event.type != UART_DATA)
+                continue;
+
+            size_t remaining = event.size;
+            while (remaining > 0) {
+                int len = uart_read_bytes(uart_num, buffer, std::min(remaining, sizeof(buffer)), 0);
+                if (len <= 0)
+                    break;
+                remaining -= len;
+                for (int i = 0; i < len; ++i) {
+                    // Resync on the start byte, then collect exactly one frame
+                    if (filled == 0 && buffer[i] != 0x7E)
+                        continue;
+                    frame[filled++] = buffer[i];
+                    if (filled == frame.size()) {
+                        filled = 0;
+                        if (isValidFrame(frame)) {
+                            onReply(frame[3], (frame[5] << 8) | frame[6]);
+                        } else {
+                            stats_.badFrames++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static bool isValidFrame(const DFFrame& f)
+    {
+        if (f[0] != 0x7E || f[1] != 0xFF || f[2] != 0x06 || f[9] != 0xEF)
+            return false;
+        uint16_t checksum = static_cast<uint16_t>(-(f[1] + f[2] + f[3] + f[4] + f[5] + f[6]));
+        return f[7] == (checksum >> 8) && f[8] == (checksum & 0xFF);
+    }
+
+    void onReply(uint8_t command, uint16_t param)
+    {
+        switch (command) {
+        case REPLY_ACK: {
+            uint8_t reply = REPLY_ACK;
+            xQueueSend(replies_, &reply, 0);
+            break;
+        }
+        case REPLY_ERROR: {
+            uint8_t reply = param & 0xFF;
+            xQueueSend(replies_, &reply, 0);
+            stats_.errors++;
+            ESP_LOGW(TAG, "Player reported error 0x%02X", reply);
+            publish(DFEvent::Error, param);
+            break;
+        }
+        case REPLY_TRACK_FINISHED: {
+            // The player sends this twice in a row
+            int64_t now = esp_timer_get_time();
+            if (now - lastFinishedUs_ > 200 * 1000)
+                publish(DFEvent::TrackFinished, param);
+            lastFinishedUs_ = now;
+            break;
+        }
+        case REPLY_CARD_INSERTED:
+            publish(DFEvent::CardInserted, param);
+            break;
+        case REPLY_CARD_REMOVED:
+            publish(DFEvent::CardRemoved, param);
+            break;
+        case REPLY_ONLINE:
+            publish(DFEvent::Online, param);
+            break;
+        default:
+            ESP_LOGD(TAG, "Unhandled reply 0x%02X 0x%04X", command, param);
+            break;
+        }
+    }
+
+    void publish(DFEvent event, uint16_t param)
+    {
+        switch (event) {
+        case DFEvent::PlaybackStarted:
+            xEventGroupClearBits(events_, DF_BIT_TRACK_FINISHED | DF_BIT_ERROR);
+            xEventGroupSetBits(events_, DF_BIT_PLAYING);
+            // The ACK is as close to the first sound as we get; tools/beat_map.py --offset-ms covers the rest
+            BeatClock::instance().trackStarted(beatMapFor(param), esp_timer_get_time());
+            break;
+        case DFEvent::TrackFinished:
+            xEventGroupClearBits(events_, DF_BIT_PLAYING);
+            xEventGroupSetBits(events_, DF_BIT_TRACK_FINISHED);
+            BeatClock::instance().trackStopped();
+            break;
+        case DFEvent::Error:
+            xEventGroupSetBits(events_, DF_BIT_ERROR);
+            break;
+        case DFEvent::Online:
+            xEventGroupSetBits(events_, DF_BIT_ONLINE);
+            break;
+        default:
+            break;
+        }
+        if (listener_)
+            listener_(event, param);
     }
 
 public:
     DFPlayer(uart_port_t uart = DF_UART_NUM)
         : uart_num(uart)
+        , replies_(repliesStorage_.create("dfplayer replies"))
+        , events_(eventsStorage_.create("dfplayer events"))
+    {
+    }
+
+    // Called from the RX/TX tasks, keep it short
+    void setEventListener(std::function<void(DFEvent, uint16_t)> listener) { listener_ = std::move(listener); }
+
+    // Blocks until the player reports the current track finished, or timeout. Returns whether it finished.
+    bool waitForTrackFinished(int timeout_ms)
     {
+        EventBits_t bits = xEventGroupWaitBits(
+            events_, DF_BIT_TRACK_FINISHED, pdFALSE, pdFALSE, timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms));
+        return bits & DF_BIT_TRACK_FINISHED;
     }
 
+    bool isPlaying() const { return xEventGroupGetBits(events_) & DF_BIT_PLAYING; }
+
+    const Stats& getStats() const { return stats_; }
+    LatencyHistogram& getAckLatency() { return ackLatency_; }
+
     void begin()
     {
         ESP_LOGI(TAG, "Initializing DFPlayer...");
@@ -71,23 +419,28 @@ public:
 
         ESP_ERROR_CHECK(uart_param_config(uart_num, &uart_config));
         ESP_ERROR_CHECK(uart_set_pin(uart_num, DF_TX, DF_RX, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
-        ESP_ERROR_CHECK(uart_driver_install(uart_num, BUF_SIZE * 2, 0, 0, NULL, 0));
-
-        // Match Arduino library timing
-        vTaskDelay(pdMS_TO_TICKS(500));
-
-        // Send initial reset like Arduino library does
-        // reset();
-        vTaskDelay(pdMS_TO_TICKS(1500));
+        ESP_ERROR_CHECK(uart_driver_install(uart_num, BUF_SIZE * 2, 0, 16, &uartEvents_, 0));
+        startTask(TASK_DFPLAYER_RX, &DFPlayer::rxTaskEntry, this, &rxTaskHandle_);
+        // The TX task holds the queued commands back until the player has booted
+        startTask(TASK_DFPLAYER_TX, &DFPlayer::txTaskEntry, this, &txTaskHandle_);
 
         setVolume(20);
         stop();
         ESP_LOGI(TAG, "DFPlayer initialized");
     }
 
+    // Frames waiting for the TX task
+    size_t queueDepth()
+    {
+        taskENTER_CRITICAL(&lock_);
+        size_t depth = count_;
+        taskEXIT_CRITICAL(&lock_);
+        return depth;
+    }
+
     void play()
     {
-        sendCommand(0x0D);
+        sendCommand(FRAME_PLAY);
         ESP_LOGI(TAG, "Play");
     }
 
@@ -99,31 +452,33 @@ public:
 
     void stop()
     {
-        sendCommand(0x16);
+        BeatClock::instance().trackStopped();
+        sendCommand(FRAME_STOP);
         ESP_LOGI(TAG, "Stop");
     }
 
     void pause()
     {
-        sendCommand(0x0E);
+        sendCommand(FRAME_PAUSE);
         ESP_LOGI(TAG, "Pause");
     }
 
     void next()
     {
-        sendCommand(0x01);
+        sendCommand(FRAME_NEXT);
         ESP_LOGI(TAG, "Next");
     }
 
     void previous()
     {
-        sendCommand(0x02);
+        sendCommand(FRAME_PREVIOUS);
         ESP_LOGI(TAG, "Previous");
     }
 
     void playTrack(uint16_t track)
     {
-        sendCommand(0x03, track >> 8, track & 0xFF);
+        xEventGroupClearBits(events_, DF_BIT_TRACK_FINISHED);
+        sendCommand(dfFrame(CMD_PLAY_TRACK, track >> 8, track & 0xFF));
         ESP_LOGI(TAG, "Playing track %d", track);
     }
 
@@ -133,25 +488,42 @@ public:
     {
         // store the volume locally
         volume = vol;
-        if (vol > 30)
-            vol = 30;
-        sendCommand(0x06, 0x00, vol);
+        if (vol > volumeLimit)
+            vol = volumeLimit;
+        if (vol == sentVolume) {
+            outputStats().dfplayer.skip();
+            return;
+        }
+        sentVolume = vol;
+        sendCommand(dfFrame(CMD_VOLUME, 0x00, vol));
         // ESP_LOGI(TAG, "Volume: %d", vol);
     }
 
+    // Caps every volume the scenes ask for (0-30), e.g. quieter in the evening
+    void setVolumeLimit(uint8_t limit)
+    {
+        volumeLimit = std::min<uint8_t>(limit, 30);
+        setVolume(volume);
+    }
+
     void reset()
     {
-        sendCommand(0x0C);
+        sentVolume = -1; // player forgets its volume on reset
+        sendCommand(FRAME_RESET);
         // ESP_LOGI(TAG, "Reset");
     }
 
-    void sleep() { sendCommand(0x0A); }
-    void wakeUp() { sendCommand(0x0B); }
+    void sleep() { sendCommand(FRAME_SLEEP); }
+    void wakeUp() { sendCommand(FRAME_WAKE_UP); }
 
 private:
     uint8_t volume = 20;
+    uint8_t volumeLimit = 30;
+    int sentVolume = -1; // last volume handed to the TX queue, -1 = unknown
 };
 
 const char* DFPlayer::TAG = "DFPlayer";
 
+static_assert(dfFrame(0x06, 0x00, 0x14)[7] == 0xFE && dfFrame(0x06, 0x00, 0x14)[8] == 0xE0, "DFPlayer checksum");
+
 #endif // DFPLAYER_HPP
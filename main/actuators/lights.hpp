@@ -2,12 +2,25 @@
 #define LIGHTS_HPP
 
 #include "../util.hpp" // for wait function
+#include "beat_clock.hpp"
+#include "diagnostics/frame_profiler.hpp"
+#include "diagnostics/latency_histogram.hpp"
+#include "diagnostics/latency_probes.hpp"
+#include "diagnostics/trace_recorder.hpp"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "led_strip.h"
+#include "pixel_kernels.hpp"
+#include "render_pool.hpp"
+#include "shadow_state.hpp"
+#include "static_alloc.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstring>
 #include <esp_random.h>
 #include <tuple>
 #include <vector>
@@ -20,8 +33,10 @@ public:
         : numLEDs(numLEDs)
         , dataPin(dataPin)
         , strip_handle(nullptr)
-        , lastColors(numLEDs, std::make_tuple(0, 0, 0))
+        , colors(numLEDs * 3, 0)
+        , shownPixels(numLEDs * 3, 0)
     {
+        MemoryReport::instance().add("lights", BOOT_MEMORY_KIND, colors.size() + shownPixels.size());
         // Configure LED strip with RMT peripheral
         led_strip_config_t strip_config = { .strip_gpio_num = dataPin,
             .max_leds = static_cast<uint32_t>(numLEDs),
@@ -52,8 +67,26 @@ public:
 
     void turnOff()
     {
-        led_strip_clear(strip_handle);
-        led_strip_refresh(strip_handle);
+        if (!pixelsDirty && isDark()) {
+            outputStats().stripRefresh.skip();
+            return;
+        }
+        // led_strip_clear also transmits the cleared frame
+        FrameProfiler* profiler = FrameProfiler::active();
+        if (profiler)
+            profiler->frame();
+        int64_t start = esp_timer_get_time();
+        {
+            TraceScope trace(TraceId::Frame, numLEDs);
+            led_strip_clear(strip_handle);
+        }
+        transmitted(esp_timer_get_time() - start);
+        if (profiler)
+            profiler->resume();
+        std::fill(shownPixels.begin(), shownPixels.end(), 0);
+        pixelsDirty = false;
+        frameCount_.fetch_add(1, std::memory_order_release);
+        outputStats().stripRefresh.hit();
         // ESP_LOGI(TAG, "LED strip turned off");
     }
 
@@ -67,6 +100,9 @@ public:
         this->brightness = brightness;
     }
 
+    // Scales everything drawn with setLed from now on (0-255); live pixel streams aren't affected
+    void setMasterBrightness(int brightness) { masterBrightness = std::max(0, std::min(255, brightness)); }
+
     void setLed(int index, std::tuple<uint8_t, uint8_t, uint8_t> color, int brightness = 255, bool refresh = true)
     {
         if (!strip_handle) {
@@ -83,27 +119,64 @@ public:
         if (brightness > 255)
             brightness = 255;
 
-        uint8_t r = (std::get<0>(color) * brightness) / 255;
-        uint8_t g = (std::get<1>(color) * brightness) / 255;
-        uint8_t b = (std::get<2>(color) * brightness) / 255;
-
-        led_strip_set_pixel(strip_handle, index, r, g, b);
-        lastColors[index] = color;
+        if (writePixel(index, color, brightness * masterBrightness / 255)) {
+            pixelsDirty = true;
+            outputStats().pixels.hit();
+        } else {
+            outputStats().pixels.skip();
+        }
 
         if (refresh) {
-            led_strip_refresh(strip_handle);
+            this->refresh();
         }
     }
 
     void setMultipleLeds(int from, int to, const std::tuple<uint8_t, uint8_t, uint8_t>& color, int brightness = 255)
     {
-        for (int i = from; i <= to; ++i) {
-            setLed(i, color, brightness, false);
-        }
+        fill(from, to, color, brightness);
         refresh();
     }
 
-    void refresh() { led_strip_refresh(strip_handle); }
+    // setLed(i, color, brightness, false) for LEDs from..to (inclusive); long strips are split over both cores
+    void fill(int from, int to, const std::tuple<uint8_t, uint8_t, uint8_t>& color, int brightness = 255)
+    {
+        int scaled = std::max(0, std::min(255, brightness)) * masterBrightness / 255;
+        auto [r, g, b] = color;
+        renderPasses(from, to + 1, [&](int begin, int end) {
+            pixel_kernels::fill(&colors[begin * 3], end - begin, r, g, b);
+            return present(begin, end, scaled);
+        });
+    }
+
+    // setLed(i, getColor(i), brightness, false) for every LED: fades the strip without touching its colours
+    void dimTo(int brightness)
+    {
+        int scaled = std::max(0, std::min(255, brightness)) * masterBrightness / 255;
+        renderPasses(0, numLEDs, [&](int begin, int end) { return present(begin, end, scaled); });
+    }
+
+    // Only transmits when a pixel changed since the last frame
+    void refresh()
+    {
+        if (!pixelsDirty) {
+            outputStats().stripRefresh.skip();
+            return;
+        }
+        FrameProfiler* profiler = FrameProfiler::active();
+        if (profiler)
+            profiler->frame();
+        int64_t start = esp_timer_get_time();
+        {
+            TraceScope trace(TraceId::Frame, numLEDs);
+            led_strip_refresh(strip_handle);
+        }
+        transmitted(esp_timer_get_time() - start);
+        if (profiler)
+            profiler->resume();
+        pixelsDirty = false;
+        frameCount_.fetch_add(1, std::memory_order_release);
+        outputStats().stripRefresh.hit();
+    }
 
     void sparkeMultipleLeds(int duration_ms, int interval_ms)
     {
@@ -238,15 +311,13 @@ public:
     {
         for (int i = 0; i < flashes; ++i) {
             // Full brightness white
-            for (int j = from; j <= to; ++j) {
-                setLed(j, std::make_tuple(255, 255, 255), 255, false);
-            }
+            fill(from, to, std::make_tuple(255, 255, 255));
             refresh();
-            vTaskDelay(pdMS_TO_TICKS(flash_duration_ms));
+            wait(flash_duration_ms);
 
             // Turn off
             turnOff();
-            vTaskDelay(pdMS_TO_TICKS(pause_duration_ms));
+            wait(pause_duration_ms);
         }
     }
 
@@ -254,6 +325,26 @@ public:
     // all leds turn off and on in between pulses
     void pulsingChaos(int timeInMs, int pulseIntervalMs = 400)
     {
+        if (BeatClock::instance().following()) {
+            // On for the first half of every beat, off for the second
+            int32_t lit = INT32_MIN;
+            onBeats(timeInMs, pulseIntervalMs, [&](const BeatClock::Position& at) {
+                if (at.phase < 0.5f && at.beat != lit) {
+                    for (int j = 0; j < numLEDs; ++j) {
+                        auto color = std::make_tuple(esp_random() % 256, esp_random() % 256, esp_random() % 256);
+                        setLed(j, color, 255, false);
+                    }
+                    refresh();
+                    lit = at.beat;
+                } else if (at.phase >= 0.5f && at.beat == lit) {
+                    turnOff();
+                    lit = INT32_MIN;
+                }
+            });
+            turnOff();
+            return;
+        }
+
         int elapsed = 0;
         while (elapsed < timeInMs) {
             int numPulses = esp_random() % 5 + 3; // 3 to 7 pulses
@@ -276,22 +367,14 @@ public:
     {
         // Fade in while changing colors
         for (int b = 0; b <= 255; b += (256 / steps)) {
-            for (int i = 0; i < numLEDs; ++i) {
-                float hue = (360.0f * b) / 255.0f;
-                auto color = hsv2rgb(hue, 0.8f, 1.0f);
-                setLed(i, color, b, false);
-            }
+            fill(0, numLEDs - 1, hsv2rgb((360.0f * b) / 255.0f, 0.8f, 1.0f), b);
             refresh();
             wait(step_delay_ms);
         }
 
         // Fade out while changing colors
         for (int b = 255; b >= 0; b -= (256 / steps)) {
-            for (int i = 0; i < numLEDs; ++i) {
-                float hue = (360.0f * b) / 255.0f;
-                auto color = hsv2rgb(hue, 0.8f, 1.0f);
-                setLed(i, color, b, false);
-            }
+            fill(0, numLEDs - 1, hsv2rgb((360.0f * b) / 255.0f, 0.8f, 1.0f), b);
             refresh();
             wait(step_delay_ms);
         }
@@ -299,6 +382,16 @@ public:
 
     void pulsingBeat(int timeInMs, int pulseIntervalMs = 400)
     {
+        if (BeatClock::instance().following()) {
+            BeatColors colors;
+            onBeats(timeInMs, pulseIntervalMs, [&](const BeatClock::Position& at) {
+                fill(0, numLEDs - 1, colors.at(pulseBeat(at)), pulseLevel(at));
+                refresh();
+            });
+            turnOff();
+            return;
+        }
+
         int elapsed = 0;
         while (elapsed < timeInMs) {
             // Pick a random color for this beat
@@ -306,18 +399,14 @@ public:
 
             // Fade in
             for (int b = 0; b <= 255; b += 16) {
-                for (int j = 0; j < numLEDs; ++j) {
-                    setLed(j, color, b, false);
-                }
+                fill(0, numLEDs - 1, color, b);
                 refresh();
                 wait(pulseIntervalMs / 32); // Adjust for smoothness
             }
 
             // Fade out
             for (int b = 255; b >= 0; b -= 16) {
-                for (int j = 0; j < numLEDs; ++j) {
-                    setLed(j, color, b, false);
-                }
+                fill(0, numLEDs - 1, color, b);
                 refresh();
                 wait(pulseIntervalMs / 32);
             }
@@ -335,8 +424,6 @@ public:
             return;
         }
 
-        int elapsed = 0;
-
         // helper to compute section start/end (end is exclusive)
         auto section_range = [this, n_sections](int section) -> std::pair<int, int> {
             int start = (numLEDs * section) / n_sections;
@@ -348,6 +435,27 @@ public:
             return { start, end };
         };
 
+        if (BeatClock::instance().following()) {
+            // Every beat lights the next pair of sections
+            BeatColors colors;
+            onBeats(timeInMs, pulseIntervalMs, [&](const BeatClock::Position& at) {
+                int32_t beat = pulseBeat(at);
+                int section = ((beat % n_sections) + n_sections) % n_sections;
+                int otherSection = (section + 1) % n_sections;
+                for (int s = 0; s < n_sections; ++s) {
+                    auto r = section_range(s);
+                    if (s == section || s == otherSection)
+                        fill(r.first, r.second - 1, colors.at(beat), pulseLevel(at));
+                    else
+                        fill(r.first, r.second - 1, std::make_tuple(0, 0, 0), 0);
+                }
+                refresh();
+            });
+            turnOff();
+            return;
+        }
+
+        int elapsed = 0;
         while (elapsed < timeInMs) {
             for (int section = 0; section < n_sections; ++section) {
                 // pick the second section to always have two sections on (wrap-around)
@@ -364,20 +472,14 @@ public:
                         if (s == section || s == otherSection)
                             continue;
                         auto r = section_range(s);
-                        for (int j = r.first; j < r.second; ++j) {
-                            setLed(j, std::make_tuple<uint8_t, uint8_t, uint8_t>(0, 0, 0), 0, false);
-                        }
+                        fill(r.first, r.second - 1, std::make_tuple(0, 0, 0), 0);
                     }
 
                     // Pulse the two active sections
                     auto r1 = section_range(section);
-                    for (int j = r1.first; j < r1.second; ++j) {
-                        setLed(j, color, b, false);
-                    }
+                    fill(r1.first, r1.second - 1, color, b);
                     auto r2 = section_range(otherSection);
-                    for (int j = r2.first; j < r2.second; ++j) {
-                        setLed(j, color, b, false);
-                    }
+                    fill(r2.first, r2.second - 1, color, b);
 
                     refresh();
                     wait(pulseIntervalMs / 32);
@@ -390,20 +492,14 @@ public:
                         if (s == section || s == otherSection)
                             continue;
                         auto r = section_range(s);
-                        for (int j = r.first; j < r.second; ++j) {
-                            setLed(j, std::make_tuple<uint8_t, uint8_t, uint8_t>(0, 0, 0), 0, false);
-                        }
+                        fill(r.first, r.second - 1, std::make_tuple(0, 0, 0), 0);
                     }
 
                     // Pulse the two active sections
                     auto r1 = section_range(section);
-                    for (int j = r1.first; j < r1.second; ++j) {
-                        setLed(j, color, b, false);
-                    }
+                    fill(r1.first, r1.second - 1, color, b);
                     auto r2 = section_range(otherSection);
-                    for (int j = r2.first; j < r2.second; ++j) {
-                        setLed(j, color, b, false);
-                    }
+                    fill(r2.first, r2.second - 1, color, b);
 
                     refresh();
                     wait(pulseIntervalMs / 32);
@@ -421,9 +517,7 @@ public:
         while (elapsed < timeInMs) {
             for (int i = 0; i < numLEDs; ++i) {
                 // Turn all LEDs off
-                for (int j = 0; j < numLEDs; ++j) {
-                    setLed(j, std::make_tuple(0, 0, 0), 0, false);
-                }
+                fill(0, numLEDs - 1, std::make_tuple(0, 0, 0), 0);
                 // Turn on the current LED with a bright color
                 auto color = std::make_tuple(static_cast<uint8_t>(esp_random() % 256),
                     static_cast<uint8_t>(esp_random() % 256), static_cast<uint8_t>(esp_random() % 256));
@@ -484,10 +578,7 @@ public:
             for (int step = 0; step <= steps_in && elapsed < timeInMs; ++step) {
                 float t = static_cast<float>(step) / static_cast<float>(steps_in);
                 // clear with very low residual to keep trails from previous frames
-                for (int i = 0; i < numLEDs; ++i) {
-                    // slightly dim previous color to create fade (do not rely on lastColors alone)
-                    setLed(i, std::make_tuple(0, 0, 0), 0, false);
-                }
+                fill(0, numLEDs - 1, std::make_tuple(0, 0, 0), 0);
 
                 for (size_t fi = 0; fi < foci.size(); ++fi) {
                     int focus = foci[fi];
@@ -532,9 +623,7 @@ public:
                     float t = static_cast<float>(s) / static_cast<float>(explosion_steps);
                     int maxRadius = std::min(12, numLEDs / 6);
                     int radius = static_cast<int>(t * maxRadius);
-                    for (int i = 0; i < numLEDs; ++i) {
-                        setLed(i, std::make_tuple(0, 0, 0), 0, false);
-                    }
+                    fill(0, numLEDs - 1, std::make_tuple(0, 0, 0), 0);
                     for (size_t fi = 0; fi < foci.size(); ++fi) {
                         int focus = foci[fi];
                         auto col = colors[fi];
@@ -564,9 +653,7 @@ public:
             for (int step = 0; step <= steps_out && elapsed < timeInMs; ++step) {
                 float t = static_cast<float>(step) / static_cast<float>(steps_out);
                 // t goes 0..1, map to positions moving from focus back to ends
-                for (int i = 0; i < numLEDs; ++i) {
-                    setLed(i, std::make_tuple(0, 0, 0), 0, false);
-                }
+                fill(0, numLEDs - 1, std::make_tuple(0, 0, 0), 0);
                 for (size_t fi = 0; fi < foci.size(); ++fi) {
                     int focus = foci[fi];
                     int leftEnd = 0;
@@ -626,13 +713,41 @@ public:
         }
     }
 
+    // The output stage as packed RGB, numLEDs * 3 bytes, exactly what was last handed to the strip. Read it
+    // without copying; it may be mid-update while a frame is being drawn.
+    const uint8_t* pixelData() const { return shownPixels.data(); }
+
+    // Number of frames transmitted so far, to see whether pixelData() changed
+    uint32_t frameCount() const { return frameCount_.load(std::memory_order_acquire); }
+
+    // Live sources (UDP pixel streams) write RGB straight into the output buffer and then commit the range they
+    // touched; the next refresh() transmits it. Brightness doesn't apply to these pixels.
+    uint8_t* pixelBuffer() { return shownPixels.data(); }
+
+    void commitPixels(int from, int count)
+    {
+        int to = std::min(from + count, numLEDs);
+        for (int i = std::max(from, 0); i < to; ++i) {
+            const uint8_t* p = &shownPixels[i * 3];
+            led_strip_set_pixel(strip_handle, i, p[0], p[1], p[2]);
+            memcpy(&colors[i * 3], p, 3);
+            outputStats().pixels.hit();
+        }
+        if (to > from)
+            pixelsDirty = true;
+    }
+
+    // How long transmitting a frame takes (blocks the caller until the RMT is done)
+    const LatencyHistogram& refreshTime() const { return refreshTime_; }
+
     // Returns the last set color for a given LED index
     std::tuple<uint8_t, uint8_t, uint8_t> getColor(int index) const
     {
         if (index < 0 || index >= numLEDs) {
             return std::make_tuple(0, 0, 0);
         }
-        return lastColors[index];
+        const uint8_t* c = &colors[index * 3];
+        return std::make_tuple(c[0], c[1], c[2]);
     }
 
     void runningOppositeNoNeighbors(int durationMs = 5000, int speedMs = 120, int runners = 4)
@@ -661,8 +776,7 @@ public:
 
         while (elapsed < durationMs) {
             // Clear strip
-            for (int i = 0; i < numLEDs; ++i)
-                setLed(i, std::make_tuple(0, 0, 0), 0, false);
+            fill(0, numLEDs - 1, std::make_tuple(0, 0, 0), 0);
 
             // Mark occupied positions to avoid neighbors
             std::vector<bool> occupied(numLEDs, false);
@@ -703,11 +817,145 @@ public:
     }
 
 private:
+    static constexpr int BEAT_FRAME_MS = 20;
+
+    // A random colour per beat, kept while that beat shows
+    struct BeatColors {
+        int32_t beat = INT32_MIN;
+        std::tuple<uint8_t, uint8_t, uint8_t> color;
+
+        const std::tuple<uint8_t, uint8_t, uint8_t>& at(int32_t b)
+        {
+            if (b != beat) {
+                beat = b;
+                color = std::make_tuple(static_cast<uint8_t>(esp_random() % 256),
+                    static_cast<uint8_t>(esp_random() % 256), static_cast<uint8_t>(esp_random() % 256));
+            }
+            return color;
+        }
+    };
+
+    // Calls frame(position) every BEAT_FRAME_MS for timeInMs, with the position in the music. Should the track
+    // stop halfway, the rest pulses every pulseIntervalMs.
+    template <typename Frame> void onBeats(int timeInMs, int pulseIntervalMs, Frame frame)
+    {
+        const BeatClock& clock = BeatClock::instance();
+        int64_t start = esp_timer_get_time();
+        int64_t end = start + static_cast<int64_t>(timeInMs) * 1000;
+        for (int64_t now = start; now < end; now = esp_timer_get_time()) {
+            frame(clock.following() ? clock.at(now) : BeatClock::fixed(now, start, pulseIntervalMs * 1000));
+            wait(BEAT_FRAME_MS);
+        }
+    }
+
+    // Pulses peak on the beat: the first half of a beat fades it out, the second fades the next one in
+    static int32_t pulseBeat(const BeatClock::Position& at) { return at.phase < 0.5f ? at.beat : at.beat + 1; }
+
+    // Louder beats flash brighter
+    static int pulseLevel(const BeatClock::Position& at)
+    {
+        uint8_t accent = at.phase < 0.5f ? at.accent : at.nextAccent;
+        float ramp = at.phase < 0.5f ? 1.0f - 2.0f * at.phase : 2.0f * at.phase - 1.0f;
+        return static_cast<int>((96 + accent * 159 / 255) * ramp);
+    }
+
     gpio_num_t dataPin;
     led_strip_handle_t strip_handle;
     int brightness = 0;
-    std::vector<std::tuple<uint8_t, uint8_t, uint8_t>> lastColors;
+    std::atomic<int> masterBrightness { 255 };
+    std::vector<uint8_t, BootAllocator<uint8_t>> colors; // RGB as last set, before brightness
+    std::vector<uint8_t, BootAllocator<uint8_t>> shownPixels; // RGB as last handed to led_strip, after brightness
+    bool pixelsDirty = true; // hardware state unknown until the first transmit
+    std::atomic<uint32_t> frameCount_ { 0 };
+    LatencyHistogram refreshTime_;
+
+    // Brightness already scaled by the master brightness. True when the pixel changed.
+    bool writePixel(int index, const std::tuple<uint8_t, uint8_t, uint8_t>& color, int brightness)
+    {
+        uint8_t r = (std::get<0>(color) * brightness) / 255;
+        uint8_t g = (std::get<1>(color) * brightness) / 255;
+        uint8_t b = (std::get<2>(color) * brightness) / 255;
+
+        uint8_t* c = &colors[index * 3];
+        c[0] = std::get<0>(color);
+        c[1] = std::get<1>(color);
+        c[2] = std::get<2>(color);
+        uint8_t* shown = &shownPixels[index * 3];
+        if (shown[0] == r && shown[1] == g && shown[2] == b)
+            return false;
+        led_strip_set_pixel(strip_handle, index, r, g, b);
+        shown[0] = r;
+        shown[1] = g;
+        shown[2] = b;
+        return true;
+    }
 
+    // Calls pass(begin, end) over [from, to), returning how many pixels it changed. The halves may run on both
+    // cores at once; the counters are added up once both are done.
+    template <typename Pass> void renderPasses(int from, int to, Pass pass)
+    {
+        from = std::max(from, 0);
+        to = std::min(to, numLEDs);
+        if (!strip_handle || from >= to)
+            return;
+        std::atomic<uint32_t> changed { 0 };
+        auto counted = [&](int begin, int end) { changed.fetch_add(pass(begin, end), std::memory_order_relaxed); };
+        RenderPool::instance().forRange(from, to, counted);
+        uint32_t n = changed.load(std::memory_order_relaxed);
+        outputStats().pixels.hit(n);
+        outputStats().pixels.skip(to - from - n);
+        if (n)
+            pixelsDirty = true;
+    }
+
+    // Shows colors [from, to) at brightness (master brightness included) where that differs from what's shown.
+    // Scales a stack-sized chunk at a time; a chunk that comes out the same as shown costs one memcmp.
+    uint32_t present(int from, int to, int brightness)
+    {
+        constexpr int CHUNK = 64;
+        alignas(4) uint8_t scratch[CHUNK * 3 + 3];
+        uint32_t changed = 0;
+        for (int first = from; first < to; first += CHUNK) {
+            int n = std::min(CHUNK, to - first);
+            const uint8_t* color = &colors[first * 3];
+            // Lined up like color, so the kernel works in whole words on both
+            uint8_t* scaled = scratch + (reinterpret_cast<uintptr_t>(color) & 3);
+            pixel_kernels::scale(scaled, color, n * 3, brightness);
+            uint8_t* shown = &shownPixels[first * 3];
+            if (memcmp(scaled, shown, n * 3) == 0)
+                continue;
+            for (int i = 0; i < n; ++i) {
+                const uint8_t* p = scaled + i * 3;
+                uint8_t* q = shown + i * 3;
+                if (p[0] == q[0] && p[1] == q[1] && p[2] == q[2])
+                    continue;
+                led_strip_set_pixel(strip_handle, first + i, p[0], p[1], p[2]);
+                memcpy(q, p, 3);
+                ++changed;
+            }
+        }
+        return changed;
+    }
+
+    bool isDark() const
+    {
+        for (uint8_t c : shownPixels) {
+            if (c != 0)
+                return false;
+        }
+        return true;
+    }
+
+    // A WS2812 bit takes 1.25 us, plus the reset gap: anything well past that means the transmitting task was held
+    // up, and the frame came late
+    void transmitted(int64_t us)
+    {
+        refreshTime_.record(us);
+        TraceRecorder::instance().checkLate(us - (numLEDs * 24 * 5 / 4 + 300));
+        LatencyProbes::instance().frameShown(esp_timer_get_time());
+    }
+
+public:
     // HSV to RGB conversion (h in [0, 360), s and v in [0, 1])
     static std::tuple<uint8_t, uint8_t, uint8_t> hsv2rgb(float h, float s, float v)
     {
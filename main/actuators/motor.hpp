@@ -2,34 +2,94 @@
 #define MOTOR_HPP
 #include "driver/ledc.h"
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "shadow_state.hpp"
+#include "static_alloc.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <stdio.h>
 
 #define MOTOR_SPEED_FORWARD 2000 // duty voor volle snelheid vooruit
-#define MOTOR_SPEED_STOP 1455 // duty voor stop
+#define MOTOR_SPEED_STOP 1455 // standaard duty voor stop, per motor te kalibreren
 #define MOTOR_SPEED_BACK 1000 // duty voor volle snelheid achteruit
 
 class Motor {
+public:
+    // Shape of a speed ramp. Linear is constant acceleration (trapezoid velocity profile), SCurve eases in and
+    // out so the acceleration itself ramps (no jerk at the start and end).
+    enum class Profile { Linear, SCurve };
+
 private:
     int motorPin;
     ledc_channel_t channel_;
+    uint32_t stopUs_;
+
+    // Running ramp, advanced by update() from the Motors timer
+    struct Ramp {
+        bool active = false;
+        float from = 0;
+        float to = 0;
+        int64_t startUs = 0;
+        int64_t durationUs = 0;
+        Profile profile = Profile::SCurve;
+    };
+    Ramp ramp_;
+    int64_t stopAtUs_ = 0; // setSpeed(speed, duration) deadline, 0 = none
+    MutexStorage lockStorage_;
+    SemaphoreHandle_t lock_; // scene task and the Motors timer both write the duty
+    std::function<void()> onActive_; // a ramp or timed speed began, see onActive()
+
+    static float clampSpeed(float speed)
+    {
+        if (speed > 100)
+            return 100;
+        if (speed < -100)
+            return -100;
+        return speed;
+    }
+
+    // Map speed (-100 tot 100) naar pulsbreedte rond het gekalibreerde stoppunt. Forward and reverse each scale over
+    // their own side of it, so full speed is MOTOR_SPEED_FORWARD or MOTOR_SPEED_BACK wherever the stop point lies.
+    void applySpeed(float speed)
+    {
+        if (speed == 0) {
+            setMotorDuty(stopUs_);
+            return;
+        }
+        float span = speed > 0 ? MOTOR_SPEED_FORWARD - static_cast<float>(stopUs_)
+                               : static_cast<float>(stopUs_) - MOTOR_SPEED_BACK;
+        float duty_us = stopUs_ + speed * span / 100.0f;
+        setMotorDuty(static_cast<uint32_t>(std::clamp<float>(duty_us, MOTOR_SPEED_BACK, MOTOR_SPEED_FORWARD)));
+    }
 
     void setMotorDuty(uint32_t duty_us)
     {
         uint32_t duty = (duty_us * ((1 << 13) - 1)) / 20000; // 20ms periode
-        ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel_, duty);
-        ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel_);
+        ShadowLedc::setDuty(LEDC_HIGH_SPEED_MODE, channel_, duty);
     }
 
-    void setupMotorPWM()
+    // All motors share LEDC_TIMER_0, configure it only for the first one
+    static void setupMotorTimer()
     {
+        static bool configured = false;
+        if (configured)
+            return;
         ledc_timer_config_t timer_conf = {};
         timer_conf.duty_resolution = LEDC_TIMER_13_BIT;
         timer_conf.freq_hz = 50; // servo standaard 50Hz
         timer_conf.speed_mode = LEDC_HIGH_SPEED_MODE;
         timer_conf.timer_num = LEDC_TIMER_0;
         ledc_timer_config(&timer_conf);
+        configured = true;
+    }
+
+    void setupMotorPWM()
+    {
+        setupMotorTimer();
 
         ledc_channel_config_t channel_conf = {};
         channel_conf.channel = channel_;
@@ -39,52 +99,150 @@ private:
         channel_conf.hpoint = 0;
         channel_conf.timer_sel = LEDC_TIMER_0;
         ledc_channel_config(&channel_conf);
+        ShadowLedc::invalidate(LEDC_HIGH_SPEED_MODE, channel_);
     }
 
 public:
-    Motor(int pin, ledc_channel_t channel)
+    Motor(int pin, ledc_channel_t channel, uint32_t stopUs = MOTOR_SPEED_STOP)
         : motorPin(pin)
         , channel_(channel)
+        , stopUs_(stopUs)
+        , lock_(lockStorage_.create("motor locks"))
     {
         setupMotorPWM();
     }
 
+    // The lock lives in lockStorage_
+    Motor(const Motor&) = delete;
+    Motor& operator=(const Motor&) = delete;
+
     void stop()
     {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        ramp_.active = false;
+        stopAtUs_ = 0;
         this->speed = 0;
-        setMotorDuty(MOTOR_SPEED_STOP);
+        setMotorDuty(stopUs_);
+        xSemaphoreGive(lock_);
     }
 
+    // Jumps to speed right away. With a duration the motor is stopped again after that time, without blocking
+    // the caller.
     void setSpeed(int speed, uint32_t duration_ms = 0)
     {
-        this->speed = speed;
-        // Clamp speed tussen -100 en 100
-        if (speed > 100)
-            speed = 100;
-        if (speed < -100)
-            speed = -100;
+        float clamped = clampSpeed(speed);
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        ramp_.active = false;
+        stopAtUs_ = duration_ms > 0 ? esp_timer_get_time() + static_cast<int64_t>(duration_ms) * 1000 : 0;
+        this->speed = clamped;
+        applySpeed(clamped);
+        xSemaphoreGive(lock_);
+        if (duration_ms > 0 && onActive_)
+            onActive_();
+    }
 
-        if (speed == 0) {
-            setMotorDuty(MOTOR_SPEED_STOP);
+    // Ramps from the current speed to target over ramp_ms in the background, returns immediately
+    void rampTo(int target, uint32_t ramp_ms, Profile profile = Profile::SCurve)
+    {
+        if (ramp_ms == 0) {
+            setSpeed(target);
             return;
         }
-        // Map speed (-100 tot 100) naar duty cycle (1000 tot 2000 us)
-        double duty_us
-            = MOTOR_SPEED_STOP + (static_cast<double>(speed) * (MOTOR_SPEED_FORWARD - MOTOR_SPEED_STOP) / 100.0);
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        ramp_.from = this->speed;
+        ramp_.to = clampSpeed(target);
+        ramp_.startUs = esp_timer_get_time();
+        ramp_.durationUs = static_cast<int64_t>(ramp_ms) * 1000;
+        ramp_.profile = profile;
+        ramp_.active = true;
+        stopAtUs_ = 0;
+        xSemaphoreGive(lock_);
+        if (onActive_)
+            onActive_();
+    }
 
-        setMotorDuty(static_cast<uint32_t>(duty_us));
+    // Same, but the ramp time follows from an acceleration in speed units per second
+    void rampWithAcceleration(int target, float speedPerSecond, Profile profile = Profile::Linear)
+    {
+        if (speedPerSecond <= 0) {
+            setSpeed(target);
+            return;
+        }
+        float delta = std::fabs(clampSpeed(target) - getSpeedExact());
+        rampTo(target, static_cast<uint32_t>(delta / speedPerSecond * 1000.0f), profile);
+    }
 
-        // Als duration is opgegeven, stop na die tijd
-        if (duration_ms > 0) {
-            vTaskDelay(pdMS_TO_TICKS(duration_ms));
-            setMotorDuty(MOTOR_SPEED_STOP);
+    // Called periodically by Motors. Returns true while the motor still needs updates.
+    bool update(int64_t nowUs)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        if (stopAtUs_ != 0 && nowUs >= stopAtUs_) {
+            stopAtUs_ = 0;
+            this->speed = 0;
+            setMotorDuty(stopUs_);
+            xSemaphoreGive(lock_);
+            return false;
+        }
+        if (!ramp_.active) {
+            bool pending = stopAtUs_ != 0;
+            xSemaphoreGive(lock_);
+            return pending;
         }
+        float t = static_cast<float>(nowUs - ramp_.startUs) / static_cast<float>(ramp_.durationUs);
+        if (t >= 1.0f) {
+            t = 1.0f;
+            ramp_.active = false;
+        }
+        if (ramp_.profile == Profile::SCurve) {
+            t = t * t * (3.0f - 2.0f * t); // smoothstep
+        }
+        this->speed = ramp_.from + (ramp_.to - ramp_.from) * t;
+        applySpeed(this->speed);
+        bool active = ramp_.active;
+        xSemaphoreGive(lock_);
+        return active;
     }
 
-    int getSpeed() const { return speed; }
+    bool isRamping() const
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        bool active = ramp_.active;
+        xSemaphoreGive(lock_);
+        return active;
+    }
+
+    // A ramp or a timed setSpeed() still waits for update()
+    bool needsUpdates() const
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        bool pending = ramp_.active || stopAtUs_ != 0;
+        xSemaphoreGive(lock_);
+        return pending;
+    }
+
+    // Called, outside the lock, whenever a ramp or timed setSpeed() begins: Motors runs update() only then
+    void onActive(std::function<void()> callback) { onActive_ = std::move(callback); }
+
+    void setStopPoint(uint32_t stopUs)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        stopUs_ = stopUs;
+        applySpeed(this->speed);
+        xSemaphoreGive(lock_);
+    }
+    uint32_t getStopPoint() const { return stopUs_; }
+
+    int getSpeed() const { return static_cast<int>(getSpeedExact()); }
+    float getSpeedExact() const
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        float current = speed;
+        xSemaphoreGive(lock_);
+        return current;
+    }
 
 private:
-    int speed = 0; // huidige snelheid instelling
+    float speed = 0; // huidige snelheid instelling
 };
 
 #endif // MOTOR_HPP
@@ -3,15 +3,34 @@
 #define MOTORS_HPP
 #include "driver/gpio.h"
 #include "driver/mcpwm.h"
+#include "esp_timer.h"
 #include "motor.hpp"
+#include "nvs.h"
 #include <array>
+#include <atomic>
+#include <stdio.h>
+
+#define MOTOR_UPDATE_PERIOD_US (20 * 1000) // one servo frame, faster updates never reach the motor
+#define MOTOR_NVS_NAMESPACE "motors" // trimmed stop points, keys stop0..stop3
 
 class Motors {
 public:
-    Motors(const std::array<gpio_num_t, 4>& pins)
-        : motors { Motor(pins[0], LEDC_CHANNEL_0), Motor(pins[1], LEDC_CHANNEL_1), Motor(pins[2], LEDC_CHANNEL_2),
-            Motor(pins[3], LEDC_CHANNEL_3) }
+    Motors(const std::array<gpio_num_t, 4>& pins,
+        const std::array<uint32_t, 4>& stopPointsUs = { MOTOR_SPEED_STOP, MOTOR_SPEED_STOP, MOTOR_SPEED_STOP,
+            MOTOR_SPEED_STOP })
+        : motors { Motor(pins[0], LEDC_CHANNEL_0, stopPointsUs[0]), Motor(pins[1], LEDC_CHANNEL_1, stopPointsUs[1]),
+            Motor(pins[2], LEDC_CHANNEL_2, stopPointsUs[2]), Motor(pins[3], LEDC_CHANNEL_3, stopPointsUs[3]) }
     {
+        // Ramps run here, in the esp_timer task, so scenes never block on them. The timer only runs while a ramp or
+        // a timed speed is in progress.
+        esp_timer_create_args_t args = {};
+        args.callback = &Motors::updateTimerCallback;
+        args.arg = this;
+        args.name = "motor_ramps";
+        esp_timer_create(&args, &updateTimer_);
+        for (auto& motor : motors) {
+            motor.onActive([this] { startUpdates(); });
+        }
     }
 
     Motor& getMotor(int index) { return motors[index]; }
@@ -21,6 +40,44 @@ public:
     Motor& getNativityMotor() { return motors[1]; }
     Motor& getAngelMotor() { return motors[0]; }
 
+    // Takes over the stop points trimmed before (calibrateStopPoint), motors never trimmed keep theirs. NVS must be
+    // initialised.
+    void loadStopPoints()
+    {
+        nvs_handle_t nvs;
+        if (nvs_open(MOTOR_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+            return;
+        for (size_t i = 0; i < motors.size(); ++i) {
+            char key[8];
+            snprintf(key, sizeof(key), "stop%u", static_cast<unsigned>(i));
+            uint32_t stopUs;
+            if (nvs_get_u32(nvs, key, &stopUs) == ESP_OK && isValidStopPoint(stopUs))
+                motors[i].setStopPoint(stopUs);
+        }
+        nvs_close(nvs);
+    }
+
+    // Sets the pulse width at which a motor stands still, effective right away, and keeps it for the next boot.
+    // False for a bad motor or pulse width, or when it couldn't be saved.
+    bool calibrateStopPoint(int index, uint32_t stopUs)
+    {
+        if (index < 0 || index >= static_cast<int>(motors.size()) || !isValidStopPoint(stopUs))
+            return false;
+        motors[index].setStopPoint(stopUs);
+        nvs_handle_t nvs;
+        if (nvs_open(MOTOR_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+            return false;
+        char key[8];
+        snprintf(key, sizeof(key), "stop%d", index);
+        bool saved = nvs_set_u32(nvs, key, stopUs) == ESP_OK && nvs_commit(nvs) == ESP_OK;
+        nvs_close(nvs);
+        return saved;
+    }
+
+    static bool isValidStopPoint(uint32_t stopUs) { return stopUs > MOTOR_SPEED_BACK && stopUs < MOTOR_SPEED_FORWARD; }
+
+    static constexpr int count() { return 4; }
+
     void stopAll()
     {
         for (auto& motor : motors) {
@@ -28,8 +85,69 @@ public:
         }
     }
 
+    void rampAllTo(int target, uint32_t ramp_ms, Motor::Profile profile = Motor::Profile::SCurve)
+    {
+        for (auto& motor : motors) {
+            motor.rampTo(target, ramp_ms, profile);
+        }
+    }
+
+    // Every motor ramps at the same rate, so faster motors take longer to come to rest
+    void rampAllWithAcceleration(int target, float speedPerSecond, Motor::Profile profile = Motor::Profile::Linear)
+    {
+        for (auto& motor : motors) {
+            motor.rampWithAcceleration(target, speedPerSecond, profile);
+        }
+    }
+
+    bool isAnyRamping() const
+    {
+        for (const auto& motor : motors) {
+            if (motor.isRamping())
+                return true;
+        }
+        return false;
+    }
+
+    void waitUntilSettled()
+    {
+        while (isAnyRamping()) {
+            vTaskDelay(pdMS_TO_TICKS(MOTOR_UPDATE_PERIOD_US / 1000));
+        }
+    }
+
 private:
     std::array<Motor, 4> motors;
+    esp_timer_handle_t updateTimer_ = nullptr;
+    std::atomic<bool> updating_ { false }; // updateTimer_ runs
+
+    void startUpdates()
+    {
+        if (!updating_.exchange(true))
+            esp_timer_start_periodic(updateTimer_, MOTOR_UPDATE_PERIOD_US);
+    }
+
+    static void updateTimerCallback(void* arg)
+    {
+        auto* self = static_cast<Motors*>(arg);
+        int64_t now = esp_timer_get_time();
+        bool active = false;
+        for (auto& motor : self->motors) {
+            active |= motor.update(now);
+        }
+        if (active)
+            return;
+        // All done, stop until the next ramp. One that began in the meantime saw updating_ still set and didn't
+        // start the timer, so look once more after clearing it.
+        esp_timer_stop(self->updateTimer_);
+        self->updating_ = false;
+        for (auto& motor : self->motors) {
+            if (motor.needsUpdates()) {
+                self->startUpdates();
+                break;
+            }
+        }
+    }
 };
 
 #endif // MOTORS_HPP
@@ -0,0 +1,216 @@
+// Batch operations on packed RGB buffers (3 bytes per pixel): fill, scale by brightness, fade to black, saturating
+// add, max blend and a 1-2-1 blur. They work on four bytes at a time in a 32-bit word (SWAR) wherever the buffers
+// line up, byte by byte at the edges. Every one gives exactly what its byte-wise twin in pixel_kernels::scalar
+// gives, which is what the per-pixel code in Lights used to do.
+#ifndef PIXEL_KERNELS_HPP
+#define PIXEL_KERNELS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace pixel_kernels {
+
+namespace scalar {
+
+    // (c * brightness) / 255, like setLed
+    inline uint8_t scaleByte(uint8_t c, uint8_t brightness) { return static_cast<uint8_t>((c * brightness) / 255); }
+
+    inline uint8_t blurByte(uint8_t prev, uint8_t c, uint8_t next)
+    {
+        return static_cast<uint8_t>((prev + 2 * c + next + 2) / 4);
+    }
+
+    inline void fill(uint8_t* dst, int pixels, uint8_t r, uint8_t g, uint8_t b)
+    {
+        for (int i = 0; i < pixels; ++i) {
+            dst[i * 3] = r;
+            dst[i * 3 + 1] = g;
+            dst[i * 3 + 2] = b;
+        }
+    }
+
+    inline void scale(uint8_t* dst, const uint8_t* src, size_t bytes, uint8_t brightness)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            dst[i] = scaleByte(src[i], brightness);
+    }
+
+    inline void addSaturate(uint8_t* dst, const uint8_t* src, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            dst[i] = static_cast<uint8_t>(dst[i] + src[i] > 255 ? 255 : dst[i] + src[i]);
+    }
+
+    inline void maxBlend(uint8_t* dst, const uint8_t* src, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            dst[i] = dst[i] > src[i] ? dst[i] : src[i];
+    }
+
+    // The end pixels count their missing neighbour as themselves
+    inline void blur(uint8_t* dst, const uint8_t* src, int pixels)
+    {
+        size_t bytes = pixels * 3;
+        for (size_t i = 0; i < bytes; ++i) {
+            uint8_t prev = i >= 3 ? src[i - 3] : src[i];
+            uint8_t next = i + 3 < bytes ? src[i + 3] : src[i];
+            dst[i] = blurByte(prev, src[i], next);
+        }
+    }
+
+} // namespace scalar
+
+namespace detail {
+
+    typedef uint32_t word __attribute__((may_alias));
+
+    inline bool aligned(const void* p) { return (reinterpret_cast<uintptr_t>(p) & 3) == 0; }
+    inline uint32_t load(const uint8_t* p) { return *reinterpret_cast<const word*>(p); }
+    inline void store(uint8_t* p, uint32_t w) { *reinterpret_cast<word*>(p) = w; }
+
+    // Bytes 0 and 2 / 1 and 3 of a word in the low halves of two 16-bit lanes, so products and sums don't carry
+    // into the next byte
+    constexpr uint32_t LANES = 0x00FF00FF;
+
+    inline uint32_t scaleWord(uint32_t w, uint32_t brightness)
+    {
+        uint32_t even = (w & LANES) * brightness;
+        uint32_t odd = ((w >> 8) & LANES) * brightness;
+        // x / 255 == (x + 1 + (x >> 8)) >> 8 for x up to 255 * 255
+        even = ((even + 0x00010001 + ((even >> 8) & LANES)) >> 8) & LANES;
+        odd = (odd + 0x00010001 + ((odd >> 8) & LANES)) & ~LANES;
+        return even | odd;
+    }
+
+    inline uint32_t addSaturateWord(uint32_t a, uint32_t b)
+    {
+        uint32_t low = (a & 0x7F7F7F7F) + (b & 0x7F7F7F7F); // carries stop at bit 7 of every byte
+        uint32_t sum = low ^ ((a ^ b) & 0x80808080);
+        uint32_t carry = ((a & b) | ((a | b) & low)) & 0x80808080; // out of bit 7: majority of a, b and carry in
+        return sum | ((carry >> 7) * 0xFF);
+    }
+
+    inline uint32_t maxWord(uint32_t a, uint32_t b)
+    {
+        // 256 + a - b per lane keeps bit 8 where a >= b
+        uint32_t even = ((((a & LANES) | 0x01000100) - (b & LANES)) >> 8) & 0x00010001;
+        uint32_t odd = (((((a >> 8) & LANES) | 0x01000100) - ((b >> 8) & LANES)) >> 8) & 0x00010001;
+        uint32_t mask = (even | (odd << 8)) * 0xFF;
+        return (a & mask) | (b & ~mask);
+    }
+
+    inline uint32_t blurWord(uint32_t prev, uint32_t w, uint32_t next)
+    {
+        uint32_t even = (prev & LANES) + 2 * (w & LANES) + (next & LANES) + 0x00020002;
+        uint32_t odd = ((prev >> 8) & LANES) + 2 * ((w >> 8) & LANES) + ((next >> 8) & LANES) + 0x00020002;
+        return ((even >> 2) & LANES) | ((odd << 6) & ~LANES);
+    }
+
+    // dst[i] = op(dst[i], src[i]) a word at a time where dst and src line up the same way
+    template <typename WordOp, typename ByteOp>
+    inline void zip(uint8_t* dst, const uint8_t* src, size_t bytes, WordOp wordOp, ByteOp byteOp)
+    {
+        size_t i = 0;
+        for (; i < bytes && !aligned(src + i); ++i)
+            dst[i] = byteOp(dst[i], src[i]);
+        if (aligned(dst + i)) {
+            for (; i + 4 <= bytes; i += 4)
+                store(dst + i, wordOp(load(dst + i), load(src + i)));
+        }
+        for (; i < bytes; ++i)
+            dst[i] = byteOp(dst[i], src[i]);
+    }
+
+} // namespace detail
+
+inline void fill(uint8_t* dst, int pixels, uint8_t r, uint8_t g, uint8_t b)
+{
+    const uint8_t rgb[3] = { r, g, b };
+    size_t bytes = pixels * 3;
+    size_t i = 0;
+    for (; i < bytes && !detail::aligned(dst + i); ++i)
+        dst[i] = rgb[i % 3];
+    // Twelve bytes are three pixels and three words
+    uint8_t pattern[12];
+    for (size_t j = 0; j < sizeof(pattern); ++j)
+        pattern[j] = rgb[(i + j) % 3];
+    uint32_t words[3];
+    memcpy(words, pattern, sizeof(words));
+    for (; i + 12 <= bytes; i += 12) {
+        detail::store(dst + i, words[0]);
+        detail::store(dst + i + 4, words[1]);
+        detail::store(dst + i + 8, words[2]);
+    }
+    for (; i < bytes; ++i)
+        dst[i] = rgb[i % 3];
+}
+
+// dst may be src
+inline void scale(uint8_t* dst, const uint8_t* src, size_t bytes, uint8_t brightness)
+{
+    size_t i = 0;
+    for (; i < bytes && !detail::aligned(src + i); ++i)
+        dst[i] = scalar::scaleByte(src[i], brightness);
+    if (detail::aligned(dst + i)) {
+        for (; i + 4 <= bytes; i += 4)
+            detail::store(dst + i, detail::scaleWord(detail::load(src + i), brightness));
+    }
+    for (; i < bytes; ++i)
+        dst[i] = scalar::scaleByte(src[i], brightness);
+}
+
+// amount 255 is black
+inline void fadeToBlack(uint8_t* px, size_t bytes, uint8_t amount) { scale(px, px, bytes, 255 - amount); }
+
+inline void addSaturate(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    detail::zip(dst, src, bytes, detail::addSaturateWord,
+        [](uint8_t a, uint8_t b) { return static_cast<uint8_t>(a + b > 255 ? 255 : a + b); });
+}
+
+inline void maxBlend(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    detail::zip(dst, src, bytes, detail::maxWord, [](uint8_t a, uint8_t b) { return a > b ? a : b; });
+}
+
+// dst must not overlap src. The neighbours of a byte are three bytes away: the words either side of an aligned
+// word give them by shifting.
+inline void blur(uint8_t* dst, const uint8_t* src, int pixels)
+{
+    size_t bytes = pixels * 3;
+    if (bytes < 6) {
+        scalar::blur(dst, src, pixels);
+        return;
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        dst[i] = scalar::blurByte(src[i], src[i], src[i + 3]);
+        dst[bytes - 3 + i] = scalar::blurByte(src[bytes - 6 + i], src[bytes - 3 + i], src[bytes - 3 + i]);
+    }
+    size_t i = 3;
+    auto blurAt = [&](size_t at) { dst[at] = scalar::blurByte(src[at - 3], src[at], src[at + 3]); };
+    for (; i < bytes - 3 && (i < 4 || !detail::aligned(src + i)); ++i)
+        blurAt(i);
+    if (detail::aligned(dst + i)) {
+        // Words from i - 4 to i + 8 are all inside the buffer
+        for (; i + 8 <= bytes; i += 4) {
+            uint32_t before = detail::load(src + i - 4);
+            uint32_t w = detail::load(src + i);
+            uint32_t after = detail::load(src + i + 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            uint32_t prev = (before >> 8) | (w << 24);
+            uint32_t next = (w >> 24) | (after << 8);
+#else
+            uint32_t prev = (before << 8) | (w >> 24);
+            uint32_t next = (w << 24) | (after >> 8);
+#endif
+            detail::store(dst + i, detail::blurWord(prev, w, next));
+        }
+    }
+    for (; i < bytes - 3; ++i)
+        blurAt(i);
+}
+
+} // namespace pixel_kernels
+
+#endif // PIXEL_KERNELS_HPP
@@ -0,0 +1,144 @@
+// Splits the per-pixel passes of a frame over both cores. The calling task renders the first half of the range, a
+// worker thread on the other core the second half, and the caller waits for it before the frame goes out. If the
+// worker hasn't picked its half up by the time the caller is done (its core is busy with Wi-Fi, say), the caller
+// renders it too, so two cores are never slower than one.
+//
+// Ranges shorter than PARALLEL_MIN_PIXELS stay on one core: waking the worker costs more than it saves. The worker
+// is a std::thread, on the host build just as on the ESP32.
+#ifndef RENDER_POOL_HPP
+#define RENDER_POOL_HPP
+
+#include "esp_pthread.h"
+#include "task_plan.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class RenderPool {
+public:
+    static constexpr int PARALLEL_MIN_PIXELS = 256;
+
+    static RenderPool& instance()
+    {
+        static RenderPool pool;
+        return pool;
+    }
+
+    ~RenderPool()
+    {
+        if (!worker_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        worker_.join();
+    }
+
+    // On by default where there are two cores; the benchmarks turn it off to compare
+    void setParallel(bool parallel) { parallel_ = parallel && portNUM_PROCESSORS > 1; }
+    bool parallel() const { return parallel_; }
+
+    // Calls fn(begin, end) for the whole of [from, to), maybe as two halves at the same time on both cores, so the
+    // halves must not write to the same data
+    template <typename Fn> void forRange(int from, int to, Fn& fn)
+    {
+        // A second task rendering at the same time (the ambient glow being parked) keeps to its own core
+        if (!parallel_ || to - from < PARALLEL_MIN_PIXELS || busy_.exchange(true, std::memory_order_acquire)) {
+            fn(from, to);
+            return;
+        }
+        startWorker();
+        int mid = from + (to - from) / 2;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = { &trampoline<Fn>, &fn, mid, to };
+            state_.store(POSTED, std::memory_order_release);
+        }
+        wake_.notify_one();
+        fn(from, mid);
+
+        int posted = POSTED;
+        if (state_.compare_exchange_strong(posted, TAKEN, std::memory_order_acq_rel))
+            fn(mid, to);
+        else
+            waitDone();
+        state_.store(IDLE, std::memory_order_relaxed);
+        busy_.store(false, std::memory_order_release);
+    }
+
+private:
+    enum State { IDLE, POSTED, TAKEN, DONE };
+
+    // The halves take about as long, so once the caller is done the worker usually is too: spin a little before
+    // going to sleep
+    static constexpr int SPIN_LIMIT = 2000;
+
+    struct Job {
+        void (*run)(void* fn, int begin, int end);
+        void* fn;
+        int begin;
+        int end;
+    };
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    Job job_ {};
+    std::atomic<int> state_ { IDLE };
+    std::atomic<bool> busy_ { false };
+    bool stopping_ = false;
+    bool parallel_ = portNUM_PROCESSORS > 1;
+
+    template <typename Fn> static void trampoline(void* fn, int begin, int end) { (*static_cast<Fn*>(fn))(begin, end); }
+
+    void startWorker()
+    {
+        if (worker_.joinable())
+            return;
+        // Threads made by this task from now on get the worker's spec, the ones after it the defaults again
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        cfg.thread_name = TASK_RENDER_WORKER.name;
+        cfg.stack_size = TASK_RENDER_WORKER.stackBytes;
+        cfg.prio = TASK_RENDER_WORKER.priority;
+        cfg.pin_to_core = TASK_RENDER_WORKER.core;
+        esp_pthread_set_cfg(&cfg);
+        worker_ = std::thread(&RenderPool::run, this);
+        cfg = esp_pthread_get_default_config();
+        esp_pthread_set_cfg(&cfg);
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return stopping_ || state_.load(std::memory_order_acquire) == POSTED; });
+            if (stopping_)
+                return;
+            int posted = POSTED;
+            if (!state_.compare_exchange_strong(posted, TAKEN, std::memory_order_acq_rel))
+                continue; // the caller was quicker
+            Job job = job_;
+            lock.unlock();
+            job.run(job.fn, job.begin, job.end);
+            lock.lock();
+            state_.store(DONE, std::memory_order_release);
+            done_.notify_one();
+        }
+    }
+
+    void waitDone()
+    {
+        for (int i = 0; i < SPIN_LIMIT; ++i) {
+            if (state_.load(std::memory_order_acquire) == DONE)
+                return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return state_.load(std::memory_order_acquire) == DONE; });
+    }
+};
+
+#endif // RENDER_POOL_HPP
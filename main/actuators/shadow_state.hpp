@@ -0,0 +1,67 @@
+// Shadow copies of actuator outputs: a hardware/UART write only happens when the value actually changes
+#ifndef SHADOW_STATE_HPP
+#define SHADOW_STATE_HPP
+
+#include "driver/ledc.h"
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+struct WriteCounter {
+    std::atomic<uint32_t> performed { 0 };
+    std::atomic<uint32_t> skipped { 0 };
+
+    void hit(uint32_t n = 1) { performed.fetch_add(n, std::memory_order_relaxed); }
+    void skip(uint32_t n = 1) { skipped.fetch_add(n, std::memory_order_relaxed); }
+};
+
+struct OutputStats {
+    WriteCounter ledcDuty; // ledc_set_duty + ledc_update_duty pairs
+    WriteCounter pixels; // led_strip_set_pixel calls
+    WriteCounter stripRefresh; // led_strip_refresh transmissions
+    WriteCounter dfplayer; // UART command frames
+};
+
+inline OutputStats& outputStats()
+{
+    static OutputStats stats;
+    return stats;
+}
+
+// Last duty written per LEDC channel. Channels are owned by one writer each, so no locking here.
+class ShadowLedc {
+public:
+    static void setDuty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty)
+    {
+        uint32_t& shadow = shadows()[mode][channel];
+        if (shadow == duty) {
+            outputStats().ledcDuty.skip();
+            return;
+        }
+        ledc_set_duty(mode, channel, duty);
+        ledc_update_duty(mode, channel);
+        shadow = duty;
+        outputStats().ledcDuty.hit();
+    }
+
+    // Forget the shadow, e.g. after the channel was reconfigured behind our back
+    static void invalidate(ledc_mode_t mode, ledc_channel_t channel) { shadows()[mode][channel] = UNKNOWN; }
+
+private:
+    static constexpr uint32_t UNKNOWN = UINT32_MAX;
+
+    using Table = std::array<std::array<uint32_t, LEDC_CHANNEL_MAX>, LEDC_SPEED_MODE_MAX>;
+
+    static Table& shadows()
+    {
+        static Table table = [] {
+            Table t;
+            for (auto& mode : t)
+                mode.fill(UNKNOWN);
+            return t;
+        }();
+        return table;
+    }
+};
+
+#endif // SHADOW_STATE_HPP
@@ -1,70 +1,227 @@
 #ifndef BUTTON_HANDLER_HPP
 #define BUTTON_HANDLER_HPP
 
+#include "diagnostics/trace_recorder.hpp"
 #include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "scenes/scene_handler.hpp"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <algorithm>
 #include <stdio.h>
-#include <tuple>
 #include <vector>
 
+// Raw edge as seen by the GPIO interrupt, timestamped in the ISR
+struct ButtonEvent {
+    int button;
+    int64_t timestamp_us;
+};
+
 class ButtonHandler {
 public:
-    ButtonHandler(const gpio_num_t* pins, SceneHandler& sceneHandler)
+    static constexpr int64_t DEBOUNCE_US = 20 * 1000; // level must integrate this long before it counts
+    static constexpr int64_t DEFAULT_CHORD_WINDOW_US = 80 * 1000;
+
+    ButtonHandler(const gpio_num_t* pins, SceneHandler& sceneHandler, int64_t chordWindowUs = DEFAULT_CHORD_WINDOW_US)
         : pins_(pins)
         , sceneHandler_(sceneHandler)
         , numButtons(sceneHandler.nScenes())
+        , chordWindowUs_(chordWindowUs)
         , buttonTaskHandle_(nullptr)
+        , eventQueue_(nullptr)
+        , isrContexts_(numButtons)
+        , buttons_(numButtons)
     {
     }
 
-    void start() { xTaskCreate(&ButtonHandler::buttonTaskEntry, "button_task", 4096, this, 5, &buttonTaskHandle_); }
-
-private:
-    const gpio_num_t* pins_;
-    SceneHandler& sceneHandler_;
-    int numButtons;
-    TaskHandle_t buttonTaskHandle_;
+    void start()
+    {
+        eventQueue_ = eventQueueStorage_.create("buttons queue");
 
-    static void buttonTaskEntry(void* param) { static_cast<ButtonHandler*>(param)->buttonTask(); }
+        // The ISR service may already be installed by another driver, that's fine
+        esp_err_t err = gpio_install_isr_service(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGE(TAG, "Failed to install GPIO ISR service: %s", esp_err_to_name(err));
+            return;
+        }
 
-    void buttonTask()
-    {
         for (int i = 0; i < numButtons; ++i) {
             gpio_config_t io_conf {};
-            io_conf.intr_type = GPIO_INTR_DISABLE;
+            io_conf.intr_type = GPIO_INTR_ANYEDGE;
             io_conf.mode = GPIO_MODE_INPUT;
             io_conf.pin_bit_mask = (1ULL << pins_[i]);
             io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
             io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
             gpio_config(&io_conf);
+
+            isrContexts_[i] = { this, i };
+            gpio_isr_handler_add(pins_[i], &ButtonHandler::gpioIsr, &isrContexts_[i]);
         }
 
+        startTask(TASK_BUTTONS, &ButtonHandler::buttonTaskEntry, this, &buttonTaskHandle_);
+    }
+
+    void setChordWindow(int64_t windowUs) { chordWindowUs_ = windowUs; }
+
+private:
+    static constexpr const char* TAG = "ButtonHandler";
+    static constexpr int64_t SAMPLE_INTERVAL_US = 2 * 1000; // integration step while a pin is unsettled
+    // Buttons 1 and 3 pressed together stop the current scene
+    static constexpr int CHORD_A = 0;
+    static constexpr int CHORD_B = 2;
+
+    struct IsrContext {
+        ButtonHandler* self;
+        int index;
+    };
+
+    struct ButtonState {
+        int64_t integrator = 0; // 0 = released, DEBOUNCE_US = pressed
+        bool pressed = false;
+        bool unsettled = false;
+        int64_t firstEdgeUs = 0; // ISR timestamp of the first edge of the current transition
+        int64_t lastSampleUs = 0;
+        int64_t pendingUntilUs = 0; // chord members wait this long for their partner, 0 = nothing pending
+        int64_t pendingPressUs = 0;
+    };
+
+    const gpio_num_t* pins_;
+    SceneHandler& sceneHandler_;
+    int numButtons;
+    int64_t chordWindowUs_;
+    TaskHandle_t buttonTaskHandle_;
+    QueueHandle_t eventQueue_;
+    static inline QueueStorage<ButtonEvent, 32> eventQueueStorage_;
+    std::vector<IsrContext> isrContexts_;
+    std::vector<ButtonState> buttons_;
+
+    static void IRAM_ATTR gpioIsr(void* arg)
+    {
+        auto* ctx = static_cast<IsrContext*>(arg);
+        ButtonEvent event { ctx->index, esp_timer_get_time() };
+        TraceRecorder::instance().instantFromIsr(TraceId::Button, ctx->index);
+        BaseType_t higherPriorityTaskWoken = pdFALSE;
+        xQueueSendFromISR(ctx->self->eventQueue_, &event, &higherPriorityTaskWoken);
+        if (higherPriorityTaskWoken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+
+    static void buttonTaskEntry(void* param) { static_cast<ButtonHandler*>(param)->buttonTask(); }
+
+    void buttonTask()
+    {
         while (true) {
-            // Read all button levels
-            std::vector<int> levels(numButtons);
+            ButtonEvent event;
+            if (xQueueReceive(eventQueue_, &event, nextTimeout()) == pdTRUE) {
+                onEdge(event);
+                // Drain whatever bounced in meanwhile before integrating
+                while (xQueueReceive(eventQueue_, &event, 0) == pdTRUE) {
+                    onEdge(event);
+                }
+            }
+
+            int64_t now = esp_timer_get_time();
             for (int i = 0; i < numButtons; ++i) {
-                levels[i] = gpio_get_level(pins_[i]);
+                integrate(i, now);
             }
+            resolvePending(now);
+        }
+    }
 
-            // If button 0 and 2 are pressed at the same time, stop the scene
-            if (levels[0] == 0 && levels[2] == 0) {
-                ESP_LOGI("ButtonHandler", "Buttons 1 and 3 pressed together: stopping scene");
-                sceneHandler_.stopScene();
-                vTaskDelay(pdMS_TO_TICKS(500)); // debounce
-            } else {
-                // Normal button handling
-                for (int i = 0; i < numButtons; ++i) {
-                    if (levels[i] == 0) { // button pressed
-                        ESP_LOGI("ButtonHandler", "Button %d pressed", i + 1);
-                        vTaskDelay(pdMS_TO_TICKS(100)); // debounce
-                        sceneHandler_.playScene(i);
-                        vTaskDelay(pdMS_TO_TICKS(500)); // debounce
-                    }
-                }
+    // Sleep until the next edge, or until an unsettled pin or pending chord needs attention
+    TickType_t nextTimeout() const
+    {
+        int64_t now = esp_timer_get_time();
+        int64_t waitUs = -1;
+        for (const auto& b : buttons_) {
+            int64_t remaining = -1;
+            if (b.unsettled)
+                remaining = SAMPLE_INTERVAL_US;
+            else if (b.pendingUntilUs != 0)
+                remaining = std::max<int64_t>(0, b.pendingUntilUs - now);
+            if (remaining >= 0 && (waitUs < 0 || remaining < waitUs))
+                waitUs = remaining;
+        }
+        if (waitUs < 0)
+            return portMAX_DELAY;
+        TickType_t ticks = pdMS_TO_TICKS((waitUs + 999) / 1000);
+        return ticks > 0 ? ticks : 1;
+    }
+
+    void onEdge(const ButtonEvent& event)
+    {
+        auto& b = buttons_[event.button];
+        if (!b.unsettled) {
+            b.unsettled = true;
+            b.firstEdgeUs = event.timestamp_us;
+            b.lastSampleUs = event.timestamp_us;
+        }
+    }
+
+    // Integration debouncer: time spent low counts up, time spent high counts down. The stable state only flips
+    // when the integrator saturates, so contact bounce shorter than DEBOUNCE_US never produces an event.
+    void integrate(int i, int64_t now)
+    {
+        auto& b = buttons_[i];
+        if (!b.unsettled)
+            return;
+
+        int64_t dt = now - b.lastSampleUs;
+        b.lastSampleUs = now;
+        bool low = gpio_get_level(pins_[i]) == 0;
+        b.integrator += low ? dt : -dt;
+        if (b.integrator >= DEBOUNCE_US) {
+            b.integrator = DEBOUNCE_US;
+            b.unsettled = false;
+            if (!b.pressed) {
+                b.pressed = true;
+                onPress(i, b.firstEdgeUs, now);
+            }
+        } else if (b.integrator <= 0) {
+            b.integrator = 0;
+            b.unsettled = false;
+            b.pressed = false;
+        }
+    }
+
+    void onPress(int i, int64_t pressUs, int64_t now)
+    {
+        ESP_LOGI(TAG, "Button %d pressed (debounced after %lld us)", i + 1, static_cast<long long>(now - pressUs));
+
+        if (i != CHORD_A && i != CHORD_B) {
+            sceneHandler_.playScene(i, pressUs, LatencyProbe::ButtonToFrame);
+            return;
+        }
+
+        int partner = i == CHORD_A ? CHORD_B : CHORD_A;
+        auto& other = buttons_[partner];
+        if (other.pendingUntilUs != 0 || other.pressed) {
+            other.pendingUntilUs = 0;
+            ESP_LOGI(TAG, "Buttons %d and %d pressed together: stopping scene", CHORD_A + 1, CHORD_B + 1);
+            sceneHandler_.stopScene(pressUs);
+            return;
+        }
+
+        // Hold the press back for the chord window so a chord doesn't first start a scene
+        auto& b = buttons_[i];
+        b.pendingPressUs = pressUs;
+        b.pendingUntilUs = pressUs + chordWindowUs_;
+    }
+
+    void resolvePending(int64_t now)
+    {
+        for (int i = 0; i < numButtons; ++i) {
+            auto& b = buttons_[i];
+            if (b.pendingUntilUs != 0 && now >= b.pendingUntilUs) {
+                b.pendingUntilUs = 0;
+                sceneHandler_.playScene(i, b.pendingPressUs, LatencyProbe::ButtonToFrame);
             }
-            vTaskDelay(pdMS_TO_TICKS(50));
         }
     }
 };
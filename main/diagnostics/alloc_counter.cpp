@@ -0,0 +1,19 @@
+// Replacement global operator new that feeds alloc_counter.hpp. The array and nothrow forms end up here as well.
+// Replacements may not be inline, hence a translation unit of its own.
+#include "alloc_counter.hpp"
+#include <new>
+#include <stdlib.h>
+
+void* operator new(size_t size)
+{
+    alloc_counter::taskAllocations++;
+    alloc_counter::totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        abort(); // C++ exceptions are off, same as the default operator new then
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
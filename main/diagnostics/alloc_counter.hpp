@@ -0,0 +1,42 @@
+// Counts C++ heap allocations (operator new, see alloc_counter.cpp) per task. Wrap a piece of code in an
+// AllocScope to see how many allocations it made; code running in other tasks at the same time doesn't count.
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+namespace alloc_counter {
+inline thread_local uint32_t taskAllocations = 0;
+inline std::atomic<uint32_t> totalAllocations { 0 };
+}
+
+class AllocScope {
+public:
+    AllocScope()
+        : start_(alloc_counter::taskAllocations)
+    {
+    }
+
+    uint32_t allocations() const { return alloc_counter::taskAllocations - start_; }
+
+private:
+    uint32_t start_;
+};
+
+// Per-request totals for a group of handlers, a well behaved endpoint keeps maxPerRequest at 0
+struct AllocStats {
+    std::atomic<uint32_t> requests { 0 };
+    std::atomic<uint32_t> allocations { 0 };
+    std::atomic<uint32_t> maxPerRequest { 0 };
+
+    void record(uint32_t count)
+    {
+        requests++;
+        allocations += count;
+        uint32_t max = maxPerRequest.load();
+        while (count > max && !maxPerRequest.compare_exchange_weak(max, count)) { }
+    }
+};
+
+#endif // ALLOC_COUNTER_HPP
@@ -0,0 +1,66 @@
+// Timestamps of the boot phases, relative to esp_timer start (= shortly after reset). Phases that finish in the
+// background (Wi-Fi, MQTT) are marked from their event handlers.
+#ifndef BOOT_REPORT_HPP
+#define BOOT_REPORT_HPP
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <array>
+#include <string.h>
+
+class BootReport {
+public:
+    static BootReport& instance()
+    {
+        static BootReport report;
+        return report;
+    }
+
+    // Only the first mark of a phase counts, so reconnects don't show up as boot phases
+    void mark(const char* phase)
+    {
+        int64_t now = esp_timer_get_time();
+        taskENTER_CRITICAL(&lock_);
+        bool known = false;
+        for (size_t i = 0; i < count_; ++i) {
+            if (strcmp(phases_[i].name, phase) == 0)
+                known = true;
+        }
+        int64_t previous = count_ > 0 ? phases_[count_ - 1].atUs : 0;
+        bool stored = !known && count_ < phases_.size();
+        if (stored)
+            phases_[count_++] = { phase, now };
+        taskEXIT_CRITICAL(&lock_);
+
+        if (stored)
+            ESP_LOGI(TAG, "%-20s at %6lld ms (+%lld ms)", phase, static_cast<long long>(now / 1000),
+                static_cast<long long>((now - previous) / 1000));
+    }
+
+    void print()
+    {
+        ESP_LOGI(TAG, "Boot phases:");
+        int64_t previous = 0;
+        for (size_t i = 0; i < count_; ++i) {
+            ESP_LOGI(TAG, "  %-20s %6lld ms (+%lld ms)", phases_[i].name,
+                static_cast<long long>(phases_[i].atUs / 1000),
+                static_cast<long long>((phases_[i].atUs - previous) / 1000));
+            previous = phases_[i].atUs;
+        }
+    }
+
+private:
+    static constexpr const char* TAG = "Boot";
+
+    struct Phase {
+        const char* name;
+        int64_t atUs;
+    };
+
+    std::array<Phase, 16> phases_ {};
+    size_t count_ = 0;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // BOOT_REPORT_HPP
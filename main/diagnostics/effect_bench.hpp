@@ -0,0 +1,256 @@
+// Benchmark cases for the Lights effects and colour kernels, shared by the on-device run (CONFIG_NATIVITY_BENCHMARK,
+// results as JSON lines on the console) and the host one (host/bench_effects.cpp). Effects are measured per
+// transmitted frame with a FrameProfiler; a kernel call is one pass over the whole strip and counts as one frame.
+// Every case runs on one core and, where there are two, again with the RenderPool splitting the strip. The pixel
+// kernels run as SWAR and scalar pairs, after a check that both give the same bytes.
+#ifndef EFFECT_BENCH_HPP
+#define EFFECT_BENCH_HPP
+
+#include "actuators/lights.hpp"
+#include "actuators/pixel_kernels.hpp"
+#include "actuators/render_pool.hpp"
+#include "esp_cpu.h"
+#include "frame_profiler.hpp"
+#include "latency_histogram.hpp"
+#include <array>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+struct EffectBench {
+    const char* name;
+    bool kernel;
+    void (*run)(Lights& strip, uint32_t pass);
+};
+
+// Strip lengths every case runs at: the current strip up to what we'd like to drive
+constexpr std::array<int, 5> BENCH_LED_COUNTS = { 89, 300, 500, 1000, 2000 };
+
+// Pseudo random bytes for the raw kernel cases, the same every run
+inline uint8_t* kernelBuffer(int which, int leds)
+{
+    static std::vector<uint8_t> buffers[3];
+    std::vector<uint8_t>& buffer = buffers[which];
+    if (buffer.size() != static_cast<size_t>(leds) * 3) {
+        buffer.resize(leds * 3);
+        uint32_t seed = which + 1;
+        for (uint8_t& c : buffer) {
+            seed = seed * 1664525 + 1013904223;
+            c = static_cast<uint8_t>(seed >> 24);
+        }
+    }
+    return buffer.data();
+}
+
+// Makes the compiler keep a kernel loop whose result nobody reads, like benchmark::DoNotOptimize does on the host
+inline void keepResult(uint32_t value) { asm volatile("" : : "r"(value) : "memory"); }
+
+inline const std::array<EffectBench, 27>& effectBenches()
+{
+    static const std::array<EffectBench, 27> benches = { {
+        // Effects, with the arguments the scenes use or shortened where the pattern repeats
+        { "sparkle", false, [](Lights& s, uint32_t) { s.sparkeMultipleLeds(2000, 100); } },
+        { "beatDrop", false, [](Lights& s, uint32_t) { s.beatDrop(0, s.numLEDs - 1, 2000); } },
+        { "lightning", false, [](Lights& s, uint32_t) { s.lightning(0, s.numLEDs - 1, 3, 100, 200); } },
+        { "pulsingChaos", false, [](Lights& s, uint32_t) { s.pulsingChaos(2000); } },
+        { "ambientGlow", false, [](Lights& s, uint32_t) { s.ambientGlow(); } },
+        { "pulsingBeat", false, [](Lights& s, uint32_t) { s.pulsingBeat(2000); } },
+        { "pulsingBeatInSections", false, [](Lights& s, uint32_t) { s.pulsingBeatInSections(2000, 6); } },
+        { "runningLights", false, [](Lights& s, uint32_t) { s.runningLights(2000); } },
+        { "fireworks", false, [](Lights& s, uint32_t) { s.fireworks(3000); } },
+        { "beckon", false, [](Lights& s, uint32_t) { s.beckon(); } },
+        { "runningOpposite", false, [](Lights& s, uint32_t) { s.runningOppositeNoNeighbors(2000); } },
+
+        // Kernels: the per-pixel work inside the effects
+        { "hsv2rgb", true,
+            [](Lights& s, uint32_t pass) {
+                uint32_t acc = 0;
+                for (int i = 0; i < s.numLEDs; ++i) {
+                    auto [r, g, b] = Lights::hsv2rgb(((i + pass) % 360) * 1.0f, 0.8f, 1.0f);
+                    acc += r + g + b;
+                }
+                keepResult(acc);
+            } },
+        { "setLed", true,
+            [](Lights& s, uint32_t pass) {
+                // A different colour every pass, or the shadow check skips the write
+                for (int i = 0; i < s.numLEDs; ++i) {
+                    uint8_t v = static_cast<uint8_t>(i + pass);
+                    s.setLed(i, std::make_tuple(v, static_cast<uint8_t>(v * 3), static_cast<uint8_t>(v * 7)), 200,
+                        false);
+                }
+            } },
+        { "fill", true,
+            [](Lights& s, uint32_t pass) {
+                uint8_t v = static_cast<uint8_t>(1 + pass % 255);
+                s.fill(0, s.numLEDs - 1, std::make_tuple(v, static_cast<uint8_t>(v * 3), static_cast<uint8_t>(v * 7)),
+                    200);
+            } },
+        { "getColor", true,
+            [](Lights& s, uint32_t) {
+                uint32_t acc = 0;
+                for (int i = 0; i < s.numLEDs; ++i) {
+                    auto [r, g, b] = s.getColor(i);
+                    acc += r + g + b;
+                }
+                keepResult(acc);
+            } },
+        { "dimTo", true, [](Lights& s, uint32_t pass) { s.dimTo(pass % 256); } },
+        // The kernels on their own, over a strip's worth of bytes
+        { "fill_swar", true,
+            [](Lights& s, uint32_t pass) { pixel_kernels::fill(kernelBuffer(0, s.numLEDs), s.numLEDs, pass, 2, 3); } },
+        { "fill_scalar", true,
+            [](Lights& s, uint32_t pass) {
+                pixel_kernels::scalar::fill(kernelBuffer(0, s.numLEDs), s.numLEDs, pass, 2, 3);
+            } },
+        { "scale_swar", true,
+            [](Lights& s, uint32_t pass) {
+                pixel_kernels::scale(kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3, pass);
+            } },
+        { "scale_scalar", true,
+            [](Lights& s, uint32_t pass) {
+                pixel_kernels::scalar::scale(
+                    kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3, pass);
+            } },
+        { "addSaturate_swar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::addSaturate(kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3);
+            } },
+        { "addSaturate_scalar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::scalar::addSaturate(
+                    kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3);
+            } },
+        { "maxBlend_swar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::maxBlend(kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3);
+            } },
+        { "maxBlend_scalar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::scalar::maxBlend(kernelBuffer(0, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs * 3);
+            } },
+        { "blur_swar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::blur(kernelBuffer(2, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs);
+            } },
+        { "blur_scalar", true,
+            [](Lights& s, uint32_t) {
+                pixel_kernels::scalar::blur(kernelBuffer(2, s.numLEDs), kernelBuffer(1, s.numLEDs), s.numLEDs);
+            } },
+        // Filling and transmitting the whole strip: the transmission is what limits the frame rate on long strips
+        { "refresh", true,
+            [](Lights& s, uint32_t pass) {
+                uint8_t red = static_cast<uint8_t>(1 + pass % 255); // never the same frame twice in a row
+                s.fill(0, s.numLEDs - 1, std::make_tuple(red, 0, 0));
+                s.refresh();
+            } },
+    } };
+    return benches;
+}
+
+// Every SWAR kernel against its scalar twin, for all lengths up to 48 bytes, all four alignments of source and
+// destination and every brightness. Bytes outside the range must stay as they were. Returns the first kernel that
+// differs, nullptr when they all agree.
+inline const char* checkPixelKernels()
+{
+    constexpr size_t MAX_BYTES = 48;
+    alignas(4) uint8_t src[MAX_BYTES + 8], init[MAX_BYTES + 8], expected[MAX_BYTES + 8], actual[MAX_BYTES + 8];
+    uint32_t seed = 1;
+    auto random = [&seed] {
+        seed = seed * 1664525 + 1013904223;
+        return static_cast<uint8_t>(seed >> 24);
+    };
+    auto differs = [&](auto scalarOp, auto swarOp) {
+        memcpy(expected, init, sizeof(init));
+        memcpy(actual, init, sizeof(init));
+        scalarOp(expected);
+        swarOp(actual);
+        return memcmp(expected, actual, sizeof(expected)) != 0;
+    };
+    namespace k = pixel_kernels;
+    for (int round = 0; round < 4; ++round) {
+        for (size_t i = 0; i < sizeof(src); ++i) {
+            // Round 0 only the extremes, where carries and saturation happen
+            src[i] = round ? random() : (random() & 1) * 255;
+            init[i] = round ? random() : (random() & 1) * 255;
+        }
+        for (size_t to = 0; to < 4; ++to) {
+            for (size_t from = 0; from < 4; ++from) {
+                const uint8_t* in = src + from;
+                for (size_t bytes = 0; bytes <= MAX_BYTES; ++bytes) {
+                    int pixels = bytes / 3;
+                    for (int brightness = 0; brightness < 256; ++brightness) {
+                        if (differs([&](uint8_t* out) { k::scalar::scale(out + to, in, bytes, brightness); },
+                                [&](uint8_t* out) { k::scale(out + to, in, bytes, brightness); }))
+                            return "scale";
+                    }
+                    if (differs([&](uint8_t* out) { k::scalar::addSaturate(out + to, in, bytes); },
+                            [&](uint8_t* out) { k::addSaturate(out + to, in, bytes); }))
+                        return "addSaturate";
+                    if (differs([&](uint8_t* out) { k::scalar::maxBlend(out + to, in, bytes); },
+                            [&](uint8_t* out) { k::maxBlend(out + to, in, bytes); }))
+                        return "maxBlend";
+                    if (differs([&](uint8_t* out) { k::scalar::blur(out + to, in, pixels); },
+                            [&](uint8_t* out) { k::blur(out + to, in, pixels); }))
+                        return "blur";
+                    if (differs([&](uint8_t* out) { k::scalar::fill(out + to, pixels, in[0], in[1], in[2]); },
+                            [&](uint8_t* out) { k::fill(out + to, pixels, in[0], in[1], in[2]); }))
+                        return "fill";
+                }
+            }
+            if (differs([&](uint8_t* out) { k::scalar::scale(out + to, out + to, MAX_BYTES, 255 - 77); },
+                    [&](uint8_t* out) { k::fadeToBlack(out + to, MAX_BYTES, 77); }))
+                return "fadeToBlack";
+        }
+    }
+    return nullptr;
+}
+
+// Collects the cycles per frame of one case in the profiler: per transmitted frame for effects, per call for
+// kernels
+inline void runEffectBench(const EffectBench& bench, Lights& strip, FrameProfiler& profiler, int kernelPasses)
+{
+    if (bench.kernel) {
+        for (int pass = 0; pass < kernelPasses; ++pass) {
+            uint32_t start = esp_cpu_get_cycle_count();
+            bench.run(strip, pass);
+            profiler.record(esp_cpu_get_cycle_count() - start);
+        }
+        return;
+    }
+    FrameProfiler::install(&profiler);
+    bench.run(strip, 0);
+    FrameProfiler::install(nullptr);
+}
+
+// Runs every case at every strip length and core count and prints one line per result, in CPU cycles per frame:
+//   BENCH {"case":"fireworks","leds":89,"cores":2,"frames":212,"mean":..,"p50":..,"p99":..,"max":..,"budget_pct":..}
+// budget_pct is p99 against frameBudgetCycles, one frame at the frame rate we aim for.
+inline void runEffectBenchmarks(gpio_num_t dataPin, uint32_t frameBudgetCycles)
+{
+    if (const char* mismatch = checkPixelKernels())
+        printf("pixel_kernels::%s differs from its scalar version\n", mismatch);
+    RenderPool& pool = RenderPool::instance();
+    for (int leds : BENCH_LED_COUNTS) {
+        Lights strip(leds, dataPin);
+        for (int cores = 1; cores <= portNUM_PROCESSORS; ++cores) {
+            pool.setParallel(cores > 1);
+            for (const EffectBench& bench : effectBenches()) {
+                FrameProfiler profiler;
+                runEffectBench(bench, strip, profiler, 50);
+                const LatencyHistogram& perFrame = profiler.perFrame();
+                uint32_t p99 = perFrame.percentile(0.99f);
+                printf("BENCH {\"case\":\"%s\",\"leds\":%d,\"cores\":%d,\"frames\":%lu,\"mean\":%lu,\"p50\":%lu,"
+                       "\"p99\":%lu,\"max\":%lu,\"budget_pct\":%.1f}\n",
+                    bench.name, leds, cores, static_cast<unsigned long>(perFrame.count()),
+                    static_cast<unsigned long>(perFrame.mean()), static_cast<unsigned long>(perFrame.percentile(0.5f)),
+                    static_cast<unsigned long>(p99), static_cast<unsigned long>(perFrame.max()),
+                    100.0 * p99 / frameBudgetCycles);
+            }
+        }
+        strip.turnOff();
+    }
+    pool.setParallel(true);
+}
+
+#endif // EFFECT_BENCH_HPP
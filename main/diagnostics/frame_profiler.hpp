@@ -0,0 +1,49 @@
+// Per-frame CPU cost of the Lights effects, for the benchmarks (see effect_bench.hpp): the cycles the drawing code
+// spends between two transmitted frames, leaving out wait() and the transmission itself. Nothing is measured
+// unless a profiler is installed; while one is, wait() only yields so an effect runs flat out.
+#ifndef FRAME_PROFILER_HPP
+#define FRAME_PROFILER_HPP
+
+#include "esp_cpu.h"
+#include "latency_histogram.hpp"
+
+class FrameProfiler {
+public:
+    static FrameProfiler* active() { return active_; }
+
+    static void install(FrameProfiler* profiler)
+    {
+        active_ = profiler;
+        if (profiler)
+            profiler->resume();
+    }
+
+    // Drawing code runs (again)
+    void resume() { segmentStart_ = esp_cpu_get_cycle_count(); }
+
+    // About to sleep or transmit
+    void pause() { busy_ += esp_cpu_get_cycle_count() - segmentStart_; }
+
+    // A frame is about to go out: everything drawn since the previous one counts for it
+    void frame()
+    {
+        pause();
+        record(busy_);
+        busy_ = 0;
+    }
+
+    // For code that times its frames itself
+    void record(uint32_t cycles) { perFrame_.record(cycles); }
+
+    // Cycles per frame (nanoseconds on the host)
+    const LatencyHistogram& perFrame() const { return perFrame_; }
+
+private:
+    inline static FrameProfiler* active_ = nullptr;
+
+    uint32_t segmentStart_ = 0;
+    uint32_t busy_ = 0;
+    LatencyHistogram perFrame_;
+};
+
+#endif // FRAME_PROFILER_HPP
@@ -0,0 +1,95 @@
+// Fixed-size log-linear latency histogram (HDR style): exact below 16 us, then 8 buckets per power of two, so any
+// reported value is within 12.5% of the real one. Recording is lock-free and allocation-free.
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int LINEAR_LIMIT = 2 * SUB_BUCKETS; // values below this get their own bucket
+    static constexpr int MAX_BITS = 27; // ~134 s, larger values land in the last bucket
+    static constexpr int NUM_BUCKETS = LINEAR_LIMIT + (MAX_BITS - SUB_BITS - 1) * SUB_BUCKETS;
+
+    void record(uint32_t us)
+    {
+        buckets_[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(us, std::memory_order_relaxed);
+
+        uint32_t seen = max_.load(std::memory_order_relaxed);
+        while (us > seen && !max_.compare_exchange_weak(seen, us, std::memory_order_relaxed)) { }
+        seen = min_.load(std::memory_order_relaxed);
+        while (us < seen && !min_.compare_exchange_weak(seen, us, std::memory_order_relaxed)) { }
+    }
+
+    void reset()
+    {
+        for (auto& b : buckets_)
+            b.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+        min_.store(UINT32_MAX, std::memory_order_relaxed);
+    }
+
+    uint32_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint32_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint32_t min() const { return count() ? min_.load(std::memory_order_relaxed) : 0; }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint32_t mean() const { return count() ? static_cast<uint32_t>(sum_.load(std::memory_order_relaxed) / count()) : 0; }
+
+    // Upper bound of the bucket holding the given fraction (0..1) of the samples, e.g. 0.99 for p99
+    uint32_t percentile(float fraction) const
+    {
+        uint32_t total = count();
+        if (total == 0)
+            return 0;
+        uint32_t target = static_cast<uint32_t>(fraction * total + 0.5f);
+        if (target == 0)
+            target = 1;
+        uint32_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                uint32_t upper = bucketUpper(i);
+                return upper < max() ? upper : max();
+            }
+        }
+        return max();
+    }
+
+    static int bucketOf(uint32_t us)
+    {
+        if (us < LINEAR_LIMIT)
+            return us;
+        int msb = 31 - __builtin_clz(us);
+        if (msb >= MAX_BITS)
+            return NUM_BUCKETS - 1;
+        int shift = msb - SUB_BITS;
+        return LINEAR_LIMIT + (msb - SUB_BITS - 1) * SUB_BUCKETS + static_cast<int>((us >> shift) - SUB_BUCKETS);
+    }
+
+    static uint32_t bucketUpper(int index)
+    {
+        if (index < LINEAR_LIMIT)
+            return index;
+        int msb = (index - LINEAR_LIMIT) / SUB_BUCKETS + SUB_BITS + 1;
+        uint32_t mantissa = (index - LINEAR_LIMIT) % SUB_BUCKETS + SUB_BUCKETS;
+        int shift = msb - SUB_BITS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint32_t>, NUM_BUCKETS> buckets_ {};
+    std::atomic<uint32_t> count_ { 0 };
+    std::atomic<uint64_t> sum_ { 0 };
+    std::atomic<uint32_t> max_ { 0 };
+    std::atomic<uint32_t> min_ { UINT32_MAX };
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
@@ -0,0 +1,105 @@
+// The delays a visitor notices, end to end, each in its own LatencyHistogram:
+//   buttonToFrame  button IRQ to the first strip frame of the scene it starts
+//   playToFrame    play command received (web or MQTT) to that frame
+//   stopToSilence  stop asked for (web, MQTT, the button chord) to the DFPlayer acknowledging its stop, the volume
+//                  fade of Scene::stop() included
+//   dfplayerAck    any DFPlayer command asked for to its ACK, the wait in the TX queue included
+// Metrics writes them out for /metrics, /latency and the MQTT telemetry batch; reset with POST /latency/reset
+// or nativity/cmd/latency_reset.
+#ifndef LATENCY_PROBES_HPP
+#define LATENCY_PROBES_HPP
+
+#include "diagnostics/latency_histogram.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+enum class LatencyProbe : uint8_t { ButtonToFrame, PlayToFrame, StopToSilence, DfplayerAck, Count };
+
+class LatencyProbes {
+public:
+    static constexpr size_t COUNT = static_cast<size_t>(LatencyProbe::Count);
+
+    static LatencyProbes& instance()
+    {
+        static LatencyProbes probes;
+        return probes;
+    }
+
+    // Opens a measurement for a later end(); a newer one replaces one still open
+    void begin(LatencyProbe probe, int64_t startUs) { open_[index(probe)].store(startUs, std::memory_order_relaxed); }
+
+    void cancel(LatencyProbe probe) { open_[index(probe)].store(0, std::memory_order_relaxed); }
+
+    // Closes the open measurement, if there is one
+    void end(LatencyProbe probe, int64_t endUs)
+    {
+        int64_t startUs = open_[index(probe)].exchange(0, std::memory_order_relaxed);
+        if (startUs != 0 && endUs >= startUs)
+            record(probe, static_cast<uint32_t>(endUs - startUs));
+    }
+
+    void record(LatencyProbe probe, uint32_t us) { histograms_[index(probe)].record(us); }
+
+    // The frame probes: opened by the scene task, closed by the first frame it transmits
+    void beginFrame(LatencyProbe probe, int64_t startUs)
+    {
+        cancelFrame();
+        begin(probe, startUs);
+        frameTask_.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+    }
+
+    void cancelFrame()
+    {
+        frameTask_.store(nullptr, std::memory_order_relaxed);
+        cancel(LatencyProbe::ButtonToFrame);
+        cancel(LatencyProbe::PlayToFrame);
+    }
+
+    // Lights, after every transmitted frame. Frames of other tasks (ambient glow, live stream) don't count.
+    void frameShown(int64_t nowUs)
+    {
+        TaskHandle_t task = frameTask_.load(std::memory_order_acquire);
+        if (task == nullptr || task != xTaskGetCurrentTaskHandle())
+            return;
+        frameTask_.store(nullptr, std::memory_order_relaxed);
+        end(LatencyProbe::ButtonToFrame, nowUs);
+        end(LatencyProbe::PlayToFrame, nowUs);
+    }
+
+    const LatencyHistogram& histogram(LatencyProbe probe) const { return histograms_[index(probe)]; }
+
+    void reset()
+    {
+        for (auto& h : histograms_)
+            h.reset();
+    }
+
+    static const char* name(LatencyProbe probe) { return INFO[index(probe)].name; }
+    static const char* metric(LatencyProbe probe) { return INFO[index(probe)].metric; }
+    static const char* help(LatencyProbe probe) { return INFO[index(probe)].help; }
+
+private:
+    struct Info {
+        const char* name;
+        const char* metric;
+        const char* help;
+    };
+
+    static constexpr Info INFO[COUNT] = {
+        { "buttonToFrame", "nativity_button_to_frame_seconds", "Button press to the first frame of its scene" },
+        { "playToFrame", "nativity_play_to_frame_seconds", "Play command received to the first frame of its scene" },
+        { "stopToSilence", "nativity_stop_to_silence_seconds", "Stop asked for to the DFPlayer acknowledging it" },
+        { "dfplayerAck", "nativity_dfplayer_ack_seconds", "DFPlayer command queued to its ACK" },
+    };
+
+    std::array<LatencyHistogram, COUNT> histograms_;
+    std::array<std::atomic<int64_t>, COUNT> open_ {}; // start of the open measurement, 0 when none
+    std::atomic<TaskHandle_t> frameTask_ { nullptr };
+
+    static size_t index(LatencyProbe probe) { return static_cast<size_t>(probe); }
+};
+
+#endif // LATENCY_PROBES_HPP
@@ -0,0 +1,89 @@
+// Where the RAM went at boot, per subsystem: bytes in .bss or the owning object (static) and bytes taken from
+// the heap. Subsystems note their share as they start; print() logs the table once everything runs and takes the
+// free heap at that point as the baseline heapUsedSinceBoot() measures against.
+#ifndef MEMORY_REPORT_HPP
+#define MEMORY_REPORT_HPP
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include <array>
+#include <string.h>
+
+class MemoryReport {
+public:
+    enum class Kind : uint8_t { Static, Heap };
+
+    static MemoryReport& instance()
+    {
+        static MemoryReport report;
+        return report;
+    }
+
+    void add(const char* subsystem, Kind kind, size_t bytes) { update(subsystem, kind, bytes, true); }
+
+    // Replaces what was noted before, for things that restart (the scene task) and shouldn't count twice
+    void set(const char* subsystem, Kind kind, size_t bytes) { update(subsystem, kind, bytes, false); }
+
+    void print()
+    {
+        heapFreeAtBoot_ = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        size_t totalStatic = 0;
+        size_t totalHeap = 0;
+        ESP_LOGI(TAG, "RAM per subsystem:         static     heap");
+        for (size_t i = 0; i < count_; ++i) {
+            ESP_LOGI(TAG, "  %-22s %8u %8u", entries_[i].subsystem, static_cast<unsigned>(entries_[i].staticBytes),
+                static_cast<unsigned>(entries_[i].heapBytes));
+            totalStatic += entries_[i].staticBytes;
+            totalHeap += entries_[i].heapBytes;
+        }
+        ESP_LOGI(TAG, "  %-22s %8u %8u", "total", static_cast<unsigned>(totalStatic),
+            static_cast<unsigned>(totalHeap));
+        ESP_LOGI(TAG, "Heap free %u, least free %u, largest block %u", static_cast<unsigned>(heapFreeAtBoot_),
+            static_cast<unsigned>(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)),
+            static_cast<unsigned>(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)));
+    }
+
+    // Heap taken since print(); stays around zero when nothing leaks or piles up
+    int32_t heapUsedSinceBoot() const
+    {
+        if (heapFreeAtBoot_ == 0)
+            return 0;
+        return static_cast<int32_t>(heapFreeAtBoot_) - static_cast<int32_t>(heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    }
+
+private:
+    static constexpr const char* TAG = "Memory";
+
+    struct Entry {
+        const char* subsystem;
+        size_t staticBytes;
+        size_t heapBytes;
+    };
+
+    std::array<Entry, 32> entries_ {};
+    size_t count_ = 0;
+    size_t heapFreeAtBoot_ = 0;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+
+    void update(const char* subsystem, Kind kind, size_t bytes, bool accumulate)
+    {
+        taskENTER_CRITICAL(&lock_);
+        Entry* entry = nullptr;
+        for (size_t i = 0; i < count_ && !entry; ++i) {
+            if (strcmp(entries_[i].subsystem, subsystem) == 0)
+                entry = &entries_[i];
+        }
+        if (!entry && count_ < entries_.size()) {
+            entry = &entries_[count_++];
+            *entry = { subsystem, 0, 0 };
+        }
+        if (entry) {
+            size_t& total = kind == Kind::Static ? entry->staticBytes : entry->heapBytes;
+            total = accumulate ? total + bytes : bytes;
+        }
+        taskEXIT_CRITICAL(&lock_);
+    }
+};
+
+#endif // MEMORY_REPORT_HPP
@@ -0,0 +1,270 @@
+// Runtime telemetry in Prometheus text format, served on /metrics, plus a compact JSON summary with the per-task
+// numbers for the MQTT telemetry batch.
+//
+// Rates (CPU share, LED frames/s) are computed over the interval since the previous collection, so the first
+// scrape after boot reports them since boot. Collecting takes one uxTaskGetSystemState() snapshot into a fixed
+// table and never allocates.
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "actuators/dfplayer.hpp"
+#include "actuators/lights.hpp"
+#include "diagnostics/alloc_counter.hpp"
+#include "diagnostics/latency_probes.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "static_alloc.hpp"
+#include "web/json_writer.hpp"
+#include "web/prometheus_writer.hpp"
+#include <array>
+#include <functional>
+#include <stdio.h>
+#include <vector>
+
+#define METRICS_MAX_TASKS 32
+
+class Metrics {
+public:
+    Metrics(Lights& strip, DFPlayer& player)
+        : strip_(strip)
+        , player_(player)
+        , lock_(lockStorage_.create("metrics lock"))
+    {
+    }
+
+    void write(PrometheusWriter& out)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        float elapsedS = (now - lastCollectUs_) / 1e6f;
+
+        out.metric("nativity_uptime_seconds", "gauge", "Time since boot", static_cast<uint32_t>(now / 1000000));
+        writeTasks(out);
+        writeHeap(out);
+        writeLeds(out, elapsedS);
+        writeDFPlayer(out);
+        writeLatency(out);
+        writeWifi(out);
+        for (auto& collector : collectors_)
+            collector(out);
+
+        lastCollectUs_ = now;
+        xSemaphoreGive(lock_);
+    }
+
+    // Extra metrics from other modules, appended to every scrape. Register them before the first scrape.
+    void addCollector(std::function<void(PrometheusWriter&)> collector) { collectors_.push_back(std::move(collector)); }
+
+    // Headline numbers as fields of the current JSON object; the frame rate is over the interval since the
+    // previous summary, independent of the scrapes
+    void writeSummary(JsonWriter& out)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        uint32_t frames = strip_.frameCount();
+        float elapsedS = (now - lastSummaryUs_) / 1e6f;
+        out.field("uptime", static_cast<uint32_t>(now / 1000000));
+        out.field("heap", static_cast<uint32_t>(heap_caps_get_free_size(MALLOC_CAP_8BIT)));
+        out.field("heapMin", static_cast<uint32_t>(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)));
+        out.field("heapBlock", static_cast<uint32_t>(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)));
+        out.field("fps", elapsedS > 0 ? (frames - summaryFrames_) / elapsedS : 0.0f, 1);
+        out.field("refreshUs", strip_.refreshTime().percentile(0.99f));
+        out.field("lateUs", wakeupLateness().percentile(0.99f));
+        out.field("dfQueue", static_cast<uint32_t>(player_.queueDepth()));
+        wifi_ap_record_t ap;
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+            out.field("rssi", static_cast<int32_t>(ap.rssi));
+        summaryFrames_ = frames;
+        lastSummaryUs_ = now;
+        xSemaphoreGive(lock_);
+    }
+
+    // "tasks":{"scene_task":[0.123,1184],...} as a field of the current JSON object: per task the CPU share since
+    // the previous call (independent of the scrapes) and the stack high-water mark in bytes. Only fills the
+    // caller's buffer, whatever sends it does so after the metrics lock is released.
+    void writeTaskSummary(JsonWriter& out)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        configRUN_TIME_COUNTER_TYPE total = 0;
+        UBaseType_t n = snapshotTasks(total);
+        out.key("tasks").beginObject();
+        for (UBaseType_t i = 0; i < n; ++i) {
+            out.key(tasks_[i].pcTaskName).beginArray();
+            out.value(summaryCpu_.share(tasks_[i], total), 3);
+            out.value(static_cast<uint32_t>(tasks_[i].usStackHighWaterMark));
+            out.endArray();
+        }
+        out.endObject();
+        summaryCpu_.advance(tasks_.data(), n, total);
+        xSemaphoreGive(lock_);
+    }
+
+    // {"count":12,"p50":41000,"p95":52000,"p99":60000,"max":61234}, in us
+    void writeLatency(JsonWriter& out, LatencyProbe probe)
+    {
+        const LatencyHistogram& h = LatencyProbes::instance().histogram(probe);
+        out.beginObject();
+        out.field("count", h.count());
+        out.field("p50", h.percentile(0.5f));
+        out.field("p95", h.percentile(0.95f));
+        out.field("p99", h.percentile(0.99f));
+        out.field("max", h.max());
+        out.endObject();
+    }
+
+private:
+    struct TaskSample {
+        TaskHandle_t handle = nullptr;
+        configRUN_TIME_COUNTER_TYPE runTime = 0;
+    };
+
+    // Run time counters at the start of a CPU share interval
+    struct CpuWindow {
+        std::array<TaskSample, METRICS_MAX_TASKS> previous {};
+        configRUN_TIME_COUNTER_TYPE previousTotal = 0;
+
+        float share(const TaskStatus_t& task, configRUN_TIME_COUNTER_TYPE total) const
+        {
+            // The run time clock runs once per core, so the shares of all tasks (idle included) add up to 1
+            configRUN_TIME_COUNTER_TYPE totalDelta = (total - previousTotal) * portNUM_PROCESSORS;
+            configRUN_TIME_COUNTER_TYPE before = 0;
+            for (const auto& p : previous) {
+                if (p.handle == task.xHandle)
+                    before = p.runTime;
+            }
+            return totalDelta ? static_cast<float>(task.ulRunTimeCounter - before) / totalDelta : 0.0f;
+        }
+
+        void advance(const TaskStatus_t* tasks, UBaseType_t n, configRUN_TIME_COUNTER_TYPE total)
+        {
+            previous = {};
+            for (UBaseType_t i = 0; i < n; ++i)
+                previous[i] = { tasks[i].xHandle, tasks[i].ulRunTimeCounter };
+            previousTotal = total;
+        }
+    };
+
+    Lights& strip_;
+    DFPlayer& player_;
+    static inline MutexStorage lockStorage_; // one exporter per firmware
+    SemaphoreHandle_t lock_;
+    int64_t lastCollectUs_ = 0;
+    std::vector<std::function<void(PrometheusWriter&)>> collectors_;
+
+    std::array<TaskStatus_t, METRICS_MAX_TASKS> tasks_ {};
+    CpuWindow scrapeCpu_;
+    CpuWindow summaryCpu_;
+    uint32_t previousFrames_ = 0;
+    int64_t lastSummaryUs_ = 0;
+    uint32_t summaryFrames_ = 0;
+
+    // Into tasks_, the number of tasks or 0 when they don't fit
+    UBaseType_t snapshotTasks(configRUN_TIME_COUNTER_TYPE& total)
+    {
+        UBaseType_t n = uxTaskGetSystemState(tasks_.data(), tasks_.size(), &total);
+        if (n == 0)
+            ESP_LOGW("Metrics", "More than %d tasks, no task metrics", METRICS_MAX_TASKS);
+        return n;
+    }
+
+    void writeTasks(PrometheusWriter& out)
+    {
+        configRUN_TIME_COUNTER_TYPE total = 0;
+        UBaseType_t n = snapshotTasks(total);
+        if (n == 0)
+            return;
+
+        out.family("nativity_task_cpu_ratio", "gauge", "Share of CPU time since the previous scrape");
+        for (UBaseType_t i = 0; i < n; ++i)
+            out.sample("nativity_task_cpu_ratio", "task", tasks_[i].pcTaskName, scrapeCpu_.share(tasks_[i], total));
+        out.family("nativity_task_stack_free_bytes", "gauge", "Stack high-water mark: least free stack ever");
+        for (UBaseType_t i = 0; i < n; ++i) {
+            out.sample("nativity_task_stack_free_bytes", "task", tasks_[i].pcTaskName,
+                static_cast<uint32_t>(tasks_[i].usStackHighWaterMark));
+        }
+        scrapeCpu_.advance(tasks_.data(), n, total);
+    }
+
+    void writeHeap(PrometheusWriter& out)
+    {
+        out.metric("nativity_heap_free_bytes", "gauge", "Free heap",
+            static_cast<uint32_t>(heap_caps_get_free_size(MALLOC_CAP_8BIT)));
+        out.metric("nativity_heap_min_free_bytes", "gauge", "Least free heap since boot",
+            static_cast<uint32_t>(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)));
+        out.metric("nativity_heap_largest_free_block_bytes", "gauge", "Largest allocatable block",
+            static_cast<uint32_t>(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)));
+        out.metric("nativity_heap_used_since_boot_bytes", "gauge", "Heap taken since the boot memory report",
+            MemoryReport::instance().heapUsedSinceBoot());
+        out.metric("nativity_cpp_allocations_total", "counter", "C++ heap allocations since boot",
+            alloc_counter::totalAllocations.load());
+    }
+
+    void writeLeds(PrometheusWriter& out, float elapsedS)
+    {
+        uint32_t frames = strip_.frameCount();
+        out.metric("nativity_led_frames_total", "counter", "LED strip frames transmitted", frames);
+        out.metric("nativity_led_frames_per_second", "gauge", "LED strip frame rate since the previous scrape",
+            elapsedS > 0 ? (frames - previousFrames_) / elapsedS : 0.0f);
+        previousFrames_ = frames;
+
+        const LatencyHistogram& refresh = strip_.refreshTime();
+        out.family("nativity_led_refresh_seconds", "summary", "Time to transmit one LED strip frame");
+        out.sample("nativity_led_refresh_seconds", "quantile", "0.5", refresh.percentile(0.5f) / 1e6f);
+        out.sample("nativity_led_refresh_seconds", "quantile", "0.99", refresh.percentile(0.99f) / 1e6f);
+        out.sample("nativity_led_refresh_seconds_sum", refresh.sum() / 1e6f);
+        out.sample("nativity_led_refresh_seconds_count", refresh.count());
+
+        const LatencyHistogram& late = wakeupLateness();
+        out.family("nativity_wait_late_seconds", "summary", "How much later than asked the show tasks woke up");
+        out.sample("nativity_wait_late_seconds", "quantile", "0.5", late.percentile(0.5f) / 1e6f);
+        out.sample("nativity_wait_late_seconds", "quantile", "0.99", late.percentile(0.99f) / 1e6f);
+        out.sample("nativity_wait_late_seconds_sum", late.sum() / 1e6f);
+        out.sample("nativity_wait_late_seconds_count", late.count());
+        out.metric("nativity_wait_late_max_seconds", "gauge", "Worst wake-up delay of a show task since boot",
+            late.max() / 1e6f);
+    }
+
+    void writeDFPlayer(PrometheusWriter& out)
+    {
+        out.metric("nativity_dfplayer_queue_depth", "gauge", "DFPlayer commands waiting to be sent",
+            static_cast<uint32_t>(player_.queueDepth()));
+        const DFPlayer::Stats& stats = player_.getStats();
+        out.metric("nativity_dfplayer_retries_total", "counter", "DFPlayer commands resent", stats.retries);
+        out.metric("nativity_dfplayer_timeouts_total", "counter", "DFPlayer commands given up on", stats.timeouts);
+    }
+
+    // Summaries named after the probe, e.g. nativity_button_to_frame_seconds
+    void writeLatency(PrometheusWriter& out)
+    {
+        char sum[48];
+        char count[48];
+        for (size_t i = 0; i < LatencyProbes::COUNT; ++i) {
+            auto probe = static_cast<LatencyProbe>(i);
+            const char* name = LatencyProbes::metric(probe);
+            const LatencyHistogram& h = LatencyProbes::instance().histogram(probe);
+            snprintf(sum, sizeof(sum), "%s_sum", name);
+            snprintf(count, sizeof(count), "%s_count", name);
+            out.family(name, "summary", LatencyProbes::help(probe));
+            out.sample(name, "quantile", "0.5", h.percentile(0.5f) / 1e6f);
+            out.sample(name, "quantile", "0.95", h.percentile(0.95f) / 1e6f);
+            out.sample(name, "quantile", "0.99", h.percentile(0.99f) / 1e6f);
+            out.sample(sum, h.sum() / 1e6f);
+            out.sample(count, h.count());
+        }
+    }
+
+    void writeWifi(PrometheusWriter& out)
+    {
+        wifi_ap_record_t ap;
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+            out.metric("nativity_wifi_rssi_dbm", "gauge", "Signal strength of the access point",
+                static_cast<int32_t>(ap.rssi));
+    }
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,282 @@
+// Event trace of the show for finding stutters: strip frames, DFPlayer traffic, scene cues, button interrupts, HTTP
+// requests and Wi-Fi events in a lock-free ring per core, served on /trace as a Chrome trace (see
+// web/trace_export.hpp). Recording is a cycle counter read, one atomic add and a few stores; with
+// CONFIG_NATIVITY_TRACE off every call compiles to nothing.
+//
+// Timestamps are the CPU cycle counter of the core the event happened on. Once a second the tick interrupt of each
+// core adds a clock event pairing that counter with esp_timer, which puts both cores on one time line afterwards.
+// A frame overrun freezes a copy of the rings until it is downloaded.
+#ifndef TRACE_RECORDER_HPP
+#define TRACE_RECORDER_HPP
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum class TraceId : uint8_t {
+    Clock, // esp_timer time at this cycle count, not exported
+    Frame, // strip update sent out (arg: LEDs)
+    DfQueue, // DFPlayer command queued (arg: command)
+    UartTx, // DFPlayer command on the UART until its reply (arg: command)
+    Scene, // scene playing (arg: scene)
+    SceneCue, // scene requested (arg: scene)
+    SceneStop, // scene stopped early (arg: scene)
+    Button, // button interrupt (arg: button)
+    Http, // request handler (arg: method)
+    Wifi, // arg: 0 disconnected, 1 got an IP
+    Overrun, // frame late (arg: ms)
+    Count
+};
+
+enum class TracePhase : uint8_t { Begin, End, Instant };
+
+struct TraceEvent {
+    uint32_t cycles;
+    uint32_t task; // TaskHandle_t, 0 in interrupts; esp_timer microseconds for Clock
+    TraceId id;
+    TracePhase phase;
+    uint16_t arg;
+};
+
+inline const char* traceName(TraceId id)
+{
+    static const char* const names[] = { "clock", "frame", "df_queue", "uart_tx", "scene", "scene_cue", "scene_stop",
+        "button", "http", "wifi", "overrun" };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(TraceId::Count));
+    return names[static_cast<size_t>(id)];
+}
+
+inline const char* traceArgName(TraceId id)
+{
+    static const char* const names[] = { "us", "leds", "command", "command", "scene", "scene", "scene", "button",
+        "method", "state", "ms" };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(TraceId::Count));
+    return names[static_cast<size_t>(id)];
+}
+
+#if CONFIG_NATIVITY_TRACE
+
+#include "esp_cpu.h"
+#include "esp_freertos_hooks.h"
+#include "esp_timer.h"
+#include <array>
+#include <atomic>
+
+#define TRACE_INLINE __attribute__((always_inline)) inline // callable from IRAM interrupt handlers
+
+class TraceRecorder {
+public:
+    static constexpr bool ENABLED = true;
+    static constexpr uint32_t EVENTS_PER_CORE = CONFIG_NATIVITY_TRACE_EVENTS;
+    static_assert((EVENTS_PER_CORE & (EVENTS_PER_CORE - 1)) == 0, "NATIVITY_TRACE_EVENTS must be a power of two");
+
+    // A plain global rather than a function static: interrupts call this, they can't take the init guard
+    static TRACE_INLINE TraceRecorder& instance();
+
+    // Starts the clock events; events recorded before carry no usable time and are dropped from the export
+    void start()
+    {
+        for (int core = 0; core < portNUM_PROCESSORS; ++core)
+            esp_register_freertos_tick_hook_for_cpu(&TraceRecorder::tickHook, core);
+    }
+
+    TRACE_INLINE void begin(TraceId id, uint16_t arg = 0) { emit(id, TracePhase::Begin, arg, currentTask()); }
+    TRACE_INLINE void end(TraceId id, uint16_t arg = 0) { emit(id, TracePhase::End, arg, currentTask()); }
+    TRACE_INLINE void instant(TraceId id, uint16_t arg = 0) { emit(id, TracePhase::Instant, arg, currentTask()); }
+    TRACE_INLINE void instantFromIsr(TraceId id, uint16_t arg = 0) { emit(id, TracePhase::Instant, arg, 0); }
+
+    // A frame went out lateUs later than it should have: past the threshold that's an overrun, and the first one
+    // since the last download freezes the rings
+    void checkLate(int64_t lateUs)
+    {
+        if (lateUs <= CONFIG_NATIVITY_TRACE_OVERRUN_MS * 1000LL)
+            return;
+        int64_t lateMs = lateUs / 1000;
+        instant(TraceId::Overrun, static_cast<uint16_t>(lateMs < UINT16_MAX ? lateMs : UINT16_MAX));
+        overruns_.fetch_add(1, std::memory_order_relaxed);
+        if (armed_.exchange(false))
+            takeSnapshot();
+    }
+
+    uint32_t overruns() const { return overruns_.load(std::memory_order_relaxed); }
+    bool hasSnapshot() const { return snapshotReady_.load(std::memory_order_acquire); }
+
+    // The live rings are only read while recording is paused
+    void pause() { paused_.store(true, std::memory_order_relaxed); }
+    void resume() { paused_.store(false, std::memory_order_relaxed); }
+
+    // The snapshot was downloaded, the next overrun may replace it
+    void rearm()
+    {
+        snapshotReady_.store(false, std::memory_order_release);
+        armed_.store(true);
+    }
+
+    // Calls fn(event, core, microseconds since boot) for every event of the live rings or the snapshot, oldest
+    // first per core. Clock events are consumed here.
+    template <typename Fn> void forEach(bool snapshot, Fn fn) const
+    {
+        int64_t nowUs = snapshot ? snapshotAtUs_ : esp_timer_get_time();
+        for (int core = 0; core < portNUM_PROCESSORS; ++core) {
+            // The first clock event anchors whatever came before it
+            TraceEvent clock {};
+            bool anchored = false;
+            visit(snapshot, core, [&](const TraceEvent& e) {
+                if (!anchored && e.id == TraceId::Clock) {
+                    clock = e;
+                    anchored = true;
+                }
+            });
+            if (!anchored)
+                continue;
+            visit(snapshot, core, [&](const TraceEvent& e) {
+                if (e.id == TraceId::Clock) {
+                    clock = e;
+                    return;
+                }
+                // The cycle counter runs at the nominal CPU clock (no dynamic frequency scaling here)
+                int64_t clockUs = nowUs - static_cast<uint32_t>(static_cast<uint32_t>(nowUs) - clock.task);
+                int32_t sinceClock = static_cast<int32_t>(e.cycles - clock.cycles);
+                fn(e, core, clockUs + sinceClock / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+            });
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq { 0 }; // index + 1 once the event is complete
+        TraceEvent event;
+    };
+
+    struct Ring {
+        std::atomic<uint32_t> head { 0 }; // events ever reserved
+        std::array<Slot, EVENTS_PER_CORE> slots;
+    };
+
+    std::array<Ring, portNUM_PROCESSORS> rings_;
+    std::array<uint32_t, portNUM_PROCESSORS> ticks_ {};
+    std::atomic<bool> paused_ { false };
+    std::atomic<uint32_t> overruns_ { 0 };
+
+    // Copy of the rings at the first overrun since the last download
+    std::array<std::array<TraceEvent, EVENTS_PER_CORE>, portNUM_PROCESSORS> snapshot_;
+    std::array<uint32_t, portNUM_PROCESSORS> snapshotCount_ {};
+    int64_t snapshotAtUs_ = 0;
+    std::atomic<bool> armed_ { true };
+    std::atomic<bool> snapshotReady_ { false };
+
+    static TRACE_INLINE uint32_t currentTask()
+    {
+        return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(xTaskGetCurrentTaskHandle()));
+    }
+
+    // Other tasks and interrupts on the same core may emit in between, every one gets its own slot. A reader
+    // skips slots whose seq changed while it copied them.
+    TRACE_INLINE void emit(TraceId id, TracePhase phase, uint16_t arg, uint32_t task)
+    {
+        if (paused_.load(std::memory_order_relaxed))
+            return;
+        Ring& ring = rings_[xPortGetCoreID()];
+        uint32_t cycles = esp_cpu_get_cycle_count();
+        uint32_t index = ring.head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = ring.slots[index & (EVENTS_PER_CORE - 1)];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.event = { cycles, task, id, phase, arg };
+        slot.seq.store(index + 1, std::memory_order_release);
+    }
+
+    static void IRAM_ATTR tickHook()
+    {
+        TraceRecorder& trace = instance();
+        int core = xPortGetCoreID();
+        if (++trace.ticks_[core] < configTICK_RATE_HZ)
+            return;
+        trace.ticks_[core] = 0;
+        trace.emit(TraceId::Clock, TracePhase::Instant, 0, static_cast<uint32_t>(esp_timer_get_time()));
+    }
+
+    // Oldest to newest, skipping slots overwritten meanwhile
+    template <typename Fn> void visit(bool snapshot, int core, Fn fn) const
+    {
+        if (snapshot) {
+            for (uint32_t i = 0; i < snapshotCount_[core]; ++i)
+                fn(snapshot_[core][i]);
+            return;
+        }
+        const Ring& ring = rings_[core];
+        uint32_t head = ring.head.load(std::memory_order_acquire);
+        uint32_t first = head > EVENTS_PER_CORE ? head - EVENTS_PER_CORE : 0;
+        for (uint32_t index = first; index != head; ++index) {
+            TraceEvent event;
+            if (read(ring, index, event))
+                fn(event);
+        }
+    }
+
+    static bool read(const Ring& ring, uint32_t index, TraceEvent& event)
+    {
+        const Slot& slot = ring.slots[index & (EVENTS_PER_CORE - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != index + 1)
+            return false;
+        event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.seq.load(std::memory_order_relaxed) == index + 1;
+    }
+
+    void takeSnapshot()
+    {
+        snapshotAtUs_ = esp_timer_get_time();
+        for (int core = 0; core < portNUM_PROCESSORS; ++core) {
+            uint32_t count = 0;
+            visit(false, core, [&](const TraceEvent& e) { snapshot_[core][count++] = e; });
+            snapshotCount_[core] = count;
+        }
+        snapshotReady_.store(true, std::memory_order_release);
+    }
+};
+
+inline TraceRecorder traceRecorder;
+
+TRACE_INLINE TraceRecorder& TraceRecorder::instance() { return traceRecorder; }
+
+#else
+
+class TraceRecorder {
+public:
+    static constexpr bool ENABLED = false;
+
+    static TraceRecorder& instance()
+    {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    void start() { }
+    void begin(TraceId, uint16_t = 0) { }
+    void end(TraceId, uint16_t = 0) { }
+    void instant(TraceId, uint16_t = 0) { }
+    void instantFromIsr(TraceId, uint16_t = 0) { }
+    void checkLate(int64_t) { }
+};
+
+#endif // CONFIG_NATIVITY_TRACE
+
+// Begin and end of a slice on the current task
+class TraceScope {
+public:
+    TraceScope(TraceId id, uint16_t arg = 0)
+        : id_(id)
+        , arg_(arg)
+    {
+        TraceRecorder::instance().begin(id, arg);
+    }
+    ~TraceScope() { TraceRecorder::instance().end(id_, arg_); }
+
+private:
+    TraceId id_;
+    uint16_t arg_;
+};
+
+#endif // TRACE_RECORDER_HPP
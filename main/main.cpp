@@ -2,15 +2,24 @@
 #include "actuators/lights.hpp"
 #include "actuators/motors.hpp"
 #include "button_handler.hpp"
+#include "diagnostics/boot_report.hpp"
+#include "diagnostics/effect_bench.hpp"
+#include "diagnostics/memory_report.hpp"
+#include "diagnostics/metrics.hpp"
+#include "diagnostics/trace_recorder.hpp"
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "scenes/beuk_de_ballen_scene.hpp"
+#include "scenes/command_dispatcher.hpp"
 #include "scenes/herdertjes_scene.hpp"
 #include "scenes/zakske_scene.hpp"
 #include "util.hpp" // for wait function
+#include "web/mqtt_bridge.hpp"
 #include "web/mqtt_client.hpp"
+#include "web/show_sync.hpp"
+#include "web/udp_pixels.hpp"
 #include "web/web_server.hpp"
 #include "wifi_connect.cpp" // or use a header if you have one
 #include <chrono> // for timing
@@ -34,12 +43,28 @@ extern "C" void app_main(void)
     esp_log_level_set("DFPlayer", ESP_LOG_WARN);
     esp_log_level_set("ButtonHandler", ESP_LOG_WARN);
 
+#if CONFIG_NATIVITY_BENCHMARK
+    // Budget: one frame at 50 fps
+    runEffectBenchmarks(GPIO_NUM_27, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000000 / 50);
+    return;
+#endif
+
+    BootReport& boot = BootReport::instance();
+    boot.mark("app_main");
+    TraceRecorder::instance().start();
+
+    // Only starts Wi-Fi, connecting and reconnecting happen in the background. Also brings up the default event
+    // loop that MQTT and the web server need.
     wifi_connect();
+    boot.mark("wifi started");
 
+    // Local hardware first: none of this waits on the network or the DFPlayer
     Motors motors(motorPins);
+    motors.loadStopPoints(); // as calibrated with POST /motors/stop, MOTOR_SPEED_STOP until then
     Lights strip = Lights(89, GPIO_NUM_27);
     DFPlayer player;
     player.begin();
+    boot.mark("actuators ready");
 
     ZakskeScene scene1(strip, player, motors);
     BeukDeBallenScene scene2(strip, player, motors);
@@ -47,17 +72,63 @@ extern "C" void app_main(void)
 
     std::vector<Scene*> scenes = { &scene1, &scene2, &scene3 };
 
-    MqttClient mqttClient;
-    mqttClient.start();
-
-    SceneHandler sceneHandler(&scenes, strip, motors, ledPins, 3, &mqttClient);
+    SceneHandler sceneHandler(&scenes, strip, motors, ledPins, 3);
     sceneHandler.start();
     ButtonHandler buttons(buttonPins, sceneHandler);
     buttons.start();
+    boot.mark("buttons ready");
 
-    WebServer webServer(&sceneHandler);
+    CommandDispatcher commands(sceneHandler);
+    commands.on(CommandType::Volume, [&player](int32_t volume) {
+        player.setVolumeLimit(volume);
+        return true;
+    });
+    commands.on(CommandType::Brightness, [&strip](int32_t brightness) {
+        strip.setMasterBrightness(brightness);
+        return true;
+    });
+    commands.on(CommandType::MotorStop, [&motors, &sceneHandler](int32_t arg) {
+        if (sceneHandler.isScenePlaying())
+            return false; // the scene drives the motors, calibrate at rest
+        return motors.calibrateStopPoint(arg >> 16, arg & 0xFFFF);
+    });
+    commands.start();
+
+    // Network services come up whenever the network does, offline the nativity keeps working on its buttons
+    UdpPixelReceiver udpPixels(strip, sceneHandler);
+    udpPixels.start();
+    Metrics metrics(strip, player);
+    metrics.addCollector([&udpPixels](PrometheusWriter& out) { udpPixels.writeMetrics(out); });
+    // Multi-node playback, see show_sync.hpp
+#if CONFIG_NATIVITY_SYNC_LEADER
+    ShowSync showSync(ShowSync::Role::Leader, sceneHandler, commands, CONFIG_NATIVITY_SYNC_PORT);
+#elif CONFIG_NATIVITY_SYNC_FOLLOWER
+    ShowSync showSync(ShowSync::Role::Follower, sceneHandler, commands, CONFIG_NATIVITY_SYNC_PORT);
+#endif
+#if CONFIG_NATIVITY_SYNC_LEADER || CONFIG_NATIVITY_SYNC_FOLLOWER
+    showSync.start();
+    metrics.addCollector([&showSync](PrometheusWriter& out) { showSync.writeMetrics(out); });
+#endif
+#if CONFIG_NATIVITY_TRACE
+    metrics.addCollector([](PrometheusWriter& out) {
+        out.metric("nativity_frame_overruns_total", "counter", "Strip frames or waits late past the trace threshold",
+            TraceRecorder::instance().overruns());
+    });
+#endif
+    MqttClient mqttClient;
+    MqttBridge mqttBridge(mqttClient, sceneHandler, commands, metrics);
+    mqttBridge.start(60 * 1000);
+    mqttClient.start();
+    WebServer webServer(&sceneHandler, &commands, &strip, &metrics, &motors);
     webServer.start();
+    boot.mark("services started");
+
     ESP_LOGI("Main", "Ready to go");
+    boot.print();
+#if CONFIG_NATIVITY_TRACE
+    MemoryReport::instance().add("trace recorder", MemoryReport::Kind::Static, sizeof(TraceRecorder));
+#endif
+    MemoryReport::instance().print();
 
     while (true) {
         vTaskDelay(pdMS_TO_TICKS(1000));
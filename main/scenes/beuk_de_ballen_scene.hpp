@@ -7,6 +7,7 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "scene.hpp"
+#include "static_alloc.hpp"
 #include <array>
 #include <cmath>
 #include <esp_log.h>
@@ -26,9 +27,11 @@ public:
         player.setVolume(20);
         player.playBeuk();
 
-        // Start a one-shot timer for 2 seconds to turn on the motors
-        motor_timer_ = xTimerCreate(
-            "motor_timer", pdMS_TO_TICKS(10 * 1000), pdFALSE, this, &BeukDeBallenScene::motorTimerCallbackStatic);
+        // One-shot timer for 10 seconds to turn on the motors, made on the first play and restarted after that
+        if (!motor_timer_) {
+            motor_timer_ = motor_timer_storage_.create("beuk motor timer", "motor_timer", pdMS_TO_TICKS(10 * 1000),
+                pdFALSE, this, &BeukDeBallenScene::motorTimerCallbackStatic);
+        }
         xTimerStart(motor_timer_, 0);
 
         strip.sparkeMultipleLeds(22.5 * 1000, 900); // 23 seconds of sparking LEDs
@@ -50,6 +53,7 @@ public:
     }
 
 private:
+    TimerStorage motor_timer_storage_;
     TimerHandle_t motor_timer_;
 
     static void motorTimerCallbackStatic(TimerHandle_t xTimer)
@@ -0,0 +1,155 @@
+// Runs state-changing commands (play, stop, ...) one after the other in a task of their own, so whoever asks
+// (an httpd worker, MQTT) gets an id back right away instead of waiting for e.g. a multi-second Scene::stop().
+// The state of the last COMMAND_HISTORY commands can be looked up by id.
+#ifndef COMMAND_DISPATCHER_HPP
+#define COMMAND_DISPATCHER_HPP
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "scene_handler.hpp"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <array>
+#include <functional>
+
+#define COMMAND_QUEUE_LENGTH 8
+#define COMMAND_HISTORY 16
+
+// SyncedStart: a scene whose start time the show sync has agreed on with the other nodes, played right away
+// MotorStop: calibrates a motor's stop point, arg is motorStopArg(motor, stopUs)
+enum class CommandType : uint8_t { Play, Stop, Volume, Brightness, SyncedStart, MotorStop, Count };
+
+constexpr int32_t motorStopArg(int motor, uint32_t stopUs)
+{
+    return static_cast<int32_t>((motor << 16) | (stopUs & 0xFFFF));
+}
+
+enum class CommandState : uint8_t { Queued, Running, Done, Failed };
+
+class CommandDispatcher {
+public:
+    // A handler returns false when the command couldn't be carried out
+    using Handler = std::function<bool(int32_t arg)>;
+
+    explicit CommandDispatcher(SceneHandler& scenes)
+        : queue_(queueStorage_.create("commands queue"))
+    {
+        // Measured from when the command came in, not from when its turn came
+        on(CommandType::Play, [this, &scenes](int32_t scene) {
+            if (scenes.isScenePlaying())
+                return false;
+            scenes.playScene(scene, runningSubmittedAtUs_, LatencyProbe::PlayToFrame);
+            return true;
+        });
+        on(CommandType::Stop, [this, &scenes](int32_t) {
+            scenes.stopScene(runningSubmittedAtUs_);
+            return true;
+        });
+    }
+
+    // Play and Stop are wired up here, the rest by whoever owns the actuator or, for SyncedStart, the show sync
+    void on(CommandType type, Handler handler) { handlers_[static_cast<size_t>(type)] = std::move(handler); }
+
+    void start() { startTask(TASK_COMMANDS, &CommandDispatcher::taskEntry, this); }
+
+    // Returns the command id, 0 if the queue is full
+    uint32_t submit(CommandType type, int32_t arg = 0)
+    {
+        taskENTER_CRITICAL(&lock_);
+        Command command = { nextId_++, type, arg, esp_timer_get_time() };
+        if (nextId_ == 0)
+            nextId_ = 1;
+        taskEXIT_CRITICAL(&lock_);
+
+        setState(command.id, type, CommandState::Queued);
+        if (xQueueSend(queue_, &command, 0) != pdTRUE) {
+            setState(command.id, type, CommandState::Failed);
+            ESP_LOGW(TAG, "Command queue full, dropping %s", name(type));
+            return 0;
+        }
+        return command.id;
+    }
+
+    // False when the id is unknown or so old it dropped out of the history
+    bool lookup(uint32_t id, CommandType& type, CommandState& state) const
+    {
+        bool found = false;
+        taskENTER_CRITICAL(&lock_);
+        const Entry& e = history_[id % COMMAND_HISTORY];
+        if (id != 0 && e.id == id) {
+            type = e.type;
+            state = e.state;
+            found = true;
+        }
+        taskEXIT_CRITICAL(&lock_);
+        return found;
+    }
+
+    static const char* name(CommandType type)
+    {
+        static const char* names[] = { "play", "stop", "volume", "brightness", "synced start", "motor stop" };
+        size_t i = static_cast<size_t>(type);
+        return i < sizeof(names) / sizeof(names[0]) ? names[i] : "?";
+    }
+
+    static const char* name(CommandState state)
+    {
+        static const char* names[] = { "queued", "running", "done", "failed" };
+        return names[static_cast<size_t>(state)];
+    }
+
+private:
+    static constexpr const char* TAG = "Commands";
+
+    struct Command {
+        uint32_t id;
+        CommandType type;
+        int32_t arg;
+        int64_t submittedAtUs;
+    };
+
+    struct Entry {
+        uint32_t id = 0;
+        CommandType type = CommandType::Play;
+        CommandState state = CommandState::Queued;
+    };
+
+    static inline QueueStorage<Command, COMMAND_QUEUE_LENGTH> queueStorage_;
+    QueueHandle_t queue_;
+    std::array<Handler, static_cast<size_t>(CommandType::Count)> handlers_;
+    std::array<Entry, COMMAND_HISTORY> history_ {};
+    uint32_t nextId_ = 1;
+    int64_t runningSubmittedAtUs_ = 0; // of the command whose handler runs, only touched by the task
+    mutable portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+
+    void setState(uint32_t id, CommandType type, CommandState state)
+    {
+        taskENTER_CRITICAL(&lock_);
+        history_[id % COMMAND_HISTORY] = { id, type, state };
+        taskEXIT_CRITICAL(&lock_);
+    }
+
+    static void taskEntry(void* param) { static_cast<CommandDispatcher*>(param)->task(); }
+
+    void task()
+    {
+        Command command;
+        while (true) {
+            if (xQueueReceive(queue_, &command, portMAX_DELAY) != pdTRUE)
+                continue;
+            setState(command.id, command.type, CommandState::Running);
+            runningSubmittedAtUs_ = command.submittedAtUs;
+            const Handler& handler = handlers_[static_cast<size_t>(command.type)];
+            bool ok = handler && handler(command.arg);
+            setState(command.id, command.type, ok ? CommandState::Done : CommandState::Failed);
+            ESP_LOGI(TAG, "#%lu %s(%ld) %s after %lld ms", static_cast<unsigned long>(command.id), name(command.type),
+                static_cast<long>(command.arg), ok ? "done" : "failed",
+                static_cast<long long>((esp_timer_get_time() - command.submittedAtUs) / 1000));
+        }
+    }
+};
+
+#endif // COMMAND_DISPATCHER_HPP
@@ -32,10 +32,8 @@ public:
         strip.runningOppositeNoNeighbors(13 * 1000); // 15s, 50ms interval
 
         // Fase 3: Engelen zingen, motor start langzaam op (10s)
-        for (int speed = 0; speed <= 20; ++speed) {
-            motors.getAngelMotor().setSpeed(speed);
-            wait(100); // 2s opstarten
-        }
+        motors.getAngelMotor().rampTo(20, 2000);
+        wait(2000); // 2s opstarten, houdt de fases gelijk met de muziek
 
         // swelling light that modulates in brightness and warmth, like angels singing, for 6 seconds
         const int swellDurationMs = 6000;
@@ -47,22 +45,17 @@ public:
             // Warmth oscillates between 0 (cool) and 1 (warm)
             float warmth = 0.5f * (1.0f + sinf(progress * 2.0f * M_PI * 2.0f + M_PI / 2.0f)); // 2 full cycles
 
-            for (int i = 0; i < strip.numLEDs; ++i) {
-                // Base color is a warm white (e.g., RGB(255, 223, 191))
-                int r = static_cast<int>(255 * (0.8f + 0.2f * warmth));
-                int g = static_cast<int>(223 * (0.8f + 0.2f * warmth));
-                int b = static_cast<int>(191 * (0.8f + 0.2f * warmth));
-                strip.setLed(i, std::make_tuple(r, g, b), brightness, false);
-            }
+            // Base color is a warm white (e.g., RGB(255, 223, 191))
+            int r = static_cast<int>(255 * (0.8f + 0.2f * warmth));
+            int g = static_cast<int>(223 * (0.8f + 0.2f * warmth));
+            int b = static_cast<int>(191 * (0.8f + 0.2f * warmth));
+            strip.fill(0, strip.numLEDs - 1, std::make_tuple(r, g, b), brightness);
             strip.refresh();
             wait(swellDurationMs / swellSteps);
         }
 
-        for (int speed = 20; speed >= 0; --speed) {
-            motors.getAngelMotor().setSpeed(speed);
-            wait(100); // 2s afremmen
-        }
-        motors.getAngelMotor().stop();
+        motors.getAngelMotor().rampTo(0, 2000);
+        wait(2000); // 2s afremmen
         motors.getTreeMotor().setSpeed(10); // Boom motor 5s draaien
 
         // Fase 4: Fireworks effect (7s)
@@ -73,10 +66,7 @@ public:
 
         // Fase 5: Alles langzaam uitfaden (3s)
         for (int b = 255; b >= 0; b -= 8) {
-            for (int i = 0; i < strip.numLEDs; ++i) {
-                auto last = strip.getColor(i);
-                strip.setLed(i, last, b, false);
-            }
+            strip.dimTo(b);
             strip.refresh();
             wait(30); // 32 stappen * 30ms ≈ 1s, maar fade kan langer duren
         }
@@ -16,6 +16,9 @@ public:
     }
     void stop()
     {
+        // Motors slow down in the background while sound and light fade out
+        motors.rampAllWithAcceleration(0, 50);
+
         // Fade out volume
         for (int vol = player.getVolume(); vol > 0; vol -= 2) {
             player.setVolume(vol);
@@ -30,23 +33,8 @@ public:
         }
         strip.turnOff();
 
-        // Smoothly slow all running motors to a stop
-        bool anyRunning;
-        do {
-            anyRunning = false;
-            for (int i = 0; i < 4; ++i) {
-                Motor& motor = motors.getMotor(i);
-                int currentSpeed = motor.getSpeed();
-                if (currentSpeed > 0) {
-                    motor.setSpeed(currentSpeed - 5);
-                    anyRunning = true;
-                } else if (currentSpeed < 0) {
-                    motor.setSpeed(currentSpeed + 5);
-                    anyRunning = true;
-                }
-            }
-            wait(100);
-        } while (anyRunning);
+        motors.waitUntilSettled();
+        motors.stopAll();
 
         wait(500);
     }
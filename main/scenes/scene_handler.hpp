@@ -1,26 +1,34 @@
 #ifndef SCENE_HANDLER_HPP
 #define SCENE_HANDLER_HPP
+#include "actuators/button_leds.hpp"
 #include "actuators/lights.hpp"
 #include "actuators/motors.hpp"
+#include "diagnostics/latency_probes.hpp"
+#include "diagnostics/trace_recorder.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "scene.hpp"
-#include "web/mqtt_client.hpp"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <atomic>
+#include <functional>
 #include <string>
 #include <vector>
 
 class SceneHandler {
 public:
-    SceneHandler(std::vector<Scene*>* scenes, Lights& strip, Motors& motors, const gpio_num_t* leds, int nButtons,
-        MqttClient* mqttClient = nullptr)
+    SceneHandler(std::vector<Scene*>* scenes, Lights& strip, Motors& motors, const gpio_num_t* leds, int nButtons)
         : scenes_(scenes)
         , strip_(strip)
         , motors_(motors)
-        , leds_(leds)
-        , mqttClient_(mqttClient)
+        , buttonLeds_(leds, nButtons)
         , numButtons(nButtons)
+        , liveLock_(liveLockStorage_.create("live lock"))
     {
         nvs_flash_init();
         loadPlayCounts();
@@ -28,31 +36,60 @@ public:
 
     void start()
     {
-        xTaskCreate(&SceneHandler::ambientGlowTaskEntry, "ambient_glow_task", 4096, this, 5, &ambientGlowTaskHandle_);
-        xTaskCreate(&SceneHandler::blinkTaskEntry, "blink_task", 2048, this, 5, &blinkTaskHandle_);
-        xTaskCreate(&SceneHandler::keepMotorsStoppedTaskEntry, "keep_motors_stopped_task", 2048, this, 5,
+        startTask(TASK_AMBIENT_GLOW, &SceneHandler::ambientGlowTaskEntry, this, &ambientGlowTaskHandle_);
+        startTask(TASK_KEEP_MOTORS_STOPPED, &SceneHandler::keepMotorsStoppedTaskEntry, this,
             &keepMotorsStoppedTaskHandle_);
-        xTaskCreate(&SceneHandler::backgroundTaskManagerEntry, "background_task_manager", 2048, this, 5, nullptr);
-        // GPIO setup (same as before)
-        for (int i = 0; i < numButtons; ++i) {
-            gpio_reset_pin(leds_[i]);
-            gpio_set_direction(leds_[i], GPIO_MODE_OUTPUT);
+        startTask(TASK_BACKGROUND_MANAGER, &SceneHandler::backgroundTaskManagerEntry, this);
+        buttonLeds_.setAll(ButtonLeds::Pattern::Breathe);
+    }
+
+    // requestedAtUs is the esp_timer timestamp of whatever triggered the play (e.g. the button IRQ), used to log
+    // the trigger-to-scene-start latency and, up to the scene's first frame, recorded in the given probe. 0 means
+    // now and isn't recorded. With a play scheduler set (multi-node sync) the scene starts when the scheduler calls
+    // playSceneNow(), on purpose later, so that isn't recorded either.
+    void playScene(size_t index, int64_t requestedAtUs = 0, LatencyProbe probe = LatencyProbe::PlayToFrame)
+    {
+        if (playScheduler_ && index < scenes_->size() && !isScenePlaying()) {
+            playScheduler_(index);
+            return;
         }
+        playSceneNow(index, requestedAtUs, probe);
     }
 
-    void playScene(size_t index)
+    void playSceneNow(size_t index, int64_t requestedAtUs = 0, LatencyProbe probe = LatencyProbe::PlayToFrame)
     {
         if (index < scenes_->size() && !isScenePlaying()) {
-
+            // The buttons win over a live stream. Under the live lock, so no stream packet takes the strip back
+            // between the clear and the scene claiming it.
+            xSemaphoreTake(liveLock_, portMAX_DELAY);
+            bool wasLive = leaveLiveMode();
             currentScene = index;
-            xTaskCreate(&SceneHandler::sceneTaskEntry, "scene_task", 4096, this, 5, &sceneTaskHandle_);
+            xSemaphoreGive(liveLock_);
+            if (wasLive)
+                notifyStateChanged();
+            TraceRecorder::instance().instant(TraceId::SceneCue, index);
+            requestedAtUs_ = requestedAtUs != 0 ? requestedAtUs : esp_timer_get_time();
+            probe_ = probe;
+            measured_ = requestedAtUs != 0;
+            // A stop that never got its ACK doesn't end on this scene's stop
+            LatencyProbes::instance().cancel(LatencyProbe::StopToSilence);
+            buttonLeds_.setOnly(index, ButtonLeds::Pattern::Active);
+            startTask(TASK_SCENE, &SceneHandler::sceneTaskEntry, this, &sceneTaskHandle_);
+            notifyStateChanged();
         }
     }
 
 
-    void stopScene()
+    // requestedAtUs as for playScene(), recorded up to the DFPlayer acknowledging its stop
+    void stopScene(int64_t requestedAtUs = 0)
     {
         if (sceneTaskHandle_ != nullptr) {
+            TraceRecorder::instance().instant(TraceId::SceneStop, currentScene);
+            LatencyProbes::instance().cancelFrame();
+            if (requestedAtUs != 0)
+                LatencyProbes::instance().begin(LatencyProbe::StopToSilence, requestedAtUs);
+            if (stopListener_)
+                stopListener_();
             // Call stop() on the current scene before killing the task
             if (currentScene >= 0 && currentScene < scenes_->size()) {
                 (*scenes_)[currentScene]->stop();
@@ -60,9 +97,43 @@ public:
             vTaskDelete(sceneTaskHandle_);
             sceneTaskHandle_ = nullptr;
             currentScene = -1;
+            buttonLeds_.setAll(ButtonLeds::Pattern::Breathe);
+            notifyStateChanged();
+        }
+    }
+
+    // Live mode: an external source (UDP pixel stream) owns the strip, the ambient glow steps aside. Refused while
+    // a scene plays. On success the caller holds the live lock and may write the strip's pixel buffer and refresh
+    // it until endLiveWrite(); exitLiveMode() and starting a scene wait for that, so they never clear the strip
+    // halfway through a stream frame and no stream frame lands after the clear.
+    bool beginLiveWrite()
+    {
+        xSemaphoreTake(liveLock_, portMAX_DELAY);
+        if (isScenePlaying()) {
+            xSemaphoreGive(liveLock_);
+            return false;
         }
+        if (!liveMode_.exchange(true)) {
+            ESP_LOGI("SceneHandler", "Live mode on");
+            notifyStateChanged();
+        }
+        return true;
+    }
+
+    void endLiveWrite() { xSemaphoreGive(liveLock_); }
+
+    // Hands the strip back: dark until the ambient glow resumes
+    void exitLiveMode()
+    {
+        xSemaphoreTake(liveLock_, portMAX_DELAY);
+        bool wasLive = leaveLiveMode();
+        xSemaphoreGive(liveLock_);
+        if (wasLive)
+            notifyStateChanged();
     }
 
+    bool isLive() const { return liveMode_; }
+
     int nScenes() const { return scenes_->size(); }
     bool isScenePlaying() const { return currentScene != -1; }
 
@@ -79,38 +150,77 @@ public:
         for (auto& c : playCounts_)
             c = 0;
         savePlayCounts();
+        notifyStateChanged();
     }
 
     int getCurrentScene() const { return currentScene; }
 
+    // Multi-node sync: plays are handed to the scheduler instead of starting right away, stops are reported
+    using PlayScheduler = std::function<void(size_t index)>;
+    void setPlayScheduler(PlayScheduler scheduler) { playScheduler_ = std::move(scheduler); }
+    void setStopListener(std::function<void()> listener) { stopListener_ = std::move(listener); }
+
+    // Called (from the task that caused it) whenever a scene starts or stops or a play count changes
+    void addStateListener(std::function<void()> listener) { stateListeners_.push_back(std::move(listener)); }
+
 private:
     std::vector<Scene*>* scenes_;
     Lights& strip_;
     Motors& motors_;
-    const gpio_num_t* leds_;
-    MqttClient* mqttClient_;
+    ButtonLeds buttonLeds_;
     int numButtons;
     int currentScene { -1 };
+    std::atomic<bool> liveMode_ { false };
+    static inline MutexStorage liveLockStorage_; // one handler per firmware
+    SemaphoreHandle_t liveLock_; // held by whoever writes the strip in live mode, see beginLiveWrite()
+    int64_t requestedAtUs_ = 0;
+    LatencyProbe probe_ = LatencyProbe::PlayToFrame;
+    bool measured_ = false;
     TaskHandle_t sceneTaskHandle_ = nullptr;
     TaskHandle_t ambientGlowTaskHandle_ = nullptr;
-    TaskHandle_t blinkTaskHandle_ = nullptr;
     TaskHandle_t keepMotorsStoppedTaskHandle_ = nullptr;
     std::vector<int> playCounts_;
+    std::vector<std::function<void()>> stateListeners_;
+    PlayScheduler playScheduler_;
+    std::function<void()> stopListener_;
+
+    // Called with liveLock_ held; true when live mode was on
+    bool leaveLiveMode()
+    {
+        if (!liveMode_.exchange(false))
+            return false;
+        ESP_LOGI("SceneHandler", "Live mode off");
+        strip_.turnOff();
+        return true;
+    }
+
+    void notifyStateChanged()
+    {
+        for (auto& listener : stateListeners_)
+            listener();
+    }
 
     static void sceneTaskEntry(void* param) { static_cast<SceneHandler*>(param)->sceneTask(); }
 
     void sceneTask()
     {
         if (currentScene >= 0 && currentScene < scenes_->size()) {
-            if (mqttClient_) {
-                mqttClient_->publish("nativity/scenePlay", std::to_string(currentScene).c_str());
+            ESP_LOGI("SceneHandler", "Scene %d started, %lld us after request", currentScene,
+                static_cast<long long>(esp_timer_get_time() - requestedAtUs_));
+            if (measured_)
+                LatencyProbes::instance().beginFrame(probe_, requestedAtUs_);
+            {
+                TraceScope trace(TraceId::Scene, currentScene);
+                (*scenes_)[currentScene]->play();
             }
-            (*scenes_)[currentScene]->play();
+            LatencyProbes::instance().cancelFrame();
             playCounts_[currentScene]++;
             // savePlayCounts(); //todo turn on voor echt
         }
         currentScene = -1;
         sceneTaskHandle_ = nullptr;
+        buttonLeds_.setAll(ButtonLeds::Pattern::Breathe);
+        notifyStateChanged();
         vTaskDelete(nullptr);
     }
 
@@ -144,36 +254,19 @@ private:
     }
 
     static void ambientGlowTaskEntry(void* param) { static_cast<SceneHandler*>(param)->ambientGlowTask(); }
-    static void blinkTaskEntry(void* param) { static_cast<SceneHandler*>(param)->blinkTask(); }
     static void keepMotorsStoppedTaskEntry(void* param) { static_cast<SceneHandler*>(param)->keepMotorsStoppedTask(); }
     static void backgroundTaskManagerEntry(void* param) { static_cast<SceneHandler*>(param)->backgroundTaskManager(); }
 
     void ambientGlowTask()
     {
         while (true) {
-            if (!isScenePlaying()) {
+            if (!isScenePlaying() && !liveMode_) {
                 strip_.ambientGlow();
             }
             vTaskDelay(pdMS_TO_TICKS(50));
         }
     }
 
-    void blinkTask()
-    {
-        while (true) {
-            // Turn all LEDs ON
-            for (int i = 0; i < numButtons; ++i) {
-                gpio_set_level(leds_[i], 1);
-            }
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            // Turn all LEDs OFF
-            for (int i = 0; i < numButtons; ++i) {
-                gpio_set_level(leds_[i], 0);
-            }
-            vTaskDelay(pdMS_TO_TICKS(1000));
-        }
-    }
-
     void keepMotorsStoppedTask()
     {
         while (true) {
@@ -187,33 +280,31 @@ private:
     void backgroundTaskManager()
     {
         bool wasPlaying = false;
+        bool wasLive = false;
         while (true) {
             bool nowPlaying = isScenePlaying();
-            if (nowPlaying && !wasPlaying) {
-
-                int i = getCurrentScene();
-                gpio_set_level(leds_[i], 1);
-                for (int j = 0; j < numButtons; ++j) {
-                    if (j != i)
-                        gpio_set_level(leds_[j], 0);
-                }
-                // Scene just started: suspend background tasks
+            bool nowLive = liveMode_;
+            // The ambient glow gives way to scenes and live mode, the motor keeper only to scenes
+            bool stripTaken = nowPlaying || nowLive;
+            bool stripWasTaken = wasPlaying || wasLive;
+            if (stripTaken && !stripWasTaken) {
                 if (ambientGlowTaskHandle_)
                     vTaskSuspend(ambientGlowTaskHandle_);
-                if (blinkTaskHandle_)
-                    vTaskSuspend(blinkTaskHandle_);
+            } else if (!stripTaken && stripWasTaken) {
+                if (ambientGlowTaskHandle_)
+                    vTaskResume(ambientGlowTaskHandle_);
+            }
+            if (nowPlaying && !wasPlaying) {
+                // Scene just started: suspend background tasks
                 if (keepMotorsStoppedTaskHandle_)
                     vTaskSuspend(keepMotorsStoppedTaskHandle_);
             } else if (!nowPlaying && wasPlaying) {
                 // Scene just ended: resume background tasks
-                if (ambientGlowTaskHandle_)
-                    vTaskResume(ambientGlowTaskHandle_);
-                if (blinkTaskHandle_)
-                    vTaskResume(blinkTaskHandle_);
                 if (keepMotorsStoppedTaskHandle_)
                     vTaskResume(keepMotorsStoppedTaskHandle_);
             }
             wasPlaying = nowPlaying;
+            wasLive = nowLive;
             vTaskDelay(pdMS_TO_TICKS(100));
         }
     }
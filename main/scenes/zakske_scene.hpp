@@ -170,7 +170,7 @@ public:
         // 52 t/m 53 — LED 24 t/m 26
         // ----------------------------
         strip.setMultipleLeds(23, 25, makeColor(255, 36, 15), 128);
-        wait(2000);
+        player.waitForTrackFinished(2000); // tot het liedje echt af is, hooguit 2s zoals voorheen
         stop();
     }
 };
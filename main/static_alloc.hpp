@@ -0,0 +1,162 @@
+// Storage for the long-lived FreeRTOS objects and frame buffers. With CONFIG_NATIVITY_STATIC_ALLOCATION the queues,
+// mutexes, event groups and timers keep their memory right here (as a static member of their owner, or inside
+// it) and buffers come from a fixed arena in .bss, so after boot the heap only serves short-lived work. Without it
+// they come from the heap as before. Both ways the bytes show up in the MemoryReport under the owner's name.
+#ifndef STATIC_ALLOC_HPP
+#define STATIC_ALLOC_HPP
+
+#include "diagnostics/memory_report.hpp"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include <cstddef>
+#include <new>
+
+// Where the memory below comes from
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+constexpr MemoryReport::Kind BOOT_MEMORY_KIND = MemoryReport::Kind::Static;
+#else
+constexpr MemoryReport::Kind BOOT_MEMORY_KIND = MemoryReport::Kind::Heap;
+#endif
+
+template <typename T, UBaseType_t Length> class QueueStorage {
+public:
+    QueueHandle_t create(const char* owner)
+    {
+        MemoryReport::instance().add(owner, BOOT_MEMORY_KIND, sizeof(StaticQueue_t) + Length * sizeof(T));
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        return xQueueCreateStatic(Length, sizeof(T), items_, &queue_);
+#else
+        return xQueueCreate(Length, sizeof(T));
+#endif
+    }
+
+private:
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    uint8_t items_[Length * sizeof(T)];
+    StaticQueue_t queue_;
+#endif
+};
+
+class MutexStorage {
+public:
+    SemaphoreHandle_t create(const char* owner)
+    {
+        MemoryReport::instance().add(owner, BOOT_MEMORY_KIND, sizeof(StaticSemaphore_t));
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        return xSemaphoreCreateMutexStatic(&mutex_);
+#else
+        return xSemaphoreCreateMutex();
+#endif
+    }
+
+private:
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    StaticSemaphore_t mutex_;
+#endif
+};
+
+class EventGroupStorage {
+public:
+    EventGroupHandle_t create(const char* owner)
+    {
+        MemoryReport::instance().add(owner, BOOT_MEMORY_KIND, sizeof(StaticEventGroup_t));
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        return xEventGroupCreateStatic(&group_);
+#else
+        return xEventGroupCreate();
+#endif
+    }
+
+private:
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    StaticEventGroup_t group_;
+#endif
+};
+
+class TimerStorage {
+public:
+    TimerHandle_t create(const char* owner, const char* name, TickType_t period, UBaseType_t autoReload, void* id,
+        TimerCallbackFunction_t callback)
+    {
+        MemoryReport::instance().add(owner, BOOT_MEMORY_KIND, sizeof(StaticTimer_t));
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        return xTimerCreateStatic(name, period, autoReload, id, callback, &timer_);
+#else
+        return xTimerCreate(name, period, autoReload, id, callback);
+#endif
+    }
+
+private:
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    StaticTimer_t timer_;
+#endif
+};
+
+// Buffers that live as long as the firmware (frame buffers), bump-allocated once and never freed. What doesn't fit
+// (the benchmarks making strips of 2000 LEDs) comes from the heap with a warning.
+class BootArena {
+public:
+    static void* allocate(size_t bytes)
+    {
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        static size_t used = 0;
+        size_t aligned = (bytes + 3) & ~size_t(3);
+        taskENTER_CRITICAL(&lock());
+        void* p = nullptr;
+        if (used + aligned <= sizeof(arena())) {
+            p = arena() + used;
+            used += aligned;
+        }
+        taskEXIT_CRITICAL(&lock());
+        if (p)
+            return p;
+        ESP_LOGW("BootArena", "%u bytes don't fit in CONFIG_NATIVITY_STATIC_ARENA_BYTES, using the heap",
+            static_cast<unsigned>(bytes));
+#endif
+        return ::operator new(bytes);
+    }
+
+    static void deallocate(void* p)
+    {
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+        if (p >= arena() && p < arena() + sizeof(arena()))
+            return;
+#endif
+        ::operator delete(p);
+    }
+
+private:
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    static uint8_t (&arena())[CONFIG_NATIVITY_STATIC_ARENA_BYTES]
+    {
+        alignas(4) static uint8_t bytes[CONFIG_NATIVITY_STATIC_ARENA_BYTES];
+        return bytes;
+    }
+
+    static portMUX_TYPE& lock()
+    {
+        static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        return mux;
+    }
+#endif
+};
+
+// For std::vector and friends whose size is fixed at boot
+template <typename T> struct BootAllocator {
+    using value_type = T;
+
+    BootAllocator() = default;
+    template <typename U> BootAllocator(const BootAllocator<U>&) { }
+
+    T* allocate(size_t n) { return static_cast<T*>(BootArena::allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t) { BootArena::deallocate(p); }
+
+    template <typename U> bool operator==(const BootAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const BootAllocator<U>&) const { return false; }
+};
+
+#endif // STATIC_ALLOC_HPP
@@ -0,0 +1,129 @@
+// Where every task of the firmware runs and how urgent it is, in one table.
+//
+// The PRO core (0) already carries the network stack: Wi-Fi (priority 23), esp_timer (22) and lwIP (18, pinned
+// there by sdkconfig.defaults). Our network services join it. The APP core (1) does the show: scene, light and
+// DFPlayer tasks, so a burst of HTTP or MQTT traffic can't hold up a frame.
+//
+// Priorities on the show core: input first (buttons, DFPlayer replies), then the commands and the task that
+// parks the background work, then output (DFPlayer commands, frames), background work last.
+//
+// Stack sizes: tools/stack_budget.py suggests them from the high-water marks on /metrics after a run of every scene.
+#ifndef TASK_PLAN_HPP
+#define TASK_PLAN_HPP
+
+#include "diagnostics/memory_report.hpp"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <atomic>
+#include <iterator>
+#include <string.h>
+
+struct TaskSpec {
+    const char* name;
+    uint32_t stackBytes;
+    UBaseType_t priority;
+    BaseType_t core;
+};
+
+constexpr BaseType_t NETWORK_CORE = 0;
+constexpr BaseType_t SHOW_CORE = portNUM_PROCESSORS > 1 ? 1 : 0;
+
+// Show core
+constexpr TaskSpec TASK_BUTTONS = { "button_task", 4096, 10, SHOW_CORE };
+constexpr TaskSpec TASK_DFPLAYER_RX = { "dfplayer_rx", 3072, 10, SHOW_CORE };
+constexpr TaskSpec TASK_BACKGROUND_MANAGER = { "background_task_manager", 2048, 9, SHOW_CORE };
+constexpr TaskSpec TASK_COMMANDS = { "command_task", 4096, 8, SHOW_CORE };
+constexpr TaskSpec TASK_DFPLAYER_TX = { "dfplayer_tx", 2048, 8, SHOW_CORE };
+constexpr TaskSpec TASK_SCENE = { "scene_task", 4096, 7, SHOW_CORE };
+constexpr TaskSpec TASK_UDP_PIXELS = { "udp_pixels_task", 4096, 7, SHOW_CORE };
+constexpr TaskSpec TASK_AMBIENT_GLOW = { "ambient_glow_task", 4096, 4, SHOW_CORE };
+constexpr TaskSpec TASK_KEEP_MOTORS_STOPPED = { "keep_motors_stopped_task", 2048, 3, SHOW_CORE };
+
+// Network core. The MQTT client task is pinned there by sdkconfig.defaults, the rest here.
+constexpr TaskSpec TASK_RENDER_WORKER = { "render_worker", 3072, 7, NETWORK_CORE }; // the scene task waits for it
+constexpr TaskSpec TASK_SHOW_SYNC = { "show_sync_task", 4096, 6, NETWORK_CORE }; // clock samples want low latency
+constexpr TaskSpec TASK_HTTPD = { "httpd", 4096, 5, NETWORK_CORE };
+constexpr TaskSpec TASK_STRIP_PREVIEW = { "strip_preview", 3072, 2, NETWORK_CORE }; // sends behind httpd's back
+constexpr TaskSpec TASK_MQTT = { "mqtt_task", 6144, 5, NETWORK_CORE };
+constexpr TaskSpec TASK_MQTT_TELEMETRY = { "mqtt_telemetry", 3072, 1, NETWORK_CORE };
+
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+// The long-lived tasks take their stack and TCB from .bss. httpd, MQTT and the render worker are created by their
+// components. Each of these is started once per boot.
+constexpr const TaskSpec* STATIC_TASKS[] = { &TASK_BUTTONS, &TASK_DFPLAYER_RX, &TASK_BACKGROUND_MANAGER,
+    &TASK_COMMANDS, &TASK_DFPLAYER_TX, &TASK_UDP_PIXELS, &TASK_AMBIENT_GLOW, &TASK_KEEP_MOTORS_STOPPED,
+    &TASK_SHOW_SYNC, &TASK_STRIP_PREVIEW, &TASK_MQTT_TELEMETRY };
+
+constexpr size_t staticStackBytes()
+{
+    size_t bytes = 0;
+    for (const TaskSpec* spec : STATIC_TASKS)
+        bytes += spec->stackBytes;
+    return bytes;
+}
+
+alignas(16) inline StackType_t staticTaskStacks[staticStackBytes() / sizeof(StackType_t)];
+inline StaticTask_t staticTaskBlocks[std::size(STATIC_TASKS)];
+
+// The scene task is started for every play and deleted when the scene ends or is stopped. A task deleted while it
+// runs, on the other core or by itself, keeps its TCB queued until the idle task cleans it up, so the next play
+// can't simply reuse its memory. It takes turns between two slots instead; a slot comes free when FreeRTOS calls
+// the thread-local storage deletion callback, as it cleans up the TCB. With both still taken the heap steps in.
+constexpr BaseType_t TASK_SLOT_TLS_INDEX = 1; // 0 is pthread's, see sdkconfig.defaults
+static_assert(configNUM_THREAD_LOCAL_STORAGE_POINTERS > TASK_SLOT_TLS_INDEX, "no TLS pointer for the scene task");
+
+struct SceneTaskSlot {
+    alignas(16) StackType_t stack[TASK_SCENE.stackBytes / sizeof(StackType_t)];
+    StaticTask_t tcb;
+    std::atomic<bool> taken { false };
+};
+
+inline SceneTaskSlot sceneTaskSlots[2];
+
+inline TaskHandle_t startSceneTaskStatic(TaskFunction_t entry, void* param)
+{
+    for (SceneTaskSlot& slot : sceneTaskSlots) {
+        if (slot.taken.exchange(true))
+            continue;
+        TaskHandle_t created = xTaskCreateStaticPinnedToCore(entry, TASK_SCENE.name, TASK_SCENE.stackBytes, param,
+            TASK_SCENE.priority, slot.stack, &slot.tcb, TASK_SCENE.core);
+        // Its starters (buttons, commands) outrank it on the show core, so it hasn't run yet, let alone ended
+        vTaskSetThreadLocalStoragePointerAndDelCallback(created, TASK_SLOT_TLS_INDEX, &slot,
+            [](int, void* slot) { static_cast<SceneTaskSlot*>(slot)->taken = false; });
+        MemoryReport::instance().set(TASK_SCENE.name, MemoryReport::Kind::Static, sizeof(sceneTaskSlots));
+        return created;
+    }
+    ESP_LOGW("TaskPlan", "Both scene task slots still wait for the idle task, using the heap");
+    return nullptr;
+}
+#endif
+
+inline BaseType_t startTask(const TaskSpec& spec, TaskFunction_t entry, void* param, TaskHandle_t* handle = nullptr)
+{
+#if CONFIG_NATIVITY_STATIC_ALLOCATION
+    if (strcmp(spec.name, TASK_SCENE.name) == 0) {
+        if (TaskHandle_t created = startSceneTaskStatic(entry, param)) {
+            if (handle)
+                *handle = created;
+            return pdPASS;
+        }
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < std::size(STATIC_TASKS); offset += STATIC_TASKS[i++]->stackBytes) {
+        if (strcmp(STATIC_TASKS[i]->name, spec.name) != 0)
+            continue;
+        TaskHandle_t created = xTaskCreateStaticPinnedToCore(entry, spec.name, spec.stackBytes, param,
+            spec.priority, &staticTaskStacks[offset / sizeof(StackType_t)], &staticTaskBlocks[i], spec.core);
+        if (handle)
+            *handle = created;
+        MemoryReport::instance().set(spec.name, MemoryReport::Kind::Static, spec.stackBytes + sizeof(StaticTask_t));
+        return created ? pdPASS : pdFAIL;
+    }
+#endif
+    // Roughly: the TCB comes from the heap too
+    MemoryReport::instance().set(spec.name, MemoryReport::Kind::Heap, spec.stackBytes + sizeof(StaticTask_t));
+    return xTaskCreatePinnedToCore(entry, spec.name, spec.stackBytes, param, spec.priority, handle, spec.core);
+}
+
+#endif // TASK_PLAN_HPP
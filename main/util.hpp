@@ -1,3 +1,7 @@
+#include "diagnostics/frame_profiler.hpp"
+#include "diagnostics/latency_histogram.hpp"
+#include "diagnostics/trace_recorder.hpp"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include <tuple>
@@ -5,6 +9,32 @@
 #ifndef MAIN_UTIL_CPP
 #define MAIN_UTIL_CPP
 
-void wait(int milliseconds) { vTaskDelay(pdMS_TO_TICKS(milliseconds)); }
+// How much later than asked wait() came back, in us: the scheduling jitter of the show tasks (see task_plan.hpp)
+LatencyHistogram& wakeupLateness()
+{
+    static LatencyHistogram lateness;
+    return lateness;
+}
+
+void wait(int milliseconds)
+{
+    // Benchmarks run the effects flat out
+    if (FrameProfiler* profiler = FrameProfiler::active()) {
+        profiler->pause();
+        taskYIELD();
+        profiler->resume();
+        return;
+    }
+    TickType_t ticks = pdMS_TO_TICKS(milliseconds);
+    int64_t start = esp_timer_get_time();
+    vTaskDelay(ticks);
+    // Up to a tick early is normal, anything past the last tick is late. A whole second late is a suspended task
+    // instead (SceneHandler parks the background tasks during a scene), not jitter.
+    int64_t lateUs = esp_timer_get_time() - start - static_cast<int64_t>(ticks) * portTICK_PERIOD_MS * 1000;
+    if (lateUs >= 1000000)
+        return;
+    wakeupLateness().record(lateUs > 0 ? static_cast<uint32_t>(lateUs) : 0);
+    TraceRecorder::instance().checkLate(lateUs);
+}
 std::tuple<int, int, int> makeColor(int r, int g, int b) { return std::make_tuple(r, g, b); }
 #endif // MAIN_UTIL_CPP
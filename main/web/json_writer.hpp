@@ -0,0 +1,123 @@
+// Streaming JSON writer on top of ResponseBuffer, commas are placed automatically.
+#ifndef JSON_WRITER_HPP
+#define JSON_WRITER_HPP
+
+#include "response_buffer.hpp"
+#include <type_traits>
+
+class JsonWriter : public ResponseBuffer {
+public:
+    JsonWriter(char* buf, size_t size, httpd_req_t* req = nullptr)
+        : ResponseBuffer(buf, size, req, "application/json")
+    {
+    }
+
+    JsonWriter& beginObject() { return open('{'); }
+    JsonWriter& endObject() { return close('}'); }
+    JsonWriter& beginArray() { return open('['); }
+    JsonWriter& endArray() { return close(']'); }
+
+    JsonWriter& key(const char* name)
+    {
+        separator();
+        string(name);
+        put(':');
+        afterKey_ = true;
+        return *this;
+    }
+
+    JsonWriter& value(const char* s)
+    {
+        separator();
+        string(s);
+        return *this;
+    }
+
+    JsonWriter& value(bool b)
+    {
+        separator();
+        write(b ? "true" : "false");
+        return *this;
+    }
+
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+    JsonWriter& value(T v)
+    {
+        separator();
+        if constexpr (std::is_signed_v<T>)
+            signedDigits(v);
+        else
+            digits(v);
+        return *this;
+    }
+
+    JsonWriter& value(float v, int decimals)
+    {
+        separator();
+        fixed(v, decimals);
+        return *this;
+    }
+
+    template <typename T> JsonWriter& field(const char* name, T v) { return key(name).value(v); }
+    JsonWriter& field(const char* name, float v, int decimals) { return key(name).value(v, decimals); }
+
+private:
+    static constexpr int MAX_DEPTH = 32;
+
+    int depth_ = 0;
+    uint32_t hasItems_ = 0; // bit per nesting level: a comma is due before the next item
+    bool afterKey_ = false;
+
+    JsonWriter& open(char c)
+    {
+        separator();
+        put(c);
+        if (depth_ < MAX_DEPTH)
+            hasItems_ &= ~(1u << depth_);
+        depth_++;
+        return *this;
+    }
+
+    JsonWriter& close(char c)
+    {
+        depth_--;
+        put(c);
+        return *this;
+    }
+
+    void separator()
+    {
+        if (afterKey_) {
+            afterKey_ = false;
+            return;
+        }
+        if (depth_ == 0 || depth_ > MAX_DEPTH)
+            return;
+        uint32_t bit = 1u << (depth_ - 1);
+        if (hasItems_ & bit)
+            put(',');
+        hasItems_ |= bit;
+    }
+
+    void string(const char* s)
+    {
+        put('"');
+        for (; *s; ++s) {
+            char c = *s;
+            if (c == '"' || c == '\\') {
+                put('\\');
+                put(c);
+            } else if (static_cast<uint8_t>(c) < 0x20) {
+                static const char hex[] = "0123456789abcdef";
+                write("\\u00");
+                put(hex[(c >> 4) & 0xF]);
+                put(hex[c & 0xF]);
+            } else {
+                put(c);
+            }
+        }
+        put('"');
+    }
+};
+
+#endif // JSON_WRITER_HPP
@@ -0,0 +1,144 @@
+// The nativity on MQTT:
+//   nativity/cmd/play <scene>, nativity/cmd/stop, nativity/cmd/volume <0-30>, nativity/cmd/brightness <0-255>
+//       commands, queued on the CommandDispatcher like the web ones
+//   nativity/cmd/latency_reset  empties the latency histograms
+//   nativity/state      retained {"playing":..,"currentScene":..,"live":..}, on every change
+//   nativity/telemetry  every interval one batch: play counts, the Metrics summary, the latency histograms and the
+//                       per-task part of /metrics. QoS 0, only sent while connected, never queued.
+//   nativity/availability  retained online/offline (see MqttClient)
+#ifndef MQTT_BRIDGE_HPP
+#define MQTT_BRIDGE_HPP
+
+#include "diagnostics/latency_probes.hpp"
+#include "diagnostics/metrics.hpp"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "json_writer.hpp"
+#include "mqtt_client.hpp"
+#include "scenes/command_dispatcher.hpp"
+#include "scenes/scene_handler.hpp"
+#include "task_plan.hpp"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_COMMAND_TOPIC "nativity/cmd/"
+#define MQTT_STATE_TOPIC "nativity/state"
+#define MQTT_TELEMETRY_TOPIC "nativity/telemetry"
+#define MQTT_TELEMETRY_LEN 2048 // the task table takes most of it
+
+class MqttBridge {
+public:
+    MqttBridge(MqttClient& mqtt, SceneHandler& scenes, CommandDispatcher& commands, Metrics& metrics)
+        : mqtt_(mqtt)
+        , scenes_(scenes)
+        , commands_(commands)
+        , metrics_(metrics)
+    {
+    }
+
+    // Before mqtt.start(), so the subscription is in place for the first connect
+    void start(int telemetryPeriodMs)
+    {
+        telemetryPeriodMs_ = telemetryPeriodMs;
+        mqtt_.subscribe(MQTT_COMMAND_TOPIC "+");
+        mqtt_.onMessage([this](const char* topic, int topicLen, const char* data, int dataLen) {
+            onMessage(topic, topicLen, data, dataLen);
+        });
+        scenes_.addStateListener([this] { publishState(); });
+        publishState();
+        startTask(TASK_MQTT_TELEMETRY, &MqttBridge::telemetryTaskEntry, this);
+    }
+
+private:
+    static constexpr const char* TAG = "MqttBridge";
+
+    MqttClient& mqtt_;
+    SceneHandler& scenes_;
+    CommandDispatcher& commands_;
+    Metrics& metrics_;
+    int telemetryPeriodMs_ = 0;
+
+    void onMessage(const char* topic, int topicLen, const char* data, int dataLen)
+    {
+        static const size_t prefixLen = strlen(MQTT_COMMAND_TOPIC);
+        if (topicLen <= static_cast<int>(prefixLen) || strncmp(topic, MQTT_COMMAND_TOPIC, prefixLen) != 0)
+            return;
+        char command[16] = {};
+        memcpy(command, topic + prefixLen, std::min<size_t>(topicLen - prefixLen, sizeof(command) - 1));
+        char payload[16] = {};
+        memcpy(payload, data, std::min<size_t>(dataLen, sizeof(payload) - 1));
+        char* end = nullptr;
+        long arg = strtol(payload, &end, 10);
+        bool hasArg = end != payload;
+
+        if (strcmp(command, "play") == 0 && hasArg && arg >= 0 && arg < scenes_.nScenes()) {
+            commands_.submit(CommandType::Play, arg);
+        } else if (strcmp(command, "stop") == 0) {
+            commands_.submit(CommandType::Stop);
+        } else if (strcmp(command, "volume") == 0 && hasArg && arg >= 0 && arg <= 30) {
+            commands_.submit(CommandType::Volume, arg);
+        } else if (strcmp(command, "brightness") == 0 && hasArg && arg >= 0 && arg <= 255) {
+            commands_.submit(CommandType::Brightness, arg);
+        } else if (strcmp(command, "latency_reset") == 0) {
+            LatencyProbes::instance().reset();
+        } else {
+            ESP_LOGW(TAG, "Ignoring %s '%s'", command, payload);
+        }
+    }
+
+    void publishState()
+    {
+        bool playing = scenes_.isScenePlaying();
+        char buf[96];
+        JsonWriter json(buf, sizeof(buf));
+        json.beginObject();
+        json.field("playing", playing);
+        json.field("currentScene", playing ? scenes_.getCurrentScene() : -1);
+        json.field("live", scenes_.isLive());
+        json.endObject();
+        mqtt_.publish(MQTT_STATE_TOPIC, json.data(), json.length(), 1, true);
+    }
+
+    static void telemetryTaskEntry(void* param) { static_cast<MqttBridge*>(param)->telemetryTask(); }
+
+    // {"plays":[3,5,2],"uptime":3600,"heap":..,"heapMin":..,"heapBlock":..,"fps":..,"refreshUs":..,"dfQueue":..,
+    //  "rssi":..,"mqttDropped":..,"latency":{"buttonToFrame":{"count":..,"p50":..,..},..},
+    //  "tasks":{"scene_task":[cpu share,stack free],..}}
+    void telemetryTask()
+    {
+        while (true) {
+            vTaskDelay(pdMS_TO_TICKS(telemetryPeriodMs_));
+            if (!mqtt_.isConnected())
+                continue;
+            JsonWriter json(telemetry_, sizeof(telemetry_));
+            json.beginObject();
+            json.key("plays").beginArray();
+            for (int i = 0; i < scenes_.nScenes(); ++i) {
+                json.value(scenes_.getPlayCount(i));
+            }
+            json.endArray();
+            metrics_.writeSummary(json);
+            json.field("mqttDropped", mqtt_.droppedMessages());
+            json.key("latency").beginObject();
+            for (size_t i = 0; i < LatencyProbes::COUNT; ++i) {
+                auto probe = static_cast<LatencyProbe>(i);
+                json.key(LatencyProbes::name(probe));
+                metrics_.writeLatency(json, probe);
+            }
+            json.endObject();
+            metrics_.writeTaskSummary(json);
+            json.endObject();
+            if (json.overflowed()) {
+                ESP_LOGW(TAG, "Telemetry doesn't fit in %d bytes", MQTT_TELEMETRY_LEN);
+                continue;
+            }
+            mqtt_.publish(MQTT_TELEMETRY_TOPIC, json.data(), json.length(), 0);
+        }
+    }
+
+    static inline char telemetry_[MQTT_TELEMETRY_LEN]; // one bridge per firmware, too big for the task's stack
+};
+
+#endif // MQTT_BRIDGE_HPP
@@ -1,16 +1,47 @@
 #ifndef MQTT_CLIENT_HPP
 #define MQTT_CLIENT_HPP
 
+#include "diagnostics/boot_report.hpp"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "mqtt_client.h"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <memory>
+#include <string.h>
+
+#define MQTT_BACKOFF_MIN_MS 1000
+#define MQTT_BACKOFF_MAX_MS (60 * 1000)
+
+// Retained "online"/"offline", the broker publishes "offline" for us when we drop off
+#define MQTT_AVAILABILITY_TOPIC "nativity/availability"
+
+// Messages published while disconnected wait here and go out on reconnect. When full the oldest message without
+// retain makes room; a retained one only gives way to another retained one.
+#define MQTT_OUTBOX_SLOTS 12
+#define MQTT_OUTBOX_TOPIC_LEN 48
+#define MQTT_OUTBOX_PAYLOAD_LEN 256
+#define MQTT_MAX_SUBSCRIPTIONS 8
 
 class MqttClient {
 public:
+    // Called from the MQTT task for every message on a subscribed topic. Topic and data aren't NUL terminated.
+    using MessageHandler = std::function<void(const char* topic, int topicLen, const char* data, int dataLen)>;
+
     explicit MqttClient()
         : client_(nullptr)
+        , lock_(lockStorage_.create("mqtt lock"))
+        , outbox_(std::make_unique<Pending[]>(MQTT_OUTBOX_SLOTS))
     {
     }
 
+    // Non-blocking: the client connects (and reconnects with backoff) in the background, also when there is no
+    // network yet
     void start()
     {
         esp_mqtt_client_config_t mqtt_cfg = {};
@@ -19,21 +50,200 @@ public:
         mqtt_cfg.credentials.authentication.password = MQTT_PASSWORD;
         mqtt_cfg.session.disable_clean_session = false;
         mqtt_cfg.session.keepalive = 60;
+        mqtt_cfg.session.last_will.topic = MQTT_AVAILABILITY_TOPIC;
+        mqtt_cfg.session.last_will.msg = "offline";
+        mqtt_cfg.session.last_will.qos = 1;
+        mqtt_cfg.session.last_will.retain = 1;
+        mqtt_cfg.network.disable_auto_reconnect = true; // we do our own backoff
+        mqtt_cfg.task.priority = TASK_MQTT.priority;
+        mqtt_cfg.task.stack_size = TASK_MQTT.stackBytes;
+
+        esp_timer_create_args_t retry_args = {};
+        retry_args.callback = &MqttClient::retryTimerCallback;
+        retry_args.arg = this;
+        retry_args.name = "mqtt_retry";
+        esp_timer_create(&retry_args, &retryTimer_);
 
         client_ = esp_mqtt_client_init(&mqtt_cfg);
         esp_mqtt_client_register_event(client_, MQTT_EVENT_ANY, &MqttClient::event_handler_static, this);
         esp_mqtt_client_start(client_);
     }
 
-    void publish(const char* topic, const char* payload)
+    // Sent right away when connected and nothing is waiting, else kept in the outbox and sent after what is already
+    // there. A retained message replaces an older one for the same topic that is still waiting, only the latest
+    // state matters. QoS 0 without retain (telemetry) is fire and forget: sent when connected, else dropped. It
+    // never takes an outbox slot, so it may be longer than one and can't push the retained state out while offline.
+    //
+    // esp_mqtt_client_publish() takes the client's API lock, which the MQTT task holds while it runs our event
+    // handler, and the handler takes lock_ to flush the outbox. So lock_ is never held while calling into esp-mqtt.
+    void publish(const char* topic, const char* payload, int len = 0, int qos = 1, bool retain = false)
     {
-        if (client_) {
-            esp_mqtt_client_publish(client_, topic, payload, 0, 1, 0);
+        if (len == 0)
+            len = strlen(payload);
+        bool fireAndForget = qos == 0 && !retain;
+        if (fireAndForget) {
+            if (client_ && connected_)
+                esp_mqtt_client_publish(client_, topic, payload, len, qos, retain);
+            return;
         }
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        bool direct = client_ && connected_ && outboxCount_ == 0 && !flushing_;
+        if (!direct)
+            enqueue(topic, payload, len, qos, retain);
+        xSemaphoreGive(lock_);
+
+        if (!direct) {
+            if (connected_)
+                flushOutbox();
+        } else if (esp_mqtt_client_publish(client_, topic, payload, len, qos, retain) < 0) {
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            enqueue(topic, payload, len, qos, retain);
+            xSemaphoreGive(lock_);
+        }
+    }
+
+    // Topic filter (wildcards allowed), (re)subscribed on every connect. Call before start().
+    void subscribe(const char* topic, int qos = 1)
+    {
+        if (numSubscriptions_ < subscriptions_.size())
+            subscriptions_[numSubscriptions_++] = { topic, qos };
     }
 
+    void onMessage(MessageHandler handler) { messageHandler_ = std::move(handler); }
+
+    bool isConnected() const { return connected_; }
+
+    // Outbox messages lost because it was full
+    uint32_t droppedMessages() const { return dropped_; }
+
 private:
+    struct Pending {
+        char topic[MQTT_OUTBOX_TOPIC_LEN];
+        char payload[MQTT_OUTBOX_PAYLOAD_LEN];
+        int len;
+        int qos;
+        bool retain;
+    };
+
+    struct Subscription {
+        const char* topic;
+        int qos;
+    };
+
     esp_mqtt_client_handle_t client_;
+    esp_timer_handle_t retryTimer_ = nullptr;
+    int backoffMs_ = MQTT_BACKOFF_MIN_MS;
+    volatile bool connected_ = false;
+    static inline MutexStorage lockStorage_; // one client per firmware
+    SemaphoreHandle_t lock_;
+    std::unique_ptr<Pending[]> outbox_; // ring, allocated once
+    size_t outboxHead_ = 0;
+    size_t outboxCount_ = 0;
+    bool flushing_ = false; // a task is sending the outbox, through sending_
+    Pending sending_;
+    uint32_t dropped_ = 0;
+    std::array<Subscription, MQTT_MAX_SUBSCRIPTIONS> subscriptions_ {};
+    size_t numSubscriptions_ = 0;
+    MessageHandler messageHandler_;
+
+    // Called with lock_ held
+    void enqueue(const char* topic, const char* payload, int len, int qos, bool retain)
+    {
+        if (strlen(topic) >= MQTT_OUTBOX_TOPIC_LEN || len > MQTT_OUTBOX_PAYLOAD_LEN) {
+            dropped_++;
+            return;
+        }
+        Pending* slot = nullptr;
+        if (retain) {
+            for (size_t i = 0; i < outboxCount_ && !slot; ++i) {
+                Pending& p = outbox_[(outboxHead_ + i) % MQTT_OUTBOX_SLOTS];
+                if (p.retain && strcmp(p.topic, topic) == 0)
+                    slot = &p;
+            }
+        }
+        if (!slot) {
+            if (outboxCount_ == MQTT_OUTBOX_SLOTS && !evictOldest(retain)) {
+                dropped_++;
+                return;
+            }
+            slot = &outbox_[(outboxHead_ + outboxCount_++) % MQTT_OUTBOX_SLOTS];
+        }
+        strcpy(slot->topic, topic);
+        memcpy(slot->payload, payload, len);
+        slot->len = len;
+        slot->qos = qos;
+        slot->retain = retain;
+    }
+
+    // Called with lock_ held and the outbox full: drops the oldest message without retain, or when there is none
+    // and orRetained is set, the oldest retained one. False when nothing may go.
+    bool evictOldest(bool orRetained)
+    {
+        size_t victim = 0;
+        while (victim < outboxCount_ && outbox_[(outboxHead_ + victim) % MQTT_OUTBOX_SLOTS].retain)
+            victim++;
+        if (victim == outboxCount_) {
+            if (!orRetained)
+                return false;
+            victim = 0;
+        }
+        // Close the gap from the front, the order of the rest stays
+        for (size_t i = victim; i > 0; --i)
+            outbox_[(outboxHead_ + i) % MQTT_OUTBOX_SLOTS] = outbox_[(outboxHead_ + i - 1) % MQTT_OUTBOX_SLOTS];
+        outboxHead_ = (outboxHead_ + 1) % MQTT_OUTBOX_SLOTS;
+        outboxCount_--;
+        dropped_++;
+        return true;
+    }
+
+    // Called with lock_ held, for a message that couldn't be sent: it goes back to the front, unless a newer retained
+    // message for the topic is waiting or the outbox filled up in the meantime (with messages it may not push out)
+    void requeue(const Pending& p)
+    {
+        for (size_t i = 0; i < outboxCount_ && p.retain; ++i) {
+            const Pending& q = outbox_[(outboxHead_ + i) % MQTT_OUTBOX_SLOTS];
+            if (q.retain && strcmp(q.topic, p.topic) == 0)
+                return;
+        }
+        if (outboxCount_ == MQTT_OUTBOX_SLOTS && !(p.retain && evictOldest(false))) {
+            dropped_++;
+            return;
+        }
+        outboxHead_ = (outboxHead_ + MQTT_OUTBOX_SLOTS - 1) % MQTT_OUTBOX_SLOTS;
+        outboxCount_++;
+        outbox_[outboxHead_] = p;
+    }
+
+    // Sends the outbox in order, one message at a time with lock_ released around the publish. Only one task
+    // flushes at a time; a publish() during the flush queues behind it and the flushing task sends it too.
+    void flushOutbox()
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        if (flushing_) {
+            xSemaphoreGive(lock_);
+            return;
+        }
+        flushing_ = true;
+        size_t flushed = 0;
+        while (outboxCount_ > 0 && connected_) {
+            sending_ = outbox_[outboxHead_];
+            outboxHead_ = (outboxHead_ + 1) % MQTT_OUTBOX_SLOTS;
+            outboxCount_--;
+            xSemaphoreGive(lock_);
+            const Pending& p = sending_;
+            bool sent = esp_mqtt_client_publish(client_, p.topic, p.payload, p.len, p.qos, p.retain) >= 0;
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            if (!sent) {
+                requeue(sending_);
+                break;
+            }
+            flushed++;
+        }
+        flushing_ = false;
+        xSemaphoreGive(lock_);
+        if (flushed > 0)
+            ESP_LOGI("mqtt", "Sent %u queued messages", static_cast<unsigned>(flushed));
+    }
 
     static void event_handler_static(void* handler_args, esp_event_base_t base, int32_t event_id, void* event_data)
     {
@@ -41,10 +251,35 @@ private:
         self->event_handler(base, event_id, event_data);
     }
 
+    static void retryTimerCallback(void* arg)
+    {
+        auto* self = static_cast<MqttClient*>(arg);
+        esp_mqtt_client_reconnect(self->client_);
+    }
+
     void event_handler(esp_event_base_t base, int32_t event_id, void* event_data)
     {
         if (event_id == MQTT_EVENT_CONNECTED) {
             ESP_LOGI("mqtt", "MQTT connected");
+            connected_ = true;
+            backoffMs_ = MQTT_BACKOFF_MIN_MS;
+            BootReport::instance().mark("mqtt connected");
+            for (size_t i = 0; i < numSubscriptions_; ++i) {
+                esp_mqtt_client_subscribe(client_, subscriptions_[i].topic, subscriptions_[i].qos);
+            }
+            esp_mqtt_client_publish(client_, MQTT_AVAILABILITY_TOPIC, "online", 0, 1, 1);
+            flushOutbox();
+        } else if (event_id == MQTT_EVENT_DISCONNECTED) {
+            connected_ = false;
+            ESP_LOGI("mqtt", "MQTT disconnected, retrying in %d ms", backoffMs_);
+            esp_timer_stop(retryTimer_);
+            esp_timer_start_once(retryTimer_, static_cast<uint64_t>(backoffMs_) * 1000);
+            backoffMs_ = std::min(backoffMs_ * 2, MQTT_BACKOFF_MAX_MS);
+        } else if (event_id == MQTT_EVENT_DATA) {
+            auto* event = static_cast<esp_mqtt_event_handle_t>(event_data);
+            // Commands are tiny, ignore the continuation parts of anything that was split up
+            if (messageHandler_ && event->current_data_offset == 0 && event->data_len == event->total_data_len)
+                messageHandler_(event->topic, event->topic_len, event->data, event->data_len);
         }
     }
 };
@@ -0,0 +1,80 @@
+// Prometheus text exposition format (version 0.0.4) on top of ResponseBuffer.
+//
+//   # HELP nativity_heap_free_bytes Free heap
+//   # TYPE nativity_heap_free_bytes gauge
+//   nativity_heap_free_bytes 123456
+//   nativity_task_stack_free_bytes{task="scene_task"} 1520
+#ifndef PROMETHEUS_WRITER_HPP
+#define PROMETHEUS_WRITER_HPP
+
+#include "response_buffer.hpp"
+#include <type_traits>
+
+class PrometheusWriter : public ResponseBuffer {
+public:
+    PrometheusWriter(char* buf, size_t size, httpd_req_t* req = nullptr)
+        : ResponseBuffer(buf, size, req, "text/plain; version=0.0.4")
+    {
+    }
+
+    // Starts a metric family, type is "gauge", "counter" or "summary"
+    PrometheusWriter& family(const char* name, const char* type, const char* help)
+    {
+        write("# HELP ");
+        write(name);
+        put(' ');
+        write(help);
+        write("\n# TYPE ");
+        write(name);
+        put(' ');
+        write(type);
+        put('\n');
+        return *this;
+    }
+
+    template <typename T> PrometheusWriter& sample(const char* name, T v) { return sample(name, nullptr, nullptr, v); }
+
+    template <typename T> PrometheusWriter& sample(const char* name, const char* label, const char* labelValue, T v)
+    {
+        write(name);
+        if (label) {
+            put('{');
+            write(label);
+            write("=\"");
+            escaped(labelValue);
+            write("\"}");
+        }
+        put(' ');
+        if constexpr (std::is_floating_point_v<T>)
+            fixed(v, 6);
+        else if constexpr (std::is_signed_v<T>)
+            signedDigits(v);
+        else
+            digits(v);
+        put('\n');
+        return *this;
+    }
+
+    // Family plus its one unlabeled sample
+    template <typename T> PrometheusWriter& metric(const char* name, const char* type, const char* help, T v)
+    {
+        return family(name, type, help).sample(name, v);
+    }
+
+private:
+    void escaped(const char* s)
+    {
+        for (; *s; ++s) {
+            if (*s == '\\' || *s == '"') {
+                put('\\');
+                put(*s);
+            } else if (*s == '\n') {
+                write("\\n");
+            } else {
+                put(*s);
+            }
+        }
+    }
+};
+
+#endif // PROMETHEUS_WRITER_HPP
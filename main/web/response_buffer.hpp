@@ -0,0 +1,114 @@
+// Text output into a caller-provided buffer. No heap, no iostreams, and no printf (newlib's float formatting
+// allocates). With a request attached, a full buffer is sent as an HTTP chunk and reused; without one the output
+// is truncated and overflowed() tells so. The content type is set up front, since the headers go out with the first
+// chunk. Base of the JSON and Prometheus writers.
+#ifndef RESPONSE_BUFFER_HPP
+#define RESPONSE_BUFFER_HPP
+
+#include <esp_http_server.h>
+#include <stdint.h>
+
+class ResponseBuffer {
+public:
+    ResponseBuffer(char* buf, size_t size, httpd_req_t* req, const char* contentType)
+        : buf_(buf)
+        , size_(size)
+        , req_(req)
+    {
+        if (size_ > 0)
+            buf_[0] = '\0';
+        if (req_)
+            httpd_resp_set_type(req_, contentType);
+    }
+
+    const char* data() const { return buf_; }
+    size_t length() const { return len_; }
+    bool overflowed() const { return overflowed_; }
+
+    // Sends what's left: as one plain response if it all fit, else as the last chunk
+    esp_err_t finish()
+    {
+        if (!req_)
+            return ESP_OK;
+        if (!chunked_)
+            return httpd_resp_send(req_, buf_, len_);
+        if (len_ > 0 && httpd_resp_send_chunk(req_, buf_, len_) != ESP_OK)
+            return ESP_FAIL;
+        return httpd_resp_send_chunk(req_, nullptr, 0);
+    }
+
+protected:
+    void put(char c)
+    {
+        if (len_ + 1 >= size_) {
+            if (req_ && httpd_resp_send_chunk(req_, buf_, len_) == ESP_OK) {
+                chunked_ = true;
+                len_ = 0;
+            } else {
+                overflowed_ = true;
+                return;
+            }
+        }
+        buf_[len_++] = c;
+        buf_[len_] = '\0';
+    }
+
+    void write(const char* s)
+    {
+        while (*s)
+            put(*s++);
+    }
+
+    void digits(uint64_t v)
+    {
+        char tmp[20];
+        int n = 0;
+        do {
+            tmp[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v > 0);
+        while (n > 0)
+            put(tmp[--n]);
+    }
+
+    void signedDigits(int64_t v)
+    {
+        if (v < 0) {
+            put('-');
+            digits(static_cast<uint64_t>(-(v + 1)) + 1);
+        } else {
+            digits(static_cast<uint64_t>(v));
+        }
+    }
+
+    // Fixed point, e.g. fixed(12.345f, 2) -> 12.35
+    void fixed(float v, int decimals)
+    {
+        if (v < 0) {
+            put('-');
+            v = -v;
+        }
+        uint32_t scale = 1;
+        for (int i = 0; i < decimals; ++i)
+            scale *= 10;
+        uint64_t scaled = static_cast<uint64_t>(v * scale + 0.5f);
+        digits(scaled / scale);
+        if (decimals > 0) {
+            put('.');
+            uint64_t frac = scaled % scale;
+            for (uint32_t div = scale / 10; div > 0; div /= 10) {
+                put('0' + (frac / div) % 10);
+            }
+        }
+    }
+
+private:
+    char* buf_;
+    size_t size_;
+    httpd_req_t* req_;
+    size_t len_ = 0;
+    bool overflowed_ = false;
+    bool chunked_ = false;
+};
+
+#endif // RESPONSE_BUFFER_HPP
@@ -0,0 +1,415 @@
+// Synchronized playback across several nativity controllers on one LAN.
+//
+// One node is the leader, the others follow (Kconfig: Nativity > Show sync role). Followers keep estimating the
+// offset of the leader's clock with NTP-style exchanges over UDP, once a second. Any play, on any node, ends up
+// at the leader, which broadcasts "scene X at leader time T" (T = now + SHOW_SYNC_LEAD_MS) and every node,
+// leader included, starts the scene when its own clock reaches T. Stops are broadcast too but not timed.
+//
+// Plays and stops go through the CommandDispatcher like every other command: the start timer (esp_timer task)
+// only submits a SyncedStart, so the RMT transmit, the scene task creation and the state listeners run in the
+// command task and never hold up the other esp_timer callbacks.
+//
+// After each start a follower reports how late its timer fired and how uncertain its offset is (half the round
+// trip of the best exchange); the leader logs the resulting skew per node and exports it on /metrics.
+//
+// Messages are one fixed-size struct, see SyncMessage. Leader times are esp_timer microseconds of the leader.
+#ifndef SHOW_SYNC_HPP
+#define SHOW_SYNC_HPP
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "prometheus_writer.hpp"
+#include "scenes/command_dispatcher.hpp"
+#include "scenes/scene_handler.hpp"
+#include "task_plan.hpp"
+#include <algorithm>
+#include <array>
+#include <stdint.h>
+
+#define SHOW_SYNC_LEAD_MS 200 // time for the announcement to reach everybody
+#define SHOW_SYNC_POLL_MS 1000
+#define SHOW_SYNC_LEADER_TIMEOUT_MS 5000
+#define SHOW_SYNC_SAMPLES 8
+#define SHOW_SYNC_REPEATS 3 // announcements are sent this often, UDP over Wi-Fi does lose packets
+#define SHOW_SYNC_MAX_FOLLOWERS 8
+
+// Offset of the leader's clock against ours (leader = local + offset) from NTP-style exchanges. Of the last few
+// samples the one with the shortest round trip wins: least queueing, so the most symmetric paths.
+class ClockOffsetFilter {
+public:
+    // t1 request sent (local), t2 request received (leader), t3 reply sent (leader), t4 reply received (local)
+    void add(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+    {
+        samples_[next_] = { ((t2 - t1) + (t3 - t4)) / 2, (t4 - t1) - (t3 - t2) };
+        next_ = (next_ + 1) % samples_.size();
+        count_ = std::min(count_ + 1, samples_.size());
+    }
+
+    void reset() { count_ = 0; }
+    bool valid() const { return count_ > 0; }
+    int64_t offset() const { return best().offset; }
+    int64_t roundTrip() const { return best().roundTrip; }
+    // The offset is only exact when both directions took equally long
+    int64_t uncertainty() const { return best().roundTrip / 2; }
+
+private:
+    struct Sample {
+        int64_t offset;
+        int64_t roundTrip;
+    };
+
+    std::array<Sample, SHOW_SYNC_SAMPLES> samples_ {};
+    size_t next_ = 0;
+    size_t count_ = 0;
+
+    Sample best() const
+    {
+        Sample b = { 0, 0 };
+        for (size_t i = 0; i < count_; ++i) {
+            if (i == 0 || samples_[i].roundTrip < b.roundTrip)
+                b = samples_[i];
+        }
+        return b;
+    }
+};
+
+class ShowSync {
+public:
+    enum class Role { Leader, Follower };
+
+    ShowSync(Role role, SceneHandler& scenes, CommandDispatcher& commands, uint16_t port)
+        : role_(role)
+        , scenes_(scenes)
+        , commands_(commands)
+        , port_(port)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = &ShowSync::startTimerCallback;
+        args.arg = this;
+        args.name = "show_start";
+        esp_timer_create(&args, &startTimer_);
+    }
+
+    void start()
+    {
+        commands_.on(CommandType::SyncedStart, [this](int32_t scene) { return startNow(scene); });
+        scenes_.setPlayScheduler([this](size_t scene) { requestPlay(scene); });
+        scenes_.setStopListener([this] { requestStop(); });
+        startTask(TASK_SHOW_SYNC, &ShowSync::taskEntry, this);
+    }
+
+    void writeMetrics(PrometheusWriter& out) const
+    {
+        if (role_ == Role::Follower) {
+            out.metric("nativity_sync_synced", "gauge", "1 while the leader's clock offset is known",
+                static_cast<uint32_t>(leaderKnown_ && clock_.valid()));
+            out.metric("nativity_sync_offset_seconds", "gauge", "Leader clock minus ours", clock_.offset() / 1e6f);
+            out.metric("nativity_sync_round_trip_seconds", "gauge", "Round trip of the best recent exchange",
+                clock_.roundTrip() / 1e6f);
+            out.metric("nativity_sync_start_lateness_seconds", "gauge", "How late the last synced scene start ran",
+                lastLatenessUs_ / 1e6f);
+            return;
+        }
+        out.family("nativity_sync_node_skew_seconds", "gauge", "Last scene start of a follower minus the leader's");
+        for (const auto& f : followers_) {
+            if (f.addr != 0)
+                out.sample("nativity_sync_node_skew_seconds", "node", f.name, f.skewUs / 1e6f);
+        }
+        out.family("nativity_sync_node_uncertainty_seconds", "gauge", "Clock offset uncertainty of a follower");
+        for (const auto& f : followers_) {
+            if (f.addr != 0)
+                out.sample("nativity_sync_node_uncertainty_seconds", "node", f.name, f.uncertaintyUs / 1e6f);
+        }
+    }
+
+private:
+    static constexpr const char* TAG = "ShowSync";
+    static constexpr uint32_t MAGIC = 0x3159534E; // "NSY1"
+
+    enum Type : uint8_t { TIME_REQUEST = 1, TIME_REPLY, PLAY_AT, STOP, PLAY_REQUEST, STOP_REQUEST, REPORT };
+
+    // TIME_REQUEST t1 | TIME_REPLY t1 t2 t3 | PLAY_AT scene show t1 = start (leader time) | PLAY_REQUEST scene
+    // REPORT scene show t1 = lateness, t2 = uncertainty
+    struct __attribute__((packed)) SyncMessage {
+        uint32_t magic;
+        uint8_t type;
+        uint8_t scene;
+        uint16_t show;
+        int64_t t1;
+        int64_t t2;
+        int64_t t3;
+    };
+
+    struct Follower {
+        uint32_t addr = 0;
+        char name[16] = {};
+        int64_t skewUs = 0;
+        int64_t uncertaintyUs = 0;
+    };
+
+    Role role_;
+    SceneHandler& scenes_;
+    CommandDispatcher& commands_;
+    uint16_t port_;
+    int sock_ = -1;
+    esp_timer_handle_t startTimer_ = nullptr;
+
+    // Follower
+    ClockOffsetFilter clock_;
+    sockaddr_in leader_ = {};
+    volatile bool leaderKnown_ = false;
+    int64_t lastReplyUs_ = 0;
+    int lastShow_ = -1;
+
+    // Both: the scheduled start. Set by the sync task (follower) or whoever plays (leader), read by the start timer
+    // and the command task, so under pendingLock_.
+    uint16_t show_ = 0;
+    size_t pendingScene_ = 0;
+    int64_t pendingAtUs_ = 0; // local time
+    portMUX_TYPE pendingLock_ = portMUX_INITIALIZER_UNLOCKED;
+    int64_t lastLatenessUs_ = 0;
+
+    // Leader
+    std::array<Follower, SHOW_SYNC_MAX_FOLLOWERS> followers_ {};
+
+    static void taskEntry(void* param) { static_cast<ShowSync*>(param)->task(); }
+
+    void task()
+    {
+        sock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        int on = 1;
+        setsockopt(sock_, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            ESP_LOGE(TAG, "Can't listen on UDP port %d", port_);
+        ESP_LOGI(TAG, "%s on port %d", role_ == Role::Leader ? "Leader" : "Follower", port_);
+
+        int64_t nextPollUs = 0;
+        while (true) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sock_, &fds);
+            timeval timeout = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+            if (select(sock_ + 1, &fds, nullptr, nullptr, &timeout) > 0)
+                receive();
+
+            int64_t now = esp_timer_get_time();
+            if (role_ == Role::Follower && now >= nextPollUs) {
+                if (leaderKnown_ && now - lastReplyUs_ > SHOW_SYNC_LEADER_TIMEOUT_MS * 1000LL) {
+                    ESP_LOGW(TAG, "Lost the leader");
+                    leaderKnown_ = false;
+                    clock_.reset();
+                }
+                SyncMessage request = message(TIME_REQUEST);
+                request.t1 = esp_timer_get_time();
+                sendTo(request, leaderKnown_ ? leader_ : broadcast());
+                nextPollUs = now + SHOW_SYNC_POLL_MS * 1000LL;
+            }
+        }
+    }
+
+    void receive()
+    {
+        SyncMessage msg;
+        sockaddr_in from = {};
+        socklen_t fromLen = sizeof(from);
+        int n = recvfrom(sock_, &msg, sizeof(msg), 0, reinterpret_cast<sockaddr*>(&from), &fromLen);
+        int64_t now = esp_timer_get_time();
+        if (n != sizeof(msg) || msg.magic != MAGIC)
+            return;
+        // Once we follow a leader, a second one (or anybody else) on the LAN doesn't get to start our scenes
+        if (role_ == Role::Follower && leaderKnown_ && !isLeader(from))
+            return;
+
+        if (role_ == Role::Leader) {
+            switch (msg.type) {
+            case TIME_REQUEST: {
+                SyncMessage reply = message(TIME_REPLY);
+                reply.t1 = msg.t1;
+                reply.t2 = now;
+                reply.t3 = esp_timer_get_time();
+                sendTo(reply, from);
+                break;
+            }
+            case PLAY_REQUEST:
+                commands_.submit(CommandType::Play, msg.scene); // comes back as requestPlay(), announced to all
+                break;
+            case STOP_REQUEST:
+                commands_.submit(CommandType::Stop);
+                break;
+            case REPORT:
+                report(from, msg);
+                break;
+            }
+            return;
+        }
+
+        switch (msg.type) {
+        case TIME_REPLY:
+            if (!leaderKnown_) {
+                char name[16];
+                inet_ntoa_r(from.sin_addr, name, sizeof(name));
+                ESP_LOGI(TAG, "Leader at %s", name);
+                leader_ = from;
+                leaderKnown_ = true;
+            }
+            clock_.add(msg.t1, msg.t2, msg.t3, now);
+            lastReplyUs_ = now;
+            break;
+        case PLAY_AT:
+            if (msg.show == lastShow_)
+                break; // a repeat
+            lastShow_ = msg.show;
+            if (!clock_.valid())
+                ESP_LOGW(TAG, "Scene %d announced before the clock is synced, starting now", msg.scene);
+            scheduleStart(msg.scene, msg.show, clock_.valid() ? msg.t1 - clock_.offset() : now);
+            break;
+        case STOP:
+            esp_timer_stop(startTimer_);
+            commands_.submit(CommandType::Stop);
+            break;
+        }
+    }
+
+    // SceneHandler::playScene, on whatever task called it
+    void requestPlay(size_t scene)
+    {
+        if (role_ == Role::Follower) {
+            if (!leaderKnown_) {
+                scenes_.playSceneNow(scene); // on our own
+                return;
+            }
+            SyncMessage request = message(PLAY_REQUEST);
+            request.scene = scene;
+            sendTo(request, leader_);
+            return;
+        }
+        int64_t startAt = esp_timer_get_time() + SHOW_SYNC_LEAD_MS * 1000LL;
+        SyncMessage announce = message(PLAY_AT);
+        announce.scene = scene;
+        taskENTER_CRITICAL(&pendingLock_);
+        announce.show = ++show_;
+        taskEXIT_CRITICAL(&pendingLock_);
+        announce.t1 = startAt;
+        for (int i = 0; i < SHOW_SYNC_REPEATS; ++i)
+            sendTo(announce, broadcast());
+        scheduleStart(scene, announce.show, startAt);
+    }
+
+    // SceneHandler::stopScene, before the scene stops
+    void requestStop()
+    {
+        esp_timer_stop(startTimer_);
+        if (role_ == Role::Leader) {
+            SyncMessage stop = message(STOP);
+            for (int i = 0; i < SHOW_SYNC_REPEATS; ++i)
+                sendTo(stop, broadcast());
+        } else if (leaderKnown_) {
+            sendTo(message(STOP_REQUEST), leader_);
+        }
+    }
+
+    void scheduleStart(size_t scene, uint16_t show, int64_t atUs)
+    {
+        esp_timer_stop(startTimer_);
+        taskENTER_CRITICAL(&pendingLock_);
+        pendingScene_ = scene;
+        show_ = show;
+        pendingAtUs_ = atUs;
+        taskEXIT_CRITICAL(&pendingLock_);
+        int64_t delay = atUs - esp_timer_get_time();
+        esp_timer_start_once(startTimer_, delay > 0 ? delay : 1);
+    }
+
+    static void startTimerCallback(void* arg)
+    {
+        auto* self = static_cast<ShowSync*>(arg);
+        taskENTER_CRITICAL(&self->pendingLock_);
+        size_t scene = self->pendingScene_;
+        taskEXIT_CRITICAL(&self->pendingLock_);
+        self->commands_.submit(CommandType::SyncedStart, scene);
+    }
+
+    // Command task. The lateness includes the hop through the command queue.
+    bool startNow(int32_t scene)
+    {
+        if (scenes_.isScenePlaying())
+            return false;
+        taskENTER_CRITICAL(&pendingLock_);
+        int64_t atUs = pendingAtUs_;
+        uint16_t show = show_;
+        taskEXIT_CRITICAL(&pendingLock_);
+        lastLatenessUs_ = esp_timer_get_time() - atUs;
+        scenes_.playSceneNow(scene);
+        if (role_ == Role::Follower && leaderKnown_) {
+            SyncMessage r = message(REPORT);
+            r.scene = scene;
+            r.show = show;
+            r.t1 = lastLatenessUs_;
+            r.t2 = clock_.uncertainty();
+            sendTo(r, leader_);
+        }
+        return true;
+    }
+
+    // Skew = how much later than the leader a follower started; the clock uncertainty comes on top of it
+    void report(const sockaddr_in& from, const SyncMessage& msg)
+    {
+        taskENTER_CRITICAL(&pendingLock_);
+        uint16_t show = show_;
+        taskEXIT_CRITICAL(&pendingLock_);
+        if (msg.show != show)
+            return;
+        Follower* slot = nullptr;
+        for (auto& f : followers_) {
+            if (f.addr == from.sin_addr.s_addr || (!slot && f.addr == 0))
+                slot = &f;
+            if (f.addr == from.sin_addr.s_addr)
+                break;
+        }
+        if (!slot)
+            return;
+        slot->addr = from.sin_addr.s_addr;
+        inet_ntoa_r(from.sin_addr, slot->name, sizeof(slot->name));
+        slot->skewUs = msg.t1 - lastLatenessUs_;
+        slot->uncertaintyUs = msg.t2;
+        ESP_LOGI(TAG, "%s started scene %d %+lld us from the leader (clock +-%lld us)", slot->name, msg.scene,
+            static_cast<long long>(slot->skewUs), static_cast<long long>(slot->uncertaintyUs));
+    }
+
+    static SyncMessage message(Type type)
+    {
+        SyncMessage msg = {};
+        msg.magic = MAGIC;
+        msg.type = type;
+        return msg;
+    }
+
+    bool isLeader(const sockaddr_in& from) const
+    {
+        return from.sin_addr.s_addr == leader_.sin_addr.s_addr && from.sin_port == leader_.sin_port;
+    }
+
+    sockaddr_in broadcast() const
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_);
+        addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+        return addr;
+    }
+
+    void sendTo(const SyncMessage& msg, const sockaddr_in& to)
+    {
+        if (sock_ >= 0)
+            sendto(sock_, &msg, sizeof(msg), 0, reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+    }
+};
+
+#endif // SHOW_SYNC_HPP
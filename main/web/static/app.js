@@ -0,0 +1,42 @@
+// The device pushes every change over the websocket, no polling
+function show(state) {
+  document.getElementById('status').textContent =
+    JSON.stringify({ playing: state.playing, currentScene: state.currentScene, live: state.live }, null, 2);
+  document.getElementById('playcounts').textContent = JSON.stringify(state.playCounts, null, 2);
+}
+function connect() {
+  let ws = new WebSocket('ws://' + location.host + '/ws');
+  ws.onmessage = (e) => show(JSON.parse(e.data));
+  ws.onclose = () => setTimeout(connect, 2000);
+}
+connect();
+
+// Live strip preview: binary keyframes (0x00) and deltas (0x01), see strip_preview.hpp
+let leds = [];
+function paint(i, r, g, b) {
+  if (!leds[i]) {
+    leds[i] = document.createElement('span');
+    document.getElementById('strip').appendChild(leds[i]);
+  }
+  leds[i].style.background = 'rgb(' + r + ',' + g + ',' + b + ')';
+}
+function connectStrip() {
+  let ws = new WebSocket('ws://' + location.host + '/ws/strip');
+  ws.binaryType = 'arraybuffer';
+  ws.onmessage = (e) => {
+    let d = new Uint8Array(e.data);
+    let n = d[1] | (d[2] << 8);
+    if (d[0] == 0) {
+      for (let i = 0; i < n; i++) paint(i, d[3 + i * 3], d[4 + i * 3], d[5 + i * 3]);
+    } else {
+      for (let k = 0, p = 3; k < n; k++, p += 5) paint(d[p] | (d[p + 1] << 8), d[p + 2], d[p + 3], d[p + 4]);
+    }
+  };
+  ws.onclose = () => setTimeout(connectStrip, 2000);
+}
+connectStrip();
+
+// Offline shell; browsers only allow service workers on https or localhost
+if ('serviceWorker' in navigator && window.isSecureContext) {
+  navigator.serviceWorker.register('/sw.js');
+}
@@ -0,0 +1,21 @@
+// Caches the app shell so the page opens instantly (and offline); live state still comes from the device
+const CACHE = 'kerststal-v1';
+const SHELL = ['/', '/app.js', '/style.css', '/manifest.json', '/icon.svg'];
+
+self.addEventListener('install', (e) => {
+  e.waitUntil(caches.open(CACHE).then((c) => c.addAll(SHELL)));
+});
+
+self.addEventListener('activate', (e) => {
+  e.waitUntil(caches.keys().then((keys) => Promise.all(keys.filter((k) => k != CACHE).map((k) => caches.delete(k)))));
+});
+
+// Shell from cache, refreshed in the background (the device answers 304 when nothing changed)
+self.addEventListener('fetch', (e) => {
+  let url = new URL(e.request.url);
+  if (e.request.method != 'GET' || !SHELL.includes(url.pathname)) return;
+  e.respondWith(caches.open(CACHE).then((c) => c.match(e.request).then((cached) => {
+    let fresh = fetch(e.request).then((res) => { c.put(e.request, res.clone()); return res; });
+    return cached || fresh;
+  })));
+});
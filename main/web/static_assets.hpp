@@ -0,0 +1,81 @@
+// Web UI files from web/static, gzipped at build time (see main/CMakeLists.txt) and embedded in flash. They are
+// sent straight from flash with Content-Encoding: gzip; a strong ETag lets browsers revalidate with a 304.
+#ifndef STATIC_ASSETS_HPP
+#define STATIC_ASSETS_HPP
+
+#include <esp_http_server.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EMBEDDED_ASSET(name)                                                                                         \
+    extern "C" const uint8_t _binary_##name##_gz_start[];                                                          \
+    extern "C" const uint8_t _binary_##name##_gz_end[];
+
+EMBEDDED_ASSET(index_html)
+EMBEDDED_ASSET(app_js)
+EMBEDDED_ASSET(style_css)
+EMBEDDED_ASSET(manifest_json)
+EMBEDDED_ASSET(sw_js)
+EMBEDDED_ASSET(icon_svg)
+
+struct StaticAsset {
+    const char* uri;
+    const char* contentType;
+    const char* cacheControl;
+    const uint8_t* start;
+    const uint8_t* end;
+    char etag[12]; // "xxxxxxxx", filled in once at startup
+
+    size_t size() const { return end - start; }
+};
+
+// Entry points and the service worker must revalidate, so a firmware update shows up on the next load. The rest
+// is only referenced from those and may be cached for a day.
+#define ASSET_REVALIDATE "no-cache"
+#define ASSET_CACHE_DAY "public, max-age=86400"
+
+inline StaticAsset* staticAssets(size_t& count)
+{
+    static StaticAsset assets[] = {
+        { "/", "text/html", ASSET_REVALIDATE, _binary_index_html_gz_start, _binary_index_html_gz_end, {} },
+        { "/app.js", "application/javascript", ASSET_REVALIDATE, _binary_app_js_gz_start, _binary_app_js_gz_end, {} },
+        { "/style.css", "text/css", ASSET_REVALIDATE, _binary_style_css_gz_start, _binary_style_css_gz_end, {} },
+        { "/sw.js", "application/javascript", ASSET_REVALIDATE, _binary_sw_js_gz_start, _binary_sw_js_gz_end, {} },
+        { "/manifest.json", "application/manifest+json", ASSET_CACHE_DAY, _binary_manifest_json_gz_start,
+            _binary_manifest_json_gz_end, {} },
+        { "/icon.svg", "image/svg+xml", ASSET_CACHE_DAY, _binary_icon_svg_gz_start, _binary_icon_svg_gz_end, {} },
+    };
+    static bool hashed = false;
+    if (!hashed) {
+        // FNV-1a over the compressed bytes: changes whenever the file does
+        for (auto& asset : assets) {
+            uint32_t hash = 2166136261u;
+            for (const uint8_t* p = asset.start; p < asset.end; ++p) {
+                hash = (hash ^ *p) * 16777619u;
+            }
+            snprintf(asset.etag, sizeof(asset.etag), "\"%08lx\"", static_cast<unsigned long>(hash));
+        }
+        hashed = true;
+    }
+    count = sizeof(assets) / sizeof(assets[0]);
+    return assets;
+}
+
+inline esp_err_t sendStaticAsset(httpd_req_t* req, const StaticAsset& asset)
+{
+    char ifNoneMatch[sizeof(asset.etag)];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) == ESP_OK
+        && strcmp(ifNoneMatch, asset.etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", asset.etag);
+        httpd_resp_set_hdr(req, "Cache-Control", asset.cacheControl);
+        return httpd_resp_send(req, nullptr, 0);
+    }
+    httpd_resp_set_type(req, asset.contentType);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    httpd_resp_set_hdr(req, "ETag", asset.etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset.cacheControl);
+    return httpd_resp_send(req, reinterpret_cast<const char*>(asset.start), asset.size());
+}
+
+#endif // STATIC_ASSETS_HPP
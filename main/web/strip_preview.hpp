@@ -0,0 +1,226 @@
+// Streams the LED strip to the web UI as binary WebSocket frames.
+//
+// Frame format (little endian):
+//   keyframe: 0x00, count:u16, count * (r, g, b)
+//   delta:    0x01, changed:u16, changed * (index:u16, r, g, b)
+//
+// All clients share one base frame. Frames are read straight from the Lights output buffer by a task of their
+// own, the render path only bumps a counter and the poll timer only wakes that task, so httpd never waits for a
+// slow client. A client whose socket can't take more right now skips the frame, as does one whose send failed;
+// it gets a keyframe as soon as it catches up while the others keep getting deltas. Without subscribers the poll
+// timer is stopped and the stream costs nothing.
+#ifndef STRIP_PREVIEW_HPP
+#define STRIP_PREVIEW_HPP
+
+#include "../actuators/lights.hpp"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "static_alloc.hpp"
+#include "task_plan.hpp"
+#include <array>
+#include <atomic>
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <string.h>
+#include <vector>
+
+#define STRIP_PREVIEW_MAX_FPS 20
+#define STRIP_PREVIEW_MAX_CLIENTS 4
+
+class StripPreview {
+public:
+    explicit StripPreview(Lights& strip)
+        : strip_(strip)
+        , lock_(lockStorage_.create("strip preview lock"))
+        , lastSent_(strip.numLEDs * 3, 0)
+        , encoded_(3 + strip.numLEDs * 5)
+    {
+        MemoryReport::instance().add("strip preview", BOOT_MEMORY_KIND, lastSent_.size() + encoded_.size());
+        for (auto& client : clients_)
+            client.fd = -1;
+        esp_timer_create_args_t args = {};
+        args.callback = &StripPreview::pollTimerCallback;
+        args.arg = this;
+        args.name = "strip_preview";
+        esp_timer_create(&args, &pollTimer_);
+    }
+
+    void attach(httpd_handle_t server)
+    {
+        server_ = server;
+        startTask(TASK_STRIP_PREVIEW, &StripPreview::taskEntry, this, &task_);
+    }
+
+    // httpd task: a client finished the /ws/strip handshake
+    void subscribe(int fd)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        Client* free = nullptr;
+        for (auto& client : clients_) {
+            if (client.fd == -1 && !free)
+                free = &client;
+        }
+        if (free) {
+            free->fd = fd;
+            free->needsKeyframe = true;
+            lastFrame_ = strip_.frameCount() - 1; // send the current frame right away
+            if (numSubscribers_++ == 0)
+                esp_timer_start_periodic(pollTimer_, 1000 * 1000 / STRIP_PREVIEW_MAX_FPS);
+        }
+        xSemaphoreGive(lock_);
+        if (!free)
+            ESP_LOGW("StripPreview", "Too many preview clients, ignoring fd %d", fd);
+    }
+
+    // httpd task: socket closed, whatever it was. Waits for a send to it to finish, so the fd isn't reused under
+    // the preview task.
+    void unsubscribe(int fd)
+    {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        for (auto& client : clients_) {
+            if (client.fd == fd) {
+                client.fd = -1;
+                if (--numSubscribers_ == 0)
+                    esp_timer_stop(pollTimer_);
+            }
+        }
+        xSemaphoreGive(lock_);
+    }
+
+    // httpd task. No lock: subscribe() and unsubscribe(), the only writers of the fds, run there too.
+    bool isSubscribed(int fd) const
+    {
+        for (const auto& client : clients_) {
+            if (client.fd == fd)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    struct Client {
+        int fd;
+        bool needsKeyframe; // missed a frame, the shared base moved on without it
+    };
+
+    Lights& strip_;
+    httpd_handle_t server_ = nullptr;
+    esp_timer_handle_t pollTimer_ = nullptr;
+    TaskHandle_t task_ = nullptr;
+    static inline MutexStorage lockStorage_; // one preview per firmware
+    SemaphoreHandle_t lock_; // clients_, held by the preview task while it sends
+    std::array<Client, STRIP_PREVIEW_MAX_CLIENTS> clients_;
+    int numSubscribers_ = 0;
+    std::atomic<uint32_t> lastFrame_ { 0 }; // the preview task writes it, the poll timer reads it
+    std::vector<uint8_t, BootAllocator<uint8_t>> lastSent_; // base frame the clients have
+    std::vector<uint8_t, BootAllocator<uint8_t>> encoded_; // worst case: every pixel in a delta
+
+    // esp_timer task: only wakes the preview task, never waits
+    static void pollTimerCallback(void* arg)
+    {
+        auto* self = static_cast<StripPreview*>(arg);
+        if (self->strip_.frameCount() != self->lastFrame_.load(std::memory_order_relaxed))
+            xTaskNotifyGive(self->task_);
+    }
+
+    static void taskEntry(void* param) { static_cast<StripPreview*>(param)->task(); }
+
+    void task()
+    {
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            send();
+            xSemaphoreGive(lock_);
+        }
+    }
+
+    // Called with lock_ held
+    void send()
+    {
+        lastFrame_ = strip_.frameCount();
+        size_t len = encodeDelta();
+        for (auto& client : clients_) {
+            if (client.fd == -1 || client.needsKeyframe)
+                continue;
+            if (len > 0 && !sendTo(client.fd, len))
+                client.needsKeyframe = true;
+        }
+
+        // The clients that missed something catch up with a keyframe of the new base, when they can take it
+        bool catchUp = false;
+        for (const auto& client : clients_)
+            catchUp |= client.fd != -1 && client.needsKeyframe;
+        if (!catchUp)
+            return;
+        len = encodeKeyframe();
+        for (auto& client : clients_) {
+            if (client.fd != -1 && client.needsKeyframe && sendTo(client.fd, len))
+                client.needsKeyframe = false;
+        }
+    }
+
+    // Skips a client whose socket has no room right now instead of waiting for it
+    bool sendTo(int fd, size_t len)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        timeval now = {};
+        if (select(fd + 1, nullptr, &fds, nullptr, &now) <= 0)
+            return false;
+        httpd_ws_frame_t frame = {};
+        frame.type = HTTPD_WS_TYPE_BINARY;
+        frame.payload = encoded_.data();
+        frame.len = len;
+        return httpd_ws_send_data(server_, fd, &frame) == ESP_OK;
+    }
+
+    // Of the base frame, which encodeDelta() has just brought up to date
+    size_t encodeKeyframe()
+    {
+        size_t n = strip_.numLEDs;
+        encoded_[0] = 0x00;
+        encoded_[1] = n & 0xFF;
+        encoded_[2] = n >> 8;
+        memcpy(&encoded_[3], lastSent_.data(), n * 3);
+        return 3 + n * 3;
+    }
+
+    size_t encodeDelta()
+    {
+        const uint8_t* pixels = strip_.pixelData();
+        size_t n = strip_.numLEDs;
+        size_t pos = 3;
+        uint16_t changed = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const uint8_t* p = pixels + i * 3;
+            uint8_t* last = &lastSent_[i * 3];
+            if (p[0] == last[0] && p[1] == last[1] && p[2] == last[2])
+                continue;
+            last[0] = p[0];
+            last[1] = p[1];
+            last[2] = p[2];
+            encoded_[pos++] = i & 0xFF;
+            encoded_[pos++] = i >> 8;
+            encoded_[pos++] = last[0];
+            encoded_[pos++] = last[1];
+            encoded_[pos++] = last[2];
+            changed++;
+        }
+        if (changed == 0)
+            return 0; // output stage changed back to what the clients already have
+        // A keyframe is smaller once more than ~60% of the strip changed
+        if (pos > 3 + n * 3)
+            return encodeKeyframe();
+        encoded_[0] = 0x01;
+        encoded_[1] = changed & 0xFF;
+        encoded_[2] = changed >> 8;
+        return pos;
+    }
+};
+
+#endif // STRIP_PREVIEW_HPP
@@ -0,0 +1,70 @@
+// The TraceRecorder as Chrome trace event JSON, for ui.perfetto.dev or chrome://tracing. One track per task (plus
+// one per core for interrupts); slices for begin/end pairs, markers for the rest. Written through a JsonWriter, so
+// on a request it goes out in chunks.
+#ifndef TRACE_EXPORT_HPP
+#define TRACE_EXPORT_HPP
+
+#include "diagnostics/trace_recorder.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "json_writer.hpp"
+#include <array>
+
+#if CONFIG_NATIVITY_TRACE
+
+#define TRACE_EXPORT_MAX_TASKS 32
+
+// snapshot: the copy taken at the last overrun instead of the live rings. The live rings don't record meanwhile.
+inline void writeChromeTrace(JsonWriter& json, bool snapshot)
+{
+    TraceRecorder& trace = TraceRecorder::instance();
+    if (!snapshot)
+        trace.pause();
+
+    json.beginObject();
+    json.field("displayTimeUnit", "ms");
+    json.key("traceEvents").beginArray();
+
+    auto threadName = [&json](uint32_t tid, const char* name) {
+        json.beginObject();
+        json.field("name", "thread_name").field("ph", "M").field("pid", 1).field("tid", tid);
+        json.key("args").beginObject().field("name", name).endObject();
+        json.endObject();
+    };
+    json.beginObject();
+    json.field("name", "process_name").field("ph", "M").field("pid", 1);
+    json.key("args").beginObject().field("name", "nativity").endObject();
+    json.endObject();
+    // Interrupts get the core number as track, tasks their handle. Tasks deleted since show up unnamed.
+    threadName(0, "interrupts cpu0");
+    threadName(1, "interrupts cpu1");
+    static std::array<TaskStatus_t, TRACE_EXPORT_MAX_TASKS> tasks;
+    UBaseType_t n = uxTaskGetSystemState(tasks.data(), tasks.size(), nullptr);
+    for (UBaseType_t i = 0; i < n; ++i)
+        threadName(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(tasks[i].xHandle)), tasks[i].pcTaskName);
+
+    static const char* const phases[] = { "B", "E", "i" };
+    trace.forEach(snapshot, [&json](const TraceEvent& e, int core, int64_t atUs) {
+        json.beginObject();
+        json.field("name", traceName(e.id));
+        json.field("ph", phases[static_cast<int>(e.phase)]);
+        if (e.phase == TracePhase::Instant)
+            json.field("s", "t");
+        json.field("ts", atUs).field("pid", 1).field("tid", e.task ? e.task : static_cast<uint32_t>(core));
+        json.key("args").beginObject();
+        json.field("core", core).field(traceArgName(e.id), e.arg);
+        json.endObject();
+        json.endObject();
+    });
+
+    json.endArray();
+    json.field("overruns", trace.overruns());
+    json.endObject();
+
+    if (!snapshot)
+        trace.resume();
+}
+
+#endif // CONFIG_NATIVITY_TRACE
+
+#endif // TRACE_EXPORT_HPP
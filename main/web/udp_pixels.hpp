@@ -0,0 +1,306 @@
+// Realtime pixel streams over UDP: DDP (port 4048, xLights/LedFx/WLED style) and E1.31/sACN (port 5568, unicast).
+//
+// Datagrams are read with recvmsg() straight into the Lights output buffer: the header is peeked first to find
+// where the payload goes, then header and pixels are scattered in one read, so there is no intermediate copy.
+// The first accepted packet puts the SceneHandler in live mode; LIVE_TIMEOUT_MS without packets (or an E1.31
+// stream-terminated flag) hands the strip back. Every accepted packet is read and shown under the SceneHandler's
+// live lock, so a scene starting or live mode ending never sees half a frame.
+//
+// A DDP frame is shown on the packet with the PUSH flag, an E1.31 frame on the packet for the last universe the
+// strip spans. Latency is measured from reading the first packet of a frame until the strip is transmitted.
+#ifndef UDP_PIXELS_HPP
+#define UDP_PIXELS_HPP
+
+#include "actuators/lights.hpp"
+#include "diagnostics/latency_histogram.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "scenes/scene_handler.hpp"
+#include "task_plan.hpp"
+#include "web/prometheus_writer.hpp"
+#include <algorithm>
+#include <array>
+#include <string.h>
+
+#define DDP_PORT 4048
+#define E131_PORT 5568
+#define E131_FIRST_UNIVERSE 1
+#define E131_MAX_UNIVERSES 4 // 170 pixels each
+#define LIVE_TIMEOUT_MS 2500 // E1.31 "network data loss" time
+
+class UdpPixelReceiver {
+public:
+    struct Stats {
+        uint32_t packets = 0;
+        uint32_t frames = 0;
+        uint32_t lost = 0; // sequence gaps
+        uint32_t outOfOrder = 0; // late or duplicate, dropped
+        uint32_t malformed = 0;
+        uint32_t rejected = 0; // arrived while a scene owned the strip
+    };
+
+    UdpPixelReceiver(Lights& strip, SceneHandler& scenes)
+        : strip_(strip)
+        , scenes_(scenes)
+    {
+    }
+
+    void start() { startTask(TASK_UDP_PIXELS, &UdpPixelReceiver::taskEntry, this); }
+
+    const Stats& getStats() const { return stats_; }
+    const LatencyHistogram& getLatency() const { return latency_; }
+
+    void writeMetrics(PrometheusWriter& out) const
+    {
+        out.metric("nativity_live_packets_total", "counter", "UDP pixel packets received", stats_.packets);
+        out.metric("nativity_live_frames_total", "counter", "Live frames shown", stats_.frames);
+        out.family("nativity_live_dropped_packets_total", "counter", "UDP pixel packets not shown, by reason");
+        out.sample("nativity_live_dropped_packets_total", "reason", "lost", stats_.lost);
+        out.sample("nativity_live_dropped_packets_total", "reason", "out_of_order", stats_.outOfOrder);
+        out.sample("nativity_live_dropped_packets_total", "reason", "malformed", stats_.malformed);
+        out.sample("nativity_live_dropped_packets_total", "reason", "scene_playing", stats_.rejected);
+        out.family("nativity_live_latency_seconds", "summary", "First packet of a frame until the strip is sent");
+        out.sample("nativity_live_latency_seconds", "quantile", "0.5", latency_.percentile(0.5f) / 1e6f);
+        out.sample("nativity_live_latency_seconds", "quantile", "0.99", latency_.percentile(0.99f) / 1e6f);
+        out.sample("nativity_live_latency_seconds_sum", latency_.sum() / 1e6f);
+        out.sample("nativity_live_latency_seconds_count", latency_.count());
+    }
+
+private:
+    static constexpr const char* TAG = "UdpPixels";
+
+    static constexpr size_t DDP_HEADER = 10;
+    static constexpr size_t DDP_HEADER_TIMECODE = 14;
+    static constexpr uint8_t DDP_VERSION_MASK = 0xC0;
+    static constexpr uint8_t DDP_VERSION_1 = 0x40;
+    static constexpr uint8_t DDP_FLAG_TIMECODE = 0x10;
+    static constexpr uint8_t DDP_FLAG_QUERY = 0x08;
+    static constexpr uint8_t DDP_FLAG_PUSH = 0x01;
+
+    static constexpr size_t E131_HEADER = 126; // up to and including the DMX start code
+    static constexpr size_t E131_UNIVERSE_BYTES = 510; // 170 RGB pixels, the last 2 slots stay unused
+    static constexpr uint8_t E131_OPTION_PREVIEW = 0x80;
+    static constexpr uint8_t E131_OPTION_TERMINATED = 0x40;
+
+    Lights& strip_;
+    SceneHandler& scenes_;
+    Stats stats_;
+    LatencyHistogram latency_;
+    int ddpSocket_ = -1;
+    int e131Socket_ = -1;
+    int64_t lastPacketUs_ = 0;
+    int64_t frameStartUs_ = 0; // 0: no packet of the current frame yet
+    uint8_t lastDdpSequence_ = 0;
+    std::array<int, E131_MAX_UNIVERSES> lastE131Sequence_ {};
+
+    static void taskEntry(void* param) { static_cast<UdpPixelReceiver*>(param)->task(); }
+
+    void task()
+    {
+        lastE131Sequence_.fill(-1);
+        ddpSocket_ = openSocket(DDP_PORT);
+        e131Socket_ = openSocket(E131_PORT);
+        ESP_LOGI(TAG, "Listening for DDP on %d and E1.31 on %d", DDP_PORT, E131_PORT);
+        while (true) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(ddpSocket_, &fds);
+            FD_SET(e131Socket_, &fds);
+            timeval timeout = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+            int ready = select(std::max(ddpSocket_, e131Socket_) + 1, &fds, nullptr, nullptr, &timeout);
+            if (ready > 0 && FD_ISSET(ddpSocket_, &fds))
+                receiveDdp();
+            if (ready > 0 && FD_ISSET(e131Socket_, &fds))
+                receiveE131();
+            if (scenes_.isLive() && esp_timer_get_time() - lastPacketUs_ > LIVE_TIMEOUT_MS * 1000LL) {
+                ESP_LOGI(TAG, "Stream timed out");
+                endStream();
+            }
+        }
+    }
+
+    static int openSocket(uint16_t port)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (sock < 0 || bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            ESP_LOGE(TAG, "Can't listen on UDP port %d", port);
+        return sock;
+    }
+
+    // Reads (and drops) the datagram that was only peeked at
+    static void discard(int sock)
+    {
+        uint8_t byte;
+        recv(sock, &byte, 1, 0);
+    }
+
+    // Scatters header and payload of the next datagram; returns the payload bytes that landed in the buffer
+    static int receiveInto(int sock, uint8_t* header, size_t headerLen, uint8_t* dest, size_t destLen)
+    {
+        iovec iov[2] = { { header, headerLen }, { dest, destLen } };
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = destLen > 0 ? 2 : 1;
+        int n = recvmsg(sock, &msg, 0);
+        return n > static_cast<int>(headerLen) ? n - static_cast<int>(headerLen) : 0;
+    }
+
+    // The first packet after a silence (or after a scene) takes the strip. Holds it until releaseStrip().
+    bool takeStrip()
+    {
+        if (scenes_.beginLiveWrite())
+            return true;
+        stats_.rejected++;
+        return false;
+    }
+
+    void releaseStrip() { scenes_.endLiveWrite(); }
+
+    void endStream()
+    {
+        frameStartUs_ = 0;
+        lastDdpSequence_ = 0;
+        lastE131Sequence_.fill(-1);
+        scenes_.exitLiveMode();
+    }
+
+    void packetArrived(int64_t now)
+    {
+        stats_.packets++;
+        lastPacketUs_ = now;
+        if (frameStartUs_ == 0)
+            frameStartUs_ = now;
+    }
+
+    void show(size_t fromByte, size_t bytes)
+    {
+        strip_.commitPixels(fromByte / 3, (fromByte % 3 + bytes + 2) / 3);
+    }
+
+    void present()
+    {
+        strip_.refresh();
+        latency_.record(esp_timer_get_time() - frameStartUs_);
+        frameStartUs_ = 0;
+        stats_.frames++;
+    }
+
+    void receiveDdp()
+    {
+        uint8_t header[DDP_HEADER_TIMECODE];
+        int n = recv(ddpSocket_, header, sizeof(header), MSG_PEEK);
+        int64_t now = esp_timer_get_time();
+        if (n < static_cast<int>(DDP_HEADER) || (header[0] & DDP_VERSION_MASK) != DDP_VERSION_1) {
+            stats_.malformed++;
+            discard(ddpSocket_);
+            return;
+        }
+        size_t headerLen = (header[0] & DDP_FLAG_TIMECODE) ? DDP_HEADER_TIMECODE : DDP_HEADER;
+        if ((header[0] & DDP_FLAG_QUERY) || n < static_cast<int>(headerLen)) {
+            discard(ddpSocket_);
+            return;
+        }
+
+        // 4 bit sequence, 1..15 wrapping, 0 = sender doesn't number its packets
+        uint8_t sequence = header[1] & 0x0F;
+        if (sequence != 0 && lastDdpSequence_ != 0) {
+            int skipped = (sequence - (lastDdpSequence_ % 15 + 1) + 15) % 15;
+            if (skipped > 7) { // behind the last one: late or duplicate
+                stats_.outOfOrder++;
+                discard(ddpSocket_);
+                return;
+            }
+            stats_.lost += skipped;
+        }
+        lastDdpSequence_ = sequence;
+        if (!takeStrip()) {
+            discard(ddpSocket_);
+            return;
+        }
+        packetArrived(now);
+
+        // Payload type is taken to be RGB888, what every DDP sender uses for pixel strips
+        uint32_t offset = (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+        uint16_t length = (header[8] << 8) | header[9];
+        size_t bufferSize = strip_.numLEDs * 3;
+        size_t start = std::min<size_t>(offset, bufferSize);
+        size_t count = std::min<size_t>(length, bufferSize - start);
+        int received = receiveInto(ddpSocket_, header, headerLen, strip_.pixelBuffer() + start, count);
+        show(start, received);
+        if (header[0] & DDP_FLAG_PUSH)
+            present();
+        releaseStrip();
+    }
+
+    void receiveE131()
+    {
+        uint8_t header[E131_HEADER];
+        int n = recv(e131Socket_, header, sizeof(header), MSG_PEEK);
+        int64_t now = esp_timer_get_time();
+        static const uint8_t acnId[] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+        if (n < static_cast<int>(E131_HEADER) || memcmp(header + 4, acnId, sizeof(acnId)) != 0) {
+            stats_.malformed++;
+            discard(e131Socket_);
+            return;
+        }
+        // Only DMX data packets: root vector 4, framing vector 2, DMP vector 2, start code 0. Sync and discovery
+        // packets are ignored.
+        bool data = header[21] == 0x04 && header[43] == 0x02 && header[117] == 0x02 && header[125] == 0x00;
+        uint8_t options = header[112];
+        if (!data || (options & E131_OPTION_PREVIEW)) {
+            discard(e131Socket_);
+            return;
+        }
+        if (options & E131_OPTION_TERMINATED) {
+            discard(e131Socket_);
+            ESP_LOGI(TAG, "Stream terminated by sender");
+            endStream();
+            return;
+        }
+
+        int universe = ((header[113] << 8) | header[114]) - E131_FIRST_UNIVERSE;
+        size_t bufferSize = strip_.numLEDs * 3;
+        int universes = std::min<int>((bufferSize + E131_UNIVERSE_BYTES - 1) / E131_UNIVERSE_BYTES, E131_MAX_UNIVERSES);
+        if (universe < 0 || universe >= universes) {
+            discard(e131Socket_);
+            return;
+        }
+
+        // Per universe 8 bit sequence, a packet up to 20 behind the last one is late (E1.31 6.7.2)
+        int& last = lastE131Sequence_[universe];
+        if (last >= 0) {
+            int8_t diff = static_cast<int8_t>(header[111] - last);
+            if (diff <= 0 && diff > -20) {
+                stats_.outOfOrder++;
+                discard(e131Socket_);
+                return;
+            }
+            if (diff > 1)
+                stats_.lost += diff - 1;
+        }
+        last = header[111];
+        if (!takeStrip()) {
+            discard(e131Socket_);
+            return;
+        }
+        packetArrived(now);
+
+        uint16_t slots = ((header[123] << 8) | header[124]) - 1; // property count includes the start code
+        size_t start = universe * E131_UNIVERSE_BYTES;
+        size_t count = std::min<size_t>({ slots, E131_UNIVERSE_BYTES, bufferSize - start });
+        int received = receiveInto(e131Socket_, header, E131_HEADER, strip_.pixelBuffer() + start, count);
+        show(start, received);
+        if (universe == universes - 1)
+            present();
+        releaseStrip();
+    }
+};
+
+#endif // UDP_PIXELS_HPP
@@ -1,36 +1,210 @@
 #ifndef WEB_SERVER_HPP
 #define WEB_SERVER_HPP
+#include "../diagnostics/alloc_counter.hpp"
+#include "../diagnostics/latency_probes.hpp"
+#include "../diagnostics/metrics.hpp"
+#include "../scenes/command_dispatcher.hpp"
 #include "../scenes/scene_handler.hpp"
+#include "../task_plan.hpp"
+#include "json_writer.hpp"
+#include "prometheus_writer.hpp"
+#include "static_assets.hpp"
+#include "strip_preview.hpp"
+#include "trace_export.hpp"
+#include <atomic>
 #include <esp_http_server.h>
 #include <esp_log.h>
-#include <sstream>
-#include <string>
+#include <memory>
+#include <unistd.h>
 
 class WebServer {
 public:
-    explicit WebServer(SceneHandler* handler)
+    WebServer(SceneHandler* handler, CommandDispatcher* commands, Lights* strip = nullptr, Metrics* metrics = nullptr,
+        Motors* motors = nullptr)
         : handler_(handler)
+        , commands_(commands)
         , server_(nullptr)
+        , preview_(strip ? std::make_unique<StripPreview>(*strip) : nullptr)
+        , metrics_(metrics)
+        , motors_(motors)
     {
     }
 
     void start()
     {
         httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+        // Every open page keeps its status socket, make room for a crowd and evict the idlest when full
+        config.max_open_sockets = CONFIG_LWIP_MAX_SOCKETS - 3;
+        config.lru_purge_enable = true;
+        config.max_uri_handlers = 24;
+        config.task_priority = TASK_HTTPD.priority;
+        config.stack_size = TASK_HTTPD.stackBytes;
+        config.core_id = TASK_HTTPD.core;
+        config.global_user_ctx = this;
+        config.global_user_ctx_free_fn = [](void*) { }; // we own ourselves, don't let httpd free() us
+        config.close_fn = &WebServer::close_handler;
         if (httpd_start(&server_, &config) == ESP_OK) {
-            register_uri("/", HTTP_GET, &WebServer::index_handler);
-            register_uri("/play", HTTP_POST, &WebServer::play_handler);
-            register_uri("/stop", HTTP_POST, &WebServer::stop_handler);
-            register_uri("/playcounts", HTTP_GET, &WebServer::playcounts_handler);
-            register_uri("/status", HTTP_GET, &WebServer::status_handler);
+            size_t numAssets;
+            StaticAsset* assets = staticAssets(numAssets);
+            for (size_t i = 0; i < numAssets; ++i) {
+                httpd_uri_t asset = {
+                    .uri = assets[i].uri, .method = HTTP_GET, .handler = &WebServer::asset_handler, .user_ctx = &assets[i]
+                };
+                httpd_register_uri_handler(server_, &asset);
+            }
+            register_uri("/play", HTTP_POST, &counted<&WebServer::play_handler>);
+            register_uri("/stop", HTTP_POST, &counted<&WebServer::stop_handler>);
+            register_uri("/commands", HTTP_GET, &counted<&WebServer::commands_handler>);
+            register_uri("/playcounts", HTTP_GET, &counted<&WebServer::playcounts_handler>);
+            register_uri("/status", HTTP_GET, &counted<&WebServer::status_handler>);
+            register_uri("/outputs", HTTP_GET, &counted<&WebServer::outputs_handler>);
+            register_uri("/allocs", HTTP_GET, &WebServer::allocs_handler);
+            if (motors_) {
+                register_uri("/motors", HTTP_GET, &counted<&WebServer::motors_handler>);
+                register_uri("/motors/stop", HTTP_POST, &counted<&WebServer::motor_stop_handler>);
+            }
+            if (metrics_) {
+                register_uri("/metrics", HTTP_GET, &counted<&WebServer::metrics_handler>);
+                register_uri("/latency", HTTP_GET, &counted<&WebServer::latency_handler>);
+                register_uri("/latency/reset", HTTP_POST, &counted<&WebServer::latency_reset_handler>);
+            }
+#if CONFIG_NATIVITY_TRACE
+            register_uri("/trace", HTTP_GET, &WebServer::trace_handler);
+#endif
+            register_ws("/ws", &WebServer::ws_handler);
+            if (preview_) {
+                preview_->attach(server_);
+                register_ws("/ws/strip", &WebServer::strip_ws_handler);
+            }
+            handler_->addStateListener([this] { broadcastState(); });
             ESP_LOGI("webserver", "Webserver started");
         }
     }
 
 private:
     SceneHandler* handler_;
+    CommandDispatcher* commands_;
     httpd_handle_t server_;
+    std::atomic<bool> broadcastQueued_ { false };
+    std::unique_ptr<StripPreview> preview_;
+    AllocStats allocStats_;
+    Metrics* metrics_;
+    Motors* motors_;
+
+    // Counts the heap allocations a handler makes while serving one request, and traces it
+    template <esp_err_t (*Handler)(httpd_req_t*)> static esp_err_t counted(httpd_req_t* req)
+    {
+        TraceScope trace(TraceId::Http, static_cast<uint16_t>(req->method));
+        AllocScope scope;
+        esp_err_t result = Handler(req);
+        static_cast<WebServer*>(req->user_ctx)->allocStats_.record(scope.allocations());
+        return result;
+    }
+
+    static void close_handler(httpd_handle_t server, int fd)
+    {
+        auto* self = static_cast<WebServer*>(httpd_get_global_user_ctx(server));
+        if (self->preview_)
+            self->preview_->unsubscribe(fd);
+        close(fd);
+    }
+
+    static esp_err_t strip_ws_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        if (req->method == HTTP_GET) {
+            self->preview_->subscribe(httpd_req_to_sockfd(req));
+            return ESP_OK;
+        }
+        return drain_ws_frame(req);
+    }
+
+    // State changes are pushed to every open page over /ws instead of each page polling. The message is built
+    // once per change (in the httpd task, so several quick changes collapse into one) and fanned out.
+    void broadcastState()
+    {
+        if (!server_ || broadcastQueued_.exchange(true))
+            return;
+        if (httpd_queue_work(server_, &WebServer::broadcastWork, this) != ESP_OK)
+            broadcastQueued_ = false;
+    }
+
+    static void broadcastWork(void* arg)
+    {
+        auto* self = static_cast<WebServer*>(arg);
+        self->broadcastQueued_ = false;
+
+        char message[128];
+        size_t len = self->stateMessage(message, sizeof(message));
+        httpd_ws_frame_t frame = {};
+        frame.type = HTTPD_WS_TYPE_TEXT;
+        frame.payload = reinterpret_cast<uint8_t*>(message);
+        frame.len = len;
+
+        size_t fds = CONFIG_LWIP_MAX_SOCKETS;
+        int clients[CONFIG_LWIP_MAX_SOCKETS];
+        if (httpd_get_client_list(self->server_, &fds, clients) != ESP_OK)
+            return;
+        for (size_t i = 0; i < fds; ++i) {
+            // The binary /ws/strip sockets only take preview frames
+            if (self->preview_ && self->preview_->isSubscribed(clients[i]))
+                continue;
+            if (httpd_ws_get_fd_info(self->server_, clients[i]) == HTTPD_WS_CLIENT_WEBSOCKET) {
+                httpd_ws_send_frame_async(self->server_, clients[i], &frame);
+            }
+        }
+    }
+
+    // {"playing":true,"currentScene":1,"live":false,"playCounts":[3,5,2]}
+    size_t stateMessage(char* buf, size_t size) const
+    {
+        bool playing = handler_->isScenePlaying();
+        JsonWriter json(buf, size);
+        json.beginObject();
+        json.field("playing", playing);
+        json.field("currentScene", playing ? handler_->getCurrentScene() : -1);
+        json.field("live", handler_->isLive());
+        json.key("playCounts");
+        writePlayCounts(json);
+        json.endObject();
+        return json.length();
+    }
+
+    void writePlayCounts(JsonWriter& json) const
+    {
+        json.beginArray();
+        for (int i = 0; i < handler_->nScenes(); ++i) {
+            json.value(handler_->getPlayCount(i));
+        }
+        json.endArray();
+    }
+
+    static esp_err_t ws_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        if (req->method == HTTP_GET) {
+            // Handshake done, bring the new page up to date
+            self->broadcastState();
+            return ESP_OK;
+        }
+        return drain_ws_frame(req);
+    }
+
+    // Pages don't send anything meaningful, just read and drop the frame
+    static esp_err_t drain_ws_frame(httpd_req_t* req)
+    {
+        uint8_t buf[32];
+        httpd_ws_frame_t frame = {};
+        frame.payload = buf;
+        if (httpd_ws_recv_frame(req, &frame, 0) != ESP_OK)
+            return ESP_FAIL;
+        if (frame.len > sizeof(buf))
+            return ESP_FAIL;
+        return frame.len > 0 ? httpd_ws_recv_frame(req, &frame, frame.len) : ESP_OK;
+    }
 
+    // Mutating endpoints only queue a command and answer 202 with its id, the httpd task never waits for a scene.
+    // Progress: GET /commands?id=<id>, or the state pushed over /ws.
     static esp_err_t play_handler(httpd_req_t* req)
     {
         auto* self = static_cast<WebServer*>(req->user_ctx);
@@ -42,60 +216,232 @@ private:
                 scene = atoi(param);
             }
         }
-        if (scene >= 0 && scene < self->handler_->nScenes()) {
-            self->handler_->playScene(scene);
-            httpd_resp_sendstr(req, "OK");
-        } else {
+        if (scene < 0 || scene >= self->handler_->nScenes()) {
             httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid scene");
+            return ESP_OK;
         }
-        return ESP_OK;
+        return self->accepted(req, CommandType::Play, self->commands_->submit(CommandType::Play, scene));
     }
 
     static esp_err_t stop_handler(httpd_req_t* req)
     {
         auto* self = static_cast<WebServer*>(req->user_ctx);
-        self->handler_->stopScene();
-        httpd_resp_sendstr(req, "Stopped");
-        return ESP_OK;
+        return self->accepted(req, CommandType::Stop, self->commands_->submit(CommandType::Stop));
     }
 
-    static esp_err_t playcounts_handler(httpd_req_t* req)
+    // Calibration: POST /motors/stop?motor=2&us=1482 with no scene playing, until the motor stands still. The new
+    // stop point drives the motor right away and is kept in NVS. Fails while a scene plays.
+    static esp_err_t motor_stop_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char query[32];
+        int motor = -1;
+        uint32_t stopUs = 0;
+        if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+            char param[8];
+            if (httpd_query_key_value(query, "motor", param, sizeof(param)) == ESP_OK)
+                motor = atoi(param);
+            if (httpd_query_key_value(query, "us", param, sizeof(param)) == ESP_OK)
+                stopUs = strtoul(param, nullptr, 10);
+        }
+        if (motor < 0 || motor >= Motors::count() || !Motors::isValidStopPoint(stopUs)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid motor or stop point");
+            return ESP_OK;
+        }
+        return self->accepted(
+            req, CommandType::MotorStop, self->commands_->submit(CommandType::MotorStop, motorStopArg(motor, stopUs)));
+    }
+
+    // [{"stopUs":1455,"speed":0},...] in motor order
+    static esp_err_t motors_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char buf[128];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginArray();
+        for (int i = 0; i < Motors::count(); ++i) {
+            Motor& motor = self->motors_->getMotor(i);
+            json.beginObject();
+            json.field("stopUs", motor.getStopPoint());
+            json.field("speed", motor.getSpeed());
+            json.endObject();
+        }
+        json.endArray();
+        return json.finish();
+    }
+
+    // {"id":12,"command":"play","state":"queued"} with Location: /commands?id=12
+    esp_err_t accepted(httpd_req_t* req, CommandType type, uint32_t id)
+    {
+        if (id == 0) {
+            httpd_resp_set_status(req, "503 Service Unavailable");
+            httpd_resp_set_hdr(req, "Retry-After", "1");
+            return httpd_resp_sendstr(req, "Busy");
+        }
+        char location[32];
+        snprintf(location, sizeof(location), "/commands?id=%lu", static_cast<unsigned long>(id));
+        httpd_resp_set_status(req, "202 Accepted");
+        httpd_resp_set_hdr(req, "Location", location);
+        CommandState state = CommandState::Queued;
+        commands_->lookup(id, type, state);
+        return writeCommand(req, id, type, state);
+    }
+
+    static esp_err_t commands_handler(httpd_req_t* req)
     {
         auto* self = static_cast<WebServer*>(req->user_ctx);
-        std::stringstream ss;
-        ss << "[";
-        for (int i = 0; i < self->handler_->nScenes(); ++i) {
-            if (i > 0)
-                ss << ",";
-            ss << self->handler_->getPlayCount(i);
+        char query[32];
+        char param[12];
+        uint32_t id = 0;
+        if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK
+            && httpd_query_key_value(query, "id", param, sizeof(param)) == ESP_OK) {
+            id = strtoul(param, nullptr, 10);
         }
-        ss << "]";
-        std::string json = ss.str();
-        httpd_resp_set_type(req, "application/json");
-        httpd_resp_send(req, json.c_str(), json.length());
-        return ESP_OK;
+        CommandType type;
+        CommandState state;
+        if (!self->commands_->lookup(id, type, state)) {
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown command");
+            return ESP_OK;
+        }
+        return writeCommand(req, id, type, state);
+    }
+
+    static esp_err_t writeCommand(httpd_req_t* req, uint32_t id, CommandType type, CommandState state)
+    {
+        char buf[64];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginObject();
+        json.field("id", id);
+        json.field("command", CommandDispatcher::name(type));
+        json.field("state", CommandDispatcher::name(state));
+        json.endObject();
+        return json.finish();
+    }
+
+    static esp_err_t playcounts_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char buf[64];
+        JsonWriter json(buf, sizeof(buf), req);
+        self->writePlayCounts(json);
+        return json.finish();
     }
 
     static esp_err_t status_handler(httpd_req_t* req)
     {
         auto* self = static_cast<WebServer*>(req->user_ctx);
-        std::stringstream ss;
-        ss << "{";
-        ss << "\"playing\":" << (self->handler_->isScenePlaying() ? "true" : "false") << ",";
-        ss << "\"currentScene\":"
-           << (self->handler_->isScenePlaying() ? std::to_string(self->handler_->getCurrentScene()) : "-1");
-        ss << "}";
-        std::string json = ss.str();
-        httpd_resp_set_type(req, "application/json");
-        httpd_resp_send(req, json.c_str(), json.length());
-        return ESP_OK;
+        bool playing = self->handler_->isScenePlaying();
+        char buf[64];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginObject();
+        json.field("playing", playing);
+        json.field("currentScene", playing ? self->handler_->getCurrentScene() : -1);
+        json.endObject();
+        return json.finish();
+    }
+
+    // Performed vs skipped (unchanged value) writes per actuator output
+    static esp_err_t outputs_handler(httpd_req_t* req)
+    {
+        const OutputStats& stats = outputStats();
+        auto counter = [](JsonWriter& json, const char* name, const WriteCounter& c) {
+            json.key(name).beginObject();
+            json.field("performed", c.performed.load());
+            json.field("skipped", c.skipped.load());
+            json.endObject();
+        };
+        char buf[256];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginObject();
+        counter(json, "ledcDuty", stats.ledcDuty);
+        counter(json, "pixels", stats.pixels);
+        counter(json, "stripRefresh", stats.stripRefresh);
+        counter(json, "dfplayer", stats.dfplayer);
+        json.endObject();
+        return json.finish();
+    }
+
+    // Heap allocations made by the request handlers above, plus everything allocated since boot
+    static esp_err_t allocs_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char buf[128];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginObject();
+        json.field("requests", self->allocStats_.requests.load());
+        json.field("allocations", self->allocStats_.allocations.load());
+        json.field("maxPerRequest", self->allocStats_.maxPerRequest.load());
+        json.field("totalSinceBoot", alloc_counter::totalAllocations.load());
+        json.endObject();
+        return json.finish();
+    }
+
+    // p50/p95/p99 and max in us of the probes in latency_probes.hpp, {"buttonToFrame":{"count":..,"p50":..},..}
+    static esp_err_t latency_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char buf[512];
+        JsonWriter json(buf, sizeof(buf), req);
+        json.beginObject();
+        for (size_t i = 0; i < LatencyProbes::COUNT; ++i) {
+            auto probe = static_cast<LatencyProbe>(i);
+            json.key(LatencyProbes::name(probe));
+            self->metrics_->writeLatency(json, probe);
+        }
+        json.endObject();
+        return json.finish();
+    }
+
+    static esp_err_t latency_reset_handler(httpd_req_t* req)
+    {
+        LatencyProbes::instance().reset();
+        httpd_resp_set_status(req, "204 No Content");
+        return httpd_resp_send(req, nullptr, 0);
+    }
+
+    // Prometheus scrape target, streamed out in chunks
+    static esp_err_t metrics_handler(httpd_req_t* req)
+    {
+        auto* self = static_cast<WebServer*>(req->user_ctx);
+        char buf[512];
+        PrometheusWriter out(buf, sizeof(buf), req);
+        self->metrics_->write(out);
+        out.metric("nativity_http_requests_total", "counter", "Requests served by the counted handlers",
+            self->allocStats_.requests.load());
+        out.metric("nativity_http_request_allocations_max", "gauge", "Most heap allocations made by one request",
+            self->allocStats_.maxPerRequest.load());
+        return out.finish();
+    }
+
+#if CONFIG_NATIVITY_TRACE
+    // Chrome trace of the last seconds, or with ?snapshot=1 the one frozen at the last frame overrun (downloading
+    // it re-arms the trigger). Open in ui.perfetto.dev.
+    static esp_err_t trace_handler(httpd_req_t* req)
+    {
+        char query[32];
+        char param[4];
+        bool snapshot = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK
+            && httpd_query_key_value(query, "snapshot", param, sizeof(param)) == ESP_OK && param[0] == '1';
+        TraceRecorder& trace = TraceRecorder::instance();
+        if (snapshot && !trace.hasSnapshot()) {
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No overrun since the last snapshot");
+            return ESP_OK;
+        }
+        // The headers go out with the first chunk
+        httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"nativity-trace.json\"");
+        char buf[768];
+        JsonWriter json(buf, sizeof(buf), req);
+        writeChromeTrace(json, snapshot);
+        esp_err_t result = json.finish();
+        if (snapshot)
+            trace.rearm();
+        return result;
     }
+#endif
 
-    static esp_err_t index_handler(httpd_req_t* req)
+    static esp_err_t asset_handler(httpd_req_t* req)
     {
-        httpd_resp_set_type(req, "text/html");
-        httpd_resp_send(req, index_html, HTTPD_RESP_USE_STRLEN);
-        return ESP_OK;
+        return sendStaticAsset(req, *static_cast<const StaticAsset*>(req->user_ctx));
     }
 
     void register_uri(const char* uri, httpd_method_t method, esp_err_t (*handler)(httpd_req_t*))
@@ -104,55 +450,12 @@ private:
         httpd_register_uri_handler(server_, &config);
     }
 
-    static constexpr const char* index_html = R"rawliteral(
-<!DOCTYPE html>
-<html>
-<head>
-  <meta charset="utf-8">
-  <meta name="viewport" content="width=device-width,initial-scale=1">
-  <title>Kerststal 2025</title>
-  <style>
-    body { font-family:sans-serif; background:#fffbe6; margin:0; text-align:center; }
-    h1 { font-size:1.3em; margin:1em 0 0.5em 0; }
-    button {
-      width:90vw; max-width:340px; margin:0.7em auto; display:block;
-      font-size:1.3em; padding:1.2em 0; border-radius:1em; border:none;
-      background:#ffe082; color:#333; font-weight:bold;
-    }
-    button:last-of-type { background:#ffb3b3; color:#900; }
-    pre { background:#fff; border-radius:0.5em; padding:0.5em; font-size:1em; margin:1em auto; max-width:340px; }
-  </style>
-</head>
-<body>
-  <h1>Kerststal 2025 Scene Controller</h1>
-  <button onclick="fetch('/play?scene=0',{method:'POST'}).then(updateStatus)">Play Scene Zakske</button>
-  <button onclick="fetch('/play?scene=1',{method:'POST'}).then(updateStatus)">Play Scene Beuk</button>
-  <button onclick="fetch('/play?scene=2',{method:'POST'}).then(updateStatus)">Play Scene Herdertjes</button>
-  <button onclick="fetch('/stop',{method:'POST'}).then(updateStatus)">Stop Scene</button>
-  <pre id="status"></pre>
-  <script>
-    async function updateStatus() {
-      let res = await fetch('/status');
-      let json = await res.json();
-      document.getElementById('status').textContent = JSON.stringify(json, null, 2);
-    }
-    setInterval(updateStatus, 1000);
-    updateStatus();
-  </script>
-  <h2>Play Counts</h2>
-  <pre id="playcounts"></pre>
-  <script>
-    async function updatePlayCounts() {
-      let res = await fetch('/playcounts');
-      let json = await res.json();
-      document.getElementById('playcounts').textContent = JSON.stringify(json, null, 2);
-    }
-    setInterval(updatePlayCounts, 5000);
-    updatePlayCounts();
-  </script>
-</body>
-</html>
-)rawliteral";
+    void register_ws(const char* uri, esp_err_t (*handler)(httpd_req_t*))
+    {
+        httpd_uri_t config = { .uri = uri, .method = HTTP_GET, .handler = handler, .user_ctx = this };
+        config.is_websocket = true;
+        httpd_register_uri_handler(server_, &config);
+    }
 };
 
 #endif // WEB_SERVER_HPP
@@ -1,41 +1,75 @@
+#include "diagnostics/boot_report.hpp"
+#include "diagnostics/trace_recorder.hpp"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/event_groups.h"
 #include "nvs_flash.h"
 #include "sdkconfig.h"
+#include "static_alloc.hpp"
+#include <algorithm>
 
+static EventGroupStorage wifi_event_group_storage;
 static EventGroupHandle_t wifi_event_group;
 const int WIFI_CONNECTED_BIT = BIT0;
 
+// Reconnect backoff: 1s, 2s, 4s ... capped, reset once we get an IP
+static const int WIFI_BACKOFF_MIN_MS = 1000;
+static const int WIFI_BACKOFF_MAX_MS = 30 * 1000;
+static int wifi_backoff_ms = WIFI_BACKOFF_MIN_MS;
+static esp_timer_handle_t wifi_retry_timer;
+
 extern "C" void wifi_connect();
+extern "C" bool wifi_is_connected();
+extern "C" bool wifi_wait_connected(int timeout_ms);
+
+static void wifi_retry(void* arg) { esp_wifi_connect(); }
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        esp_wifi_connect();
         xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        TraceRecorder::instance().instant(TraceId::Wifi, 0);
+        ESP_LOGI("wifi", "Disconnected, retrying in %d ms", wifi_backoff_ms);
+        esp_timer_stop(wifi_retry_timer);
+        esp_timer_start_once(wifi_retry_timer, static_cast<uint64_t>(wifi_backoff_ms) * 1000);
+        wifi_backoff_ms = std::min(wifi_backoff_ms * 2, WIFI_BACKOFF_MAX_MS);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        auto* event = static_cast<ip_event_got_ip_t*>(event_data);
+        ESP_LOGI("wifi", "Connected to WiFi, IP Address: " IPSTR, IP2STR(&event->ip_info.ip));
+        wifi_backoff_ms = WIFI_BACKOFF_MIN_MS;
+        TraceRecorder::instance().instant(TraceId::Wifi, 1);
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        BootReport::instance().mark("wifi connected");
     }
 }
 
+// Starts Wi-Fi and returns right away, the connection (and any reconnect) happens in the background
 extern "C" void wifi_connect()
 {
-    nvs_flash_init();
-    wifi_event_group = xEventGroupCreate();
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        nvs_flash_erase();
+        nvs_flash_init();
+    }
+    wifi_event_group = wifi_event_group_storage.create("wifi events");
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
 
+    esp_timer_create_args_t retry_args = {};
+    retry_args.callback = &wifi_retry;
+    retry_args.name = "wifi_retry";
+    ESP_ERROR_CHECK(esp_timer_create(&retry_args, &wifi_retry_timer));
+
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     cfg.nvs_enable = 0; // Disable NVS usage for WiFi
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     wifi_config_t wifi_config = {};
-    cfg.nvs_enable = 0; // Disable NVS usage for WiFi
     strcpy((char*)wifi_config.sta.ssid, WIFI_SSID);
     strcpy((char*)wifi_config.sta.password, WIFI_PASS);
 
@@ -47,15 +81,16 @@ extern "C" void wifi_connect()
     ESP_ERROR_CHECK(esp_wifi_start());
 
     ESP_LOGI("wifi", "Connecting to WiFi SSID:%s", WIFI_SSID);
+}
 
-    // Wait for connection
-    xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
-    ESP_LOGI("wifi", "Connected to WiFi");
-    esp_netif_ip_info_t ip_info;
-    esp_netif_t* sta_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-    if (sta_netif && esp_netif_get_ip_info(sta_netif, &ip_info) == ESP_OK) {
-        ESP_LOGI("wifi", "IP Address: " IPSTR, IP2STR(&ip_info.ip));
-    } else {
-        ESP_LOGE("wifi", "Failed to obtain IP address");
-    }
+extern "C" bool wifi_is_connected()
+{
+    return wifi_event_group && (xEventGroupGetBits(wifi_event_group) & WIFI_CONNECTED_BIT);
+}
+
+extern "C" bool wifi_wait_connected(int timeout_ms)
+{
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+        timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms));
+    return bits & WIFI_CONNECTED_BIT;
 }
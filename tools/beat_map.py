@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""Finds the beats in the tracks on the DFPlayer's SD card and writes them as main/actuators/beat_maps.hpp, for
+the beat effects in Lights to lock to (see main/actuators/beat_clock.hpp).
+
+Per track: an onset envelope (rises in the energy of a low band, kicks and bass, and of the rest, 5 ms steps),
+the tempo from its autocorrelation, then the beats by dynamic programming (Ellis, "Beat Tracking by Dynamic
+Programming", 2007): on strong onsets, and as evenly spaced as the tempo says. Every beat keeps the strength of
+its onset as accent. Only the standard library is needed; MP3s are decoded with ffmpeg, WAVs are read directly.
+
+The track number is the one the DFPlayer plays, from the file name (0002.mp3 or 0002_beuk.mp3 is track 2) or
+given as N=path:
+
+    tools/beat_map.py /media/sd/mp3/0001.mp3 /media/sd/mp3/0002.mp3 /media/sd/mp3/0003.mp3
+    tools/beat_map.py 2=beuk.wav --offset-ms 40 --min-bpm 90 --max-bpm 160
+
+--offset-ms moves every beat later, for the time the player takes from acknowledging a track to sounding it.
+Without tracks it writes an empty table: the effects then keep their fixed pulse.
+"""
+import argparse
+import math
+import os
+import re
+import struct
+import subprocess
+import sys
+import wave
+
+UNIT_MS = 5  # BEAT_MAP_UNIT_MS
+RATE = 11025  # what ffmpeg decodes to; WAVs are read at their own rate
+BASS_HZ = 150
+OUTPUT = os.path.join(os.path.dirname(__file__), "..", "main", "actuators", "beat_maps.hpp")
+
+
+def read_audio(path):
+    """(mono samples in -1..1, sample rate)"""
+    if path.lower().endswith(".wav"):
+        with wave.open(path) as w:
+            width, channels, rate = w.getsampwidth(), w.getnchannels(), w.getframerate()
+            raw = w.readframes(w.getnframes())
+        if width != 2:
+            sys.exit(f"{path}: only 16-bit WAVs, convert it with ffmpeg first")
+    else:
+        try:
+            raw = subprocess.run(["ffmpeg", "-v", "error", "-i", path, "-ac", "1", "-ar", str(RATE), "-f", "s16le",
+                "-"], check=True, capture_output=True).stdout
+        except FileNotFoundError:
+            sys.exit(f"{path}: decoding needs ffmpeg on the PATH (or give a WAV)")
+        channels, rate = 1, RATE
+    values = struct.unpack(f"<{len(raw) // 2}h", raw[: len(raw) // 2 * 2])
+    if channels > 1:
+        values = [sum(values[i : i + channels]) / channels for i in range(0, len(values) - channels + 1, channels)]
+    return [v / 32768 for v in values], rate
+
+
+def onset_envelope(samples, rate):
+    """(positive energy changes per step of about UNIT_MS, bass and the rest, over their deviation; loudness per
+    step; step in ms)"""
+    hop = max(1, round(rate * UNIT_MS / 1000))
+    step_ms = hop * 1000 / rate
+    k = 1 - math.exp(-2 * math.pi * BASS_HZ / rate)  # one-pole low-pass
+    low = 0.0
+    bands = []
+    for start in range(0, len(samples) - hop + 1, hop):
+        e_low = e_high = 0.0
+        for x in samples[start : start + hop]:
+            low += k * (x - low)
+            e_low += low * low
+            e_high += (x - low) * (x - low)
+        bands.append((math.log1p(1000 * e_low), math.log1p(1000 * e_high)))
+    loudness = [l + h for l, h in bands]
+    flux = [0.0]
+    for (l0, h0), (l1, h1) in zip(bands, bands[1:]):
+        flux.append(max(0.0, l1 - l0) + 0.5 * max(0.0, h1 - h0))
+    # Minus the local mean (a quarter second either side), so only the onsets stand out
+    window = round(250 / step_ms)
+    prefix = [0.0]
+    for f in flux:
+        prefix.append(prefix[-1] + f)
+    env = []
+    for i, f in enumerate(flux):
+        lo, hi = max(0, i - window), min(len(flux), i + window + 1)
+        env.append(max(0.0, f - (prefix[hi] - prefix[lo]) / (hi - lo)))
+    mean = sum(env) / max(1, len(env))
+    deviation = math.sqrt(sum((e - mean) ** 2 for e in env) / max(1, len(env))) or 1.0
+    return [e / deviation for e in env], loudness, step_ms
+
+
+def tempo(env, step_ms, min_bpm, max_bpm):
+    """Beat period in steps: the autocorrelation peak, weighted towards 120 bpm like people tap"""
+    steps_per_minute = 60000 / step_ms
+    best, best_lag = -1.0, None
+    scores = {}
+    for lag in range(int(steps_per_minute / max_bpm), int(steps_per_minute / min_bpm) + 1):
+        ac = sum(a * b for a, b in zip(env, env[lag:])) / (len(env) - lag)
+        weight = math.exp(-0.5 * (math.log2(lag / (steps_per_minute / 120)) / 1.0) ** 2)
+        scores[lag] = ac * weight
+        if scores[lag] > best:
+            best, best_lag = scores[lag], lag
+    if best_lag is None:
+        sys.exit("track too short to find a tempo")
+    # Between two lags: parabola through the peak and its neighbours
+    a, b, c = scores.get(best_lag - 1, best), best, scores.get(best_lag + 1, best)
+    shift = 0.5 * (a - c) / (a - 2 * b + c) if a - 2 * b + c != 0 else 0.0
+    return best_lag + max(-0.5, min(0.5, shift))
+
+
+def track_beats(env, period, tightness=100.0):
+    """Steps of the beats: the path through the envelope with the most onset strength, penalising intervals away
+    from the period"""
+    n = len(env)
+    score = list(env)
+    back = [-1] * n
+    lo_gap, hi_gap = max(1, round(period / 2)), round(period * 2)
+    penalty = {gap: tightness * math.log(gap / period) ** 2 for gap in range(lo_gap, hi_gap + 1)}
+    for t in range(n):
+        best, best_prev = 0.0, -1
+        for gap in range(lo_gap, min(hi_gap, t) + 1):
+            s = score[t - gap] - penalty[gap]
+            if s > best:
+                best, best_prev = s, t - gap
+        score[t] = env[t] + best
+        back[t] = best_prev
+    # End on the best beat in the last period, then follow the links back
+    tail = range(max(0, n - round(period)), n)
+    t = max(tail, key=lambda i: score[i]) if n else -1
+    beats = []
+    while t >= 0:
+        beats.append(t)
+        t = back[t]
+    return beats[::-1]
+
+
+def beat_map(path, offset_ms, min_bpm, max_bpm):
+    samples, rate = read_audio(path)
+    env, loudness, step_ms = onset_envelope(samples, rate)
+    period = tempo(env, step_ms, min_bpm, max_bpm)
+    beats = track_beats(env, period)
+    # No beats in the silence before and after the music
+    floor = max(loudness, default=0) * 0.1
+    loud = [i for i, l in enumerate(loudness) if l > floor]
+    if loud:
+        beats = [b for b in beats if loud[0] - period / 2 <= b <= loud[-1] + period / 2]
+    strength = [max(env[max(0, b - 2) : b + 3]) for b in beats]
+    # Nor where the path just coasts on at the ends, with nothing on the beat
+    if strength:
+        weak = 0.2 * sorted(strength)[len(strength) // 2]
+        first = next(i for i, s in enumerate(strength) if s >= weak)
+        last = len(strength) - next(i for i, s in enumerate(reversed(strength)) if s >= weak)
+        beats, strength = beats[first:last], strength[first:last]
+    top = max(strength, default=0) or 1.0
+    units = [max(0, round((b * step_ms + offset_ms) / UNIT_MS)) for b in beats]
+    if units and units[-1] > 0xFFFF:
+        sys.exit(f"{path}: beats past {0xFFFF * UNIT_MS / 1000:.0f} s don't fit in a uint16_t, raise BEAT_MAP_UNIT_MS")
+    accents = [round(255 * s / top) for s in strength]
+    bpm = 60000 / (period * step_ms)
+    return units, accents, round(period * step_ms * 1000), bpm
+
+
+def track_number(arg):
+    """(track, path) from N=path or the leading digits of the file name"""
+    if "=" in arg and arg.split("=", 1)[0].isdigit():
+        track, path = arg.split("=", 1)
+        return int(track), path
+    match = re.match(r"(\d+)", os.path.basename(arg))
+    if not match:
+        sys.exit(f"{arg}: no track number in the file name, give it as N={arg}")
+    return int(match.group(1)), arg
+
+
+def wrapped(values, indent="    ", width=120):
+    lines, line = [], indent
+    for v in values:
+        item = f"{v}, "
+        if len(line) + len(item.rstrip()) > width:
+            lines.append(line.rstrip())
+            line = indent
+        line += item
+    if line.strip():
+        lines.append(line.rstrip())
+    return "\n".join(lines)
+
+
+def header(maps, command):
+    out = [
+        "// Beats of the DFPlayer tracks, generated by tools/beat_map.py. Don't edit, regenerate:",
+        f"//   {command}",
+        "#ifndef BEAT_MAPS_HPP",
+        "#define BEAT_MAPS_HPP",
+        "",
+        '#include "beat_clock.hpp"',
+        "#include <array>",
+        "",
+    ]
+    for track, name, (units, accents, period_us, bpm) in maps:
+        out += [
+            f"// {name}: {len(units)} beats, {bpm:.1f} bpm",
+            f"constexpr uint16_t TRACK_{track}_BEATS[] = {{",
+            wrapped(units),
+            "};",
+            f"constexpr uint8_t TRACK_{track}_ACCENTS[] = {{",
+            wrapped(accents),
+            "};",
+            "",
+        ]
+    out.append(f"constexpr std::array<BeatMap, {len(maps)}> BEAT_MAPS = {{ {{")
+    for track, _, (units, _, period_us, _) in maps:
+        out.append(f"    {{ {track}, {len(units)}, {period_us}, TRACK_{track}_BEATS, TRACK_{track}_ACCENTS }},")
+    out += [
+        "} };",
+        "",
+        "inline const BeatMap* beatMapFor(uint16_t track)",
+        "{",
+        "    for (const BeatMap& map : BEAT_MAPS) {",
+        "        if (map.track == track)",
+        "            return &map;",
+        "    }",
+        "    return nullptr;",
+        "}",
+        "",
+        "#endif // BEAT_MAPS_HPP",
+    ]
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("tracks", nargs="*", help="audio files, track number from the name or as N=path")
+    parser.add_argument("--offset-ms", type=float, default=0, help="move every beat this much later")
+    parser.add_argument("--min-bpm", type=float, default=70)
+    parser.add_argument("--max-bpm", type=float, default=180)
+    parser.add_argument("-o", "--output", default=OUTPUT, help="header to write, - for stdout")
+    args = parser.parse_args()
+
+    maps = []
+    for arg in args.tracks:
+        track, path = track_number(arg)
+        result = beat_map(path, args.offset_ms, args.min_bpm, args.max_bpm)
+        units, _, _, bpm = result
+        if not units:
+            sys.exit(f"{path}: no beats found")
+        print(f"track {track}: {len(units)} beats, {bpm:.1f} bpm, first at {units[0] * UNIT_MS} ms", file=sys.stderr)
+        maps.append((track, os.path.basename(path), result))
+    maps.sort()
+
+    command = " ".join(["tools/beat_map.py"] + [a if a.startswith("-") else os.path.basename(a) for a in sys.argv[1:]])
+    if not maps:
+        command += " <the tracks on the SD card>"
+    text = header(maps, command)
+    if args.output == "-":
+        sys.stdout.write(text)
+    else:
+        with open(args.output, "w") as f:
+            f.write(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
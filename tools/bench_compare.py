@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Compares two runs of the light effect benchmarks (main/diagnostics/effect_bench.hpp).
+
+Either run can be a console log of the controller with CONFIG_NATIVITY_BENCHMARK ("BENCH {json}" lines, cycles
+per frame) or the JSON of host/bench_effects --benchmark_out (nanoseconds). Cases are matched by name and LED
+count and cores (runs from before the RenderPool count as one core); the script prints the change of every metric and exits with 1 when any case got slower than --threshold.
+
+    tools/bench_compare.py before.log after.log
+    tools/bench_compare.py before.json after.json --metric p99 --threshold 5
+"""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """{(case, leds, cores): {metric: value}}"""
+    with open(path) as f:
+        text = f.read()
+    results = {}
+    if text.lstrip().startswith("{"):
+        for b in json.loads(text)["benchmarks"]:
+            if b.get("run_type", "iteration") != "iteration":
+                continue
+            case, leds, *cores = b["run_name"].split("/")
+            metrics = {m: b[m] for m in ("mean", "p50", "p99", "max") if m in b}
+            if not metrics:  # kernels: time per call
+                scale = {"ns": 1, "us": 1e3, "ms": 1e6, "s": 1e9}[b["time_unit"]]
+                metrics = {"mean": b["real_time"] * scale}
+            results[(case, int(leds), int(cores[0]) if cores else 1)] = metrics
+    else:
+        for line in text.splitlines():
+            start = line.find("BENCH {")
+            if start < 0:
+                continue
+            r = json.loads(line[start + len("BENCH "):])
+            results[(r["case"], r["leds"], r.get("cores", 1))] = {m: r[m] for m in ("mean", "p50", "p99", "max")}
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument("--metric", default="mean", choices=("mean", "p50", "p99", "max"),
+                        help="metric the threshold applies to (kernels only have mean)")
+    parser.add_argument("--threshold", type=float, default=10.0, help="percent slower that fails (default 10)")
+    args = parser.parse_args()
+
+    before, after = load(args.before), load(args.after)
+    slower = []
+    print(f"{'case':<24}{'leds':>6}{'cores':>6}{'before':>12}{'after':>12}{'change':>9}")
+    for key in sorted(before.keys() & after.keys()):
+        metric = args.metric if args.metric in before[key] and args.metric in after[key] else "mean"
+        old, new = before[key][metric], after[key][metric]
+        change = (new - old) / old * 100 if old else 0.0
+        flag = ""
+        if change > args.threshold:
+            slower.append(key)
+            flag = "  slower"
+        print(f"{key[0]:<24}{key[1]:>6}{key[2]:>6}{old:>12.0f}{new:>12.0f}{change:>+8.1f}%{flag}")
+    for key in sorted(before.keys() ^ after.keys()):
+        print(f"{key[0]:<24}{key[1]:>6}{key[2]:>6}  only in {'before' if key in before else 'after'}")
+
+    if slower:
+        print(f"{len(slower)} case(s) more than {args.threshold:g}% slower on {args.metric}")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Measures how much network load disturbs the show: a quiet phase, then a phase with parallel HTTP requests (and
+MQTT messages with --mqtt), each followed by a /metrics scrape. Prints per phase:
+
+- measured here, so it works against any firmware with /status and /metrics: the LED frame rate over the phase and
+  the round trip of a GET /status probe sent every --probe-ms next to the load (median, p99 and its spread)
+- reported by the device, '-' on firmware that doesn't export them yet: how late the show tasks woke up on average
+  (nativity_wait_late_seconds), their worst wake-up and the frame overruns
+
+Start a scene first so the strip is busy, and run it once per firmware to compare before and after a change:
+
+    tools/net_load.py 192.168.1.50
+    tools/net_load.py 192.168.1.50 --seconds 30 --http-workers 8 --mqtt 192.168.1.10 --mqtt-user u --mqtt-password p
+
+MQTT messages go to nativity/cmd/load, which the device receives and ignores.
+"""
+import argparse
+import math
+import socket
+import struct
+import threading
+import time
+import urllib.request
+
+HTTP_PATHS = ["/status", "/metrics", "/playcounts", "/"]
+
+
+def scrape(host):
+    values = {}
+    with urllib.request.urlopen(f"http://{host}/metrics", timeout=5) as response:
+        for line in response.read().decode().splitlines():
+            if line.startswith("#") or " " not in line:
+                continue
+            name, value = line.rsplit(" ", 1)
+            values[name] = float(value)
+    return values
+
+
+def http_worker(host, stop, counts):
+    i = 0
+    while not stop.is_set():
+        try:
+            with urllib.request.urlopen(f"http://{host}{HTTP_PATHS[i % len(HTTP_PATHS)]}", timeout=5) as response:
+                response.read()
+            counts["http"] += 1
+        except OSError:
+            counts["errors"] += 1
+        i += 1
+
+
+def prober(host, interval, stop, round_trips):
+    """Round trips of GET /status in ms, one every interval seconds"""
+    while not stop.is_set():
+        start = time.monotonic()
+        try:
+            with urllib.request.urlopen(f"http://{host}/status", timeout=5) as response:
+                response.read()
+            round_trips.append((time.monotonic() - start) * 1000)
+        except OSError:
+            pass
+        stop.wait(max(0.0, interval - (time.monotonic() - start)))
+
+
+def percentile(values, fraction):
+    if not values:
+        return math.nan
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def mqtt_string(s):
+    data = s.encode()
+    return struct.pack(">H", len(data)) + data
+
+
+def mqtt_packet(kind, body):
+    length = bytearray()
+    n = len(body)
+    while True:
+        byte, n = n % 128, n // 128
+        length.append(byte | (0x80 if n else 0))
+        if not n:
+            break
+    return bytes([kind]) + bytes(length) + body
+
+
+def mqtt_worker(broker, user, password, rate, stop, counts):
+    host, _, port = broker.partition(":")
+    with socket.create_connection((host, int(port or 1883)), timeout=5) as sock:
+        flags = 0x02 | (0x80 if user else 0) | (0x40 if password else 0)  # clean session
+        body = mqtt_string("MQTT") + bytes([4, flags]) + struct.pack(">H", 60) + mqtt_string("nativity-load")
+        if user:
+            body += mqtt_string(user)
+        if password:
+            body += mqtt_string(password)
+        sock.sendall(mqtt_packet(0x10, body))
+        if sock.recv(4)[3] != 0:
+            raise SystemExit("MQTT broker refused the connection")
+        publish = mqtt_packet(0x30, mqtt_string("nativity/cmd/load") + b"load")
+        while not stop.is_set():
+            sock.sendall(publish)
+            counts["mqtt"] += 1
+            time.sleep(1 / rate)
+        sock.sendall(mqtt_packet(0xE0, b""))
+
+
+def phase(args, loaded):
+    before = scrape(args.host)
+    stop = threading.Event()
+    counts = {"http": 0, "mqtt": 0, "errors": 0}
+    round_trips = []
+    workers = [threading.Thread(target=prober, args=(args.host, args.probe_ms / 1000, stop, round_trips))]
+    if loaded:
+        workers += [threading.Thread(target=http_worker, args=(args.host, stop, counts))
+                    for _ in range(args.http_workers)]
+        if args.mqtt:
+            workers.append(threading.Thread(target=mqtt_worker, args=(args.mqtt, args.mqtt_user, args.mqtt_password,
+                                                                      args.mqtt_rate, stop, counts)))
+    for w in workers:
+        w.start()
+    time.sleep(args.seconds)
+    stop.set()
+    for w in workers:
+        w.join()
+    after = scrape(args.host)
+
+    def delta(name):
+        return after.get(name, 0) - before.get(name, 0)
+
+    def reported(name, value, width, decimals):
+        return f"{value:>{width}.{decimals}f}" if name in after else f"{'-':>{width}}"
+
+    wakeups = delta("nativity_wait_late_seconds_count")
+    mean_ms = delta("nativity_wait_late_seconds_sum") / wakeups * 1000 if wakeups else 0
+    p50, p99 = percentile(round_trips, 0.5), percentile(round_trips, 0.99)
+    print(f"{'loaded' if loaded else 'quiet':<8}{delta('nativity_led_frames_total') / args.seconds:>8.1f}"
+          f"{p50:>10.1f}{p99:>10.1f}{p99 - p50:>10.1f}"
+          f"{reported('nativity_wait_late_seconds_count', mean_ms, 10, 2)}"
+          f"{reported('nativity_wait_late_max_seconds', after.get('nativity_wait_late_max_seconds', 0) * 1000, 10, 1)}"
+          f"{reported('nativity_frame_overruns_total', delta('nativity_frame_overruns_total'), 10, 0)}"
+          f"{counts['http'] / args.seconds:>8.1f}{counts['mqtt'] / args.seconds:>8.1f}{counts['errors']:>8}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--seconds", type=float, default=20, help="length of each phase (default 20)")
+    parser.add_argument("--http-workers", type=int, default=4, help="parallel HTTP clients (default 4)")
+    parser.add_argument("--mqtt", metavar="BROKER[:PORT]", help="also publish MQTT messages through this broker")
+    parser.add_argument("--mqtt-user")
+    parser.add_argument("--mqtt-password")
+    parser.add_argument("--mqtt-rate", type=float, default=50, help="MQTT messages per second (default 50)")
+    parser.add_argument("--probe-ms", type=float, default=100, help="time between /status probes (default 100)")
+    args = parser.parse_args()
+
+    # The worst wake-up is since boot, so it only ever grows
+    print(f"{'phase':<8}{'fps':>8}{'rtt p50':>10}{'rtt p99':>10}{'spread':>10}{'late ms':>10}{'worst ms':>10}"
+          f"{'overruns':>10}{'http/s':>8}{'mqtt/s':>8}{'errors':>8}")
+    phase(args, loaded=False)
+    phase(args, loaded=True)
+
+
+if __name__ == "__main__":
+    main()
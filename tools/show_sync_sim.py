@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Simulates a leader and several followers running the show sync of main/web/show_sync.hpp on one machine.
+
+Every node gets its own clock (random offset and drift) and every packet a random one-way delay, so the exchanges
+are asymmetric like on a busy Wi-Fi. The followers estimate the leader's clock exactly like ClockOffsetFilter
+(best of the last 8 round trips), then the leader announces a scene SHOW_SYNC_LEAD_MS ahead and the script prints
+how far apart, in real time, the nodes start it.
+
+    tools/show_sync_sim.py                        # 4 followers, 5 shows
+    tools/show_sync_sim.py --followers 8 --jitter-ms 20 --drift-ppm 50
+"""
+import argparse
+import heapq
+import random
+
+LEAD_MS = 200
+POLL_MS = 1000
+SAMPLES = 8
+
+
+class Clock:
+    def __init__(self, offset_us, drift_ppm):
+        self.offset_us = offset_us
+        self.rate = 1 + drift_ppm / 1e6
+
+    def local(self, true_us):
+        return true_us * self.rate + self.offset_us
+
+    def true(self, local_us):
+        return (local_us - self.offset_us) / self.rate
+
+
+class Follower:
+    def __init__(self, clock):
+        self.clock = clock
+        self.samples = []
+
+    def add(self, t1, t2, t3, t4):
+        self.samples = (self.samples + [(((t2 - t1) + (t3 - t4)) / 2, (t4 - t1) - (t3 - t2))])[-SAMPLES:]
+
+    def best(self):
+        return min(self.samples, key=lambda s: s[1])
+
+
+def simulate(args, rng):
+    leader = Clock(rng.uniform(-5e6, 5e6), rng.uniform(-args.drift_ppm, args.drift_ppm))
+    followers = [Follower(Clock(rng.uniform(-5e6, 5e6), rng.uniform(-args.drift_ppm, args.drift_ppm)))
+                 for _ in range(args.followers)]
+
+    def delay():
+        # Mostly quick, sometimes stuck behind other traffic
+        return (args.base_ms + rng.expovariate(1 / args.jitter_ms)) * 1000
+
+    events = []  # (true time, sequence, action)
+    counter = [0]
+
+    def at(t, action):
+        counter[0] += 1
+        heapq.heappush(events, (t, counter[0], action))
+
+    def poll(f, t):
+        t1 = f.clock.local(t)
+        arrive = t + delay()
+
+        def at_leader():
+            t2 = t3 = leader.local(arrive)
+            back = arrive + delay()
+            at(back, lambda: f.add(t1, t2, t3, f.clock.local(back)))
+        at(arrive, at_leader)
+        at(t + POLL_MS * 1000, lambda: poll(f, t + POLL_MS * 1000))
+
+    for f in followers:
+        start = rng.uniform(0, POLL_MS * 1000)
+        at(start, lambda f=f, start=start: poll(f, start))
+
+    results = []
+    show_every = args.warmup_s * 1e6
+    for show in range(args.shows):
+        t_announce = show_every * (show + 1)
+        while events and events[0][0] < t_announce:
+            _, _, action = heapq.heappop(events)
+            action()
+        start_leader = leader.local(t_announce) + LEAD_MS * 1000
+        leader_true = leader.true(start_leader)
+        skews = []
+        for f in followers:
+            offset, round_trip = f.best()
+            local_start = start_leader - offset
+            received = t_announce + delay()
+            follower_true = max(f.clock.true(local_start), received)  # late announcements start right away
+            skews.append((follower_true - leader_true, round_trip / 2))
+        results.append(skews)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--followers", type=int, default=4)
+    parser.add_argument("--shows", type=int, default=5)
+    parser.add_argument("--warmup-s", type=float, default=30, help="time between shows (exchanges keep going)")
+    parser.add_argument("--base-ms", type=float, default=2, help="minimum one-way delay")
+    parser.add_argument("--jitter-ms", type=float, default=8, help="mean extra one-way delay")
+    parser.add_argument("--drift-ppm", type=float, default=30, help="crystal tolerance of the nodes")
+    parser.add_argument("--seed", type=int)
+    args = parser.parse_args()
+
+    results = simulate(args, random.Random(args.seed))
+    worst = 0
+    for show, skews in enumerate(results, 1):
+        line = "  ".join(f"{s / 1000:+6.2f} ms (+-{u / 1000:.2f})" for s, u in skews)
+        print(f"show {show}: {line}")
+        worst = max([worst] + [abs(s) for s, _ in skews])
+    print(f"worst skew {worst / 1000:.2f} ms")
+    return 0 if worst < 10000 else 1
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
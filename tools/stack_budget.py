@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Suggests stack sizes for the tasks in main/task_plan.hpp from what they actually used.
+
+Reads the high-water marks (nativity_task_stack_free_bytes, the least free stack each task ever had) from /metrics
+and the sizes from task_plan.hpp, and prints per task the size, the most it used and a size with --margin percent
+headroom, rounded up to 256 bytes. Play every scene (and use the web interface, MQTT and live LED control) before
+running it, so every task went through its deepest path:
+
+    tools/stack_budget.py 192.168.1.50
+    tools/stack_budget.py 192.168.1.50 --margin 50
+
+With CONFIG_NATIVITY_STATIC_ALLOCATION every byte saved here is .bss the heap gets back.
+"""
+import argparse
+import os
+import re
+import sys
+import urllib.request
+
+TASK_PLAN = os.path.join(os.path.dirname(__file__), "..", "main", "task_plan.hpp")
+SPEC = re.compile(r'constexpr TaskSpec (\w+) = \{ "([^"]+)", (\d+),')
+SAMPLE = re.compile(r'^nativity_task_stack_free_bytes\{task="([^"]+)"\} (\d+)')
+
+
+def task_plan(path):
+    """{task name: (constant, stack bytes)}"""
+    with open(path) as f:
+        return {name: (constant, int(size)) for constant, name, size in SPEC.findall(f.read())}
+
+
+def free_stack(host):
+    """{task name: least free stack in bytes}"""
+    with urllib.request.urlopen(f"http://{host}/metrics", timeout=5) as response:
+        lines = response.read().decode().splitlines()
+    return {m.group(1): int(m.group(2)) for m in map(SAMPLE.match, lines) if m}
+
+
+def suggest(used, margin):
+    wanted = used * (100 + margin) / 100
+    return int((wanted + 255) // 256 * 256)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="IP address or name of the controller")
+    parser.add_argument("--margin", type=float, default=25, help="headroom on top of the most used, in percent")
+    parser.add_argument("--task-plan", default=TASK_PLAN, help="path to main/task_plan.hpp")
+    args = parser.parse_args()
+
+    plan = task_plan(args.task_plan)
+    free = free_stack(args.host)
+    print(f"{'task':<28} {'constant':<28} {'size':>6} {'used':>6} {'suggest':>8} {'change':>7}")
+    total = 0
+    for name, (constant, size) in sorted(plan.items(), key=lambda item: item[1][0]):
+        if name not in free:
+            print(f"{name:<28} {constant:<28} {size:>6} {'-':>6} {'-':>8}   not running")
+            continue
+        used = size - free[name]
+        suggested = suggest(used, args.margin)
+        total += suggested - size
+        print(f"{name:<28} {constant:<28} {size:>6} {used:>6} {suggested:>8} {suggested - size:>+7}")
+    print(f"{'total':<28} {'':<28} {'':>6} {'':>6} {'':>8} {total:>+7}")
+    return 0 if plan.keys() & free.keys() else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
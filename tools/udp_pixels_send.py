@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Sends a moving rainbow to the nativity strip over DDP or E1.31, to try live mode without xLights/LedFx.
+
+    tools/udp_pixels_send.py 192.168.1.50                  # DDP, 89 pixels, 40 fps, until Ctrl+C
+    tools/udp_pixels_send.py 192.168.1.50 --e131 --fps 30
+    tools/udp_pixels_send.py 192.168.1.50 --loss 5          # drop 5% of the packets to see the counters move
+
+Watch nativity_live_* on http://<device>/metrics for frames, drops and latency.
+"""
+import argparse
+import colorsys
+import random
+import socket
+import struct
+import time
+import uuid
+
+DDP_PORT = 4048
+E131_PORT = 5568
+DDP_MAX_DATA = 1440  # keeps packets under a typical MTU
+E131_UNIVERSE_PIXELS = 170
+
+
+def rainbow(pixels, t):
+    data = bytearray()
+    for i in range(pixels):
+        r, g, b = colorsys.hsv_to_rgb((i / pixels + t * 0.25) % 1.0, 1.0, 0.5)
+        data += bytes((int(r * 255), int(g * 255), int(b * 255)))
+    return data
+
+
+def ddp_packets(data, sequence):
+    packets = []
+    for offset in range(0, len(data), DDP_MAX_DATA):
+        chunk = data[offset:offset + DDP_MAX_DATA]
+        flags = 0x40 | (0x01 if offset + len(chunk) >= len(data) else 0)  # version 1, push on the last one
+        header = struct.pack(">BBBBIH", flags, sequence, 0x0B, 0x01, offset, len(chunk))
+        packets.append(header + chunk)
+    return packets
+
+
+def e131_packet(cid, universe, sequence, dmx, options=0):
+    slots = b"\x00" + dmx  # start code + data
+    root = struct.pack(">HH12sHI16s", 0x0010, 0x0000, b"ASC-E1.17\x00\x00\x00",
+                       0x7000 | (22 + 77 + 10 + len(slots)), 0x00000004, cid)
+    framing = struct.pack(">HI64sHBBBH", 0x7000 | (77 + 10 + len(slots)), 0x00000002,
+                          b"nativity sender".ljust(64, b"\x00"), 100, 0, sequence, options, universe)
+    dmp = struct.pack(">HBBHHH", 0x7000 | (10 + len(slots)), 0x02, 0xA1, 0x0000, 0x0001, len(slots))
+    return root + framing + dmp + slots
+
+
+def e131_packets(data, cid, sequence, first_universe, options=0):
+    step = E131_UNIVERSE_PIXELS * 3
+    return [e131_packet(cid, first_universe + n, sequence, data[offset:offset + step], options)
+            for n, offset in enumerate(range(0, len(data), step))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--e131", action="store_true", help="send E1.31 (sACN) instead of DDP")
+    parser.add_argument("--universe", type=int, default=1, help="first E1.31 universe")
+    parser.add_argument("--pixels", type=int, default=89)
+    parser.add_argument("--fps", type=float, default=40)
+    parser.add_argument("--seconds", type=float, default=0, help="stop after this long, 0 = until Ctrl+C")
+    parser.add_argument("--loss", type=float, default=0, help="percentage of packets to drop on purpose")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    port = E131_PORT if args.e131 else DDP_PORT
+    cid = uuid.uuid4().bytes
+    start = time.monotonic()
+    frame = 0
+    sent = dropped = 0
+    try:
+        while not args.seconds or time.monotonic() - start < args.seconds:
+            data = rainbow(args.pixels, time.monotonic() - start)
+            if args.e131:
+                packets = e131_packets(data, cid, frame % 256, args.universe)
+            else:
+                packets = ddp_packets(data, frame % 15 + 1)
+            for packet in packets:
+                if random.uniform(0, 100) < args.loss:
+                    dropped += 1
+                    continue
+                sock.sendto(packet, (args.host, port))
+                sent += 1
+            frame += 1
+            time.sleep(max(0.0, start + frame / args.fps - time.monotonic()))
+    except KeyboardInterrupt:
+        pass
+    if args.e131:
+        # Tell the device the stream is over instead of letting it time out
+        for packet in e131_packets(bytes(args.pixels * 3), cid, frame % 256, args.universe, options=0x40):
+            sock.sendto(packet, (args.host, port))
+    print(f"{frame} frames, {sent} packets sent, {dropped} dropped on purpose")
+
+
+if __name__ == "__main__":
+    main()